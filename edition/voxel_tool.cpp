@@ -1,8 +1,5 @@
 #include "voxel_tool.h"
 #include "../terrain/voxel_lod_terrain.h"
-#include "../util/macros.h"
-#include "../util/profiling.h"
-#include "../voxel_buffer.h"
 
 Vector3 VoxelRaycastResult::_b_get_position() const {
 	return position.to_vec3();
@@ -127,92 +124,14 @@ void VoxelTool::_set_voxel_f(Vector3i pos, float v) {
 	ERR_PRINT("Not implemented");
 }
 
-// TODO May be worth using VoxelBuffer::read_write_action() in the future with a lambda,
-// so we avoid the burden of going through get/set, validation and rehash access to blocks.
-// Would work well by avoiding virtual as well using a specialized implementation.
-
-namespace {
-inline float sdf_blend(float src_value, float dst_value, VoxelTool::Mode mode) {
-	float res;
-	switch (mode) {
-		case VoxelTool::MODE_ADD:
-			// Union
-			res = min(src_value, dst_value);
-			break;
-
-		case VoxelTool::MODE_REMOVE:
-			// Relative complement (or difference)
-			res = max(1.f - src_value, dst_value);
-			break;
-
-		case VoxelTool::MODE_SET:
-			res = src_value;
-			break;
-
-		default:
-			res = 0;
-			break;
-	}
-	return res;
-}
-} // namespace
-
 void VoxelTool::do_sphere(Vector3 center, float radius) {
-	VOXEL_PROFILE_SCOPE();
-
-	Rect3i box(Vector3i(center) - Vector3i(Math::floor(radius)), Vector3i(Math::ceil(radius) * 2));
-
-	if (!is_area_editable(box)) {
-		PRINT_VERBOSE("Area not editable");
-		return;
-	}
-
-	if (_channel == VoxelBuffer::CHANNEL_SDF) {
-		box.for_each_cell([this, center, radius](Vector3i pos) {
-			float d = pos.to_vec3().distance_to(center) - radius;
-			_set_voxel_f(pos, sdf_blend(d, get_voxel_f(pos), _mode));
-		});
-
-	} else {
-		int value = _mode == MODE_REMOVE ? _eraser_value : _value;
-
-		box.for_each_cell([this, center, radius, value](Vector3i pos) {
-			float d = pos.to_vec3().distance_to(center);
-			if (d <= radius) {
-				_set_voxel(pos, value);
-			}
-		});
-	}
-
-	_post_edit(box);
+	VirtualStorage storage = { *this };
+	do_sphere_t(storage, center, radius);
 }
 
 void VoxelTool::do_box(Vector3i begin, Vector3i end) {
-	VOXEL_PROFILE_SCOPE();
-	Vector3i::sort_min_max(begin, end);
-	Rect3i box = Rect3i::from_min_max(begin, end + Vector3i(1, 1, 1));
-
-	if (!is_area_editable(box)) {
-		PRINT_VERBOSE("Area not editable");
-		return;
-	}
-
-	if (_channel == VoxelBuffer::CHANNEL_SDF) {
-
-		box.for_each_cell([this](Vector3i pos) {
-			_set_voxel_f(pos, sdf_blend(-1.0, get_voxel_f(pos), _mode));
-		});
-
-	} else {
-
-		int value = _mode == MODE_REMOVE ? _eraser_value : _value;
-
-		box.for_each_cell([this, value](Vector3i pos) {
-			_set_voxel(pos, value);
-		});
-	}
-
-	_post_edit(box);
+	VirtualStorage storage = { *this };
+	do_box_t(storage, begin, end);
 }
 
 void VoxelTool::copy(Vector3i pos, Ref<VoxelBuffer> dst, uint64_t mask_value) {
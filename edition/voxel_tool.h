@@ -2,10 +2,11 @@
 #define VOXEL_TOOL_H
 
 #include "../math/rect3i.h"
+#include "../util/macros.h"
+#include "../util/profiling.h"
+#include "../voxel_buffer.h"
 #include <core/reference.h>
 
-class VoxelBuffer;
-
 // This class exists only to make the script API nicer.
 class VoxelRaycastResult : public Reference {
 	GDCLASS(VoxelRaycastResult, Reference)
@@ -81,6 +82,116 @@ protected:
 	virtual void _set_voxel_f(Vector3i pos, float v);
 	virtual void _post_edit(const Rect3i &box);
 
+	static inline float sdf_blend(float src_value, float dst_value, Mode mode) {
+		switch (mode) {
+			case MODE_ADD:
+				// Union
+				return MIN(src_value, dst_value);
+
+			case MODE_REMOVE:
+				// Relative complement (or difference)
+				return MAX(1.f - src_value, dst_value);
+
+			case MODE_SET:
+				return src_value;
+
+			default:
+				return 0;
+		}
+	}
+
+	static inline Rect3i get_sphere_box(Vector3 center, float radius) {
+		return Rect3i(Vector3i(center) - Vector3i(Math::floor(radius)), Vector3i(Math::ceil(radius) * 2));
+	}
+
+	static inline Rect3i get_box_from_corners(Vector3i begin, Vector3i end) {
+		Vector3i::sort_min_max(begin, end);
+		return Rect3i::from_min_max(begin, end + Vector3i(1, 1, 1));
+	}
+
+	// Edits are applied with `read_write_action(box, channel, action)` and `read_write_action_f(box, channel, action)`
+	// of the given storage. Tools having direct access to voxels use these so the action is inlined,
+	// instead of going through virtual calls and channel depth checks for every voxel.
+
+	template <typename Storage_T>
+	void do_sphere_t(Storage_T &storage, Vector3 center, float radius) {
+		VOXEL_PROFILE_SCOPE();
+
+		const Rect3i box = get_sphere_box(center, radius);
+
+		if (!is_area_editable(box)) {
+			PRINT_VERBOSE("Area not editable");
+			return;
+		}
+
+		if (_channel == VoxelBuffer::CHANNEL_SDF) {
+			const Mode mode = _mode;
+			storage.read_write_action_f(box, _channel, [center, radius, mode](Vector3i pos, real_t v) {
+				const float d = pos.to_vec3().distance_to(center) - radius;
+				return sdf_blend(d, v, mode);
+			});
+
+		} else {
+			const uint64_t value = _mode == MODE_REMOVE ? _eraser_value : _value;
+			storage.read_write_action(box, _channel, [center, radius, value](Vector3i pos, uint64_t v) {
+				return pos.to_vec3().distance_to(center) <= radius ? value : v;
+			});
+		}
+
+		_post_edit(box);
+	}
+
+	template <typename Storage_T>
+	void do_box_t(Storage_T &storage, Vector3i begin, Vector3i end) {
+		VOXEL_PROFILE_SCOPE();
+
+		const Rect3i box = get_box_from_corners(begin, end);
+
+		if (!is_area_editable(box)) {
+			PRINT_VERBOSE("Area not editable");
+			return;
+		}
+
+		if (_channel == VoxelBuffer::CHANNEL_SDF) {
+			const Mode mode = _mode;
+			storage.read_write_action_f(box, _channel, [mode](Vector3i pos, real_t v) {
+				return sdf_blend(-1.0, v, mode);
+			});
+
+		} else {
+			const uint64_t value = _mode == MODE_REMOVE ? _eraser_value : _value;
+			storage.read_write_action(box, _channel, [value](Vector3i pos, uint64_t v) {
+				return value;
+			});
+		}
+
+		_post_edit(box);
+	}
+
+	// Storage going through `_get_voxel` and `_set_voxel`, for tools which don't have a faster way.
+	// The channel is always the one of the tool.
+	struct VirtualStorage {
+		VoxelTool &tool;
+
+		template <typename F>
+		void read_write_action(Rect3i box, unsigned int channel_index, F action) {
+			box.for_each_cell([this, &action](Vector3i pos) {
+				const uint64_t v0 = tool._get_voxel(pos);
+				const uint64_t v1 = action(pos, v0);
+				if (v0 != v1) {
+					tool._set_voxel(pos, v1);
+				}
+			});
+		}
+
+		template <typename F>
+		void read_write_action_f(Rect3i box, unsigned int channel_index, F action) {
+			box.for_each_cell([this, &action](Vector3i pos) {
+				tool._set_voxel_f(pos, action(pos, tool._get_voxel_f(pos)));
+			});
+		}
+	};
+
 private:
 	// Bindings to convert to more specialized C++ types and handle virtuality cuz I don't know if it works by binding straight
 	uint64_t _b_get_voxel(Vector3 pos) { return get_voxel(Vector3i(pos)); }
@@ -11,6 +11,16 @@ bool VoxelToolBuffer::is_area_editable(const Rect3i &box) const {
 	return Rect3i(Vector3i(), _buffer->get_size()).encloses(box);
 }
 
+void VoxelToolBuffer::do_sphere(Vector3 center, float radius) {
+	ERR_FAIL_COND(_buffer.is_null());
+	do_sphere_t(**_buffer, center, radius);
+}
+
+void VoxelToolBuffer::do_box(Vector3i begin, Vector3i end) {
+	ERR_FAIL_COND(_buffer.is_null());
+	do_box_t(**_buffer, begin, end);
+}
+
 uint64_t VoxelToolBuffer::_get_voxel(Vector3i pos) {
 	ERR_FAIL_COND_V(_buffer.is_null(), 0);
 	return _buffer->get_voxel(pos, _channel);
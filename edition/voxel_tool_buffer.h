@@ -11,6 +11,8 @@ public:
 	VoxelToolBuffer(Ref<VoxelBuffer> vb);
 
 	bool is_area_editable(const Rect3i &box) const override;
+	void do_sphere(Vector3 center, float radius) override;
+	void do_box(Vector3i begin, Vector3i end) override;
 	void paste(Vector3i p_pos, Ref<VoxelBuffer> p_voxels, uint64_t mask_value) override;
 
 	void set_voxel_metadata(Vector3i pos, Variant meta) override;
@@ -14,6 +14,16 @@ bool VoxelToolLodTerrain::is_area_editable(const Rect3i &box) const {
 	return _map->is_area_fully_loaded(box.padded(1));
 }
 
+void VoxelToolLodTerrain::do_sphere(Vector3 center, float radius) {
+	ERR_FAIL_COND(_terrain == nullptr);
+	do_sphere_t(**_map, center, radius);
+}
+
+void VoxelToolLodTerrain::do_box(Vector3i begin, Vector3i end) {
+	ERR_FAIL_COND(_terrain == nullptr);
+	do_box_t(**_map, begin, end);
+}
+
 uint64_t VoxelToolLodTerrain::_get_voxel(Vector3i pos) {
 	ERR_FAIL_COND_V(_terrain == nullptr, 0);
 	return _map->get_voxel(pos, _channel);
@@ -12,6 +12,8 @@ public:
 	VoxelToolLodTerrain(VoxelLodTerrain *terrain, Ref<VoxelMap> map);
 
 	bool is_area_editable(const Rect3i &box) const override;
+	void do_sphere(Vector3 center, float radius) override;
+	void do_box(Vector3i begin, Vector3i end) override;
 
 protected:
 	uint64_t _get_voxel(Vector3i pos) override;
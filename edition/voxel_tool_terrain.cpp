@@ -79,6 +79,16 @@ Ref<VoxelRaycastResult> VoxelToolTerrain::raycast(Vector3 pos, Vector3 dir, floa
 	return res;
 }
 
+void VoxelToolTerrain::do_sphere(Vector3 center, float radius) {
+	ERR_FAIL_COND(_terrain == nullptr);
+	do_sphere_t(**_map, center, radius);
+}
+
+void VoxelToolTerrain::do_box(Vector3i begin, Vector3i end) {
+	ERR_FAIL_COND(_terrain == nullptr);
+	do_box_t(**_map, begin, end);
+}
+
 uint64_t VoxelToolTerrain::_get_voxel(Vector3i pos) {
 	ERR_FAIL_COND_V(_terrain == nullptr, 0);
 	return _map->get_voxel(pos, _channel);
@@ -14,6 +14,8 @@ public:
 	VoxelToolTerrain(VoxelTerrain *terrain, Ref<VoxelMap> map);
 
 	bool is_area_editable(const Rect3i &box) const override;
+	void do_sphere(Vector3 center, float radius) override;
+	void do_box(Vector3i begin, Vector3i end) override;
 	Ref<VoxelRaycastResult> raycast(Vector3 pos, Vector3 dir, float max_distance, uint32_t collision_mask) override;
 
 	void set_voxel_metadata(Vector3i pos, Variant meta) override;
@@ -250,11 +250,18 @@ void VoxelGeneratorGraph::generate_block(VoxelBlockRequest &input) {
 	Vector3i gpos;
 	// Loads of possible optimization from there
 
+	// Columns are written in one go
+	std::vector<real_t> column(rmax.y - rmin.y);
+	const ArraySlice<const real_t> column_slice(column.data(), 0, column.size());
+
 	for (rpos.z = rmin.z, gpos.z = gmin.z; rpos.z < rmax.z; ++rpos.z, gpos.z += stride) {
 		for (rpos.x = rmin.x, gpos.x = gmin.x; rpos.x < rmax.x; ++rpos.x, gpos.x += stride) {
-			for (rpos.y = rmin.y, gpos.y = gmin.y; rpos.y < rmax.y; ++rpos.y, gpos.y += stride) {
-				out_buffer.set_voxel_f(generate_single(gpos), rpos.x, rpos.y, rpos.z, channel);
+			unsigned int i = 0;
+			for (rpos.y = rmin.y, gpos.y = gmin.y; rpos.y < rmax.y; ++rpos.y, gpos.y += stride, ++i) {
+				column[i] = generate_single(gpos);
 			}
+			out_buffer.set_voxels_f(Rect3i(Vector3i(rpos.x, rmin.y, rpos.z), Vector3i(1, column.size(), 1)),
+					channel, column_slice);
 		}
 	}
 
@@ -56,20 +56,19 @@ void VoxelGeneratorFlat::generate_block(VoxelBlockRequest &input) {
 
 	if (use_sdf) {
 
-		int gz = origin.z;
-		for (int z = 0; z < bs.z; ++z, gz += stride) {
-
-			int gx = origin.x;
-			for (int x = 0; x < bs.x; ++x, gx += stride) {
-
-				int gy = origin.y;
-				for (int y = 0; y < bs.y; ++y, gy += stride) {
-					float sdf = _iso_scale * (gy - _height);
-					out_buffer.set_voxel_f(sdf, x, y, z, channel);
-				}
-
-			} // for x
-		} // for z
+		// The ground is flat, so all columns are the same
+		std::vector<real_t> column(bs.y);
+		int gy = origin.y;
+		for (int y = 0; y < bs.y; ++y, gy += stride) {
+			column[y] = _iso_scale * (gy - _height);
+		}
+		const ArraySlice<const real_t> column_slice(column.data(), 0, column.size());
+
+		for (int z = 0; z < bs.z; ++z) {
+			for (int x = 0; x < bs.x; ++x) {
+				out_buffer.set_voxels_f(Rect3i(Vector3i(x, 0, z), Vector3i(1, bs.y, 1)), channel, column_slice);
+			}
+		}
 
 	} else {
 		// Blocky
@@ -45,6 +45,10 @@ protected:
 
 		if (use_sdf) {
 
+			// Columns are written in one go
+			std::vector<real_t> column(bs.y);
+			const ArraySlice<const real_t> column_slice(column.data(), 0, column.size());
+
 			int gz = origin.z;
 			for (int z = 0; z < bs.z; ++z, gz += stride) {
 
@@ -54,9 +58,9 @@ protected:
 					float h = _range.xform(height_func(gx, gz));
 					int gy = origin.y;
 					for (int y = 0; y < bs.y; ++y, gy += stride) {
-						float sdf = _iso_scale * (gy - h);
-						out_buffer.set_voxel_f(sdf, x, y, z, channel);
+						column[y] = _iso_scale * (gy - h);
 					}
+					out_buffer.set_voxels_f(Rect3i(Vector3i(x, 0, z), Vector3i(1, bs.y, 1)), channel, column_slice);
 
 				} // for x
 			} // for z
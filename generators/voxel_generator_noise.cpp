@@ -87,6 +87,16 @@ static inline float get_shaped_noise(OpenSimplexNoise &noise, float x, float y,
 	return sum / max;
 }
 
+template <typename View_T>
+static inline void write_type_column(View_T &view, unsigned int x, unsigned int z, const std::vector<real_t> &sdf,
+		uint8_t matter_type, uint8_t air_type) {
+	// Y is the contiguous axis
+	uint8_t *p = view.data() + View_T::index(x, 0, z);
+	for (size_t y = 0; y < sdf.size(); ++y) {
+		p[y] = sdf[y] < 0 ? matter_type : air_type;
+	}
+}
+
 void VoxelGeneratorNoise::generate_block(VoxelBlockRequest &input) {
 	ERR_FAIL_COND(input.voxel_buffer.is_null());
 	ERR_FAIL_COND(_noise.is_null());
@@ -127,6 +137,18 @@ void VoxelGeneratorNoise::generate_block(VoxelBlockRequest &input) {
 		const float height_range_inv = 1.f / _height_range;
 		const float one_minus_persistence = 1.f - noise.get_persistence();
 
+		// SDF is computed column by column, then written in one go
+		const bool use_sdf = _channel == VoxelBuffer::CHANNEL_SDF;
+		const bool use_types = _channel == VoxelBuffer::CHANNEL_TYPE;
+		std::vector<real_t> column(size.y);
+
+		// Types of blocks with a common size are written through a view, others voxel by voxel
+		VoxelBufferCubeView<uint8_t, 16> types16;
+		VoxelBufferCubeView<uint8_t, 32> types32;
+		if (use_types && !buffer.get_channel_view_for_write(_channel, types16)) {
+			buffer.get_channel_view_for_write(_channel, types32);
+		}
+
 		for (int z = 0; z < size.z; ++z) {
 			int lz = origin_in_voxels.z + (z << lod);
 
@@ -139,20 +161,12 @@ void VoxelGeneratorNoise::generate_block(VoxelBlockRequest &input) {
 
 					if (ly < isosurface_lower_bound) {
 						// Below is only matter
-						if (_channel == VoxelBuffer::CHANNEL_SDF) {
-							buffer.set_voxel_f(-1, x, y, z, _channel);
-						} else if (_channel == VoxelBuffer::CHANNEL_TYPE) {
-							buffer.set_voxel(matter_type, x, y, z, _channel);
-						}
+						column[y] = -1;
 						continue;
 
 					} else if (ly >= isosurface_upper_bound) {
 						// Above is only air
-						if (_channel == VoxelBuffer::CHANNEL_SDF) {
-							buffer.set_voxel_f(1, x, y, z, _channel);
-						} else if (_channel == VoxelBuffer::CHANNEL_TYPE) {
-							buffer.set_voxel(air_type, x, y, z, _channel);
-						}
+						column[y] = 1;
 						continue;
 					}
 
@@ -164,10 +178,22 @@ void VoxelGeneratorNoise::generate_block(VoxelBlockRequest &input) {
 					float n = get_shaped_noise(noise, lx, ly, lz, one_minus_persistence, bias);
 					float d = (n + bias) * iso_scale;
 
-					if (_channel == VoxelBuffer::CHANNEL_SDF) {
-						buffer.set_voxel_f(d, x, y, z, _channel);
-					} else if (_channel == VoxelBuffer::CHANNEL_TYPE && d < 0) {
-						buffer.set_voxel(matter_type, x, y, z, _channel);
+					column[y] = d;
+				}
+
+				if (use_sdf) {
+					buffer.set_voxels_f(Rect3i(Vector3i(x, 0, z), Vector3i(1, size.y, 1)), _channel,
+							ArraySlice<const real_t>(column.data(), 0, column.size()));
+
+				} else if (use_types) {
+					if (types16.is_valid()) {
+						write_type_column(types16, x, z, column, matter_type, air_type);
+					} else if (types32.is_valid()) {
+						write_type_column(types32, x, z, column, matter_type, air_type);
+					} else {
+						for (int y = 0; y < size.y; ++y) {
+							buffer.set_voxel(column[y] < 0 ? matter_type : air_type, x, y, z, _channel);
+						}
 					}
 				}
 			}
@@ -66,9 +66,9 @@ public:
 		return other.pos.x >= pos.x &&
 			   other.pos.y >= pos.y &&
 			   other.pos.z >= pos.z &&
-			   other_end.x < end.x &&
-			   other_end.y < end.y &&
-			   other_end.z < end.z;
+			   other_end.x <= end.x &&
+			   other_end.y <= end.y &&
+			   other_end.z <= end.z;
 	}
 
 	String to_string() const {
@@ -2,6 +2,7 @@
 #include "../../cube_tables.h"
 #include "../../util/array_slice.h"
 #include "../../util/utility.h"
+#include "../voxel_neighborhood_view.h"
 #include <core/os/os.h>
 
 namespace {
@@ -483,6 +484,48 @@ void VoxelMesherBlocky::build(VoxelMesher::Output &output, const VoxelMesher::In
 	output.primitive_type = Mesh::PRIMITIVE_TRIANGLES;
 }
 
+void VoxelMesherBlocky::build_from_neighborhood(
+		VoxelMesher::Output &output, const VoxelMesher::NeighborhoodInput &input) {
+
+	ERR_FAIL_COND(_library.is_null());
+
+	{
+		// Only voxels of the central block produce geometry. If its palette tells they all have empty models,
+		// there is nothing to do, whatever the neighbors are.
+		Ref<VoxelBuffer> central_block = input.blocks[Cube::MOORE_AREA_3D_CENTRAL_INDEX];
+		RWLockRead lock(central_block->get_lock());
+		if (central_block->get_channel_palette(VoxelBuffer::CHANNEL_TYPE, _palette_cache)) {
+			RWLockRead library_lock(_library->get_baked_data_rw_lock());
+			const VoxelLibrary::BakedData &library_baked_data = _library->get_baked_data();
+			bool empty = true;
+			for (size_t i = 0; i < _palette_cache.size(); ++i) {
+				const uint64_t id = _palette_cache[i];
+				if (id < library_baked_data.models.size() && !library_baked_data.models[id].empty) {
+					empty = false;
+					break;
+				}
+			}
+			if (empty) {
+				return;
+			}
+		}
+	}
+
+	{
+		// Uniform areas produce no geometry, so they are common enough to skip the copy.
+		// Missing neighbors are considered to contain air.
+		const VoxelNeighborhoodView view(input.blocks, VoxelBuffer::CHANNEL_TYPE, 0);
+		if (view.is_uniform()) {
+			return;
+		}
+	}
+	VoxelMesher::build_from_neighborhood(output, input);
+}
+
+unsigned int VoxelMesherBlocky::get_used_channels_mask() const {
+	return (1 << VoxelBuffer::CHANNEL_TYPE);
+}
+
 VoxelMesher *VoxelMesherBlocky::clone() {
 	VoxelMesherBlocky *c = memnew(VoxelMesherBlocky);
 	c->set_library(_library);
@@ -27,6 +27,8 @@ public:
 	bool get_occlusion_enabled() const { return _bake_occlusion; }
 
 	void build(VoxelMesher::Output &output, const VoxelMesher::Input &input) override;
+	void build_from_neighborhood(VoxelMesher::Output &output, const VoxelMesher::NeighborhoodInput &input) override;
+	unsigned int get_used_channels_mask() const override;
 
 	VoxelMesher *clone() override;
 
@@ -46,6 +48,7 @@ protected:
 private:
 	Ref<VoxelLibrary> _library;
 	FixedArray<Arrays, MAX_MATERIALS> _arrays_per_material;
+	std::vector<uint64_t> _palette_cache;
 	float _baked_occlusion_darkness;
 	bool _bake_occlusion;
 };
@@ -1,4 +1,5 @@
 #include "voxel_mesher_cubes.h"
+#include "../voxel_neighborhood_view.h"
 
 namespace {
 // 2-----3
@@ -507,6 +508,23 @@ bool VoxelMesherCubes::is_greedy_meshing_enabled() const {
 	return _greedy_meshing;
 }
 
+void VoxelMesherCubes::build_from_neighborhood(
+		VoxelMesher::Output &output, const VoxelMesher::NeighborhoodInput &input) {
+	{
+		// Uniform areas produce no geometry, so they are common enough to skip the copy.
+		// Missing neighbors are considered empty.
+		const VoxelNeighborhoodView view(input.blocks, VoxelBuffer::CHANNEL_COLOR, 0);
+		if (view.is_uniform()) {
+			return;
+		}
+	}
+	VoxelMesher::build_from_neighborhood(output, input);
+}
+
+unsigned int VoxelMesherCubes::get_used_channels_mask() const {
+	return (1 << VoxelBuffer::CHANNEL_COLOR);
+}
+
 VoxelMesher *VoxelMesherCubes::clone() {
 	VoxelMesherCubes *d = memnew(VoxelMesherCubes);
 	d->_greedy_meshing = _greedy_meshing;
@@ -12,6 +12,8 @@ public:
 	VoxelMesherCubes();
 
 	void build(VoxelMesher::Output &output, const VoxelMesher::Input &input) override;
+	void build_from_neighborhood(VoxelMesher::Output &output, const VoxelMesher::NeighborhoodInput &input) override;
+	unsigned int get_used_channels_mask() const override;
 
 	void set_greedy_meshing_enabled(bool enable);
 	bool is_greedy_meshing_enabled() const;
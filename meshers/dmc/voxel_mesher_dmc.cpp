@@ -1611,6 +1611,10 @@ void VoxelMesherDMC::build(VoxelMesher::Output &output, const VoxelMesher::Input
 	}
 }
 
+unsigned int VoxelMesherDMC::get_used_channels_mask() const {
+	return (1 << VoxelBuffer::CHANNEL_SDF);
+}
+
 VoxelMesher *VoxelMesherDMC::clone() {
 	VoxelMesherDMC *c = memnew(VoxelMesherDMC);
 	c->set_mesh_mode(_mesh_mode);
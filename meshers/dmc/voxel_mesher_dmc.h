@@ -102,6 +102,7 @@ public:
 	SeamMode get_seam_mode() const;
 
 	void build(VoxelMesher::Output &output, const VoxelMesher::Input &input) override;
+	unsigned int get_used_channels_mask() const override;
 
 	Dictionary get_statistics() const;
 
@@ -1,4 +1,5 @@
 #include "voxel_mesher_transvoxel.h"
+#include "../voxel_neighborhood_view.h"
 #include "transvoxel_tables.cpp"
 #include <core/os/os.h>
 
@@ -30,14 +31,72 @@ inline uint8_t sign(int8_t v) {
 }
 
 // Wrapped to invert SDF data, Transvoxel apparently works backwards?
-inline uint8_t get_voxel(const VoxelBuffer &vb, int x, int y, int z, int channel) {
+template <typename Voxels_T>
+inline uint8_t get_voxel(const Voxels_T &vb, int x, int y, int z, int channel) {
 	return 255 - vb.get_voxel(x, y, z, channel);
 }
 
-inline uint8_t get_voxel(const VoxelBuffer &vb, Vector3i pos, int channel) {
+template <typename Voxels_T>
+inline uint8_t get_voxel(const Voxels_T &vb, Vector3i pos, int channel) {
 	return get_voxel(vb, pos.x, pos.y, pos.z, channel);
 }
 
+// Presents a neighborhood view the same way as a buffer padded for this mesher, so it can be read without copying
+class PaddedNeighborhood {
+public:
+	PaddedNeighborhood(const VoxelNeighborhoodView &view) :
+			_view(view),
+			_size(view.get_block_size() + VoxelMesherTransvoxel::MIN_PADDING + VoxelMesherTransvoxel::MAX_PADDING) {}
+
+	inline uint64_t get_voxel(int x, int y, int z, unsigned int channel) const {
+		return _view.get_voxel(
+				x - VoxelMesherTransvoxel::MIN_PADDING,
+				y - VoxelMesherTransvoxel::MIN_PADDING,
+				z - VoxelMesherTransvoxel::MIN_PADDING);
+	}
+
+	// The view covers more than the padded area, so this can miss a few uniform cases, but never gives a wrong one
+	inline bool is_uniform(unsigned int channel) const {
+		return _view.is_uniform();
+	}
+
+	inline Vector3i get_size() const {
+		return _size;
+	}
+
+private:
+	const VoxelNeighborhoodView &_view;
+	const Vector3i _size;
+};
+
+// Same as PaddedNeighborhood, for 8-bit blocks of a size known at compile time
+template <unsigned int BLOCK_SIZE_PO2>
+class FixedPaddedNeighborhood {
+public:
+	static const int SIZE = (1 << BLOCK_SIZE_PO2) + VoxelMesherTransvoxel::MIN_PADDING + VoxelMesherTransvoxel::MAX_PADDING;
+
+	FixedPaddedNeighborhood(const VoxelNeighborhoodView &view) :
+			_view(view) {}
+
+	inline uint8_t get_voxel(int x, int y, int z, unsigned int channel) const {
+		return _view.get_voxel_t<uint8_t, BLOCK_SIZE_PO2>(
+				x - VoxelMesherTransvoxel::MIN_PADDING,
+				y - VoxelMesherTransvoxel::MIN_PADDING,
+				z - VoxelMesherTransvoxel::MIN_PADDING);
+	}
+
+	inline bool is_uniform(unsigned int channel) const {
+		return _view.is_uniform();
+	}
+
+	inline Vector3i get_size() const {
+		return Vector3i(SIZE);
+	}
+
+private:
+	const VoxelNeighborhoodView &_view;
+};
+
 Vector3 get_border_offset(const Vector3 pos, const int lod_index, const Vector3i block_size) {
 	// When transition meshes are inserted between blocks of different LOD, we need to make space for them.
 	// Secondary vertex positions can be calculated by linearly transforming positions inside boundary cells
@@ -163,6 +222,41 @@ void VoxelMesherTransvoxel::fill_surface_arrays(Array &arrays) {
 }
 
 void VoxelMesherTransvoxel::build(VoxelMesher::Output &output, const VoxelMesher::Input &input) {
+	const VoxelBuffer &voxels = input.voxels;
+	ERR_FAIL_COND(voxels.get_channel_depth(VoxelBuffer::CHANNEL_SDF) != VoxelBuffer::DEPTH_8_BIT);
+	build_from_voxels(output, voxels, input.lod);
+}
+
+void VoxelMesherTransvoxel::build_from_neighborhood(
+		VoxelMesher::Output &output, const VoxelMesher::NeighborhoodInput &input) {
+
+	{
+		// Missing neighbors are considered to contain air, like in a new buffer
+		const VoxelNeighborhoodView view(input.blocks, VoxelBuffer::CHANNEL_SDF, 255);
+
+		if (view.is_valid() && view.get_depth() == VoxelBuffer::DEPTH_8_BIT) {
+			// Common block sizes get index calculations resolved at compile time
+			switch (view.get_block_size()) {
+				case 16:
+					build_from_voxels(output, FixedPaddedNeighborhood<4>(view), input.lod);
+					break;
+				case 32:
+					build_from_voxels(output, FixedPaddedNeighborhood<5>(view), input.lod);
+					break;
+				default:
+					build_from_voxels(output, PaddedNeighborhood(view), input.lod);
+					break;
+			}
+			return;
+		}
+	}
+
+	// Blocks can't be read directly, go through a padded copy
+	VoxelMesher::build_from_neighborhood(output, input);
+}
+
+template <typename Voxels_T>
+void VoxelMesherTransvoxel::build_from_voxels(VoxelMesher::Output &output, const Voxels_T &voxels, int lod_index) {
 
 	int channel = VoxelBuffer::CHANNEL_SDF;
 
@@ -172,10 +266,7 @@ void VoxelMesherTransvoxel::build(VoxelMesher::Output &output, const VoxelMesher
 	// Once capacity is big enough, no more memory should be allocated
 	clear_output();
 
-	const VoxelBuffer &voxels = input.voxels;
-	ERR_FAIL_COND(voxels.get_channel_depth(channel) != VoxelBuffer::DEPTH_8_BIT);
-
-	build_internal(voxels, channel, input.lod);
+	build_internal(voxels, channel, lod_index);
 
 	if (_output_vertices.size() == 0) {
 		// The mesh can be empty
@@ -190,7 +281,7 @@ void VoxelMesherTransvoxel::build(VoxelMesher::Output &output, const VoxelMesher
 
 		clear_output();
 
-		build_transition(voxels, channel, dir, input.lod);
+		build_transition(voxels, channel, dir, lod_index);
 
 		if (_output_vertices.size() == 0) {
 			continue;
@@ -227,7 +318,8 @@ Ref<ArrayMesh> VoxelMesherTransvoxel::build_transition_mesh(Ref<VoxelBuffer> vox
 	return mesh;
 }
 
-void VoxelMesherTransvoxel::build_internal(const VoxelBuffer &voxels, unsigned int channel, int lod_index) {
+template <typename Voxels_T>
+void VoxelMesherTransvoxel::build_internal(const Voxels_T &voxels, unsigned int channel, int lod_index) {
 
 	struct L {
 		inline static Vector3i dir_to_prev_vec(uint8_t dir) {
@@ -523,8 +615,9 @@ void VoxelMesherTransvoxel::build_internal(const VoxelBuffer &voxels, unsigned i
 	} // z
 }
 
+template <typename Voxels_T>
 void VoxelMesherTransvoxel::build_transition(
-		const VoxelBuffer &p_voxels, unsigned int channel, int direction, int lod_index) {
+		const Voxels_T &p_voxels, unsigned int channel, int direction, int lod_index) {
 
 	//    y            y
 	//    |            | z
@@ -651,7 +744,7 @@ void VoxelMesherTransvoxel::build_transition(
 		for (int fx = min_fpos_x; fx < max_fpos_x; fx += 2) {
 			const int fz = MIN_PADDING;
 
-			const VoxelBuffer &fvoxels = p_voxels;
+			const Voxels_T &fvoxels = p_voxels;
 
 			// Cell positions in block space
 			// Warning: temporarily includes padding. It is undone later.
@@ -959,6 +1052,10 @@ int VoxelMesherTransvoxel::emit_vertex(Vector3 primary, Vector3 normal, uint16_t
 	return vi;
 }
 
+unsigned int VoxelMesherTransvoxel::get_used_channels_mask() const {
+	return (1 << VoxelBuffer::CHANNEL_SDF);
+}
+
 VoxelMesher *VoxelMesherTransvoxel::clone() {
 	return memnew(VoxelMesherTransvoxel);
 }
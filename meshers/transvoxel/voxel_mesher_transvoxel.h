@@ -16,6 +16,8 @@ public:
 	VoxelMesherTransvoxel();
 
 	void build(VoxelMesher::Output &output, const VoxelMesher::Input &input) override;
+	void build_from_neighborhood(VoxelMesher::Output &output, const VoxelMesher::NeighborhoodInput &input) override;
+	unsigned int get_used_channels_mask() const override;
 
 	VoxelMesher *clone() override;
 
@@ -35,8 +37,13 @@ private:
 		const VoxelBuffer *full_resolution_neighbor_voxels[Cube::SIDE_COUNT] = { nullptr };
 	};
 
-	void build_internal(const VoxelBuffer &voxels, unsigned int channel, int lod_index);
-	void build_transition(const VoxelBuffer &voxels, unsigned int channel, int direction, int lod_index);
+	// Voxels can be read from a padded buffer, or directly from the blocks of a neighborhood
+	template <typename Voxels_T>
+	void build_from_voxels(VoxelMesher::Output &output, const Voxels_T &voxels, int lod_index);
+	template <typename Voxels_T>
+	void build_internal(const Voxels_T &voxels, unsigned int channel, int lod_index);
+	template <typename Voxels_T>
+	void build_transition(const Voxels_T &voxels, unsigned int channel, int direction, int lod_index);
 	Ref<ArrayMesh> build_transition_mesh(Ref<VoxelBuffer> voxels, int direction);
 	void reset_reuse_cells(Vector3i block_size);
 	void reset_reuse_cells_2d(Vector3i block_size);
@@ -1,10 +1,117 @@
 #include "voxel_mesher.h"
+#include "../util/profiling.h"
+#include <core/os/rw_lock.h>
+
+// Copies the given channels of a block and the part of its neighbors needed for meshing.
+// `dst` is meant to be reused across calls, so previous contents are always overwritten.
+static void copy_block_and_neighbors(const FixedArray<Ref<VoxelBuffer>, Cube::MOORE_AREA_3D_COUNT> &moore_blocks,
+		VoxelBuffer &dst, int min_padding, int max_padding, unsigned int channels_mask) {
+
+	VOXEL_PROFILE_SCOPE();
+
+	Ref<VoxelBuffer> central_buffer = moore_blocks[Cube::MOORE_AREA_3D_CENTRAL_INDEX];
+	CRASH_COND_MSG(central_buffer.is_null(), "Central buffer must be valid");
+	const int block_size = central_buffer->get_size().x;
+	const unsigned int padded_block_size = block_size + min_padding + max_padding;
+
+	// Channels keep their memory if the size doesn't change
+	dst.create(padded_block_size, padded_block_size, padded_block_size);
+
+	const Vector3i min_pos = -Vector3i(min_padding);
+	const Vector3i max_pos = Vector3i(block_size + max_padding);
+
+	for (unsigned int ci = 0; ci < VoxelBuffer::MAX_CHANNELS; ++ci) {
+		if ((channels_mask & (1 << ci)) == 0) {
+			continue;
+		}
+
+		const VoxelBuffer::Depth depth = central_buffer->get_channel_depth(ci);
+		if (dst.get_channel_depth(ci) != depth) {
+			// Previous contents are not needed, so no need to convert them
+			dst.clear_channel(ci);
+			dst.set_channel_depth(ci, depth);
+		}
+
+		// Missing neighbors are considered to contain the same defaults as a new buffer
+		const uint64_t missing_value = ci == VoxelBuffer::CHANNEL_SDF ? 255 : 0;
+
+		bool uniform = true;
+		uint64_t uniform_value = 0;
+		for (unsigned int i = 0; i < Cube::MOORE_AREA_3D_COUNT; ++i) {
+			Ref<VoxelBuffer> src = moore_blocks[i];
+			uint64_t v = missing_value;
+			if (src.is_valid()) {
+				RWLockRead read(src->get_lock());
+				if (src->get_channel_compression(ci) != VoxelBuffer::COMPRESSION_UNIFORM) {
+					uniform = false;
+					break;
+				}
+				v = src->get_voxel(0, 0, 0, ci);
+			}
+			if (i == 0) {
+				uniform_value = v;
+			} else if (v != uniform_value) {
+				uniform = false;
+				break;
+			}
+		}
+
+		if (uniform) {
+			// Meshers have fast paths for uniform channels, which is worth letting the memory go
+			dst.clear_channel(ci, uniform_value);
+			continue;
+		}
+
+		dst.decompress_channel(ci);
+
+		for (unsigned int i = 0; i < Cube::MOORE_AREA_3D_COUNT; ++i) {
+			const Vector3i offset = block_size * Cube::g_ordered_moore_area_3d[i];
+			Ref<VoxelBuffer> src = moore_blocks[i];
+
+			Vector3i src_min = min_pos - offset;
+			Vector3i src_max = max_pos - offset;
+			Vector3i dst_min = offset - min_pos;
+
+			if (src.is_valid()) {
+				RWLockRead read(src->get_lock());
+				if (src->get_channel_compression(ci) != VoxelBuffer::COMPRESSION_UNIFORM) {
+					dst.copy_from(**src, src_min, src_max, dst_min, ci);
+					continue;
+				}
+				// Copying would skip the area if the value equals the default value of `dst`
+				src_min.clamp_to(Vector3i(), Vector3i(block_size));
+				src_max.clamp_to(Vector3i(), Vector3i(block_size + 1));
+				dst_min.clamp_to(Vector3i(), dst.get_size());
+				dst.fill_area(src->get_voxel(0, 0, 0, ci), dst_min, dst_min + (src_max - src_min), ci);
+
+			} else {
+				src_min.clamp_to(Vector3i(), Vector3i(block_size));
+				src_max.clamp_to(Vector3i(), Vector3i(block_size + 1));
+				dst_min.clamp_to(Vector3i(), dst.get_size());
+				dst.fill_area(missing_value, dst_min, dst_min + (src_max - src_min), ci);
+			}
+		}
+	}
+}
 
 Ref<Mesh> VoxelMesher::build_mesh(Ref<VoxelBuffer> voxels, Array materials) {
 	ERR_FAIL_COND_V(voxels.is_null(), Ref<ArrayMesh>());
 
+	// Meshers read channels that are dense or uniform. Others are expanded in a copy, which shares the rest.
+	Ref<VoxelBuffer> readable_voxels = voxels;
+	for (unsigned int ci = 0; ci < VoxelBuffer::MAX_CHANNELS; ++ci) {
+		const VoxelBuffer::Compression compression = voxels->get_channel_compression(ci);
+		if (compression == VoxelBuffer::COMPRESSION_NONE || compression == VoxelBuffer::COMPRESSION_UNIFORM) {
+			continue;
+		}
+		if (readable_voxels == voxels) {
+			readable_voxels = voxels->duplicate(false);
+		}
+		readable_voxels->decompress_channel(ci);
+	}
+
 	Output output;
-	Input input = { **voxels, 0 };
+	Input input = { **readable_voxels, 0 };
 	build(output, input);
 
 	if (output.surfaces.empty()) {
@@ -40,6 +147,21 @@ void VoxelMesher::build(Output &output, const Input &input) {
 	ERR_PRINT("Not implemented");
 }
 
+void VoxelMesher::build_from_neighborhood(Output &output, const NeighborhoodInput &input) {
+	if (_neighborhood_buffer.is_null()) {
+		_neighborhood_buffer.instance();
+	}
+	copy_block_and_neighbors(input.blocks, **_neighborhood_buffer,
+			get_minimum_padding(), get_maximum_padding(), get_used_channels_mask());
+
+	Input padded_input = { **_neighborhood_buffer, input.lod };
+	build(output, padded_input);
+}
+
+unsigned int VoxelMesher::get_used_channels_mask() const {
+	return (1 << VoxelBuffer::MAX_CHANNELS) - 1;
+}
+
 unsigned int VoxelMesher::get_minimum_padding() const {
 	return _minimum_padding;
 }
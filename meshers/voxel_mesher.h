@@ -22,8 +22,23 @@ public:
 		unsigned int compression_flags = Mesh::ARRAY_COMPRESS_DEFAULT;
 	};
 
+	// Blocks of a Moore neighborhood ordered by forward XYZ iteration, the central one being meshed.
+	// Neighbors can be null if they don't exist.
+	struct NeighborhoodInput {
+		const FixedArray<Ref<VoxelBuffer>, Cube::MOORE_AREA_3D_COUNT> &blocks;
+		int lod;
+	};
+
 	virtual void build(Output &output, const Input &voxels);
 
+	// Builds a mesh from a block and its neighbors, which are read-locked while in use.
+	// By default, they are copied into a padded buffer given to `build`.
+	// Meshers can override this to read blocks directly instead.
+	virtual void build_from_neighborhood(Output &output, const NeighborhoodInput &input);
+
+	// Channels read by the mesher, as a bitmask. Only these are copied when a padded buffer is needed.
+	virtual unsigned int get_used_channels_mask() const;
+
 	// Get how many neighbor voxels need to be accessed around the meshed area.
 	// If this is not respected, the mesher might produce seams at the edges, or an error
 	unsigned int get_minimum_padding() const;
@@ -43,6 +58,9 @@ protected:
 private:
 	unsigned int _minimum_padding = 0;
 	unsigned int _maximum_padding = 0;
+
+	// Reused by `build_from_neighborhood`, so it doesn't have to be allocated every time
+	Ref<VoxelBuffer> _neighborhood_buffer;
 };
 
 #endif // VOXEL_MESHER_H
@@ -0,0 +1,63 @@
+#include "voxel_neighborhood_view.h"
+#include <core/os/rw_lock.h>
+
+VoxelNeighborhoodView::VoxelNeighborhoodView(const Blocks &blocks, unsigned int channel_index, uint64_t missing_value) {
+	CRASH_COND(channel_index >= VoxelBuffer::MAX_CHANNELS);
+
+	Ref<VoxelBuffer> central_block = blocks[Cube::MOORE_AREA_3D_CENTRAL_INDEX];
+	CRASH_COND_MSG(central_block.is_null(), "Central block must be valid");
+
+	for (unsigned int i = 0; i < blocks.size(); ++i) {
+		Ref<VoxelBuffer> block = blocks[i];
+		if (block.is_valid()) {
+			// Only the snapshot needs the lock. Blocks written afterwards get their own copy of the data.
+			RWLockRead lock(block->get_lock());
+			block->get_channel_snapshot(channel_index, _snapshots[i]);
+		}
+	}
+
+	const VoxelBuffer::ChannelSnapshot &central_snapshot = _snapshots[Cube::MOORE_AREA_3D_CENTRAL_INDEX];
+	const Vector3i size = central_snapshot.get_size();
+	_block_size = size.x;
+	_depth = central_snapshot.get_depth();
+
+	while ((1 << _block_size_po2) < _block_size) {
+		++_block_size_po2;
+	}
+	_block_size_mask = _block_size - 1;
+
+	if (size != Vector3i(_block_size) || (1 << _block_size_po2) != _block_size) {
+		_valid = false;
+	}
+
+	for (unsigned int i = 0; i < blocks.size(); ++i) {
+		const VoxelBuffer::ChannelSnapshot &snapshot = _snapshots[i];
+		_data[i] = nullptr;
+		_compressed[i] = false;
+		_uniform_values[i] = missing_value;
+
+		if (blocks[i].is_valid()) {
+			if (snapshot.get_size() != size || snapshot.get_depth() != _depth) {
+				_valid = false;
+			}
+
+			switch (snapshot.get_compression()) {
+				case VoxelBuffer::COMPRESSION_NONE:
+					_data[i] = snapshot.get_dense_data();
+					_uniform = false;
+					break;
+				case VoxelBuffer::COMPRESSION_UNIFORM:
+					_uniform_values[i] = snapshot.get_voxel(0, 0, 0);
+					break;
+				default:
+					_compressed[i] = true;
+					_uniform = false;
+					break;
+			}
+		}
+
+		if (_uniform_values[i] != _uniform_values[0]) {
+			_uniform = false;
+		}
+	}
+}
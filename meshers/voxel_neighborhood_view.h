@@ -0,0 +1,112 @@
+#ifndef VOXEL_NEIGHBORHOOD_VIEW_H
+#define VOXEL_NEIGHBORHOOD_VIEW_H
+
+#include "../cube_tables.h"
+#include "../voxel_buffer.h"
+
+// Read-only access to one channel of a block and its 26 neighbors, without copying them into a padded buffer.
+// Positions are relative to the origin of the central block, and can go up to one block away from it.
+// Uniform blocks are read from their single value, and compressed blocks are read in place.
+// Channels are snapshotted under a short read lock per block, so the view doesn't hold locks while it is used.
+class VoxelNeighborhoodView {
+public:
+	// Moore area ordered by forward XYZ iteration
+	typedef FixedArray<Ref<VoxelBuffer>, Cube::MOORE_AREA_3D_COUNT> Blocks;
+
+	// Missing blocks are considered uniform with `missing_value`
+	VoxelNeighborhoodView(const Blocks &blocks, unsigned int channel_index, uint64_t missing_value);
+
+	// Blocks must be cubes of the same power-of-two size and channel depth. Otherwise the view can't be used.
+	inline bool is_valid() const { return _valid; }
+
+	inline int get_block_size() const { return _block_size; }
+	inline VoxelBuffer::Depth get_depth() const { return _depth; }
+
+	// True if all voxels of the neighborhood have the same value
+	inline bool is_uniform() const { return _uniform; }
+
+	// Returns true if the given block is uniform, and gives its value
+	inline bool is_block_uniform(unsigned int block_index, uint64_t &out_value) const {
+		if (_data[block_index] != nullptr || _compressed[block_index]) {
+			return false;
+		}
+		out_value = _uniform_values[block_index];
+		return true;
+	}
+
+	// Positions are not checked, they must be within the neighborhood
+	inline uint64_t get_voxel(int x, int y, int z) const {
+		const unsigned int bx = (x + _block_size) >> _block_size_po2;
+		const unsigned int by = (y + _block_size) >> _block_size_po2;
+		const unsigned int bz = (z + _block_size) >> _block_size_po2;
+		const unsigned int bi = bx + 3 * (by + 3 * bz);
+
+		const uint8_t *data = _data[bi];
+		if (data == nullptr) {
+			if (_compressed[bi]) {
+				return _snapshots[bi].get_voxel(x & _block_size_mask, y & _block_size_mask, z & _block_size_mask);
+			}
+			return _uniform_values[bi];
+		}
+
+		// Same layout as VoxelBuffer
+		const unsigned int i = (y & _block_size_mask) +
+							   _block_size * ((x & _block_size_mask) + _block_size * (z & _block_size_mask));
+
+		switch (_depth) {
+			case VoxelBuffer::DEPTH_8_BIT:
+				return data[i];
+			case VoxelBuffer::DEPTH_16_BIT:
+				return reinterpret_cast<const uint16_t *>(data)[i];
+			case VoxelBuffer::DEPTH_32_BIT:
+				return reinterpret_cast<const uint32_t *>(data)[i];
+			case VoxelBuffer::DEPTH_64_BIT:
+				return reinterpret_cast<const uint64_t *>(data)[i];
+			default:
+				CRASH_NOW();
+				return 0;
+		}
+	}
+
+	inline uint64_t get_voxel(const Vector3i pos) const {
+		return get_voxel(pos.x, pos.y, pos.z);
+	}
+
+	// Same as get_voxel, with block size and depth resolved at compile time. They must match those of the view.
+	template <typename T, unsigned int BLOCK_SIZE_PO2>
+	inline T get_voxel_t(int x, int y, int z) const {
+		static const int BLOCK_SIZE = 1 << BLOCK_SIZE_PO2;
+		static const unsigned int MASK = BLOCK_SIZE - 1;
+
+		const unsigned int bx = (x + BLOCK_SIZE) >> BLOCK_SIZE_PO2;
+		const unsigned int by = (y + BLOCK_SIZE) >> BLOCK_SIZE_PO2;
+		const unsigned int bz = (z + BLOCK_SIZE) >> BLOCK_SIZE_PO2;
+		const unsigned int bi = bx + 3 * (by + 3 * bz);
+
+		const uint8_t *data = _data[bi];
+		if (data == nullptr) {
+			if (_compressed[bi]) {
+				return _snapshots[bi].get_voxel(x & MASK, y & MASK, z & MASK);
+			}
+			return _uniform_values[bi];
+		}
+		return reinterpret_cast<const T *>(data)[VoxelBufferCubeView<const T, BLOCK_SIZE>::index(
+				x & MASK, y & MASK, z & MASK)];
+	}
+
+private:
+	FixedArray<VoxelBuffer::ChannelSnapshot, Cube::MOORE_AREA_3D_COUNT> _snapshots;
+	// Dense data of each block, null if the block is uniform or compressed
+	FixedArray<const uint8_t *, Cube::MOORE_AREA_3D_COUNT> _data;
+	// Compressed blocks are read through their snapshot
+	FixedArray<bool, Cube::MOORE_AREA_3D_COUNT> _compressed;
+	FixedArray<uint64_t, Cube::MOORE_AREA_3D_COUNT> _uniform_values;
+	int _block_size = 0;
+	unsigned int _block_size_po2 = 0;
+	unsigned int _block_size_mask = 0;
+	VoxelBuffer::Depth _depth = VoxelBuffer::DEFAULT_CHANNEL_DEPTH;
+	bool _uniform = true;
+	bool _valid = true;
+};
+
+#endif // VOXEL_NEIGHBORHOOD_VIEW_H
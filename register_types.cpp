@@ -18,6 +18,7 @@
 #include "meshers/dmc/voxel_mesher_dmc.h"
 #include "meshers/transvoxel/voxel_mesher_transvoxel.h"
 #include "streams/voxel_stream_block_files.h"
+#include "streams/voxel_stream_cache.h"
 #include "streams/voxel_stream_file.h"
 #include "streams/voxel_stream_region_files.h"
 #include "terrain/voxel_box_mover.h"
@@ -60,6 +61,7 @@ void register_voxel_types() {
 	ClassDB::register_class<VoxelStreamFile>();
 	ClassDB::register_class<VoxelStreamBlockFiles>();
 	ClassDB::register_class<VoxelStreamRegionFiles>();
+	ClassDB::register_class<VoxelStreamCache>();
 
 	// Generators
 	ClassDB::register_class<VoxelGenerator>();
@@ -2,13 +2,19 @@
 #include "../meshers/transvoxel/voxel_mesher_transvoxel.h"
 #include "../util/macros.h"
 #include "../util/profiling.h"
+#include "../util/profiling_clock.h"
 #include "../voxel_constants.h"
+#include "../voxel_memory_pool.h"
+#include <core/hash_map.h>
 #include <core/os/memory.h>
+#include <core/project_settings.h>
 #include <scene/main/viewport.h>
 
 namespace {
 VoxelServer *g_voxel_server = nullptr;
-}
+// Beyond this, files are unlikely to be read faster
+const int MAX_AUTO_STREAMING_THREADS = 8;
+} // namespace
 
 template <typename Dst_T>
 inline Dst_T *must_be_cast(IVoxelTask *src) {
@@ -44,31 +50,66 @@ void VoxelServer::destroy_singleton() {
 }
 
 VoxelServer::VoxelServer() {
-	// TODO Can't set more than 1 thread yet, streams aren't well made for it... unless we can separate file ones
+	const int processor_count = OS::get_singleton()->get_processor_count();
+	const String streaming_thread_count_name = "voxel/threads/streaming/thread_count";
+	const String meshing_thread_count_name = "voxel/threads/meshing/thread_count";
+	const String meshing_work_stealing_name = "voxel/threads/meshing/work_stealing";
+	const String free_memory_budget_name = "voxel/memory/free_memory_budget_mb";
+	const String save_delay_name = "voxel/streaming/save_delay_ms";
+	const String max_pending_saves_name = "voxel/streaming/max_pending_saves";
+
+	// 0 means automatic: a quarter of the processor count, at least 1 and at most MAX_AUTO_STREAMING_THREADS (8).
+	// Streaming mostly waits on files, so it only takes a share of the hardware, and the meshing pool gets the rest.
+	int streaming_thread_count = GLOBAL_DEF(streaming_thread_count_name, 0);
+	ProjectSettings::get_singleton()->set_custom_property_info(streaming_thread_count_name,
+			PropertyInfo(Variant::INT, streaming_thread_count_name, PROPERTY_HINT_RANGE, "0,128"));
+	if (streaming_thread_count <= 0) {
+		streaming_thread_count = clamp(processor_count / 4, 1, MAX_AUTO_STREAMING_THREADS);
+	}
+
+	// 0 means automatic: use what remains of the hardware after the main and streaming threads.
+	int meshing_thread_count = GLOBAL_DEF(meshing_thread_count_name, 0);
+	ProjectSettings::get_singleton()->set_custom_property_info(meshing_thread_count_name,
+			PropertyInfo(Variant::INT, meshing_thread_count_name, PROPERTY_HINT_RANGE, "0,128"));
+	if (meshing_thread_count <= 0) {
+		meshing_thread_count = max(processor_count - 1 - streaming_thread_count, 1);
+	}
+
+	const bool meshing_work_stealing = GLOBAL_DEF(meshing_work_stealing_name, false);
+
+	// Memory of unloaded blocks is kept for reuse. On long-running instances, a budget prevents it from staying
+	// at its peak forever. 0 means no limit.
+	const int free_memory_budget_mb = GLOBAL_DEF(free_memory_budget_name, 0);
+	ProjectSettings::get_singleton()->set_custom_property_info(free_memory_budget_name,
+			PropertyInfo(Variant::INT, free_memory_budget_name, PROPERTY_HINT_RANGE, "0,65536"));
+	VoxelMemoryPool::get_singleton()->set_free_memory_budget(static_cast<uint64_t>(free_memory_budget_mb) << 20);
+
+	// Blocks edited continuously would be saved over and over. Waiting a bit before sending saves
+	// allows to only write the latest version. 0 sends them right away.
+	const int save_delay_ms = GLOBAL_DEF(save_delay_name, 1000);
+	ProjectSettings::get_singleton()->set_custom_property_info(save_delay_name,
+			PropertyInfo(Variant::INT, save_delay_name, PROPERTY_HINT_RANGE, "0,60000"));
+	_save_delay_usec = static_cast<uint64_t>(max(save_delay_ms, 0)) * 1000;
+
+	// Beyond this amount, saves are sent without waiting, to bound memory usage
+	const int max_pending_saves = GLOBAL_DEF(max_pending_saves_name, 1024);
+	ProjectSettings::get_singleton()->set_custom_property_info(max_pending_saves_name,
+			PropertyInfo(Variant::INT, max_pending_saves_name, PROPERTY_HINT_RANGE, "0,65536"));
+	_max_pending_saves = max(max_pending_saves, 0);
+
 	// This pool can work on larger periods, it doesn't require low latency
-	_streaming_thread_pool.set_thread_count(1);
 	_streaming_thread_pool.set_priority_update_period(300);
 	_streaming_thread_pool.set_batch_count(16);
+	set_streaming_thread_count(streaming_thread_count);
 
-	// TODO Try more threads, it should be possible
 	// This pool works on visuals so it must have low latency
-	_meshing_thread_pool.set_thread_count(2);
 	_meshing_thread_pool.set_priority_update_period(64);
 	_meshing_thread_pool.set_batch_count(1);
+	_meshing_thread_pool.set_work_stealing_enabled(meshing_work_stealing);
+	set_meshing_thread_count(meshing_thread_count);
 
-	for (size_t i = 0; i < _meshing_thread_pool.get_thread_count(); ++i) {
-		Ref<VoxelMesherBlocky> mesher;
-		mesher.instance();
-		mesher->set_occlusion_enabled(true);
-		mesher->set_occlusion_darkness(0.8f);
-		_blocky_meshers[i] = mesher;
-	}
-
-	for (size_t i = 0; i < _meshing_thread_pool.get_thread_count(); ++i) {
-		Ref<VoxelMesherTransvoxel> mesher;
-		mesher.instance();
-		_smooth_meshers[i] = mesher;
-	}
+	PRINT_VERBOSE(String("Voxel thread counts: {0} streaming, {1} meshing")
+						  .format(varray(streaming_thread_count, meshing_thread_count)));
 
 	if (Engine::get_singleton()->is_editor_hint()) {
 		// Default viewer
@@ -94,6 +135,9 @@ VoxelServer::~VoxelServer() {
 }
 
 void VoxelServer::wait_and_clear_all_tasks(bool warn) {
+	// Saves still waiting in the lane must not be lost
+	schedule_pending_saves(true);
+
 	_streaming_thread_pool.wait_for_all_tasks();
 	_meshing_thread_pool.wait_for_all_tasks();
 
@@ -104,6 +148,8 @@ void VoxelServer::wait_and_clear_all_tasks(bool warn) {
 		}
 		memdelete(task);
 	});
+	_save_batches_in_flight = 0;
+	_saves_in_flight.clear();
 
 	_meshing_thread_pool.dequeue_completed_tasks([](IVoxelTask *task) {
 		memdelete(task);
@@ -164,6 +210,9 @@ void VoxelServer::set_volume_stream(uint32_t volume_id, Ref<VoxelStream> stream)
 	Volume &volume = _world.volumes.get(volume_id);
 	volume.stream = stream;
 
+	// Saves meant for the previous stream are sent right away instead of waiting for their delay
+	schedule_pending_saves_of_volume(volume_id);
+
 	// Commit a new stream to process requests with
 	if (volume.stream_dependency != nullptr) {
 		volume.stream_dependency->valid = false;
@@ -172,13 +221,73 @@ void VoxelServer::set_volume_stream(uint32_t volume_id, Ref<VoxelStream> stream)
 	if (stream.is_valid()) {
 		volume.stream_dependency = gd_make_shared<StreamingDependency>();
 		for (size_t i = 0; i < _streaming_thread_pool.get_thread_count(); ++i) {
-			volume.stream_dependency->streams[i] = stream->duplicate();
+			volume.stream_dependency->streams[i] = create_stream_instance_for_thread(stream);
 		}
 	} else {
 		volume.stream_dependency = nullptr;
 	}
 }
 
+Ref<VoxelStream> VoxelServer::create_stream_instance_for_thread(Ref<VoxelStream> stream) {
+	if (stream->is_thread_safe()) {
+		return stream;
+	}
+	return stream->duplicate();
+}
+
+void VoxelServer::set_streaming_thread_count(int count) {
+	ERR_FAIL_COND(count < 1);
+	const unsigned int new_count = min(static_cast<unsigned int>(count), VoxelThreadPool::MAX_THREADS);
+	const unsigned int previous_count = _streaming_thread_pool.get_thread_count();
+
+	// New threads need their stream instances before they start
+	_world.volumes.for_each([new_count, previous_count](Volume &volume) {
+		if (volume.stream_dependency == nullptr) {
+			return;
+		}
+		for (unsigned int i = previous_count; i < new_count; ++i) {
+			Ref<VoxelStream> &stream = volume.stream_dependency->streams[i];
+			if (stream.is_null()) {
+				stream = create_stream_instance_for_thread(volume.stream);
+			}
+		}
+	});
+
+	_streaming_thread_pool.set_thread_count(new_count);
+}
+
+int VoxelServer::get_streaming_thread_count() const {
+	return _streaming_thread_pool.get_thread_count();
+}
+
+void VoxelServer::set_meshing_thread_count(int count) {
+	ERR_FAIL_COND(count < 1);
+	const unsigned int new_count = min(static_cast<unsigned int>(count), VoxelThreadPool::MAX_THREADS);
+
+	// New threads need their mesher instances and buffers before they start.
+	// They are kept when threads are removed, so they don't have to be re-created if more threads are added again.
+	for (unsigned int i = 0; i < new_count; ++i) {
+		if (_blocky_meshers[i].is_null()) {
+			Ref<VoxelMesherBlocky> mesher;
+			mesher.instance();
+			mesher->set_occlusion_enabled(true);
+			mesher->set_occlusion_darkness(0.8f);
+			_blocky_meshers[i] = mesher;
+		}
+		if (_smooth_meshers[i].is_null()) {
+			Ref<VoxelMesherTransvoxel> mesher;
+			mesher.instance();
+			_smooth_meshers[i] = mesher;
+		}
+	}
+
+	_meshing_thread_pool.set_thread_count(new_count);
+}
+
+int VoxelServer::get_meshing_thread_count() const {
+	return _meshing_thread_pool.get_thread_count();
+}
+
 void VoxelServer::set_volume_voxel_library(uint32_t volume_id, Ref<VoxelLibrary> library) {
 	Volume &volume = _world.volumes.get(volume_id);
 	volume.voxel_library = library;
@@ -197,11 +306,8 @@ static inline Vector3i get_block_center(Vector3i pos, int bs, int lod) {
 	return (pos << lod) * bs + Vector3i(bs / 2);
 }
 
-void VoxelServer::request_block_mesh(uint32_t volume_id, BlockMeshInput &input) {
-	const Volume &volume = _world.volumes.get(volume_id);
-	ERR_FAIL_COND(volume.stream.is_null());
-	CRASH_COND(volume.stream_dependency == nullptr);
-	ERR_FAIL_COND(volume.meshing_dependency == nullptr);
+VoxelServer::BlockMeshRequest *VoxelServer::create_block_mesh_request(
+		uint32_t volume_id, const Volume &volume, const BlockMeshInput &input) {
 
 	// TODO Handle spamming!
 	// It was previously done by remembering the request with a hashmap by position.
@@ -223,30 +329,117 @@ void VoxelServer::request_block_mesh(uint32_t volume_id, BlockMeshInput &input)
 	r->priority_dependency.world_position = volume.transform.xform(voxel_pos.to_vec3());
 	r->priority_dependency.shared = _world.shared_priority_dependency;
 
+	return r;
+}
+
+void VoxelServer::request_block_mesh(uint32_t volume_id, BlockMeshInput &input) {
+	const Volume &volume = _world.volumes.get(volume_id);
+	ERR_FAIL_COND(volume.stream.is_null());
+	CRASH_COND(volume.stream_dependency == nullptr);
+	ERR_FAIL_COND(volume.meshing_dependency == nullptr);
+
 	// We'll allocate this quite often. If it becomes a problem, it should be easy to pool.
+	BlockMeshRequest *r = create_block_mesh_request(volume_id, volume, input);
 	_meshing_thread_pool.enqueue(r);
 }
 
+VoxelServer::BlockDataRequest *VoxelServer::create_block_load_request(
+		uint32_t volume_id, const Volume &volume, Vector3i block_pos, int lod) {
+
+	BlockDataRequest *r = memnew(BlockDataRequest);
+	r->volume_id = volume_id;
+	r->position = block_pos;
+	r->lod = lod;
+	r->type = BlockDataRequest::TYPE_LOAD;
+	r->block_size = volume.block_size;
+	// The buffer is only allocated by the task, but the reference exists already so meshing tasks can depend on it
+	r->voxels.instance();
+
+	r->stream_dependency = volume.stream_dependency;
+
+	// The stream doesn't have the latest version of blocks with a save still waiting or being written
+	const PendingSave *pending_save = get_pending_save(volume_id, block_pos, lod);
+	if (pending_save != nullptr && pending_save->stream_dependency == volume.stream_dependency) {
+		r->pending_save_voxels = pending_save->item.voxels;
+
+	} else {
+		PendingSaveKey key;
+		key.position = block_pos;
+		key.volume_id = volume_id;
+		key.lod = lod;
+		const SaveInFlight *save_in_flight = _saves_in_flight.getptr(key);
+		if (save_in_flight != nullptr && save_in_flight->stream_dependency == volume.stream_dependency) {
+			r->pending_save_voxels = save_in_flight->voxels;
+		}
+	}
+
+	const Vector3i voxel_pos = get_block_center(block_pos, volume.block_size, lod);
+	r->priority_dependency.world_position = volume.transform.xform(voxel_pos.to_vec3());
+	r->priority_dependency.shared = _world.shared_priority_dependency;
+
+	return r;
+}
+
 void VoxelServer::request_block_load(uint32_t volume_id, Vector3i block_pos, int lod) {
 	const Volume &volume = _world.volumes.get(volume_id);
 	ERR_FAIL_COND(volume.stream.is_null());
 	CRASH_COND(volume.stream_dependency == nullptr);
 
-	BlockDataRequest r;
-	r.volume_id = volume_id;
-	r.position = block_pos;
-	r.lod = lod;
-	r.type = BlockDataRequest::TYPE_LOAD;
-	r.block_size = volume.block_size;
+	BlockDataRequest *r = create_block_load_request(volume_id, volume, block_pos, lod);
+	_streaming_thread_pool.enqueue(r);
+}
 
-	r.stream_dependency = volume.stream_dependency;
+void VoxelServer::request_block_loads(uint32_t volume_id, const std::vector<Vector3i> &block_positions, int lod,
+		const std::vector<BlockMeshInput> &meshes) {
 
-	const Vector3i voxel_pos = get_block_center(block_pos, volume.block_size, lod);
-	r.priority_dependency.world_position = volume.transform.xform(voxel_pos.to_vec3());
-	r.priority_dependency.shared = _world.shared_priority_dependency;
+	VOXEL_PROFILE_SCOPE();
+	const Volume &volume = _world.volumes.get(volume_id);
+	ERR_FAIL_COND(volume.stream.is_null());
+	CRASH_COND(volume.stream_dependency == nullptr);
+	ERR_FAIL_COND(volume.meshing_dependency == nullptr);
+
+	if (block_positions.size() == 0) {
+		return;
+	}
+
+	std::vector<IVoxelTask *> loads;
+	loads.resize(block_positions.size());
+	HashMap<Vector3i, BlockDataRequest *, Vector3iHasher> loads_by_position;
+
+	for (size_t i = 0; i < block_positions.size(); ++i) {
+		BlockDataRequest *r = create_block_load_request(volume_id, volume, block_positions[i], lod);
+		loads[i] = r;
+		loads_by_position.set(r->position, r);
+	}
 
-	BlockDataRequest *rp = memnew(BlockDataRequest(r));
-	_streaming_thread_pool.enqueue(rp);
+	// Meshes must be linked to the loads before those are queued
+	std::vector<IVoxelTask *> dependencies;
+	for (size_t i = 0; i < meshes.size(); ++i) {
+		const BlockMeshInput &input = meshes[i];
+		BlockMeshRequest *r = create_block_mesh_request(volume_id, volume, input);
+
+		for (unsigned int j = 0; j < Cube::MOORE_AREA_3D_COUNT; ++j) {
+			if (r->blocks[j].is_valid()) {
+				continue;
+			}
+			const Vector3i npos = input.position + Cube::g_ordered_moore_area_3d[j];
+			BlockDataRequest **load_ptr = loads_by_position.getptr(npos);
+			ERR_CONTINUE_MSG(load_ptr == nullptr, "Mesh input is missing a block which isn't requested for loading");
+			BlockDataRequest *load = *load_ptr;
+			r->blocks[j] = load->voxels;
+			dependencies.push_back(load);
+		}
+
+		if (dependencies.size() > 0) {
+			r->has_load_dependencies = true;
+			_meshing_thread_pool.enqueue_after(r, ArraySlice<IVoxelTask *>(dependencies, 0, dependencies.size()));
+		} else {
+			_meshing_thread_pool.enqueue(r);
+		}
+		dependencies.clear();
+	}
+
+	_streaming_thread_pool.enqueue(ArraySlice<IVoxelTask *>(loads, 0, loads.size()));
 }
 
 void VoxelServer::request_block_save(uint32_t volume_id, Ref<VoxelBuffer> voxels, Vector3i block_pos, int lod) {
@@ -254,23 +447,205 @@ void VoxelServer::request_block_save(uint32_t volume_id, Ref<VoxelBuffer> voxels
 	ERR_FAIL_COND(volume.stream.is_null());
 	CRASH_COND(volume.stream_dependency == nullptr);
 
-	BlockDataRequest r;
-	r.voxels = voxels;
-	r.volume_id = volume_id;
-	r.position = block_pos;
-	r.lod = lod;
-	r.type = BlockDataRequest::TYPE_SAVE;
-	r.block_size = volume.block_size;
-
-	r.stream_dependency = volume.stream_dependency;
+	PendingSave *pending_save = get_pending_save(volume_id, block_pos, lod);
+	if (pending_save != nullptr && pending_save->stream_dependency == volume.stream_dependency) {
+		// The block was saved again before the previous version got sent, only the latest needs to be written
+		pending_save->item.voxels = voxels;
+		++_coalesced_save_count;
+		return;
+	}
 
 	// No priority data, saving doesnt need sorting
+	PendingSave s;
+	s.item.voxels = voxels;
+	s.item.position = block_pos;
+	s.item.lod = lod;
+	s.volume_id = volume_id;
+	s.block_size = volume.block_size;
+	s.time_usec = OS::get_singleton()->get_ticks_usec();
+	s.stream_dependency = volume.stream_dependency;
+
+	_pending_saves.push_back(s);
+
+	PendingSaveKey key;
+	key.position = block_pos;
+	key.volume_id = volume_id;
+	key.lod = lod;
+	_pending_save_ids.set(key, _next_pending_save_id);
+	++_next_pending_save_id;
+}
+
+VoxelServer::PendingSave *VoxelServer::get_pending_save(uint32_t volume_id, Vector3i block_pos, int lod) {
+	PendingSaveKey key;
+	key.position = block_pos;
+	key.volume_id = volume_id;
+	key.lod = lod;
 
-	BlockDataRequest *rp = memnew(BlockDataRequest(r));
-	_streaming_thread_pool.enqueue(rp);
+	const uint64_t *id = _pending_save_ids.getptr(key);
+	if (id == nullptr) {
+		return nullptr;
+	}
+	const uint64_t front_id = _next_pending_save_id - _pending_saves.size();
+	CRASH_COND(*id < front_id);
+	return &_pending_saves[*id - front_id];
+}
+
+void VoxelServer::schedule_pending_saves(bool flush) {
+	// Limiting how many batches can be in flight leaves room for loads, which need low latency
+	const unsigned int max_batches_in_flight = _streaming_thread_pool.get_thread_count();
+	const uint64_t now = OS::get_singleton()->get_ticks_usec();
+
+	// Saves wait for a delay in case their block gets saved again, unless too many of them are waiting
+	auto is_ready = [this, flush, now](const PendingSave &s) {
+		return flush || _pending_saves.size() > _max_pending_saves || now - s.time_usec >= _save_delay_usec;
+	};
+
+	while (_pending_saves.size() > 0 && (flush || _save_batches_in_flight < max_batches_in_flight) &&
+			is_ready(_pending_saves.front())) {
+		const PendingSave &first = _pending_saves.front();
+
+		BlockDataRequest *r = memnew(BlockDataRequest);
+		r->volume_id = first.volume_id;
+		r->type = BlockDataRequest::TYPE_SAVE;
+		r->block_size = first.block_size;
+		r->stream_dependency = first.stream_dependency;
+
+		// Group consecutive saves going to the same stream
+		while (_pending_saves.size() > 0 && r->save_items.size() < MAX_BLOCKS_PER_SAVE_BATCH) {
+			const PendingSave &s = _pending_saves.front();
+			if (s.stream_dependency != r->stream_dependency || !is_ready(s)) {
+				break;
+			}
+			r->save_items.push_back(s.item);
+
+			// A newer save of the same block may have been queued separately if the stream changed
+			PendingSaveKey key;
+			key.position = s.item.position;
+			key.volume_id = s.volume_id;
+			key.lod = s.item.lod;
+			const uint64_t id = _next_pending_save_id - _pending_saves.size();
+			const uint64_t *mapped_id = _pending_save_ids.getptr(key);
+			if (mapped_id != nullptr && *mapped_id == id) {
+				_pending_save_ids.erase(key);
+			}
+
+			_pending_saves.pop_front();
+		}
+
+		enqueue_save_batch(r);
+	}
+}
+
+// Sends all pending saves of a volume right away, when they can't wait anymore because the volume goes away
+// or stops using the stream they were meant for
+void VoxelServer::schedule_pending_saves_of_volume(uint32_t volume_id) {
+	std::deque<PendingSave> remaining_saves;
+	BlockDataRequest *r = nullptr;
+
+	for (auto it = _pending_saves.begin(); it != _pending_saves.end(); ++it) {
+		const PendingSave &s = *it;
+		if (s.volume_id != volume_id) {
+			remaining_saves.push_back(s);
+			continue;
+		}
+
+		// Group consecutive saves going to the same stream
+		if (r != nullptr &&
+				(s.stream_dependency != r->stream_dependency || r->save_items.size() >= MAX_BLOCKS_PER_SAVE_BATCH)) {
+			enqueue_save_batch(r);
+			r = nullptr;
+		}
+
+		if (r == nullptr) {
+			r = memnew(BlockDataRequest);
+			r->volume_id = s.volume_id;
+			r->type = BlockDataRequest::TYPE_SAVE;
+			r->block_size = s.block_size;
+			r->stream_dependency = s.stream_dependency;
+		}
+
+		r->save_items.push_back(s.item);
+	}
+
+	if (r == nullptr) {
+		// The volume had no pending saves
+		return;
+	}
+
+	enqueue_save_batch(r);
+
+	_pending_saves.swap(remaining_saves);
+
+	// Renumber remaining saves. They are iterated in the order they were queued,
+	// so if a block has several of them, the newest one ends up mapped.
+	_pending_save_ids.clear();
+	const uint64_t front_id = _next_pending_save_id - _pending_saves.size();
+	for (size_t i = 0; i < _pending_saves.size(); ++i) {
+		const PendingSave &s = _pending_saves[i];
+		PendingSaveKey key;
+		key.position = s.item.position;
+		key.volume_id = s.volume_id;
+		key.lod = s.item.lod;
+		_pending_save_ids.set(key, front_id + i);
+	}
+}
+
+void VoxelServer::enqueue_save_batch(BlockDataRequest *r) {
+	for (size_t i = 0; i < r->save_items.size(); ++i) {
+		const SaveItem &item = r->save_items[i];
+		PendingSaveKey key;
+		key.position = item.position;
+		key.volume_id = r->volume_id;
+		key.lod = item.lod;
+		// If an older version of the block is still being written, this one replaces it
+		SaveInFlight s;
+		s.voxels = item.voxels;
+		s.stream_dependency = r->stream_dependency;
+		_saves_in_flight.set(key, s);
+	}
+
+	_streaming_thread_pool.enqueue_fifo(r);
+	++_save_batches_in_flight;
+}
+
+void VoxelServer::remove_saves_in_flight(const BlockDataRequest &r) {
+	for (size_t i = 0; i < r.save_items.size(); ++i) {
+		const SaveItem &item = r.save_items[i];
+		PendingSaveKey key;
+		key.position = item.position;
+		key.volume_id = r.volume_id;
+		key.lod = item.lod;
+		const SaveInFlight *s = _saves_in_flight.getptr(key);
+		// Keep it if a newer version was sent since
+		if (s != nullptr && s->voxels == item.voxels) {
+			_saves_in_flight.erase(key);
+		}
+	}
+}
+
+void VoxelServer::flush_pending_saves() {
+	VOXEL_PROFILE_SCOPE();
+
+	schedule_pending_saves(true);
+
+	while (_save_batches_in_flight > 0) {
+		OS::get_singleton()->delay_usec(1000);
+		// Load results received meanwhile are handed to volumes as usual
+		process_streaming_results();
+	}
+
+	// Some streams keep saved blocks in memory before writing them
+	_world.volumes.for_each([](Volume &volume) {
+		if (volume.stream.is_valid()) {
+			volume.stream->flush();
+		}
+	});
 }
 
 void VoxelServer::remove_volume(uint32_t volume_id) {
+	// Don't leave saves of the volume waiting for their delay once it's gone
+	schedule_pending_saves_of_volume(volume_id);
+
 	{
 		Volume &volume = _world.volumes.get(volume_id);
 		if (volume.stream_dependency != nullptr) {
@@ -357,42 +732,51 @@ bool VoxelServer::viewer_exists(uint32_t viewer_id) const {
 	return _world.viewers.is_valid(viewer_id);
 }
 
-void VoxelServer::process() {
-	// Note, this shouldn't be here. It should normally done just after SwapBuffers.
-	// Godot does not have any C++ profiler usage anywhere, so when using Tracy Profiler I have to put it somewhere...
-	VOXEL_PROFILE_MARK_FRAME();
+void VoxelServer::process_streaming_results() {
 	VOXEL_PROFILE_SCOPE();
 
-	// Receive data updates
 	_streaming_thread_pool.dequeue_completed_tasks([this](IVoxelTask *task) {
 		BlockDataRequest *r = must_be_cast<BlockDataRequest>(task);
 		Volume *volume = _world.volumes.try_get(r->volume_id);
 
+		if (r->type == BlockDataRequest::TYPE_SAVE) {
+			CRASH_COND(_save_batches_in_flight == 0);
+			--_save_batches_in_flight;
+			remove_saves_in_flight(*r);
+		}
+
 		if (volume != nullptr) {
 			// TODO Comparing pointer may not be guaranteed
 			// The request response must match the dependency it would have been requested with.
 			// If it doesn't match, we are no longer interested in the result.
 			if (r->stream_dependency == volume->stream_dependency) {
-				BlockDataOutput o;
-				o.voxels = r->voxels;
-				o.position = r->position;
-				o.lod = r->lod;
-				o.dropped = !r->has_run;
-
 				switch (r->type) {
 					case BlockDataRequest::TYPE_SAVE:
-						o.type = BlockDataOutput::TYPE_SAVE;
+						// One confirmation per block of the batch
+						for (size_t i = 0; i < r->save_items.size(); ++i) {
+							const SaveItem &item = r->save_items[i];
+							BlockDataOutput o;
+							o.type = BlockDataOutput::TYPE_SAVE;
+							o.position = item.position;
+							o.lod = item.lod;
+							o.dropped = !r->has_run;
+							volume->reception_buffers->data_output.push_back(o);
+						}
 						break;
 
-					case BlockDataRequest::TYPE_LOAD:
+					case BlockDataRequest::TYPE_LOAD: {
+						BlockDataOutput o;
 						o.type = BlockDataOutput::TYPE_LOAD;
-						break;
+						o.voxels = r->voxels;
+						o.position = r->position;
+						o.lod = r->lod;
+						o.dropped = !r->has_run;
+						volume->reception_buffers->data_output.push_back(o);
+					} break;
 
 					default:
 						CRASH_NOW_MSG("Unexpected data request response type");
 				}
-
-				volume->reception_buffers->data_output.push_back(o);
 			}
 
 		} else {
@@ -402,8 +786,17 @@ void VoxelServer::process() {
 
 		memdelete(r);
 	});
+}
+
+void VoxelServer::process() {
+	// Note, this shouldn't be here. It should normally done just after SwapBuffers.
+	// Godot does not have any C++ profiler usage anywhere, so when using Tracy Profiler I have to put it somewhere...
+	VOXEL_PROFILE_MARK_FRAME();
+	VOXEL_PROFILE_SCOPE();
 
-	// Receive mesh updates
+	// Receive mesh updates.
+	// This is done before data updates: a load task always completes before the meshing tasks depending on it,
+	// so this order guarantees volumes won't get a mesh before the blocks it was made from.
 	_meshing_thread_pool.dequeue_completed_tasks([this](IVoxelTask *task) {
 		BlockMeshRequest *r = must_be_cast<BlockMeshRequest>(task);
 		Volume *volume = _world.volumes.try_get(r->volume_id);
@@ -439,6 +832,12 @@ void VoxelServer::process() {
 		memdelete(r);
 	});
 
+	// Receive data updates
+	process_streaming_results();
+
+	// Send saves after receiving, so finished batches leave room for new ones
+	schedule_pending_saves(false);
+
 	// Update viewer dependencies
 	{
 		const size_t viewer_count = _world.viewers.count();
@@ -502,18 +901,119 @@ static Dictionary debug_get_pool_stats(const VoxelThreadPool &pool) {
 	d["tasks"] = pool.get_debug_remaining_tasks();
 	d["active_threads"] = debug_get_active_thread_count(pool);
 	d["thread_count"] = pool.get_thread_count();
+	d["work_stealing"] = pool.is_work_stealing_enabled();
 	return d;
 }
 
+namespace {
+class BenchmarkTask : public IVoxelTask {
+public:
+	BenchmarkTask(int p_priority) :
+			priority(p_priority) {}
+
+	void run(VoxelTaskContext ctx) override {}
+	int get_priority() override { return priority; }
+
+	int priority;
+};
+} // namespace
+
+Dictionary VoxelServer::debug_measure_task_scheduling(int task_count, int thread_count, bool work_stealing) {
+	ERR_FAIL_COND_V(task_count <= 0, Dictionary());
+	ERR_FAIL_COND_V(thread_count <= 0, Dictionary());
+
+	VoxelThreadPool pool;
+	pool.set_priority_update_period(64);
+	pool.set_batch_count(1);
+	pool.set_work_stealing_enabled(work_stealing);
+
+	// Priorities are pseudo-random so the pool can't benefit from insertion order
+	std::vector<IVoxelTask *> tasks;
+	tasks.resize(task_count);
+	uint32_t seed = 131;
+	for (size_t i = 0; i < tasks.size(); ++i) {
+		seed = seed * 1103515245 + 12345;
+		tasks[i] = memnew(BenchmarkTask((seed >> 8) % 100000));
+	}
+
+	// Tasks are queued before threads are started so all of them compete in the queue
+	pool.enqueue(ArraySlice<IVoxelTask *>(tasks, 0, tasks.size()));
+
+	ProfilingClock profiling_clock;
+	pool.set_thread_count(thread_count);
+	pool.wait_for_all_tasks();
+	const uint64_t total_time_usec = profiling_clock.restart();
+
+	pool.dequeue_completed_tasks([](IVoxelTask *task) {
+		memdelete(task);
+	});
+
+	const uint64_t pick_count = pool.get_debug_pick_count();
+	const uint64_t picking_time_usec = pool.get_debug_picking_time_usec();
+
+	Dictionary d;
+	d["task_count"] = task_count;
+	d["thread_count"] = pool.get_thread_count();
+	d["work_stealing"] = pool.is_work_stealing_enabled();
+	d["total_time_usec"] = total_time_usec;
+	d["pick_count"] = pick_count;
+	d["average_pick_time_usec"] = pick_count > 0 ? static_cast<double>(picking_time_usec) / pick_count : 0.0;
+	d["tasks_per_second"] = total_time_usec > 0 ? 1000000.0 * task_count / total_time_usec : 0.0;
+	return d;
+}
+
+static Dictionary debug_get_memory_pool_stats() {
+	const VoxelMemoryPool::DebugStats stats = VoxelMemoryPool::get_singleton()->debug_get_stats();
+	Dictionary d;
+	d["used_blocks"] = stats.used_blocks;
+	d["cache_hits"] = stats.cache_hits;
+	d["cache_misses"] = stats.cache_misses;
+	d["lock_contentions"] = stats.lock_contentions;
+	d["free_bytes"] = stats.free_bytes;
+	d["used_bytes"] = stats.used_bytes;
+	d["free_memory_budget"] = VoxelMemoryPool::get_singleton()->get_free_memory_budget();
+
+	std::vector<VoxelMemoryPool::SizeClassStats> size_class_stats;
+	VoxelMemoryPool::get_singleton()->debug_get_size_class_stats(size_class_stats);
+	Array size_classes;
+	for (size_t i = 0; i < size_class_stats.size(); ++i) {
+		const VoxelMemoryPool::SizeClassStats &sc = size_class_stats[i];
+		Dictionary scd;
+		scd["block_size"] = sc.block_size;
+		scd["free_bytes"] = static_cast<uint64_t>(sc.block_size) * sc.free_blocks;
+		scd["used_bytes"] = static_cast<uint64_t>(sc.block_size) * sc.used_blocks;
+		size_classes.append(scd);
+	}
+	d["size_classes"] = size_classes;
+
+	return d;
+}
+
+void VoxelServer::trim_memory_pool(int64_t max_free_bytes) {
+	ERR_FAIL_COND(max_free_bytes < 0);
+	VoxelMemoryPool::get_singleton()->trim(max_free_bytes);
+}
+
 Dictionary VoxelServer::_b_get_stats() {
 	Dictionary d;
+	d["memory_pool"] = debug_get_memory_pool_stats();
 	d["streaming"] = debug_get_pool_stats(_streaming_thread_pool);
 	d["meshing"] = debug_get_pool_stats(_meshing_thread_pool);
+	d["pending_saves"] = SIZE_T_TO_VARIANT(_pending_saves.size());
+	d["save_batches_in_flight"] = _save_batches_in_flight;
+	d["coalesced_saves"] = SIZE_T_TO_VARIANT(_coalesced_save_count);
 	return d;
 }
 
 void VoxelServer::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("get_stats"), &VoxelServer::_b_get_stats);
+	ClassDB::bind_method(D_METHOD("flush_pending_saves"), &VoxelServer::flush_pending_saves);
+	ClassDB::bind_method(D_METHOD("trim_memory_pool", "max_free_bytes"), &VoxelServer::trim_memory_pool, DEFVAL(0));
+
+	ClassDB::bind_method(D_METHOD("set_streaming_thread_count", "count"), &VoxelServer::set_streaming_thread_count);
+	ClassDB::bind_method(D_METHOD("get_streaming_thread_count"), &VoxelServer::get_streaming_thread_count);
+	ClassDB::bind_method(D_METHOD("set_meshing_thread_count", "count"), &VoxelServer::set_meshing_thread_count);
+	ClassDB::bind_method(D_METHOD("get_meshing_thread_count"), &VoxelServer::get_meshing_thread_count);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -529,19 +1029,42 @@ void VoxelServer::BlockDataRequest::run(VoxelTaskContext ctx) {
 
 	switch (type) {
 		case TYPE_LOAD:
-			voxels.instance();
+			CRASH_COND(voxels.is_null());
 			voxels->create(block_size, block_size, block_size);
-			stream->emerge_block(voxels, origin_in_voxels, lod);
+			if (pending_save_voxels.is_valid()) {
+				{
+					// Channels are shared, not copied
+					RWLockRead lock(pending_save_voxels->get_lock());
+					for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
+						voxels->set_channel_depth(i, pending_save_voxels->get_channel_depth(i));
+					}
+					voxels->copy_from(**pending_save_voxels);
+					voxels->copy_voxel_metadata(**pending_save_voxels);
+				}
+				pending_save_voxels.unref();
+			} else {
+				stream->emerge_block(voxels, origin_in_voxels, lod);
+			}
+			// Stratified terrain and blocks using few types take a lot less memory this way
+			voxels->compress_channels();
 			break;
 
 		case TYPE_SAVE: {
-			Ref<VoxelBuffer> voxels_copy;
-			{
-				RWLockRead lock(voxels->get_lock());
-				voxels_copy = voxels->duplicate(true);
+			// Sending the whole batch at once allows streams to group accesses, like region files do
+			Vector<VoxelBlockRequest> requests;
+			requests.resize(save_items.size());
+			for (size_t i = 0; i < save_items.size(); ++i) {
+				SaveItem &item = save_items[i];
+				VoxelBlockRequest &r = requests.write[i];
+				{
+					RWLockRead lock(item.voxels->get_lock());
+					r.voxel_buffer = item.voxels->duplicate(true);
+				}
+				item.voxels.unref();
+				r.origin_in_voxels = (item.position << item.lod) * block_size;
+				r.lod = item.lod;
 			}
-			voxels.unref();
-			stream->immerge_block(voxels_copy, origin_in_voxels, lod);
+			stream->immerge_blocks(requests);
 		} break;
 
 		default:
@@ -567,64 +1090,26 @@ bool VoxelServer::BlockDataRequest::is_cancelled() {
 
 //----------------------------------------------------------------------------------------------------------------------
 
-static void copy_block_and_neighbors(const FixedArray<Ref<VoxelBuffer>, Cube::MOORE_AREA_3D_COUNT> &moore_blocks,
-		VoxelBuffer &dst, int min_padding, int max_padding) {
-
+void VoxelServer::BlockMeshRequest::run(VoxelTaskContext ctx) {
 	VOXEL_PROFILE_SCOPE();
+	CRASH_COND(meshing_dependency == nullptr);
 
-	FixedArray<unsigned int, 2> channels;
-	channels[0] = VoxelBuffer::CHANNEL_TYPE;
-	channels[1] = VoxelBuffer::CHANNEL_SDF;
-
-	Ref<VoxelBuffer> central_buffer = moore_blocks[Cube::MOORE_AREA_3D_CENTRAL_INDEX];
-	CRASH_COND_MSG(central_buffer.is_null(), "Central buffer must be valid");
-	const int block_size = central_buffer->get_size().x;
-	const unsigned int padded_block_size = block_size + min_padding + max_padding;
-
-	dst.create(padded_block_size, padded_block_size, padded_block_size);
-
-	for (unsigned int ci = 0; ci < channels.size(); ++ci) {
-		dst.set_channel_depth(ci, central_buffer->get_channel_depth(ci));
-	}
-
-	const Vector3i min_pos = -Vector3i(min_padding);
-	const Vector3i max_pos = Vector3i(block_size + max_padding);
-
-	for (unsigned int i = 0; i < Cube::MOORE_AREA_3D_COUNT; ++i) {
-		const Vector3i offset = block_size * Cube::g_ordered_moore_area_3d[i];
-		Ref<VoxelBuffer> src = moore_blocks[i];
-
-		if (src.is_null()) {
-			continue;
-		}
-
-		const Vector3i src_min = min_pos - offset;
-		const Vector3i src_max = max_pos - offset;
-		const Vector3i dst_min = offset - min_pos;
-
-		{
-			RWLockRead read(src->get_lock());
-			for (unsigned int ci = 0; ci < channels.size(); ++ci) {
-				dst.copy_from(**src, src_min, src_max, dst_min, ci);
+	if (has_load_dependencies) {
+		for (unsigned int i = 0; i < blocks.size(); ++i) {
+			Ref<VoxelBuffer> block = blocks[i];
+			if (block.is_null()) {
+				continue;
+			}
+			RWLockRead lock(block->get_lock());
+			if (block->get_size() == Vector3i()) {
+				// A load we depended on was cancelled, the block has no data
+				return;
 			}
 		}
 	}
-}
-
-void VoxelServer::BlockMeshRequest::run(VoxelTaskContext ctx) {
-	VOXEL_PROFILE_SCOPE();
-	CRASH_COND(meshing_dependency == nullptr);
-
-	unsigned int min_padding;
-	unsigned int max_padding;
-	VoxelServer::get_singleton()->get_min_max_block_padding(blocky_enabled, smooth_enabled, min_padding, max_padding);
-
-	// TODO Cache?
-	Ref<VoxelBuffer> voxels;
-	voxels.instance();
-	copy_block_and_neighbors(blocks, **voxels, min_padding, max_padding);
 
-	VoxelMesher::Input input = { **voxels, lod };
+	// Meshers read blocks directly when they can, otherwise they copy them into a buffer of their own
+	VoxelMesher::NeighborhoodInput input = { blocks, lod };
 
 	if (blocky_enabled) {
 		Ref<VoxelLibrary> library = meshing_dependency->library;
@@ -634,7 +1119,7 @@ void VoxelServer::BlockMeshRequest::run(VoxelTaskContext ctx) {
 			CRASH_COND(blocky_mesher.is_null());
 			// This mesher only uses baked data from the library, which is protected by a lock
 			blocky_mesher->set_library(library);
-			blocky_mesher->build(blocky_surfaces_output, input);
+			blocky_mesher->build_from_neighborhood(blocky_surfaces_output, input);
 			blocky_mesher->set_library(Ref<VoxelLibrary>());
 		}
 	}
@@ -643,7 +1128,7 @@ void VoxelServer::BlockMeshRequest::run(VoxelTaskContext ctx) {
 		VOXEL_PROFILE_SCOPE_NAMED("Smooth meshing");
 		Ref<VoxelMesher> smooth_mesher = VoxelServer::get_singleton()->_smooth_meshers[ctx.thread_index];
 		CRASH_COND(smooth_mesher.is_null());
-		smooth_mesher->build(smooth_surfaces_output, input);
+		smooth_mesher->build_from_neighborhood(smooth_surfaces_output, input);
 	}
 
 	has_run = true;
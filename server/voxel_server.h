@@ -5,8 +5,10 @@
 #include "../streams/voxel_stream.h"
 #include "struct_db.h"
 #include "voxel_thread_pool.h"
+#include <core/hash_map.h>
 #include <scene/main/node.h>
 
+#include <deque>
 #include <memory>
 
 // Access point for asynchronous voxel processing APIs.
@@ -81,6 +83,11 @@ public:
 	void invalidate_volume_mesh_requests(uint32_t volume_id);
 	void request_block_mesh(uint32_t volume_id, BlockMeshInput &input);
 	void request_block_load(uint32_t volume_id, Vector3i block_pos, int lod);
+	// Loads several blocks, and meshes some of them as soon as the blocks they need are loaded,
+	// without waiting for the loaded blocks to go through the main thread first.
+	// Null blocks in mesh inputs are taken from the requested loads, so they must be part of `block_positions`.
+	void request_block_loads(uint32_t volume_id, const std::vector<Vector3i> &block_positions, int lod,
+			const std::vector<BlockMeshInput> &meshes);
 	void request_block_save(uint32_t volume_id, Ref<VoxelBuffer> voxels, Vector3i block_pos, int lod);
 	void remove_volume(uint32_t volume_id);
 
@@ -100,6 +107,13 @@ public:
 		_world.viewers.for_each_with_id(f);
 	}
 
+	// Thread counts can be changed at runtime. Queued tasks are kept.
+	// Per-thread stream and mesher instances are created when threads are added.
+	void set_streaming_thread_count(int count);
+	int get_streaming_thread_count() const;
+	void set_meshing_thread_count(int count);
+	int get_meshing_thread_count() const;
+
 	// Gets by how much voxels must be padded with neighbors in order to be polygonized properly
 	void get_min_max_block_padding(
 			bool blocky_enabled, bool smooth_enabled,
@@ -108,11 +122,23 @@ public:
 	void process();
 	void wait_and_clear_all_tasks(bool warn);
 
+	// Blocks until all requested saves have been written by their stream
+	void flush_pending_saves();
+
+	// Releases free memory kept for reuse by voxel buffers, until at most `max_free_bytes` remain
+	void trim_memory_pool(int64_t max_free_bytes);
+
+	// Measures how fast a thread pool can schedule a large amount of empty tasks with random priorities.
+	// Not exposed to scripts.
+	Dictionary debug_measure_task_scheduling(int task_count, int thread_count, bool work_stealing);
+
 private:
 	Dictionary _b_get_stats();
 
 	static void _bind_methods();
 
+	static Ref<VoxelStream> create_stream_instance_for_thread(Ref<VoxelStream> stream);
+
 	// Since we are going to send data to tasks running in multiple threads, a few strategies are in place:
 	//
 	// - Copy the data for each task. This is suitable for simple information that doesn't change after scheduling.
@@ -127,6 +153,7 @@ private:
 
 	// Data common to all requests about a particular volume
 	struct StreamingDependency {
+		// One per thread, only filled up to the current thread count
 		FixedArray<Ref<VoxelStream>, VoxelThreadPool::MAX_THREADS> streams;
 		bool valid = true;
 	};
@@ -171,6 +198,64 @@ private:
 
 	static int get_priority(const PriorityDependency &dep, uint8_t lod, float *out_closest_distance_sq);
 
+	class BlockDataRequest;
+	class BlockMeshRequest;
+
+	BlockDataRequest *create_block_load_request(uint32_t volume_id, const Volume &volume, Vector3i block_pos, int lod);
+	BlockMeshRequest *create_block_mesh_request(uint32_t volume_id, const Volume &volume, const BlockMeshInput &input);
+
+	struct SaveItem {
+		Ref<VoxelBuffer> voxels;
+		Vector3i position;
+		uint8_t lod;
+	};
+
+	// Saves are kept out of the prioritized queue. They are sent in FIFO batches grouped by volume,
+	// and only a few batches can be in flight at once, so they don't delay loads too much.
+	// They also wait a bit before being sent. If the same block is saved again meanwhile, only the latest version
+	// gets written.
+	struct PendingSave {
+		SaveItem item;
+		uint32_t volume_id;
+		uint8_t block_size;
+		// When the first of the saves coalesced into this one was requested
+		uint64_t time_usec;
+		std::shared_ptr<StreamingDependency> stream_dependency;
+	};
+
+	struct PendingSaveKey {
+		Vector3i position;
+		uint32_t volume_id;
+		uint8_t lod;
+
+		inline bool operator==(const PendingSaveKey &other) const {
+			return position == other.position && volume_id == other.volume_id && lod == other.lod;
+		}
+	};
+
+	struct PendingSaveKeyHasher {
+		static inline uint32_t hash(const PendingSaveKey &key) {
+			uint32_t h = Vector3iHasher::hash(key.position);
+			h = hash_djb2_one_32(key.volume_id, h);
+			return hash_djb2_one_32(key.lod, h);
+		}
+	};
+
+	// Save sent to the stream, which may not have written it yet
+	struct SaveInFlight {
+		Ref<VoxelBuffer> voxels;
+		std::shared_ptr<StreamingDependency> stream_dependency;
+	};
+
+	static const unsigned int MAX_BLOCKS_PER_SAVE_BATCH = 64;
+
+	void schedule_pending_saves(bool flush);
+	void schedule_pending_saves_of_volume(uint32_t volume_id);
+	void enqueue_save_batch(BlockDataRequest *r);
+	void remove_saves_in_flight(const BlockDataRequest &r);
+	PendingSave *get_pending_save(uint32_t volume_id, Vector3i block_pos, int lod);
+	void process_streaming_results();
+
 	class BlockDataRequest : public IVoxelTask {
 	public:
 		enum Type {
@@ -192,7 +277,11 @@ private:
 		bool too_far = false;
 		PriorityDependency priority_dependency;
 		std::shared_ptr<StreamingDependency> stream_dependency;
-		// TODO Find a way to separate save, it doesnt need sorting
+		// Only used with TYPE_SAVE, which processes a batch of blocks
+		std::vector<SaveItem> save_items;
+		// Only used with TYPE_LOAD, when the block still has a save waiting to be sent or being written.
+		// The block is copied from it instead of being loaded from the stream, which would have older data.
+		Ref<VoxelBuffer> pending_save_voxels;
 	};
 
 	class BlockMeshRequest : public IVoxelTask {
@@ -209,6 +298,8 @@ private:
 		bool blocky_enabled;
 		bool has_run = false;
 		bool too_far = false;
+		// Some blocks come from loads which may have been cancelled
+		bool has_load_dependencies = false;
 		PriorityDependency priority_dependency;
 		std::shared_ptr<MeshingDependency> meshing_dependency;
 		VoxelMesher::Output blocky_surfaces_output;
@@ -221,11 +312,26 @@ private:
 	VoxelThreadPool _streaming_thread_pool;
 	VoxelThreadPool _meshing_thread_pool;
 
+	std::deque<PendingSave> _pending_saves;
+	// Pending saves are numbered in the order they were queued, so the one at the front is
+	// `_next_pending_save_id - _pending_saves.size()`
+	HashMap<PendingSaveKey, uint64_t, PendingSaveKeyHasher> _pending_save_ids;
+	uint64_t _next_pending_save_id = 0;
+	unsigned int _save_batches_in_flight = 0;
+	// Latest version of blocks whose saves were sent, until their batch completes.
+	// Loads requested meanwhile read from there, as the stream may not have written them yet.
+	HashMap<PendingSaveKey, SaveInFlight, PendingSaveKeyHasher> _saves_in_flight;
+	uint64_t _save_delay_usec = 0;
+	unsigned int _max_pending_saves = 0;
+	// Saves which replaced a pending save of the same block, instead of being written too
+	uint64_t _coalesced_save_count = 0;
+
 	// TODO I do this because meshers have memory caches. But perhaps we could put them in thread locals?
 	// Used by tasks from threads.
 	// Meshers have internal state because they use memory caches,
 	// so we instanciate one per thread to be sure it's safe without having to lock.
 	// Options such as library etc can change per task.
+	// Only filled up to the highest thread count that was used.
 	FixedArray<Ref<VoxelMesherBlocky>, VoxelThreadPool::MAX_THREADS> _blocky_meshers;
 	FixedArray<Ref<VoxelMesher>, VoxelThreadPool::MAX_THREADS> _smooth_meshers;
 };
@@ -5,6 +5,8 @@
 #include <core/os/semaphore.h>
 #include <core/os/thread.h>
 
+#include <algorithm>
+
 // template <typename T>
 // static bool contains(const std::vector<T> vec, T v) {
 // 	for (size_t i = 0; i < vec.size(); ++i) {
@@ -16,50 +18,98 @@
 // }
 
 VoxelThreadPool::VoxelThreadPool() {
-	_tasks_mutex = Mutex::create();
+	_shared_queue.mutex = Mutex::create();
+	// The first local queue always exists, it receives tasks when there is no thread yet
+	_local_queues[0].mutex = Mutex::create();
+	_allocated_queue_count = 1;
 	_tasks_semaphore = Semaphore::create();
-	_completed_tasks_mutex = Mutex::create();
 }
 
 VoxelThreadPool::~VoxelThreadPool() {
-	destroy_all_threads();
+	stop_threads(0);
 
-	if (_completed_tasks.size() != 0) {
-		// We don't have ownership over tasks, so it's an error to destroy the pool without handling them
-		ERR_PRINT("There are unhandled completed tasks remaining!");
+	for (size_t i = 0; i < _allocated_queue_count; ++i) {
+		if (_completed_lists[i].head.load() != nullptr) {
+			// We don't have ownership over tasks, so it's an error to destroy the pool without handling them
+			ERR_PRINT("There are unhandled completed tasks remaining!");
+			break;
+		}
 	}
 
-	memdelete(_tasks_mutex);
+	memdelete(_shared_queue.mutex);
+	for (size_t i = 0; i < _allocated_queue_count; ++i) {
+		memdelete(_local_queues[i].mutex);
+	}
 	memdelete(_tasks_semaphore);
-	memdelete(_completed_tasks_mutex);
 }
 
 void VoxelThreadPool::create_thread(ThreadData &d, uint32_t i) {
 	d.pool = this;
 	d.stop = false;
 	d.waiting = false;
+	d.exited = false;
 	d.index = i;
 	d.thread = Thread::create(thread_func_static, &d);
 }
 
-void VoxelThreadPool::destroy_all_threads() {
-	// We have only one semaphore to signal threads to resume, and one `post()` lets only one pass.
-	// We cannot tell one single thread to stop, because when we post and other threads are waiting, we can't guarantee
-	// the one to pass will be the one we want.
-	// So we can only choose to stop ALL threads, and then start them again if we want to adjust their count.
-	// Also, it shouldn't drop tasks. Any tasks the thread was working on should still complete normally.
-	for (size_t i = 0; i < _thread_count; ++i) {
+// Stops threads with an index higher or equal to `first_index`.
+// It doesn't drop tasks. Any tasks the threads were working on still complete normally.
+void VoxelThreadPool::stop_threads(uint32_t first_index) {
+	for (uint32_t i = first_index; i < _thread_count; ++i) {
 		ThreadData &d = _threads[i];
 		d.stop = true;
 	}
-	for (size_t i = 0; i < _thread_count; ++i) {
+
+	// We have only one semaphore to signal threads to resume, and one `post()` lets only one pass.
+	// We can't choose which thread wakes up, so a thread we don't want to stop may consume the post and go back to
+	// sleep. So we keep posting until the threads we want to stop have actually exited.
+	for (uint32_t i = first_index; i < _thread_count; ++i) {
 		_tasks_semaphore->post();
 	}
-	for (size_t i = 0; i < _thread_count; ++i) {
+	for (uint32_t i = first_index; i < _thread_count; ++i) {
 		ThreadData &d = _threads[i];
+		while (!d.exited) {
+			if (d.waiting) {
+				_tasks_semaphore->post();
+			}
+			OS::get_singleton()->delay_usec(500);
+		}
 		Thread::wait_to_finish(d.thread);
 		memdelete(d.thread);
-		d = ThreadData();
+		// Other fields are reset when the thread is created again
+		d.thread = nullptr;
+	}
+
+	const uint32_t previous_count = _thread_count;
+	if (first_index < _thread_count) {
+		_thread_count = first_index;
+	}
+
+	// Give tasks left in queues of stopped threads to the remaining ones
+	const uint32_t remaining_count = max(_thread_count.load(), 1u);
+	size_t moved_count = 0;
+	for (uint32_t i = remaining_count; i < previous_count; ++i) {
+		TaskQueue &src = _local_queues[i];
+		TaskQueue &dst = _local_queues[i % remaining_count];
+		MutexLock src_lock(src.mutex);
+		MutexLock dst_lock(dst.mutex);
+		for (size_t j = 0; j < src.tasks.size(); ++j) {
+			dst.new_tasks.push_back(src.tasks[j].task);
+		}
+		for (size_t j = 0; j < src.new_tasks.size(); ++j) {
+			dst.new_tasks.push_back(src.new_tasks[j]);
+		}
+		moved_count += src.tasks.size() + src.new_tasks.size() + src.fifo_tasks.size();
+		src.tasks.clear();
+		src.new_tasks.clear();
+		while (!src.fifo_tasks.empty()) {
+			dst.fifo_tasks.push(src.fifo_tasks.front());
+			src.fifo_tasks.pop();
+		}
+	}
+	// Stopped threads may have consumed posts meant for these tasks
+	for (size_t i = 0; i < moved_count; ++i) {
+		_tasks_semaphore->post();
 	}
 }
 
@@ -67,12 +117,27 @@ void VoxelThreadPool::set_thread_count(uint32_t count) {
 	if (count > MAX_THREADS) {
 		count = MAX_THREADS;
 	}
-	destroy_all_threads();
-	for (uint32_t i = _thread_count; i < count; ++i) {
-		ThreadData &d = _threads[i];
-		create_thread(d, i);
+
+	if (count < _thread_count) {
+		stop_threads(count);
+
+	} else if (count > _thread_count) {
+		for (uint32_t i = _allocated_queue_count; i < count; ++i) {
+			_local_queues[i].mutex = Mutex::create();
+		}
+		if (count > _allocated_queue_count) {
+			_allocated_queue_count = count;
+		}
+
+		const uint32_t previous_count = _thread_count;
+		// Set the count first so running threads can steal from new queues.
+		// Releasing it also makes their mutexes visible to threads reading it.
+		_thread_count.store(count, std::memory_order_release);
+		for (uint32_t i = previous_count; i < count; ++i) {
+			ThreadData &d = _threads[i];
+			create_thread(d, i);
+		}
 	}
-	_thread_count = count;
 }
 
 void VoxelThreadPool::set_batch_count(uint32_t count) {
@@ -83,47 +148,212 @@ void VoxelThreadPool::set_priority_update_period(uint32_t milliseconds) {
 	_priority_update_period = milliseconds;
 }
 
+void VoxelThreadPool::set_work_stealing_enabled(bool enabled) {
+	_work_stealing_enabled = enabled;
+}
+
+VoxelThreadPool::TaskQueue &VoxelThreadPool::get_next_local_queue() {
+	const uint32_t queue_count = max(_thread_count.load(), 1u);
+	TaskQueue &queue = _local_queues[_next_local_queue % queue_count];
+	_next_local_queue = (_next_local_queue + 1) % queue_count;
+	return queue;
+}
+
 void VoxelThreadPool::enqueue(IVoxelTask *task) {
 	CRASH_COND(task == nullptr);
-	{
-		MutexLock lock(_tasks_mutex);
-		TaskItem t;
-		t.task = task;
-		_tasks.push_back(t);
-		++_debug_received_tasks;
+	if (_work_stealing_enabled) {
+		TaskQueue &queue = get_next_local_queue();
+		MutexLock lock(queue.mutex);
+		queue.new_tasks.push_back(task);
+	} else {
+		MutexLock lock(_shared_queue.mutex);
+		_shared_queue.new_tasks.push_back(task);
 	}
+	_debug_received_tasks.fetch_add(1, std::memory_order_relaxed);
 	// TODO Do I need to post a certain amount of times?
 	_tasks_semaphore->post();
 }
 
 void VoxelThreadPool::enqueue(ArraySlice<IVoxelTask *> tasks) {
-	{
-		MutexLock lock(_tasks_mutex);
+	if (_work_stealing_enabled) {
+		// Distribute tasks in round-robin, locking each queue only once
+		const uint32_t queue_count = max(_thread_count.load(), 1u);
+		for (uint32_t qi = 0; qi < queue_count; ++qi) {
+			TaskQueue &queue = _local_queues[(_next_local_queue + qi) % queue_count];
+			MutexLock lock(queue.mutex);
+			for (size_t i = qi; i < tasks.size(); i += queue_count) {
+				IVoxelTask *task = tasks[i];
+				CRASH_COND(task == nullptr);
+				queue.new_tasks.push_back(task);
+			}
+		}
+		_next_local_queue = (_next_local_queue + tasks.size()) % queue_count;
+
+	} else {
+		MutexLock lock(_shared_queue.mutex);
 		for (size_t i = 0; i < tasks.size(); ++i) {
-			TaskItem t;
-			t.task = tasks[i];
-			CRASH_COND(t.task == nullptr);
-			_tasks.push_back(t);
-			++_debug_received_tasks;
+			IVoxelTask *task = tasks[i];
+			CRASH_COND(task == nullptr);
+			_shared_queue.new_tasks.push_back(task);
 		}
 	}
+	_debug_received_tasks.fetch_add(tasks.size(), std::memory_order_relaxed);
 	// TODO Do I need to post a certain amount of times?
 	for (size_t i = 0; i < tasks.size(); ++i) {
 		_tasks_semaphore->post();
 	}
 }
 
+void VoxelThreadPool::enqueue_fifo(IVoxelTask *task) {
+	CRASH_COND(task == nullptr);
+	TaskQueue &queue = _work_stealing_enabled ? get_next_local_queue() : _shared_queue;
+	{
+		MutexLock lock(queue.mutex);
+		queue.fifo_tasks.push(task);
+	}
+	_debug_received_tasks.fetch_add(1, std::memory_order_relaxed);
+	_tasks_semaphore->post();
+}
+
+void VoxelThreadPool::enqueue_after(IVoxelTask *task, ArraySlice<IVoxelTask *> dependencies) {
+	CRASH_COND(task == nullptr);
+	if (dependencies.size() == 0) {
+		enqueue(task);
+		return;
+	}
+
+	// Dependencies are not queued yet, so nothing can decrement the count while we set this up
+	task->_dependent_pool = this;
+	task->_pending_dependency_count = dependencies.size();
+	for (size_t i = 0; i < dependencies.size(); ++i) {
+		IVoxelTask *dependency = dependencies[i];
+		CRASH_COND(dependency == nullptr);
+		dependency->_dependents.push_back(task);
+	}
+}
+
+// Called from worker threads of any pool, when the last dependency of a task completed
+void VoxelThreadPool::enqueue_released(IVoxelTask *task) {
+	// The first queue is never removed, so the task can't get lost if threads are being removed at the same time
+	TaskQueue &queue = _work_stealing_enabled ? _local_queues[0] : _shared_queue;
+	{
+		MutexLock lock(queue.mutex);
+		queue.new_tasks.push_back(task);
+	}
+	_debug_received_tasks.fetch_add(1, std::memory_order_relaxed);
+	_tasks_semaphore->post();
+}
+
 void VoxelThreadPool::thread_func_static(void *p_data) {
 	ThreadData &data = *static_cast<ThreadData *>(p_data);
 	VoxelThreadPool &pool = *data.pool;
 	pool.thread_func(data);
 }
 
+// Must be called with the queue locked
+void VoxelThreadPool::push_new_tasks(TaskQueue &queue, std::vector<IVoxelTask *> &cancelled_tasks) {
+	for (size_t i = 0; i < queue.new_tasks.size(); ++i) {
+		IVoxelTask *task = queue.new_tasks[i];
+		TaskItem item;
+		item.task = task;
+		// Calling `get_priority()` first since it can update cancellation
+		// (not clear API tho, might review that in the future)
+		item.cached_priority = task->get_priority();
+
+		if (task->is_cancelled()) {
+			cancelled_tasks.push_back(task);
+			continue;
+		}
+
+		queue.tasks.push_back(item);
+		std::push_heap(queue.tasks.begin(), queue.tasks.end(), TaskItemComparator());
+	}
+	queue.new_tasks.clear();
+}
+
+// Must be called with the queue locked
+void VoxelThreadPool::update_priorities(TaskQueue &queue, std::vector<IVoxelTask *> &cancelled_tasks) {
+	VOXEL_PROFILE_SCOPE();
+	std::vector<TaskItem> &tasks = queue.tasks;
+
+	for (size_t i = 0; i < tasks.size(); ++i) {
+		TaskItem &item = tasks[i];
+		CRASH_COND(item.task == nullptr);
+
+		item.cached_priority = item.task->get_priority();
+
+		if (item.task->is_cancelled()) {
+			cancelled_tasks.push_back(item.task);
+			tasks[i] = tasks.back();
+			tasks.pop_back();
+			--i;
+		}
+	}
+
+	// Order is no longer valid, rebuild the heap in one go. That's O(n),
+	// but only happens once per update period instead of at every pick.
+	std::make_heap(tasks.begin(), tasks.end(), TaskItemComparator());
+}
+
+// Must be called with the queue locked
+void VoxelThreadPool::pick_tasks(TaskQueue &queue, uint32_t now, std::vector<TaskItem> &out_tasks,
+		std::vector<IVoxelTask *> &out_cancelled_tasks) {
+
+	push_new_tasks(queue, out_cancelled_tasks);
+
+	if (now - queue.last_priority_update_time > _priority_update_period) {
+		update_priorities(queue, out_cancelled_tasks);
+		queue.last_priority_update_time = now;
+	}
+
+	uint32_t bi = 0;
+
+	// Tasks that don't need sorting are taken first, one at a time
+	if (!queue.fifo_tasks.empty()) {
+		TaskItem item;
+		item.task = queue.fifo_tasks.front();
+		queue.fifo_tasks.pop();
+		out_tasks.push_back(item);
+		++bi;
+	}
+
+	// Pick best tasks
+	for (; bi < _batch_count && queue.tasks.size() != 0; ++bi) {
+		std::pop_heap(queue.tasks.begin(), queue.tasks.end(), TaskItemComparator());
+		out_tasks.push_back(queue.tasks.back());
+		queue.tasks.pop_back();
+	}
+}
+
+void VoxelThreadPool::push_completed_task(uint32_t thread_index, IVoxelTask *task) {
+	std::atomic<IVoxelTask *> &head = _completed_lists[thread_index].head;
+	IVoxelTask *next = head.load(std::memory_order_relaxed);
+	do {
+		task->_next_completed = next;
+	} while (!head.compare_exchange_weak(next, task, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void VoxelThreadPool::complete_task(uint32_t thread_index, IVoxelTask *task, std::vector<IVoxelTask *> &dependents) {
+	// The task can be deleted as soon as it is pushed, so take its dependents before.
+	// Pushing before releasing them also guarantees the main thread can't receive a dependent before this task.
+	dependents.swap(task->_dependents);
+	push_completed_task(thread_index, task);
+
+	for (size_t i = 0; i < dependents.size(); ++i) {
+		IVoxelTask *dependent = dependents[i];
+		if (dependent->_pending_dependency_count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			dependent->_dependent_pool->enqueue_released(dependent);
+		}
+	}
+	dependents.clear();
+}
+
 void VoxelThreadPool::thread_func(ThreadData &data) {
 	data.debug_state = STATE_RUNNING;
 
 	std::vector<TaskItem> tasks;
 	std::vector<IVoxelTask *> cancelled_tasks;
+	std::vector<IVoxelTask *> dependents;
 
 	while (!data.stop) {
 		{
@@ -131,57 +361,36 @@ void VoxelThreadPool::thread_func(ThreadData &data) {
 
 			data.debug_state = STATE_PICKING;
 			const uint32_t now = OS::get_singleton()->get_ticks_msec();
+			const uint64_t time_before = OS::get_singleton()->get_ticks_usec();
 
-			MutexLock lock(_tasks_mutex);
-
-			// Pick best tasks
-			for (uint32_t bi = 0; bi < _batch_count && _tasks.size() != 0; ++bi) {
-				size_t best_index = 0; // Take first by default, this is a valid index
-				int best_priority = 999999;
-
-				// TODO This takes a lot of time when there are many queued tasks. Use a better container?
-				for (size_t i = 0; i < _tasks.size(); ++i) {
-					TaskItem &item = _tasks[i];
-					CRASH_COND(item.task == nullptr);
-
-					if (now - item.last_priority_update_time > _priority_update_period) {
-						// Calling `get_priority()` first since it can update cancellation
-						// (not clear API tho, might review that in the future)
-						item.cached_priority = item.task->get_priority();
-
-						if (item.task->is_cancelled()) {
-							cancelled_tasks.push_back(item.task);
-							_tasks[i] = _tasks.back();
-							_tasks.pop_back();
-							--i;
-							continue;
-						}
-
-						item.last_priority_update_time = now;
-					}
-
-					if (item.cached_priority < best_priority) {
-						best_priority = item.cached_priority;
-						best_index = i;
-					}
+			if (_work_stealing_enabled) {
+				{
+					TaskQueue &queue = _local_queues[data.index];
+					MutexLock lock(queue.mutex);
+					pick_tasks(queue, now, tasks, cancelled_tasks);
 				}
 
-				// If not all tasks were cancelled
-				if (_tasks.size() != 0) {
-					tasks.push_back(_tasks[best_index]);
-					CRASH_COND(best_index >= _tasks.size());
-					_tasks[best_index] = _tasks.back();
-					_tasks.pop_back();
+				// Our own queue is empty, steal from other threads.
+				// The count may change meanwhile, so it is read once to get consistent indices.
+				const uint32_t thread_count = _thread_count.load(std::memory_order_acquire);
+				for (uint32_t i = 1; i < thread_count && tasks.empty(); ++i) {
+					TaskQueue &queue = _local_queues[(data.index + i) % thread_count];
+					MutexLock lock(queue.mutex);
+					pick_tasks(queue, now, tasks, cancelled_tasks);
 				}
+
+			} else {
+				MutexLock lock(_shared_queue.mutex);
+				pick_tasks(_shared_queue, now, tasks, cancelled_tasks);
 			}
+
+			_debug_picking_time_usec.fetch_add(OS::get_singleton()->get_ticks_usec() - time_before,
+					std::memory_order_relaxed);
+			_debug_pick_count.fetch_add(1, std::memory_order_relaxed);
 		}
 
-		if (cancelled_tasks.size() > 0) {
-			MutexLock lock(_completed_tasks_mutex);
-			for (size_t i = 0; i < cancelled_tasks.size(); ++i) {
-				_completed_tasks.push_back(cancelled_tasks[i]);
-				++_debug_completed_tasks;
-			}
+		for (size_t i = 0; i < cancelled_tasks.size(); ++i) {
+			complete_task(data.index, cancelled_tasks[i], dependents);
 		}
 		cancelled_tasks.clear();
 
@@ -205,14 +414,7 @@ void VoxelThreadPool::thread_func(ThreadData &data) {
 					ctx.thread_index = data.index;
 					item.task->run(ctx);
 				}
-			}
-			{
-				MutexLock lock(_completed_tasks_mutex);
-				for (size_t i = 0; i < tasks.size(); ++i) {
-					TaskItem &item = tasks[i];
-					_completed_tasks.push_back(item.task);
-					++_debug_completed_tasks;
-				}
+				complete_task(data.index, item.task, dependents);
 			}
 
 			tasks.clear();
@@ -220,6 +422,7 @@ void VoxelThreadPool::thread_func(ThreadData &data) {
 	}
 
 	data.debug_state = STATE_STOPPED;
+	data.exited = true;
 }
 
 void VoxelThreadPool::wait_for_all_tasks() {
@@ -230,11 +433,18 @@ void VoxelThreadPool::wait_for_all_tasks() {
 
 	// Wait until all tasks have been taken
 	while (true) {
+		bool all_empty = true;
 		{
-			MutexLock lock(_tasks_mutex);
-			if (_tasks.size() == 0) {
-				break;
-			}
+			MutexLock lock(_shared_queue.mutex);
+			all_empty = _shared_queue.is_empty();
+		}
+		for (size_t i = 0; i < _allocated_queue_count && all_empty; ++i) {
+			TaskQueue &queue = _local_queues[i];
+			MutexLock lock(queue.mutex);
+			all_empty = queue.is_empty();
+		}
+		if (all_empty) {
+			break;
 		}
 
 		OS::get_singleton()->delay_usec(2000);
@@ -278,5 +488,6 @@ VoxelThreadPool::State VoxelThreadPool::get_thread_debug_state(uint32_t i) const
 }
 
 unsigned int VoxelThreadPool::get_debug_remaining_tasks() const {
-	return _debug_received_tasks - _debug_completed_tasks;
+	const uint32_t received_count = _debug_received_tasks.load(std::memory_order_relaxed);
+	return received_count - _debug_completed_tasks.load(std::memory_order_relaxed);
 }
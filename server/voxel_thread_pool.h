@@ -6,11 +6,14 @@
 #include "../voxel_buffer.h"
 #include <core/os/mutex.h>
 
+#include <atomic>
 #include <queue>
+#include <vector>
 
 class Mutex;
 class Thread;
 class Semaphore;
+class VoxelThreadPool;
 
 struct VoxelTaskContext {
 	uint8_t thread_index;
@@ -26,12 +29,26 @@ public:
 	virtual int get_priority() { return 0; }
 
 	virtual bool is_cancelled() { return false; }
+
+private:
+	friend class VoxelThreadPool;
+
+	// Used by the pool to chain completed tasks without allocating
+	IVoxelTask *_next_completed = nullptr;
+
+	// Tasks to queue once this one has completed
+	std::vector<IVoxelTask *> _dependents;
+	// How many tasks must still complete before this one can be queued, and where it will be
+	std::atomic<uint32_t> _pending_dependency_count{ 0 };
+	VoxelThreadPool *_dependent_pool = nullptr;
 };
 
 // Generic thread pool that performs batches of tasks based on priority
 class VoxelThreadPool {
 public:
-	static const uint32_t MAX_THREADS = 8;
+	// Upper limit, the actual count is set at runtime.
+	// Per-thread storage is reserved up-front so threads can be added while others are running.
+	static const uint32_t MAX_THREADS = 128;
 
 	enum State {
 		STATE_RUNNING = 0,
@@ -43,8 +60,7 @@ public:
 	VoxelThreadPool();
 	~VoxelThreadPool();
 
-	// TODO Add ability to change it while running without skipping tasks
-	// Can't be changed after tasks have been queued
+	// Can be changed while running. Queued tasks are kept, and tasks being processed by removed threads still complete.
 	void set_thread_count(uint32_t count);
 	uint32_t get_thread_count() const { return _thread_count; }
 
@@ -56,19 +72,52 @@ public:
 	// Can't be changed after tasks have been queued
 	void set_priority_update_period(uint32_t milliseconds);
 
+	// When enabled, each thread has its own queue, and threads steal tasks from others when theirs is empty.
+	// This reduces contention when there are many threads, at the cost of priority being only sorted per queue.
+	// Can't be changed after tasks have been queued
+	void set_work_stealing_enabled(bool enabled);
+	bool is_work_stealing_enabled() const { return _work_stealing_enabled; }
+
 	// Schedules a task.
 	// Ownership is NOT passed to the pool, so make sure you get them back when completed if you want to delete them.
 	void enqueue(IVoxelTask *task);
 	void enqueue(ArraySlice<IVoxelTask *> tasks);
 
+	// Schedules a task which doesn't need sorting. `get_priority()` is never called on it.
+	// Such tasks run in the order they were queued. At most one is picked each time a thread picks tasks,
+	// so a long series of them can't delay prioritized tasks too much.
+	void enqueue_fifo(IVoxelTask *task);
+
+	// Schedules a task which will only be queued once all the given tasks have completed, whether they ran or got
+	// cancelled. Dependencies can belong to any pool, but must not have been queued yet.
+	// This allows to chain tasks without having to go through the main thread.
+	void enqueue_after(IVoxelTask *task, ArraySlice<IVoxelTask *> dependencies);
+
 	template <typename F>
 	void dequeue_completed_tasks(F f) {
-		MutexLock lock(_completed_tasks_mutex);
-		for (size_t i = 0; i < _completed_tasks.size(); ++i) {
-			IVoxelTask *task = _completed_tasks[i];
-			f(task);
+		for (size_t ti = 0; ti < _allocated_queue_count; ++ti) {
+			// Take the whole list at once. Threads only ever push, so there is no ABA problem.
+			IVoxelTask *task = _completed_lists[ti].head.exchange(nullptr, std::memory_order_acquire);
+
+			// Tasks were pushed in LIFO order, reverse them so they come out in the order they completed
+			IVoxelTask *prev = nullptr;
+			while (task != nullptr) {
+				IVoxelTask *next = task->_next_completed;
+				task->_next_completed = prev;
+				prev = task;
+				task = next;
+			}
+
+			task = prev;
+			while (task != nullptr) {
+				// Read next before calling, the callback is allowed to delete the task
+				IVoxelTask *next = task->_next_completed;
+				task->_next_completed = nullptr;
+				_debug_completed_tasks.fetch_add(1, std::memory_order_relaxed);
+				f(task);
+				task = next;
+			}
 		}
-		_completed_tasks.clear();
 	}
 
 	// Blocks and wait for all tasks to finish (assuming no more are getting added!)
@@ -76,44 +125,97 @@ public:
 
 	State get_thread_debug_state(uint32_t i) const;
 	unsigned int get_debug_remaining_tasks() const;
+	uint64_t get_debug_picking_time_usec() const { return _debug_picking_time_usec.load(std::memory_order_relaxed); }
+	uint64_t get_debug_pick_count() const { return _debug_pick_count.load(std::memory_order_relaxed); }
 
 private:
 	struct TaskItem {
 		IVoxelTask *task = nullptr;
 		int cached_priority = 99999;
+	};
+
+	// Orders the heap so that its top is the task with lowest priority value
+	struct TaskItemComparator {
+		inline bool operator()(const TaskItem &a, const TaskItem &b) const {
+			return a.cached_priority > b.cached_priority;
+		}
+	};
+
+	struct TaskQueue {
+		// Binary heap sorted by cached priority.
+		// Priorities can change over time, so they are all re-evaluated periodically and the heap is rebuilt.
+		std::vector<TaskItem> tasks;
+		// Tasks enqueued since the last pick. Their priority is evaluated by worker threads before entering the heap.
+		std::vector<IVoxelTask *> new_tasks;
+		// Tasks that don't need sorting
+		std::queue<IVoxelTask *> fifo_tasks;
 		uint32_t last_priority_update_time = 0;
+		Mutex *mutex = nullptr;
+
+		inline bool is_empty() const {
+			return tasks.size() == 0 && new_tasks.size() == 0 && fifo_tasks.size() == 0;
+		}
+	};
+
+	// Lock-free stack of completed tasks, written by one thread and drained by the thread owning the pool
+	struct CompletedList {
+		std::atomic<IVoxelTask *> head{ nullptr };
 	};
 
 	struct ThreadData {
 		Thread *thread = nullptr;
 		VoxelThreadPool *pool = nullptr;
 		uint32_t index = 0;
-		bool stop = false;
-		bool waiting = false;
+		// Written by the thread owning the pool and read by the thread, or the other way around
+		std::atomic<bool> stop{ false };
+		std::atomic<bool> waiting{ false };
+		std::atomic<bool> exited{ false };
 		State debug_state = STATE_STOPPED;
 	};
 
 	static void thread_func_static(void *p_data);
 	void thread_func(ThreadData &data);
 
+	TaskQueue &get_next_local_queue();
 	void create_thread(ThreadData &d, uint32_t i);
-	void destroy_all_threads();
+	void stop_threads(uint32_t first_index);
+
+	void pick_tasks(TaskQueue &queue, uint32_t now, std::vector<TaskItem> &out_tasks,
+			std::vector<IVoxelTask *> &out_cancelled_tasks);
+	void push_new_tasks(TaskQueue &queue, std::vector<IVoxelTask *> &cancelled_tasks);
+	void update_priorities(TaskQueue &queue, std::vector<IVoxelTask *> &cancelled_tasks);
+	void push_completed_task(uint32_t thread_index, IVoxelTask *task);
+	void complete_task(uint32_t thread_index, IVoxelTask *task, std::vector<IVoxelTask *> &dependents);
+	void enqueue_released(IVoxelTask *task);
 
 	FixedArray<ThreadData, MAX_THREADS> _threads;
-	uint32_t _thread_count = 0;
+	// Only changed by the thread owning the pool, but threads read it to steal tasks
+	std::atomic<uint32_t> _thread_count{ 0 };
+
+	// Used when work stealing is disabled
+	TaskQueue _shared_queue;
+	// Used when work stealing is enabled, one per thread.
+	// Queues of removed threads are not destroyed until the pool is, so threads can still use them with an old count.
+	FixedArray<TaskQueue, MAX_THREADS> _local_queues;
+	uint32_t _next_local_queue = 0;
+	// How many local queues and completed lists have been used so far. Never decreases.
+	uint32_t _allocated_queue_count = 0;
+	bool _work_stealing_enabled = false;
 
-	std::vector<TaskItem> _tasks;
-	Mutex *_tasks_mutex = nullptr; // TODO Optimize this with a less naive design?
 	Semaphore *_tasks_semaphore = nullptr;
 
-	std::vector<IVoxelTask *> _completed_tasks;
-	Mutex *_completed_tasks_mutex = nullptr;
+	// One per thread, so threads never contend when they complete tasks
+	FixedArray<CompletedList, MAX_THREADS> _completed_lists;
 
 	uint32_t _batch_count = 1;
 	uint32_t _priority_update_period = 32;
 
-	unsigned int _debug_received_tasks = 0;
-	unsigned int _debug_completed_tasks = 0;
+	// Worker threads also receive tasks, when they release dependents
+	std::atomic<uint32_t> _debug_received_tasks{ 0 };
+	std::atomic<uint32_t> _debug_completed_tasks{ 0 };
+	// Updated by all threads
+	std::atomic<uint64_t> _debug_picking_time_usec{ 0 };
+	std::atomic<uint64_t> _debug_pick_count{ 0 };
 };
 
 #endif // VOXEL_THREAD_TASK_MANAGER_H
@@ -1,5 +1,13 @@
 #include "file_utils.h"
 
+#ifdef __linux__
+#include <core/project_settings.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 const char *to_string(VoxelFileResult res) {
 	switch (res) {
 		case VOXEL_FILE_OK:
@@ -61,3 +69,66 @@ Error check_directory_created(const String &directory_path) {
 	memdelete(d);
 	return OK;
 }
+
+VoxelFileMapping::~VoxelFileMapping() {
+	unmap();
+}
+
+bool VoxelFileMapping::map(const String &fpath) {
+	unmap();
+
+#ifdef __linux__
+	// Godot paths such as `user://` have to be converted first
+	const String os_path = ProjectSettings::get_singleton()->globalize_path(fpath);
+
+	const int fd = ::open(os_path.utf8().get_data(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		::close(fd);
+		return false;
+	}
+
+	void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	// The mapping remains valid after the descriptor is closed
+	::close(fd);
+
+	if (p == MAP_FAILED) {
+		return false;
+	}
+
+	_data = (const uint8_t *)p;
+	_size = st.st_size;
+	return true;
+
+#else
+	return false;
+#endif
+}
+
+void VoxelFileMapping::unmap() {
+#ifdef __linux__
+	if (_data != nullptr) {
+		munmap((void *)_data, _size);
+	}
+#endif
+	_data = nullptr;
+	_size = 0;
+}
+
+void VoxelFileMapping::prefetch(size_t offset, size_t size) const {
+	ERR_FAIL_COND(!is_mapped());
+	ERR_FAIL_COND(offset >= _size);
+	if (size > _size - offset) {
+		size = _size - offset;
+	}
+#ifdef __linux__
+	// The range must start on a page boundary. Mappings do, so we only need to align the offset.
+	const size_t page_size = sysconf(_SC_PAGESIZE);
+	const size_t begin = offset - offset % page_size;
+	madvise((void *)(_data + begin), offset + size - begin, MADV_WILLNEED);
+#endif
+}
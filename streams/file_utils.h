@@ -46,4 +46,34 @@ const char *to_string(VoxelFileResult res);
 VoxelFileResult check_magic_and_version(FileAccess *f, uint8_t expected_version, const char *expected_magic, uint8_t &out_version);
 Error check_directory_created(const String &directory_path);
 
+// Read-only memory mapping of a whole file.
+// Only implemented on Linux for now. On other platforms `map()` fails, so callers must keep a fallback.
+class VoxelFileMapping {
+public:
+	~VoxelFileMapping();
+
+	// Fails if the path doesn't resolve to a file on disk, like files packed in an exported game
+	bool map(const String &fpath);
+	void unmap();
+
+	// Asks the OS to start loading a range of the file in the background, without waiting for it
+	void prefetch(size_t offset, size_t size) const;
+
+	inline bool is_mapped() const {
+		return _data != nullptr;
+	}
+
+	inline const uint8_t *get_data() const {
+		return _data;
+	}
+
+	inline size_t get_size() const {
+		return _size;
+	}
+
+private:
+	const uint8_t *_data = nullptr;
+	size_t _size = 0;
+};
+
 #endif // FILE_UTILS_H
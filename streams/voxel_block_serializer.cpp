@@ -13,6 +13,8 @@
 
 namespace {
 // TODO Introduce versionning
+// Until then, files storing blocks carry the version, and must change it when this format changes.
+// It happened when RLE and palette channels started being stored as they are.
 //const uint16_t BLOCK_VERSION = 0;
 //const unsigned int BLOCK_VERSION_HEADER_SIZE = sizeof(uint16_t);
 const unsigned int BLOCK_TRAILING_MAGIC = 0x900df00d;
@@ -20,45 +22,6 @@ const unsigned int BLOCK_TRAILING_MAGIC_SIZE = 4;
 const unsigned int BLOCK_METADATA_HEADER_SIZE = sizeof(uint32_t);
 } // namespace
 
-size_t get_metadata_size_in_bytes(const VoxelBuffer &buffer) {
-	size_t size = 0;
-
-	const Map<Vector3i, Variant>::Element *elem = buffer.get_voxel_metadata().front();
-	while (elem != nullptr) {
-		const Vector3i pos = elem->key();
-
-		ERR_FAIL_COND_V_MSG(pos.x < 0 || static_cast<uint32_t>(pos.x) >= VoxelBuffer::MAX_SIZE, 0,
-				"Invalid voxel metadata X position");
-		ERR_FAIL_COND_V_MSG(pos.y < 0 || static_cast<uint32_t>(pos.y) >= VoxelBuffer::MAX_SIZE, 0,
-				"Invalid voxel metadata Y position");
-		ERR_FAIL_COND_V_MSG(pos.z < 0 || static_cast<uint32_t>(pos.z) >= VoxelBuffer::MAX_SIZE, 0,
-				"Invalid voxel metadata Z position");
-
-		size += 3 * sizeof(uint16_t); // Positions are stored as 3 unsigned shorts
-
-		int len;
-		const Error err = encode_variant(elem->value(), nullptr, len, false);
-		ERR_FAIL_COND_V_MSG(err != OK, 0, "Error when trying to encode voxel metadata.");
-		size += len;
-
-		elem = elem->next();
-	}
-
-	// If no metadata is found at all, nothing is serialized, not even null.
-	// It spares 24 bytes (40 if real_t == double),
-	// and is backward compatible with saves made before introduction of metadata.
-
-	if (size != 0 || buffer.get_block_metadata() != Variant()) {
-		int len;
-		// Get size first by invoking the function is "length mode"
-		const Error err = encode_variant(buffer.get_block_metadata(), nullptr, len, false);
-		ERR_FAIL_COND_V_MSG(err != OK, 0, "Error when trying to encode block metadata.");
-		size += len;
-	}
-
-	return size;
-}
-
 template <typename T>
 inline void write(uint8_t *&dst, T d) {
 	*(T *)dst = d;
@@ -66,52 +29,107 @@ inline void write(uint8_t *&dst, T d) {
 }
 
 template <typename T>
-inline T read(uint8_t *&src) {
+inline T read(const uint8_t *&src) {
 	T d = *(T *)src;
 	src += sizeof(T);
 	return d;
 }
 
-// The target buffer MUST have correct size. Recoverable errors must have been checked before.
-void serialize_metadata(uint8_t *p_dst, const VoxelBuffer &buffer, const size_t metadata_size) {
-	uint8_t *dst = p_dst;
-
-	{
-		int written_length;
-		encode_variant(buffer.get_block_metadata(), dst, written_length, false);
-		dst += written_length;
+// Upper bound for the encoded size of variants which don't contain strings, arrays or objects
+const unsigned int MAX_FIXED_SIZE_VARIANT_ENCODING_SIZE = 128;
+
+inline bool has_fixed_encoding_size(Variant::Type type) {
+	switch (type) {
+		case Variant::NIL:
+		case Variant::BOOL:
+		case Variant::INT:
+		case Variant::REAL:
+		case Variant::VECTOR2:
+		case Variant::RECT2:
+		case Variant::VECTOR3:
+		case Variant::TRANSFORM2D:
+		case Variant::PLANE:
+		case Variant::QUAT:
+		case Variant::AABB:
+		case Variant::BASIS:
+		case Variant::TRANSFORM:
+		case Variant::COLOR:
+			return true;
+		default:
+			return false;
+	}
+}
 
-		// I chose to cast this way to fix a GCC warning.
-		// If dst - p_dst is negative (which is wrong), it will wrap and cause a justified assertion failure
-		CRASH_COND_MSG(static_cast<size_t>(dst - p_dst) > metadata_size, "Wrote block metadata out of expected bounds");
+// Encodes a variant at the end of `dst`.
+// Most metadata is made of small fixed-size values, which are encoded directly without measuring them first.
+Error append_variant(std::vector<uint8_t> &dst, const Variant &v) {
+	const size_t pos = dst.size();
+	int len;
+	if (has_fixed_encoding_size(v.get_type())) {
+		dst.resize(pos + MAX_FIXED_SIZE_VARIANT_ENCODING_SIZE);
+		const Error err = encode_variant(v, dst.data() + pos, len, false);
+		CRASH_COND(len > static_cast<int>(MAX_FIXED_SIZE_VARIANT_ENCODING_SIZE));
+		if (err != OK) {
+			return err;
+		}
+	} else {
+		// Get size first by invoking the function is "length mode"
+		Error err = encode_variant(v, nullptr, len, false);
+		if (err != OK) {
+			return err;
+		}
+		dst.resize(pos + len);
+		err = encode_variant(v, dst.data() + pos, len, false);
+		if (err != OK) {
+			return err;
+		}
 	}
+	dst.resize(pos + len);
+	return OK;
+}
 
-	const Map<Vector3i, Variant>::Element *elem = buffer.get_voxel_metadata().front();
-	while (elem != nullptr) {
-		// Serializing key as ushort because it's more than enough for a 3D dense array
-		static_assert(VoxelBuffer::MAX_SIZE <= 65535, "Maximum size exceeds serialization support");
-		const Vector3i pos = elem->key();
-		write<uint16_t>(dst, pos.x);
-		write<uint16_t>(dst, pos.y);
-		write<uint16_t>(dst, pos.z);
+// Appends metadata at the end of `dst`, in a single pass over the flat metadata of the buffer.
+// Metadata has more reasons to fail. If a recoverable error occurs, nothing is appended, as if it was empty.
+void serialize_metadata(std::vector<uint8_t> &dst, const VoxelBuffer &buffer) {
+	const std::vector<VoxelBuffer::VoxelMetadata> &voxel_metadata = buffer.get_voxel_metadata();
 
-		int written_length;
-		const Error err = encode_variant(elem->value(), dst, written_length, false);
-		CRASH_COND_MSG(err != OK, "Error when trying to encode voxel metadata.");
-		dst += written_length;
+	// If no metadata is found at all, nothing is serialized, not even null.
+	// It spares 24 bytes (40 if real_t == double),
+	// and is backward compatible with saves made before introduction of metadata.
+	if (voxel_metadata.empty() && buffer.get_block_metadata() == Variant()) {
+		return;
+	}
 
-		CRASH_COND_MSG(static_cast<size_t>(dst - p_dst) > metadata_size, "Wrote voxel metadata out of expected bounds");
+	const size_t header_pos = dst.size();
+	dst.resize(header_pos + BLOCK_METADATA_HEADER_SIZE);
+
+	if (append_variant(dst, buffer.get_block_metadata()) != OK) {
+		dst.resize(header_pos);
+		ERR_FAIL_MSG("Error when trying to encode block metadata.");
+	}
 
-		elem = elem->next();
+	for (auto it = voxel_metadata.begin(); it != voxel_metadata.end(); ++it) {
+		// Serializing key as ushort because it's more than enough for a 3D dense array
+		static_assert(VoxelBuffer::MAX_SIZE <= 65535, "Maximum size exceeds serialization support");
+		const Vector3i pos = buffer.get_position_from_index(it->index);
+		const size_t pos_offset = dst.size();
+		dst.resize(pos_offset + 3 * sizeof(uint16_t));
+		uint8_t *pos_dst = dst.data() + pos_offset;
+		write<uint16_t>(pos_dst, pos.x);
+		write<uint16_t>(pos_dst, pos.y);
+		write<uint16_t>(pos_dst, pos.z);
+
+		if (append_variant(dst, it->value) != OK) {
+			dst.resize(header_pos);
+			ERR_FAIL_MSG("Error when trying to encode voxel metadata.");
+		}
 	}
 
-	CRASH_COND_MSG(static_cast<size_t>(dst - p_dst) != metadata_size,
-			String("Written metadata doesn't match expected count (expected {0}, got {1})")
-					.format(varray(SIZE_T_TO_VARIANT(metadata_size), (int)(dst - p_dst))));
+	encode_uint32(dst.size() - header_pos - BLOCK_METADATA_HEADER_SIZE, dst.data() + header_pos);
 }
 
-bool deserialize_metadata(uint8_t *p_src, VoxelBuffer &buffer, const size_t metadata_size) {
-	uint8_t *src = p_src;
+bool deserialize_metadata(const uint8_t *p_src, VoxelBuffer &buffer, const size_t metadata_size) {
+	const uint8_t *src = p_src;
 	size_t remaining_length = metadata_size;
 
 	{
@@ -147,7 +165,8 @@ bool deserialize_metadata(uint8_t *p_src, VoxelBuffer &buffer, const size_t meta
 	return true;
 }
 
-size_t get_size_in_bytes(const VoxelBuffer &buffer, size_t &metadata_size) {
+// Size of channels, without metadata
+size_t get_channels_size_in_bytes(const VoxelBuffer &buffer) {
 	size_t size = 0;
 	const Vector3i size_in_voxels = buffer.get_size();
 
@@ -156,12 +175,21 @@ size_t get_size_in_bytes(const VoxelBuffer &buffer, size_t &metadata_size) {
 		size += 1;
 
 		switch (compression) {
-			case VoxelBuffer::COMPRESSION_NONE: {
-				size += size_in_voxels.volume() * sizeof(uint8_t);
+			case VoxelBuffer::COMPRESSION_NONE:
+			case VoxelBuffer::COMPRESSION_SPARSE: {
+				size += VoxelBuffer::get_size_in_bytes_for_volume(
+						size_in_voxels, buffer.get_channel_depth(channel_index));
 			} break;
 
 			case VoxelBuffer::COMPRESSION_UNIFORM: {
-				size += 1;
+				size += VoxelBuffer::get_depth_bit_count(buffer.get_channel_depth(channel_index)) / 8;
+			} break;
+
+			case VoxelBuffer::COMPRESSION_RLE:
+			case VoxelBuffer::COMPRESSION_PALETTE: {
+				ArraySlice<uint8_t> data;
+				CRASH_COND(!buffer.get_channel_compressed_data(channel_index, data));
+				size += sizeof(uint32_t) + data.size();
 			} break;
 
 			default:
@@ -170,28 +198,22 @@ size_t get_size_in_bytes(const VoxelBuffer &buffer, size_t &metadata_size) {
 		}
 	}
 
-	metadata_size = get_metadata_size_in_bytes(buffer);
-
-	size_t metadata_size_with_header = 0;
-	if (metadata_size > 0) {
-		metadata_size_with_header = metadata_size + BLOCK_METADATA_HEADER_SIZE;
-	}
-
-	return size + metadata_size_with_header + BLOCK_TRAILING_MAGIC_SIZE;
+	return size;
 }
 
 const std::vector<uint8_t> &VoxelBlockSerializerInternal::serialize(VoxelBuffer &voxel_buffer) {
 	VOXEL_PROFILE_SCOPE();
-	size_t metadata_size = 0;
-	const size_t data_size = get_size_in_bytes(voxel_buffer, metadata_size);
-	_data.resize(data_size);
+	const size_t channels_size = get_channels_size_in_bytes(voxel_buffer);
+	_data.resize(channels_size);
 
 	CRASH_COND(_file_access_memory.open_custom(_data.data(), _data.size()) != OK);
 	FileAccessMemory *f = &_file_access_memory;
 
 	for (unsigned int channel_index = 0; channel_index < VoxelBuffer::MAX_CHANNELS; ++channel_index) {
 		VoxelBuffer::Compression compression = voxel_buffer.get_channel_compression(channel_index);
-		f->store_8(static_cast<uint8_t>(compression));
+		// Sparse bricks are an in-memory layout, they are saved expanded
+		f->store_8(static_cast<uint8_t>(
+				compression == VoxelBuffer::COMPRESSION_SPARSE ? VoxelBuffer::COMPRESSION_NONE : compression));
 
 		switch (compression) {
 			case VoxelBuffer::COMPRESSION_NONE: {
@@ -200,6 +222,13 @@ const std::vector<uint8_t> &VoxelBlockSerializerInternal::serialize(VoxelBuffer
 				f->store_buffer(data.data(), data.size());
 			} break;
 
+			case VoxelBuffer::COMPRESSION_SPARSE: {
+				_channel_tmp.resize(VoxelBuffer::get_size_in_bytes_for_volume(
+						voxel_buffer.get_size(), voxel_buffer.get_channel_depth(channel_index)));
+				voxel_buffer.copy_channel_raw_to(channel_index, ArraySlice<uint8_t>(_channel_tmp, 0, _channel_tmp.size()));
+				f->store_buffer(_channel_tmp.data(), _channel_tmp.size());
+			} break;
+
 			case VoxelBuffer::COMPRESSION_UNIFORM: {
 				uint64_t v = voxel_buffer.get_voxel(Vector3i(), channel_index);
 				switch (voxel_buffer.get_channel_depth(channel_index)) {
@@ -220,22 +249,28 @@ const std::vector<uint8_t> &VoxelBlockSerializerInternal::serialize(VoxelBuffer
 				}
 			} break;
 
+			case VoxelBuffer::COMPRESSION_RLE:
+			case VoxelBuffer::COMPRESSION_PALETTE: {
+				// Stored as-is, so it doesn't need to be expanded
+				ArraySlice<uint8_t> data;
+				CRASH_COND(!voxel_buffer.get_channel_compressed_data(channel_index, data));
+				f->store_32(data.size());
+				f->store_buffer(data.data(), data.size());
+			} break;
+
 			default:
 				CRASH_COND("Unhandled compression mode");
 		}
 	}
 
-	// Metadata has more reasons to fail. If a recoverable error occurs prior to serializing,
-	// we just discard all metadata as if it was empty.
-	if (metadata_size > 0) {
-		f->store_32(metadata_size);
-		_metadata_tmp.resize(metadata_size);
-		// This function brings me joy. </irony>
-		serialize_metadata(_metadata_tmp.data(), voxel_buffer, metadata_size);
-		f->store_buffer(_metadata_tmp.data(), _metadata_tmp.size());
-	}
+	CRASH_COND(f->get_position() != channels_size);
+	f->close();
 
-	f->store_32(BLOCK_TRAILING_MAGIC);
+	serialize_metadata(_data, voxel_buffer);
+
+	const size_t magic_pos = _data.size();
+	_data.resize(magic_pos + BLOCK_TRAILING_MAGIC_SIZE);
+	encode_uint32(BLOCK_TRAILING_MAGIC, _data.data() + magic_pos);
 
 	return _data;
 }
@@ -253,6 +288,8 @@ bool VoxelBlockSerializerInternal::deserialize(const std::vector<uint8_t> &p_dat
 
 		switch (compression) {
 			case VoxelBuffer::COMPRESSION_NONE: {
+				// Data is written directly below, so previous contents must not be remembered as non-uniform
+				out_voxel_buffer.clear_channel(channel_index);
 				out_voxel_buffer.decompress_channel(channel_index);
 
 				ArraySlice<uint8_t> buffer;
@@ -287,6 +324,20 @@ bool VoxelBlockSerializerInternal::deserialize(const std::vector<uint8_t> &p_dat
 				out_voxel_buffer.clear_channel(channel_index, v);
 			} break;
 
+			case VoxelBuffer::COMPRESSION_RLE:
+			case VoxelBuffer::COMPRESSION_PALETTE: {
+				const uint32_t size_in_bytes = f->get_32();
+				if (size_in_bytes > f->get_len() - f->get_position()) {
+					ERR_PRINT("Unexpected end of file");
+					return false;
+				}
+				_channel_tmp.resize(size_in_bytes);
+				f->get_buffer(_channel_tmp.data(), _channel_tmp.size());
+				ERR_FAIL_COND_V_MSG(!out_voxel_buffer.set_channel_compressed_data(
+											channel_index, compression, _channel_tmp.data(), size_in_bytes),
+						false, "Invalid compressed channel");
+			} break;
+
 			default:
 				ERR_PRINT("Unhandled compression mode");
 				return false;
@@ -294,10 +345,12 @@ bool VoxelBlockSerializerInternal::deserialize(const std::vector<uint8_t> &p_dat
 	}
 
 	if (p_data.size() - f->get_position() > BLOCK_TRAILING_MAGIC_SIZE) {
-		size_t metadata_size = f->get_32();
-		_metadata_tmp.resize(metadata_size);
-		f->get_buffer(_metadata_tmp.data(), _metadata_tmp.size());
-		deserialize_metadata(_metadata_tmp.data(), out_voxel_buffer, _metadata_tmp.size());
+		const size_t metadata_size = f->get_32();
+		const size_t metadata_pos = f->get_position();
+		ERR_FAIL_COND_V_MSG(metadata_size > p_data.size() - metadata_pos, false, "Unexpected end of file");
+		// Decoded in place, entries are sorted so they get appended to the buffer's metadata
+		deserialize_metadata(p_data.data() + metadata_pos, out_voxel_buffer, metadata_size);
+		f->seek(metadata_pos + metadata_size);
 	}
 
 	// Failure at this indicates file corruption
@@ -332,12 +385,16 @@ const std::vector<uint8_t> &VoxelBlockSerializerInternal::serialize_and_compress
 }
 
 bool VoxelBlockSerializerInternal::decompress_and_deserialize(const std::vector<uint8_t> &p_data, VoxelBuffer &out_voxel_buffer) {
+	ERR_FAIL_COND_V(p_data.size() == 0, false);
+	return decompress_and_deserialize(ArraySlice<const uint8_t>(p_data.data(), 0, p_data.size()), out_voxel_buffer);
+}
+
+bool VoxelBlockSerializerInternal::decompress_and_deserialize(ArraySlice<const uint8_t> p_data, VoxelBuffer &out_voxel_buffer) {
 	VOXEL_PROFILE_SCOPE();
 	// Read header
 	unsigned int header_size = sizeof(unsigned int);
-	ERR_FAIL_COND_V(_file_access_memory.open_custom(p_data.data(), p_data.size()) != OK, false);
-	unsigned int decompressed_size = _file_access_memory.get_32();
-	_file_access_memory.close();
+	ERR_FAIL_COND_V(p_data.size() < header_size, false);
+	unsigned int decompressed_size = decode_uint32(p_data.data());
 
 	_data.resize(decompressed_size);
 
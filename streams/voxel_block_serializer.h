@@ -1,6 +1,7 @@
 #ifndef VOXEL_BLOCK_SERIALIZER_H
 #define VOXEL_BLOCK_SERIALIZER_H
 
+#include "../util/array_slice.h"
 #include <core/io/file_access_memory.h>
 #include <core/reference.h>
 #include <vector>
@@ -16,6 +17,8 @@ public:
 
 	const std::vector<uint8_t> &serialize_and_compress(VoxelBuffer &voxel_buffer);
 	bool decompress_and_deserialize(const std::vector<uint8_t> &p_data, VoxelBuffer &out_voxel_buffer);
+	// Reads compressed data from memory the serializer doesn't own, like a mapped file
+	bool decompress_and_deserialize(ArraySlice<const uint8_t> p_data, VoxelBuffer &out_voxel_buffer);
 	bool decompress_and_deserialize(FileAccess *f, unsigned int size_to_read, VoxelBuffer &out_voxel_buffer);
 
 	int serialize(Ref<StreamPeer> peer, Ref<VoxelBuffer> voxel_buffer, bool compress);
@@ -24,7 +27,7 @@ public:
 private:
 	std::vector<uint8_t> _data;
 	std::vector<uint8_t> _compressed_data;
-	std::vector<uint8_t> _metadata_tmp;
+	std::vector<uint8_t> _channel_tmp;
 	FileAccessMemory _file_access_memory;
 };
 
@@ -30,6 +30,9 @@ void VoxelStream::immerge_blocks(Vector<VoxelBlockRequest> &p_blocks) {
 	}
 }
 
+void VoxelStream::flush() {
+}
+
 bool VoxelStream::is_thread_safe() const {
 	return false;
 }
@@ -34,6 +34,9 @@ public:
 	// This function is recommended if you save to files, because you can batch their access.
 	virtual void immerge_blocks(Vector<VoxelBlockRequest> &p_blocks);
 
+	// Writes data the stream keeps in memory, if any. Saving blocks might not write them right away.
+	virtual void flush();
+
 	// Declares the format expected from this stream
 	virtual int get_used_channels_mask() const;
 
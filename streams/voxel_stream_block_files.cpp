@@ -4,11 +4,22 @@
 #include <core/os/file_access.h>
 
 namespace {
-const uint8_t FORMAT_VERSION = 1;
+const uint8_t FORMAT_VERSION = 2;
+// Version 2 blocks can contain RLE and palette channels, it is the only difference with version 1
+const uint8_t FORMAT_VERSION_LEGACY_1 = 1;
 const char *FORMAT_META_MAGIC = "VXBM";
 const char *FORMAT_BLOCK_MAGIC = "VXB_";
 const char *META_FILE_NAME = "meta.vxbm";
 const char *BLOCK_FILE_EXTENSION = ".vxb";
+
+VoxelFileResult check_magic_and_supported_version(FileAccess *f, const char *expected_magic, uint8_t &out_version) {
+	const VoxelFileResult result = check_magic_and_version(f, FORMAT_VERSION, expected_magic, out_version);
+	if (result == VOXEL_FILE_INVALID_VERSION && out_version == FORMAT_VERSION_LEGACY_1) {
+		return VOXEL_FILE_OK;
+	}
+	return result;
+}
+
 } // namespace
 
 VoxelStreamBlockFiles::VoxelStreamBlockFiles() {
@@ -61,7 +72,7 @@ void VoxelStreamBlockFiles::emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i o
 	{
 		{
 			uint8_t version;
-			VoxelFileResult err = check_magic_and_version(f, FORMAT_VERSION, FORMAT_BLOCK_MAGIC, version);
+			VoxelFileResult err = check_magic_and_supported_version(f, FORMAT_BLOCK_MAGIC, version);
 			ERR_FAIL_COND_MSG(err != VOXEL_FILE_OK, ::to_string(err));
 		}
 
@@ -214,7 +225,7 @@ VoxelFileResult VoxelStreamBlockFiles::load_meta() {
 		}
 		ERR_FAIL_COND_V(!f, VOXEL_FILE_CANT_OPEN);
 
-		VoxelFileResult check_result = check_magic_and_version(f.f, FORMAT_VERSION, FORMAT_META_MAGIC, meta.version);
+		VoxelFileResult check_result = check_magic_and_supported_version(f.f, FORMAT_META_MAGIC, meta.version);
 		if (check_result != VOXEL_FILE_OK) {
 			return check_result;
 		}
@@ -0,0 +1,397 @@
+#include "voxel_stream_cache.h"
+#include "../util/profiling.h"
+#include "../voxel_buffer.h"
+#include <core/os/mutex.h>
+
+namespace {
+const int DEFAULT_MEMORY_BUDGET_MB = 64;
+
+void copy_block(const VoxelBuffer &src, VoxelBuffer &dst) {
+	for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
+		dst.set_channel_depth(i, src.get_channel_depth(i));
+	}
+	// Channels are shared, not copied
+	dst.copy_from(src);
+	dst.clear_voxel_metadata();
+	dst.copy_voxel_metadata(src);
+	dst.set_block_metadata(src.get_block_metadata().duplicate());
+}
+
+} // namespace
+
+VoxelStreamCache::VoxelStreamCache() {
+	_memory_budget = DEFAULT_MEMORY_BUDGET_MB * 1024 * 1024;
+	_cache_mutex = Mutex::create();
+	_write_back_mutex = Mutex::create();
+	_stream_mutex = Mutex::create();
+}
+
+VoxelStreamCache::~VoxelStreamCache() {
+	write_back(true);
+
+	for (unsigned int lod = 0; lod < _entries.size(); ++lod) {
+		HashMap<Vector3i, Entry *, Vector3iHasher> &entries = _entries[lod];
+		const Vector3i *key = nullptr;
+		while ((key = entries.next(key))) {
+			memdelete(entries.get(*key));
+		}
+		entries.clear();
+	}
+
+	memdelete(_cache_mutex);
+	memdelete(_write_back_mutex);
+	memdelete(_stream_mutex);
+}
+
+void VoxelStreamCache::emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod) {
+	VoxelBlockRequest r;
+	r.voxel_buffer = out_buffer;
+	r.origin_in_voxels = origin_in_voxels;
+	r.lod = lod;
+	Vector<VoxelBlockRequest> requests;
+	requests.push_back(r);
+	emerge_blocks(requests);
+}
+
+void VoxelStreamCache::immerge_block(Ref<VoxelBuffer> buffer, Vector3i origin_in_voxels, int lod) {
+	VoxelBlockRequest r;
+	r.voxel_buffer = buffer;
+	r.origin_in_voxels = origin_in_voxels;
+	r.lod = lod;
+	Vector<VoxelBlockRequest> requests;
+	requests.push_back(r);
+	immerge_blocks(requests);
+}
+
+void VoxelStreamCache::emerge_blocks(Vector<VoxelBlockRequest> &p_blocks) {
+	VOXEL_PROFILE_SCOPE();
+
+	// Cached buffers are never modified, they get replaced. So they can be copied outside of the lock.
+	std::vector<Ref<VoxelBuffer>> cached_buffers;
+	cached_buffers.resize(p_blocks.size());
+	Vector<VoxelBlockRequest> misses;
+
+	{
+		MutexLock lock(_cache_mutex);
+
+		for (int i = 0; i < p_blocks.size(); ++i) {
+			const VoxelBlockRequest &r = p_blocks[i];
+			ERR_CONTINUE(r.voxel_buffer.is_null());
+			Entry *e = get_entry(r.origin_in_voxels, r.lod);
+
+			if (e != nullptr && e->voxels->get_size() == r.voxel_buffer->get_size()) {
+				if (e->in_lru) {
+					lru_remove(e);
+				}
+				// If the block is being written back, this also keeps it in the cache
+				lru_push_front(e);
+				cached_buffers[i] = e->voxels;
+
+			} else {
+				misses.push_back(r);
+			}
+		}
+	}
+
+	for (int i = 0; i < p_blocks.size(); ++i) {
+		if (cached_buffers[i].is_valid()) {
+			copy_block(**cached_buffers[i], **p_blocks[i].voxel_buffer);
+		}
+	}
+
+	if (misses.size() > 0) {
+		emerge_blocks_from_stream(misses);
+	}
+}
+
+void VoxelStreamCache::immerge_blocks(Vector<VoxelBlockRequest> &p_blocks) {
+	VOXEL_PROFILE_SCOPE();
+
+	// The caller may keep modifying its buffers. Duplicates share their data until then.
+	std::vector<Ref<VoxelBuffer>> buffers;
+	buffers.resize(p_blocks.size());
+	for (int i = 0; i < p_blocks.size(); ++i) {
+		const VoxelBlockRequest &r = p_blocks[i];
+		ERR_CONTINUE(r.voxel_buffer.is_null());
+		ERR_CONTINUE(r.lod < 0 || r.lod >= static_cast<int>(VoxelConstants::MAX_LOD));
+		buffers[i] = r.voxel_buffer->duplicate(true);
+		buffers[i]->set_block_metadata(r.voxel_buffer->get_block_metadata().duplicate());
+	}
+
+	bool over_budget;
+	{
+		MutexLock lock(_cache_mutex);
+
+		for (int i = 0; i < p_blocks.size(); ++i) {
+			if (buffers[i].is_null()) {
+				continue;
+			}
+			const VoxelBlockRequest &r = p_blocks[i];
+			Entry *e = get_entry(r.origin_in_voxels, r.lod);
+
+			if (e == nullptr) {
+				e = memnew(Entry);
+				e->origin_in_voxels = r.origin_in_voxels;
+				e->lod = r.lod;
+				_entries[r.lod].set(r.origin_in_voxels, e);
+			} else {
+				_memory_usage -= e->memory_usage;
+				if (e->in_lru) {
+					lru_remove(e);
+				}
+			}
+
+			e->voxels = buffers[i];
+			e->dirty = true;
+			// Uniform blocks take almost no voxel data, the entry itself has to be accounted for
+			e->memory_usage = sizeof(Entry) + sizeof(VoxelBuffer) + e->voxels->get_memory_usage();
+			_memory_usage += e->memory_usage;
+			lru_push_front(e);
+		}
+
+		over_budget = _memory_usage > _memory_budget;
+	}
+
+	if (over_budget) {
+		write_back(false);
+	}
+}
+
+void VoxelStreamCache::flush() {
+	VOXEL_PROFILE_SCOPE();
+	write_back(true);
+
+	// Streams which are not thread-safe don't keep data in memory so far, so only our instance is flushed
+	Ref<VoxelStream> stream = get_stream_for_current_thread();
+	if (stream.is_valid()) {
+		stream->flush();
+	}
+}
+
+// If the cache is over budget, evicts least recently used blocks, and writes those which were not saved yet.
+// If `flush_all` is true, all other blocks not saved yet are written too, but they stay in the cache.
+void VoxelStreamCache::write_back(bool flush_all) {
+	VOXEL_PROFILE_SCOPE();
+
+	MutexLock write_back_lock(_write_back_mutex);
+
+	Vector<VoxelBlockRequest> requests;
+	// Evicted blocks stay in the cache until they are written, so loading them in the meantime doesn't get old data
+	std::vector<Entry *> evicted_entries;
+
+	{
+		MutexLock lock(_cache_mutex);
+
+		if (_memory_usage > _memory_budget) {
+			// Going a bit below the budget sends blocks in batches, instead of one for every block saved afterwards
+			const size_t target_memory_usage = _memory_budget - _memory_budget / 4;
+			size_t memory_usage = _memory_usage;
+
+			while (memory_usage > target_memory_usage && _lru_last != nullptr) {
+				Entry *e = _lru_last;
+				lru_remove(e);
+				memory_usage -= e->memory_usage;
+
+				if (e->dirty) {
+					VoxelBlockRequest r;
+					r.voxel_buffer = e->voxels;
+					r.origin_in_voxels = e->origin_in_voxels;
+					r.lod = e->lod;
+					requests.push_back(r);
+					e->dirty = false;
+					evicted_entries.push_back(e);
+
+				} else {
+					remove_entry(e);
+				}
+			}
+		}
+
+		if (flush_all) {
+			for (Entry *e = _lru_first; e != nullptr; e = e->next) {
+				if (e->dirty) {
+					VoxelBlockRequest r;
+					r.voxel_buffer = e->voxels;
+					r.origin_in_voxels = e->origin_in_voxels;
+					r.lod = e->lod;
+					requests.push_back(r);
+					e->dirty = false;
+				}
+			}
+		}
+	}
+
+	if (requests.size() > 0) {
+		// Sending them all at once lets streams like region files group them
+		immerge_blocks_to_stream(requests);
+	}
+
+	if (evicted_entries.size() > 0) {
+		MutexLock lock(_cache_mutex);
+
+		for (size_t i = 0; i < evicted_entries.size(); ++i) {
+			Entry *e = evicted_entries[i];
+			// Blocks loaded or saved again during the write are kept
+			if (!e->in_lru) {
+				remove_entry(e);
+			}
+		}
+	}
+}
+
+// The wrapped stream can be changed from the main thread meanwhile, so the returned reference must be kept
+Ref<VoxelStream> VoxelStreamCache::get_stream_for_current_thread() {
+	MutexLock lock(_stream_mutex);
+
+	if (_stream.is_null() || _stream->is_thread_safe()) {
+		return _stream;
+	}
+
+	const Thread::ID thread_id = Thread::get_caller_id();
+	const Ref<VoxelStream> *instance = _stream_instances.getptr(thread_id);
+	if (instance != nullptr) {
+		return *instance;
+	}
+
+	Ref<VoxelStream> stream = _stream->duplicate();
+	_stream_instances.set(thread_id, stream);
+	return stream;
+}
+
+void VoxelStreamCache::emerge_blocks_from_stream(Vector<VoxelBlockRequest> &requests) {
+	Ref<VoxelStream> stream = get_stream_for_current_thread();
+	if (stream.is_valid()) {
+		stream->emerge_blocks(requests);
+	}
+}
+
+void VoxelStreamCache::immerge_blocks_to_stream(Vector<VoxelBlockRequest> &requests) {
+	Ref<VoxelStream> stream = get_stream_for_current_thread();
+	ERR_FAIL_COND_MSG(stream.is_null(), "Blocks could not be saved, the cache has no stream");
+	stream->immerge_blocks(requests);
+}
+
+VoxelStreamCache::Entry *VoxelStreamCache::get_entry(Vector3i origin_in_voxels, int lod) const {
+	if (lod < 0 || lod >= static_cast<int>(_entries.size())) {
+		return nullptr;
+	}
+	Entry *const *e = _entries[lod].getptr(origin_in_voxels);
+	return e != nullptr ? *e : nullptr;
+}
+
+void VoxelStreamCache::remove_entry(Entry *e) {
+	CRASH_COND(e->in_lru);
+	_entries[e->lod].erase(e->origin_in_voxels);
+	_memory_usage -= e->memory_usage;
+	memdelete(e);
+}
+
+void VoxelStreamCache::lru_push_front(Entry *e) {
+	CRASH_COND(e->in_lru);
+	e->prev = nullptr;
+	e->next = _lru_first;
+	if (_lru_first != nullptr) {
+		_lru_first->prev = e;
+	} else {
+		_lru_last = e;
+	}
+	_lru_first = e;
+	e->in_lru = true;
+}
+
+void VoxelStreamCache::lru_remove(Entry *e) {
+	CRASH_COND(!e->in_lru);
+	if (e->prev != nullptr) {
+		e->prev->next = e->next;
+	} else {
+		_lru_first = e->next;
+	}
+	if (e->next != nullptr) {
+		e->next->prev = e->prev;
+	} else {
+		_lru_last = e->prev;
+	}
+	e->prev = nullptr;
+	e->next = nullptr;
+	e->in_lru = false;
+}
+
+int VoxelStreamCache::get_used_channels_mask() const {
+	Ref<VoxelStream> stream = get_stream();
+	if (stream.is_valid()) {
+		return stream->get_used_channels_mask();
+	}
+	return VoxelStream::get_used_channels_mask();
+}
+
+bool VoxelStreamCache::is_thread_safe() const {
+	return true;
+}
+
+bool VoxelStreamCache::has_script() const {
+	Ref<VoxelStream> stream = get_stream();
+	if (stream.is_valid()) {
+		return stream->has_script();
+	}
+	return VoxelStream::has_script();
+}
+
+void VoxelStreamCache::set_stream(Ref<VoxelStream> stream) {
+	ERR_FAIL_COND(*stream == this);
+	if (stream == get_stream()) {
+		return;
+	}
+
+	// Cached blocks belong to the previous stream
+	write_back(true);
+	{
+		MutexLock write_back_lock(_write_back_mutex);
+		MutexLock lock(_cache_mutex);
+		while (_lru_last != nullptr) {
+			Entry *e = _lru_last;
+			lru_remove(e);
+			remove_entry(e);
+		}
+	}
+
+	MutexLock lock(_stream_mutex);
+	_stream = stream;
+	_stream_instances.clear();
+}
+
+Ref<VoxelStream> VoxelStreamCache::get_stream() const {
+	MutexLock lock(_stream_mutex);
+	return _stream;
+}
+
+void VoxelStreamCache::set_memory_budget_mb(int mb) {
+	ERR_FAIL_COND(mb < 0);
+	{
+		MutexLock lock(_cache_mutex);
+		_memory_budget = static_cast<size_t>(mb) * 1024 * 1024;
+	}
+	write_back(false);
+}
+
+int VoxelStreamCache::get_memory_budget_mb() const {
+	return _memory_budget / (1024 * 1024);
+}
+
+int VoxelStreamCache::get_memory_usage() const {
+	MutexLock lock(_cache_mutex);
+	return _memory_usage;
+}
+
+void VoxelStreamCache::_bind_methods() {
+	ClassDB::bind_method(D_METHOD("set_stream", "stream"), &VoxelStreamCache::set_stream);
+	ClassDB::bind_method(D_METHOD("get_stream"), &VoxelStreamCache::get_stream);
+
+	ClassDB::bind_method(D_METHOD("set_memory_budget_mb", "mb"), &VoxelStreamCache::set_memory_budget_mb);
+	ClassDB::bind_method(D_METHOD("get_memory_budget_mb"), &VoxelStreamCache::get_memory_budget_mb);
+
+	ClassDB::bind_method(D_METHOD("get_memory_usage"), &VoxelStreamCache::get_memory_usage);
+	ClassDB::bind_method(D_METHOD("flush"), &VoxelStreamCache::flush);
+
+	ADD_PROPERTY(PropertyInfo(Variant::OBJECT, "stream", PROPERTY_HINT_RESOURCE_TYPE, "VoxelStream"), "set_stream", "get_stream");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "memory_budget_mb"), "set_memory_budget_mb", "get_memory_budget_mb");
+}
@@ -0,0 +1,93 @@
+#ifndef VOXEL_STREAM_CACHE_H
+#define VOXEL_STREAM_CACHE_H
+
+#include "../math/vector3i.h"
+#include "../util/fixed_array.h"
+#include "../voxel_constants.h"
+#include "voxel_stream.h"
+#include <core/hash_map.h>
+#include <core/os/thread.h>
+
+class Mutex;
+
+// Keeps saved blocks in memory in front of another stream, up to a memory budget.
+// When a block gets loaded again shortly after being saved, like when walking back and forth, it is copied from
+// memory instead of going through the wrapped stream. Blocks share their voxel data with the cache until either
+// of them is modified, so this is cheap to do.
+// Saved blocks are written to the wrapped stream in batches, when they get evicted or when `flush()` is called.
+// If the wrapped stream is not thread-safe, each thread uses its own duplicate of it, like VoxelServer does.
+// Note: terrains can't get the block size of the wrapped stream through the cache, it must be set to match.
+class VoxelStreamCache : public VoxelStream {
+	GDCLASS(VoxelStreamCache, VoxelStream)
+public:
+	VoxelStreamCache();
+	~VoxelStreamCache();
+
+	void emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod) override;
+	void immerge_block(Ref<VoxelBuffer> buffer, Vector3i origin_in_voxels, int lod) override;
+
+	void emerge_blocks(Vector<VoxelBlockRequest> &p_blocks) override;
+	void immerge_blocks(Vector<VoxelBlockRequest> &p_blocks) override;
+
+	void flush() override;
+
+	int get_used_channels_mask() const override;
+	bool is_thread_safe() const override;
+	bool has_script() const override;
+
+	void set_stream(Ref<VoxelStream> stream);
+	Ref<VoxelStream> get_stream() const;
+
+	void set_memory_budget_mb(int mb);
+	int get_memory_budget_mb() const;
+
+	int get_memory_usage() const;
+
+protected:
+	static void _bind_methods();
+
+private:
+	struct Entry {
+		Ref<VoxelBuffer> voxels;
+		Vector3i origin_in_voxels;
+		uint8_t lod = 0;
+		// Not written to the wrapped stream yet
+		bool dirty = false;
+		// False while the block is being written back after eviction. It gets removed once done.
+		bool in_lru = false;
+		size_t memory_usage = 0;
+		// Least recently used list, starting from the most recent
+		Entry *prev = nullptr;
+		Entry *next = nullptr;
+	};
+
+	Ref<VoxelStream> get_stream_for_current_thread();
+	void emerge_blocks_from_stream(Vector<VoxelBlockRequest> &requests);
+	void immerge_blocks_to_stream(Vector<VoxelBlockRequest> &requests);
+	void write_back(bool flush_all);
+
+	Entry *get_entry(Vector3i origin_in_voxels, int lod) const;
+	void remove_entry(Entry *e);
+	void lru_push_front(Entry *e);
+	void lru_remove(Entry *e);
+
+	Ref<VoxelStream> _stream;
+	// Duplicates of the wrapped stream when it is not thread-safe
+	HashMap<Thread::ID, Ref<VoxelStream> > _stream_instances;
+	size_t _memory_budget = 0;
+
+	// Per LOD, indexed by origin in voxels
+	FixedArray<HashMap<Vector3i, Entry *, Vector3iHasher>, VoxelConstants::MAX_LOD> _entries;
+	Entry *_lru_first = nullptr;
+	Entry *_lru_last = nullptr;
+	size_t _memory_usage = 0;
+	// Protects entries, the LRU list and memory usage
+	Mutex *_cache_mutex = nullptr;
+
+	// Write-backs happen one at a time, so blocks reach the wrapped stream in the order they were evicted
+	Mutex *_write_back_mutex = nullptr;
+	// Protects the wrapped stream and its duplicates
+	Mutex *_stream_mutex = nullptr;
+};
+
+#endif // VOXEL_STREAM_CACHE_H
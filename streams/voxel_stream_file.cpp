@@ -1,8 +1,17 @@
 #include "voxel_stream_file.h"
 #include "../util/profiling.h"
 #include <core/os/file_access.h>
+#include <core/os/mutex.h>
 #include <core/os/os.h>
 
+VoxelStreamFile::VoxelStreamFile() {
+	_fallback_stream_mutex = Mutex::create();
+}
+
+VoxelStreamFile::~VoxelStreamFile() {
+	memdelete(_fallback_stream_mutex);
+}
+
 void VoxelStreamFile::set_save_fallback_output(bool enabled) {
 	_save_fallback_output = enabled;
 }
@@ -17,7 +26,27 @@ Ref<VoxelStream> VoxelStreamFile::get_fallback_stream() const {
 
 void VoxelStreamFile::set_fallback_stream(Ref<VoxelStream> stream) {
 	ERR_FAIL_COND(*stream == this);
+	MutexLock lock(_fallback_stream_mutex);
 	_fallback_stream = stream;
+	_fallback_stream_instances.clear();
+}
+
+Ref<VoxelStream> VoxelStreamFile::get_fallback_stream_for_current_thread() {
+	MutexLock lock(_fallback_stream_mutex);
+
+	if (_fallback_stream.is_null() || _fallback_stream->is_thread_safe()) {
+		return _fallback_stream;
+	}
+
+	const Thread::ID thread_id = Thread::get_caller_id();
+	const Ref<VoxelStream> *instance = _fallback_stream_instances.getptr(thread_id);
+	if (instance != nullptr) {
+		return *instance;
+	}
+
+	Ref<VoxelStream> stream = _fallback_stream->duplicate();
+	_fallback_stream_instances.set(thread_id, stream);
+	return stream;
 }
 
 void VoxelStreamFile::emerge_block_fallback(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod) {
@@ -37,8 +66,11 @@ void VoxelStreamFile::emerge_block_fallback(Ref<VoxelBuffer> out_buffer, Vector3
 void VoxelStreamFile::emerge_blocks_fallback(Vector<VoxelBlockRequest> &requests) {
 	VOXEL_PROFILE_SCOPE();
 
-	if (_fallback_stream.is_valid()) {
-		_fallback_stream->emerge_blocks(requests);
+	// The fallback can be changed from the main thread meanwhile, so a reference is kept
+	Ref<VoxelStream> fallback_stream = get_fallback_stream_for_current_thread();
+
+	if (fallback_stream.is_valid()) {
+		fallback_stream->emerge_blocks(requests);
 
 		if (_save_fallback_output) {
 			immerge_blocks(requests);
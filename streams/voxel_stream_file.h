@@ -3,8 +3,11 @@
 
 #include "voxel_block_serializer.h"
 #include "voxel_stream.h"
+#include <core/hash_map.h>
+#include <core/os/thread.h>
 
 class FileAccess;
+class Mutex;
 
 // TODO Could be worth integrating with Godot ResourceLoader
 // Loads and saves blocks to the filesystem.
@@ -13,6 +16,9 @@ class FileAccess;
 class VoxelStreamFile : public VoxelStream {
 	GDCLASS(VoxelStreamFile, VoxelStream)
 public:
+	VoxelStreamFile();
+	~VoxelStreamFile();
+
 	void set_save_fallback_output(bool enabled);
 	bool get_save_fallback_output() const;
 
@@ -40,8 +46,14 @@ protected:
 
 private:
 	Vector3 _get_block_size() const;
+	Ref<VoxelStream> get_fallback_stream_for_current_thread();
 
 	Ref<VoxelStream> _fallback_stream;
+	// File streams can be thread-safe while their fallback is not.
+	// Such fallbacks are duplicated for each thread using them, the same way VoxelServer does with streams.
+	HashMap<Thread::ID, Ref<VoxelStream> > _fallback_stream_instances;
+	// Protects the fallback stream and its instances
+	Mutex *_fallback_stream_mutex = nullptr;
 	bool _save_fallback_output = true;
 };
 
@@ -4,16 +4,34 @@
 #include "../util/profiling.h"
 #include "../util/utility.h"
 #include <core/io/json.h>
+#include <core/io/marshalls.h>
+#include <core/os/mutex.h>
 #include <core/os/os.h>
+#include <core/os/rw_lock.h>
 #include <algorithm>
 
 namespace {
-const uint8_t FORMAT_VERSION = 2;
+const uint8_t FORMAT_VERSION = 3;
+// Version 3 blocks can contain RLE and palette channels. Older files only differ by that, so they are upgraded
+// to version 3 when a block gets written into them.
+const uint8_t FORMAT_VERSION_LEGACY_2 = 2;
 const uint8_t FORMAT_VERSION_LEGACY_1 = 1;
 const char *FORMAT_REGION_MAGIC = "VXR_";
 const char *META_FILE_NAME = "meta.vxrm";
 const int MAGIC_AND_VERSION_SIZE = 4 + 1;
 const char *REGION_FILE_EXTENSION = "vxr";
+
+// Blocks are serialized and decompressed outside of region locks, so each thread needs its own buffers
+struct ThreadData {
+	VoxelBlockSerializerInternal serializer;
+	std::vector<uint8_t> compressed_data;
+};
+
+ThreadData &get_thread_data() {
+	static thread_local ThreadData data;
+	return data;
+}
+
 } // namespace
 
 VoxelStreamRegionFiles::VoxelStreamRegionFiles() {
@@ -23,10 +41,25 @@ VoxelStreamRegionFiles::VoxelStreamRegionFiles() {
 	_meta.sector_size = 512; // next_power_of_2(_meta.block_size.volume() / 10) // based on compression ratios
 	_meta.lod_count = 1;
 	_meta.channel_depths.fill(VoxelBuffer::DEFAULT_CHANNEL_DEPTH);
+	_meta_mutex = Mutex::create();
+	_region_cache_mutex = Mutex::create();
 }
 
 VoxelStreamRegionFiles::~VoxelStreamRegionFiles() {
 	close_all_regions();
+	memdelete(_meta_mutex);
+	memdelete(_region_cache_mutex);
+}
+
+VoxelStreamRegionFiles::CachedRegion::CachedRegion() {
+	rw_lock = RWLock::create();
+	file_mutex = Mutex::create();
+}
+
+VoxelStreamRegionFiles::CachedRegion::~CachedRegion() {
+	CRASH_COND(users != 0);
+	memdelete(rw_lock);
+	memdelete(file_mutex);
 }
 
 void VoxelStreamRegionFiles::emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod) {
@@ -62,6 +95,10 @@ void VoxelStreamRegionFiles::emerge_blocks(Vector<VoxelBlockRequest> &p_blocks)
 	sorter.compare.self = this;
 	sorter.sort(sorted_blocks.ptrw(), sorted_blocks.size());
 
+	if (sorted_blocks.size() > 1) {
+		prefetch_blocks(sorted_blocks);
+	}
+
 	Vector<VoxelBlockRequest> fallback_requests;
 
 	for (int i = 0; i < sorted_blocks.size(); ++i) {
@@ -75,6 +112,71 @@ void VoxelStreamRegionFiles::emerge_blocks(Vector<VoxelBlockRequest> &p_blocks)
 	emerge_blocks_fallback(fallback_requests);
 }
 
+// Lets the OS read all blocks of a batch from disk at once, while previous ones get decompressed.
+// This only works when region files are mapped, otherwise blocks are read one by one.
+void VoxelStreamRegionFiles::prefetch_blocks(const Vector<VoxelBlockRequest> &sorted_blocks) {
+	VOXEL_PROFILE_SCOPE();
+
+	{
+		MutexLock lock(_meta_mutex);
+		if (!_meta_loaded) {
+			// Loading the first block will do it
+			return;
+		}
+	}
+
+	const Vector3i region_size = Vector3i(1 << _meta.region_size_po2);
+	const int blocks_begin_offset = get_region_header_size();
+
+	int i = 0;
+	while (i < sorted_blocks.size()) {
+		const VoxelBlockRequest &first = sorted_blocks[i];
+		const Vector3i region_pos = get_region_position_from_blocks(
+				get_block_position_from_voxels(first.origin_in_voxels) >> first.lod);
+
+		// Requests are grouped by region
+		int end = i + 1;
+		while (end < sorted_blocks.size()) {
+			const VoxelBlockRequest &r = sorted_blocks[end];
+			if (r.lod != first.lod ||
+					get_region_position_from_blocks(get_block_position_from_voxels(r.origin_in_voxels) >> r.lod) !=
+							region_pos) {
+				break;
+			}
+			++end;
+		}
+
+		if (first.lod < _meta.lod_count) {
+			CachedRegion *cache = open_region(region_pos, first.lod, false);
+
+			if (cache != nullptr) {
+				{
+					RWLockRead rlock(cache->rw_lock);
+
+					if (cache->file_exists && map_region_file(cache)) {
+						for (int j = i; j < end; ++j) {
+							const VoxelBlockRequest &r = sorted_blocks[j];
+							const Vector3i block_pos = get_block_position_from_voxels(r.origin_in_voxels) >> r.lod;
+							const BlockInfo &block_info =
+									cache->header.blocks[get_block_index_in_header(block_pos.wrap(region_size))];
+
+							if (block_info.data != 0) {
+								cache->file_mapping.prefetch(
+										blocks_begin_offset + block_info.get_sector_index() * _meta.sector_size,
+										block_info.get_sector_count() * _meta.sector_size);
+							}
+						}
+					}
+				}
+
+				release_region(cache);
+			}
+		}
+
+		i = end;
+	}
+}
+
 void VoxelStreamRegionFiles::immerge_blocks(Vector<VoxelBlockRequest> &p_blocks) {
 	VOXEL_PROFILE_SCOPE();
 
@@ -100,18 +202,25 @@ VoxelStreamRegionFiles::EmergeResult VoxelStreamRegionFiles::_emerge_block(Ref<V
 		return EMERGE_OK_FALLBACK;
 	}
 
-	if (!_meta_loaded) {
-		VoxelFileResult load_res = load_meta();
-		if (load_res != VOXEL_FILE_OK) {
-			if (!_meta_saved && load_res == VOXEL_FILE_CANT_OPEN) {
-				// TODO Is it a good idea to save on read?
-				// New data folder, save it for first time
-				VoxelFileResult save_res = save_meta();
-				ERR_FAIL_COND_V(save_res != VOXEL_FILE_OK, EMERGE_FAILED);
-			} else {
-				return EMERGE_FAILED;
+	// Depths can be set by the first save, which may happen on another thread
+	FixedArray<VoxelBuffer::Depth, VoxelBuffer::MAX_CHANNELS> channel_depths;
+
+	{
+		MutexLock lock(_meta_mutex);
+		if (!_meta_loaded) {
+			VoxelFileResult load_res = load_meta();
+			if (load_res != VOXEL_FILE_OK) {
+				if (!_meta_saved && load_res == VOXEL_FILE_CANT_OPEN) {
+					// TODO Is it a good idea to save on read?
+					// New data folder, save it for first time
+					VoxelFileResult save_res = save_meta();
+					ERR_FAIL_COND_V(save_res != VOXEL_FILE_OK, EMERGE_FAILED);
+				} else {
+					return EMERGE_FAILED;
+				}
 			}
 		}
+		channel_depths = _meta.channel_depths;
 	}
 
 	const Vector3i block_size = Vector3i(1 << _meta.block_size_po2);
@@ -123,43 +232,107 @@ VoxelStreamRegionFiles::EmergeResult VoxelStreamRegionFiles::_emerge_block(Ref<V
 
 	// Configure depths, as they currently are only specified in the meta file.
 	// Regions are expected to contain such depths, and use those in the buffer to know how much data to read.
-	for (unsigned int channel_index = 0; channel_index < _meta.channel_depths.size(); ++channel_index) {
-		out_buffer->set_channel_depth(channel_index, _meta.channel_depths[channel_index]);
+	for (unsigned int channel_index = 0; channel_index < channel_depths.size(); ++channel_index) {
+		out_buffer->set_channel_depth(channel_index, channel_depths[channel_index]);
 	}
 
 	Vector3i block_pos = get_block_position_from_voxels(origin_in_voxels) >> lod;
 	Vector3i region_pos = get_region_position_from_blocks(block_pos);
 
 	CachedRegion *cache = open_region(region_pos, lod, false);
-	if (cache == nullptr || !cache->file_exists) {
+	if (cache == nullptr) {
 		return EMERGE_OK_FALLBACK;
 	}
 
-	Vector3i block_rpos = block_pos.wrap(region_size);
-	int lut_index = get_block_index_in_header(block_rpos);
-	const BlockInfo &block_info = cache->header.blocks[lut_index];
+	ThreadData &thread_data = get_thread_data();
+	bool found = false;
+	bool read_complete = true;
+	bool decompressed = false;
+	bool decompress_success = false;
 
-	if (block_info.data == 0) {
-		return EMERGE_OK_FALLBACK;
-	}
+	{
+		RWLockRead rlock(cache->rw_lock);
+
+		Vector3i block_rpos = block_pos.wrap(region_size);
+		int lut_index = get_block_index_in_header(block_rpos);
+		const BlockInfo &block_info = cache->header.blocks[lut_index];
+
+		if (cache->file_exists && block_info.data != 0) {
+			unsigned int sector_index = block_info.get_sector_index();
+			//unsigned int sector_count = block_info.get_sector_count();
+			int blocks_begin_offset = get_region_header_size();
+			const size_t block_offset = blocks_begin_offset + sector_index * _meta.sector_size;
+			found = true;
+
+			if (map_region_file(cache)) {
+				// Decompress straight from the mapping.
+				// Writers can't modify or unmap the file while we hold the read lock.
+				const VoxelFileMapping &mapping = cache->file_mapping;
+				const size_t data_begin = block_offset + sizeof(uint32_t);
+
+				if (data_begin <= mapping.get_size()) {
+					const unsigned int block_data_size = decode_uint32(mapping.get_data() + block_offset);
+
+					if (block_data_size > 0 && block_data_size <= mapping.get_size() - data_begin) {
+						decompress_success = thread_data.serializer.decompress_and_deserialize(
+								ArraySlice<const uint8_t>(mapping.get_data(), data_begin, data_begin + block_data_size),
+								**out_buffer);
+						decompressed = true;
+					} else {
+						read_complete = false;
+					}
+				} else {
+					read_complete = false;
+				}
 
-	unsigned int sector_index = block_info.get_sector_index();
-	//unsigned int sector_count = block_info.get_sector_count();
-	int blocks_begin_offset = get_region_header_size();
+			} else {
+				// Only copying compressed bytes is serialized, decompression happens in parallel
+				MutexLock flock(cache->file_mutex);
+				FileAccess *f = cache->file_access;
 
-	FileAccess *f = cache->file_access;
+				f->seek(block_offset);
 
-	f->seek(blocks_begin_offset + sector_index * _meta.sector_size);
+				unsigned int block_data_size = f->get_32();
+				CRASH_COND(f->eof_reached());
 
-	unsigned int block_data_size = f->get_32();
-	CRASH_COND(f->eof_reached());
+				thread_data.compressed_data.resize(block_data_size);
+				unsigned int read_size = f->get_buffer(thread_data.compressed_data.data(), block_data_size);
+				read_complete = read_size == block_data_size;
+			}
+		}
+	}
+
+	release_region(cache);
+
+	if (!found) {
+		return EMERGE_OK_FALLBACK;
+	}
+	ERR_FAIL_COND_V(!read_complete, EMERGE_FAILED);
 
-	ERR_FAIL_COND_V_MSG(!_block_serializer.decompress_and_deserialize(f, block_data_size, **out_buffer), EMERGE_FAILED,
+	if (!decompressed) {
+		decompress_success = thread_data.serializer.decompress_and_deserialize(thread_data.compressed_data, **out_buffer);
+	}
+
+	ERR_FAIL_COND_V_MSG(!decompress_success, EMERGE_FAILED,
 			String("Failed to read block {0} at region {1}").format(varray(block_pos.to_vec3(), region_pos.to_vec3())));
 
 	return EMERGE_OK;
 }
 
+// Returns true if the region file is mapped in memory. Must be called with the region locked for reading.
+bool VoxelStreamRegionFiles::map_region_file(CachedRegion *region) {
+	MutexLock lock(region->file_mutex);
+
+	if (!region->file_mapping.is_mapped() && !region->file_mapping_failed) {
+		// Data written through the file handle must reach the OS to appear in the mapping
+		region->file_access->flush();
+		// Don't try again if the file can't be mapped, like on platforms where it's not implemented
+		region->file_mapping_failed = !region->file_mapping.map(region->file_path);
+	}
+
+	return region->file_mapping.is_mapped();
+}
+
 void VoxelStreamRegionFiles::pad_to_sector_size(FileAccess *f) {
 	int blocks_begin_offset = get_region_header_size();
 	int rpos = f->get_position() - blocks_begin_offset;
@@ -180,32 +353,40 @@ void VoxelStreamRegionFiles::_immerge_block(Ref<VoxelBuffer> voxel_buffer, Vecto
 	ERR_FAIL_COND(_directory_path.empty());
 	ERR_FAIL_COND(voxel_buffer.is_null());
 
-	if (!_meta_loaded) {
-		// If it's not loaded, always try to load meta file first if it exists already,
-		// because we could want to save blocks without reading any
-		VoxelFileResult load_res = load_meta();
-		if (load_res != VOXEL_FILE_OK && load_res != VOXEL_FILE_CANT_OPEN) {
-			// The file is present but there is a problem with it
-			String meta_path = _directory_path.plus_file(META_FILE_NAME);
-			ERR_PRINT(String("Could not read {0}: error {1}").format(varray(meta_path, ::to_string(load_res))));
-			return;
+	FixedArray<VoxelBuffer::Depth, VoxelBuffer::MAX_CHANNELS> channel_depths;
+
+	{
+		MutexLock lock(_meta_mutex);
+
+		if (!_meta_loaded) {
+			// If it's not loaded, always try to load meta file first if it exists already,
+			// because we could want to save blocks without reading any
+			VoxelFileResult load_res = load_meta();
+			if (load_res != VOXEL_FILE_OK && load_res != VOXEL_FILE_CANT_OPEN) {
+				// The file is present but there is a problem with it
+				String meta_path = _directory_path.plus_file(META_FILE_NAME);
+				ERR_PRINT(String("Could not read {0}: error {1}").format(varray(meta_path, ::to_string(load_res))));
+				return;
+			}
 		}
-	}
 
-	if (!_meta_saved) {
-		// First time we save the meta file, initialize it from the first block format
-		for (unsigned int i = 0; i < _meta.channel_depths.size(); ++i) {
-			_meta.channel_depths[i] = voxel_buffer->get_channel_depth(i);
+		if (!_meta_saved) {
+			// First time we save the meta file, initialize it from the first block format
+			for (unsigned int i = 0; i < _meta.channel_depths.size(); ++i) {
+				_meta.channel_depths[i] = voxel_buffer->get_channel_depth(i);
+			}
+			VoxelFileResult err = save_meta();
+			ERR_FAIL_COND(err != VOXEL_FILE_OK);
 		}
-		VoxelFileResult err = save_meta();
-		ERR_FAIL_COND(err != VOXEL_FILE_OK);
+
+		channel_depths = _meta.channel_depths;
 	}
 
 	// Verify format
 	const Vector3i block_size = Vector3i(1 << _meta.block_size_po2);
 	ERR_FAIL_COND(voxel_buffer->get_size() != block_size);
 	for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
-		ERR_FAIL_COND(voxel_buffer->get_channel_depth(i) != _meta.channel_depths[i]);
+		ERR_FAIL_COND(voxel_buffer->get_channel_depth(i) != channel_depths[i]);
 	}
 
 	const Vector3i region_size = Vector3i(1 << _meta.region_size_po2);
@@ -214,10 +395,29 @@ void VoxelStreamRegionFiles::_immerge_block(Ref<VoxelBuffer> voxel_buffer, Vecto
 	Vector3i block_rpos = block_pos.wrap(region_size);
 	//print_line(String("Immerging block {0} r {1}").format(varray(block_pos.to_vec3(), region_pos.to_vec3())));
 
+	// Compressing doesn't need the region
+	const std::vector<uint8_t> &data = get_thread_data().serializer.serialize_and_compress(**voxel_buffer);
+
 	CachedRegion *cache = open_region(region_pos, lod, true);
 	ERR_FAIL_COND(cache == nullptr);
+	{
+		RWLockWrite wlock(cache->rw_lock);
+		_immerge_block_in_region(cache, block_rpos, data);
+	}
+	release_region(cache);
+}
+
+void VoxelStreamRegionFiles::_immerge_block_in_region(CachedRegion *cache, Vector3i block_rpos,
+		const std::vector<uint8_t> &data) {
 	FileAccess *f = cache->file_access;
 
+	if (cache->header.version != FORMAT_VERSION) {
+		// The block may use compression modes older versions can't read
+		f->seek(4);
+		f->store_8(FORMAT_VERSION);
+		cache->header.version = FORMAT_VERSION;
+	}
+
 	int lut_index = get_block_index_in_header(block_rpos);
 	BlockInfo &block_info = cache->header.blocks[lut_index];
 	int blocks_begin_offset = get_region_header_size();
@@ -231,7 +431,6 @@ void VoxelStreamRegionFiles::_immerge_block(Ref<VoxelBuffer> voxel_buffer, Vecto
 		// Check position matches the sectors rule
 		CRASH_COND((block_offset - blocks_begin_offset) % _meta.sector_size != 0);
 
-		const std::vector<uint8_t> &data = _block_serializer.serialize_and_compress(**voxel_buffer);
 		f->store_32(data.size());
 		int written_size = sizeof(int) + data.size();
 		f->store_buffer(data.data(), data.size());
@@ -260,7 +459,6 @@ void VoxelStreamRegionFiles::_immerge_block(Ref<VoxelBuffer> voxel_buffer, Vecto
 		int old_sector_count = block_info.get_sector_count();
 		CRASH_COND(old_sector_count < 1);
 
-		const std::vector<uint8_t> &data = _block_serializer.serialize_and_compress(**voxel_buffer);
 		int written_size = sizeof(int) + data.size();
 
 		int new_sector_count = get_sector_count_from_bytes(written_size);
@@ -312,6 +510,16 @@ void VoxelStreamRegionFiles::_immerge_block(Ref<VoxelBuffer> voxel_buffer, Vecto
 
 		block_info.set_sector_count(new_sector_count);
 	}
+
+	if (cache->file_mapping.is_mapped()) {
+		// Readers use the mapping, so they must see what we wrote.
+		// The mapping doesn't grow with the file, it has to be created again when readers need it.
+		f->flush();
+		const size_t end_offset = blocks_begin_offset + cache->sectors.size() * _meta.sector_size;
+		if (end_offset > cache->file_mapping.get_size()) {
+			cache->file_mapping.unmap();
+		}
+	}
 }
 
 void VoxelStreamRegionFiles::remove_sectors_from_block(CachedRegion *p_region, Vector3i block_rpos, unsigned int p_sector_count) {
@@ -397,6 +605,12 @@ String VoxelStreamRegionFiles::get_directory() const {
 void VoxelStreamRegionFiles::set_directory(String dirpath) {
 	if (_directory_path != dirpath) {
 		_directory_path = dirpath.strip_edges();
+		{
+			MutexLock lock(_region_cache_mutex);
+			for (unsigned int lod = 0; lod < _absent_regions.size(); ++lod) {
+				_absent_regions[lod].clear();
+			}
+		}
 		_meta_loaded = false;
 		_meta_saved = false;
 		load_meta();
@@ -500,6 +714,11 @@ static void migrate_region_meta_data(Dictionary &data) {
 			depths[i] = VoxelBuffer::DEFAULT_CHANNEL_DEPTH;
 		}
 		data["channel_depths"] = depths;
+		data["version"] = real_t(FORMAT_VERSION_LEGACY_2);
+	}
+
+	if (data["version"] == Variant(real_t(FORMAT_VERSION_LEGACY_2))) {
+		// Nothing changed in the meta file
 		data["version"] = FORMAT_VERSION;
 	}
 }
@@ -578,12 +797,16 @@ Vector3i VoxelStreamRegionFiles::get_region_position_from_blocks(const Vector3i
 }
 
 void VoxelStreamRegionFiles::close_all_regions() {
+	MutexLock lock(_region_cache_mutex);
 	for (unsigned int i = 0; i < _region_cache.size(); ++i) {
 		CachedRegion *cache = _region_cache[i];
 		close_region(cache);
 		memdelete(cache);
 	}
 	_region_cache.clear();
+	for (unsigned int lod = 0; lod < _absent_regions.size(); ++lod) {
+		_absent_regions[lod].clear();
+	}
 }
 
 String VoxelStreamRegionFiles::get_region_file_path(const Vector3i &region_pos, unsigned int lod) const {
@@ -610,26 +833,120 @@ VoxelStreamRegionFiles::CachedRegion *VoxelStreamRegionFiles::get_region_from_ca
 	return nullptr;
 }
 
+// Returns a region which can't be closed until `release_region` is called on it.
+// Files are opened without holding the cache lock. Meanwhile, the region is listed as opening, and other threads
+// asking for it wait on its lock.
 VoxelStreamRegionFiles::CachedRegion *VoxelStreamRegionFiles::open_region(const Vector3i region_pos, unsigned int lod, bool create_if_not_found) {
 	VOXEL_PROFILE_SCOPE();
 	ERR_FAIL_COND_V(!_meta_loaded, nullptr);
 	ERR_FAIL_COND_V(lod < 0, nullptr);
+	ERR_FAIL_COND_V(lod >= _absent_regions.size(), nullptr);
+
+	CachedRegion *cache = nullptr;
+
+	while (cache == nullptr) {
+		_region_cache_mutex->lock();
+
+		cache = get_region_from_cache(region_pos, lod);
+
+		if (cache != nullptr) {
+			++cache->users;
+			cache->last_accessed = OS::get_singleton()->get_ticks_usec();
+			const bool opening = cache->opening;
+			_region_cache_mutex->unlock();
+
+			if (opening) {
+				// Wait for the thread opening it
+				cache->rw_lock->read_lock();
+				cache->rw_lock->read_unlock();
+
+				if (cache->file_access == nullptr) {
+					// It didn't open. If the file was absent, we may have to create it.
+					release_region(cache);
+					if (!create_if_not_found) {
+						return nullptr;
+					}
+					cache = nullptr;
+					continue;
+				}
+			}
+			return cache;
+		}
+
+		if (!create_if_not_found && _absent_regions[lod].has(region_pos)) {
+			_region_cache_mutex->unlock();
+			return nullptr;
+		}
 
-	CachedRegion *cache = get_region_from_cache(region_pos, lod);
-	if (cache != nullptr) {
-		return cache;
+		while (_region_cache.size() > _max_open_regions - 1) {
+			if (!close_oldest_region()) {
+				// All regions are in use by other threads, go above the limit until they are done
+				break;
+			}
+		}
+
+		cache = memnew(CachedRegion);
+		cache->position = region_pos;
+		cache->lod = lod;
+		cache->opening = true;
+		cache->users = 1;
+		// Nobody else can have it yet, so this doesn't block
+		cache->rw_lock->write_lock();
+		_region_cache.push_back(cache);
+
+		_region_cache_mutex->unlock();
 	}
 
-	while (_region_cache.size() > _max_open_regions - 1) {
-		close_oldest_region();
+	const bool opened = open_region_file(cache, create_if_not_found);
+
+	// Written while opening, so threads waiting for the region see them once it is unlocked
+	cache->rw_lock->write_unlock();
+
+	MutexLock lock(_region_cache_mutex);
+
+	if (!opened) {
+		for (unsigned int i = 0; i < _region_cache.size(); ++i) {
+			if (_region_cache[i] == cache) {
+				_region_cache.erase(_region_cache.begin() + i);
+				break;
+			}
+		}
+		if (!cache->file_exists && !create_if_not_found) {
+			// Remember it, so loading blocks there doesn't check the file system every time.
+			// We assume no other process creates region files.
+			_absent_regions[lod].set(region_pos, true);
+		}
+		// Threads which waited for it will delete it if they are the last ones
+		cache->opening_failed = true;
+		CRASH_COND(cache->users == 0);
+		--cache->users;
+		if (cache->users == 0) {
+			memdelete(cache);
+		}
+		return nullptr;
+	}
+
+	if (create_if_not_found) {
+		_absent_regions[lod].erase(region_pos);
 	}
+	cache->opening = false;
+	cache->last_opened = OS::get_singleton()->get_ticks_usec();
+	cache->last_accessed = cache->last_opened;
+
+	return cache;
+}
+
+// Opens the file of a region, creating it if asked to, and reads its header.
+// Must be called with the region locked for writing. Returns false if the file could not be opened,
+// in which case `file_exists` tells if it was absent.
+bool VoxelStreamRegionFiles::open_region_file(CachedRegion *cache, bool create_if_not_found) {
+	VOXEL_PROFILE_SCOPE();
 
 	const Vector3i region_size = Vector3i(1 << _meta.region_size_po2);
 
-	String fpath = get_region_file_path(region_pos, lod);
+	String fpath = get_region_file_path(cache->position, cache->lod);
 	Error existing_file_err;
 	FileAccess *existing_f = open_file(fpath, FileAccess::READ_WRITE, &existing_file_err);
-	// TODO Cache the fact the file doesnt exist, so we won't need to do a system call to actually check it every time
 	// TODO No need to read the header again when it has been read once, we assume no other process will modify region files
 
 	if (existing_f == nullptr || existing_file_err != OK) {
@@ -637,32 +954,34 @@ VoxelStreamRegionFiles::CachedRegion *VoxelStreamRegionFiles::open_region(const
 
 		if (!create_if_not_found) {
 			//print_error(String("Could not open file {0}").format(varray(fpath)));
-			return nullptr;
+			return false;
 		}
 
 		VOXEL_PROFILE_SCOPE();
 
 		Error dir_err = check_directory_created(fpath.get_base_dir());
 		if (dir_err != OK) {
-			return nullptr;
+			return false;
 		}
 
 		Error file_err;
 		FileAccess *f = open_file(fpath, FileAccess::WRITE_READ, &file_err);
-		ERR_FAIL_COND_V_MSG(!f, nullptr, "Failed to write file " + fpath + ", error " + String::num_int64(file_err));
-		ERR_FAIL_COND_V_MSG(file_err != OK, nullptr, "Error " + String::num_int64(file_err));
+		ERR_FAIL_COND_V_MSG(!f, false, "Failed to write file " + fpath + ", error " + String::num_int64(file_err));
+		if (file_err != OK) {
+			memdelete(f);
+			ERR_PRINT("Error " + String::num_int64(file_err));
+			return false;
+		}
 
 		f->store_buffer((uint8_t *)FORMAT_REGION_MAGIC, 4);
 		f->store_8(FORMAT_VERSION);
 
-		cache = memnew(CachedRegion);
 		cache->file_exists = true;
+		cache->file_path = fpath;
 		cache->file_access = f;
-		cache->position = region_pos;
-		cache->lod = lod;
-		_region_cache.push_back(cache);
 		RegionHeader &header = cache->header;
 
+		header.version = FORMAT_VERSION;
 		header.blocks.resize(region_size.volume());
 
 		save_header(cache);
@@ -671,32 +990,32 @@ VoxelStreamRegionFiles::CachedRegion *VoxelStreamRegionFiles::open_region(const
 		// Read existing
 		VOXEL_PROFILE_SCOPE();
 
+		// The file is there even if it turns out invalid, it must not be cached as absent
+		cache->file_exists = true;
+
 		uint8_t version;
 		const VoxelFileResult check_result = check_magic_and_version(existing_f, FORMAT_VERSION, FORMAT_REGION_MAGIC, version);
 
 		if (check_result == VOXEL_FILE_INVALID_VERSION) {
-			if (version != FORMAT_VERSION_LEGACY_1) {
+			if (version != FORMAT_VERSION_LEGACY_1 && version != FORMAT_VERSION_LEGACY_2) {
 				memdelete(existing_f);
 				ERR_PRINT(String("Could not open file {0}, invalid version {1}").format(varray(fpath, version)));
-				return nullptr;
+				return false;
 			}
 
 		} else if (check_result != VOXEL_FILE_OK) {
 			memdelete(existing_f);
 			ERR_PRINT(String("Could not open file {0}, {1}").format(varray(fpath, ::to_string(check_result))));
-			return nullptr;
+			return false;
 		}
 
-		// Versions 1 and 2 are the same
+		// Versions 1 and 2 are read the same as 3
 
-		cache = memnew(CachedRegion);
-		cache->file_exists = true;
+		cache->file_path = fpath;
 		cache->file_access = existing_f;
-		cache->position = region_pos;
-		cache->lod = lod;
-		_region_cache.push_back(cache);
 		RegionHeader &header = cache->header;
 
+		header.version = version;
 		header.blocks.resize(region_size.volume());
 
 		// TODO Deal with endianess
@@ -737,9 +1056,17 @@ VoxelStreamRegionFiles::CachedRegion *VoxelStreamRegionFiles::open_region(const
 		}
 	}
 
-	cache->last_opened = OS::get_singleton()->get_ticks_usec();
+	return true;
+}
 
-	return cache;
+void VoxelStreamRegionFiles::release_region(CachedRegion *region) {
+	MutexLock lock(_region_cache_mutex);
+	CRASH_COND(region->users == 0);
+	--region->users;
+	if (region->opening_failed && region->users == 0) {
+		// It was already removed from the cache
+		memdelete(region);
+	}
 }
 
 void VoxelStreamRegionFiles::save_header(CachedRegion *p_region) {
@@ -757,6 +1084,8 @@ void VoxelStreamRegionFiles::save_header(CachedRegion *p_region) {
 void VoxelStreamRegionFiles::close_region(CachedRegion *region) {
 	VOXEL_PROFILE_SCOPE();
 
+	region->file_mapping.unmap();
+
 	if (region->file_access) {
 		FileAccess *f = region->file_access;
 
@@ -771,30 +1100,35 @@ void VoxelStreamRegionFiles::close_region(CachedRegion *region) {
 	}
 }
 
-void VoxelStreamRegionFiles::close_oldest_region() {
-	// Close region assumed to be the least recently used
-
-	if (_region_cache.size() == 0) {
-		return;
-	}
-
+// Closes the least recently used region which no thread is using.
+// Returns false if there was none.
+bool VoxelStreamRegionFiles::close_oldest_region() {
 	int oldest_index = -1;
 	uint64_t oldest_time = 0;
 	uint64_t now = OS::get_singleton()->get_ticks_usec();
 
 	for (unsigned int i = 0; i < _region_cache.size(); ++i) {
 		CachedRegion *r = _region_cache[i];
-		uint64_t time = now - r->last_opened;
-		if (time >= oldest_time) {
+		if (r->users > 0) {
+			continue;
+		}
+		uint64_t time = now - r->last_accessed;
+		if (oldest_index == -1 || time >= oldest_time) {
 			oldest_index = i;
+			oldest_time = time;
 		}
 	}
 
+	if (oldest_index == -1) {
+		return false;
+	}
+
 	CachedRegion *region = _region_cache[oldest_index];
 	_region_cache.erase(_region_cache.begin() + oldest_index);
 
 	close_region(region);
 	memdelete(region);
+	return true;
 }
 
 unsigned int VoxelStreamRegionFiles::get_block_index_in_header(const Vector3i &rpos) const {
@@ -935,7 +1269,7 @@ void VoxelStreamRegionFiles::_convert_files(Meta new_meta) {
 	for (unsigned int i = 0; i < old_region_list.size(); ++i) {
 		PositionAndLod region_info = old_region_list[i];
 
-		const CachedRegion *region = old_stream->open_region(region_info.position, region_info.lod, false);
+		CachedRegion *region = old_stream->open_region(region_info.position, region_info.lod, false);
 		if (region == nullptr) {
 			continue;
 		}
@@ -1011,6 +1345,8 @@ void VoxelStreamRegionFiles::_convert_files(Meta new_meta) {
 				}
 			}
 		}
+
+		old_stream->release_region(region);
 	}
 
 	close_all_regions();
@@ -1091,6 +1427,11 @@ void VoxelStreamRegionFiles::set_lod_count(int p_lod_count) {
 	emit_changed();
 }
 
+// Fallback streams which are not thread-safe are duplicated for each thread by VoxelStreamFile
+bool VoxelStreamRegionFiles::is_thread_safe() const {
+	return true;
+}
+
 void VoxelStreamRegionFiles::convert_files(Dictionary d) {
 
 	Meta meta;
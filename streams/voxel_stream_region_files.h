@@ -1,11 +1,16 @@
 #ifndef VOXEL_STREAM_REGION_H
 #define VOXEL_STREAM_REGION_H
 
+#include "../math/vector3i.h"
 #include "../util/fixed_array.h"
+#include "../voxel_constants.h"
 #include "file_utils.h"
 #include "voxel_stream_file.h"
+#include <core/hash_map.h>
 
 class FileAccess;
+class Mutex;
+class RWLock;
 
 // Loads and saves blocks to the filesystem, under a directory.
 // Blocks are saved in region files to minimize I/O.
@@ -14,6 +19,13 @@ class FileAccess;
 // because it allows to keep using the same file handles and avoid switching.
 // Inspired by https://www.seedofandromeda.com/blogs/1-creating-a-region-file-system-for-a-voxel-game
 //
+// The same instance can be used by multiple threads. Each region has its own lock,
+// so blocks of different regions are loaded and saved in parallel, and blocks of the same region can be loaded
+// in parallel too. Changing settings or converting files must not happen while blocks are streamed.
+//
+// On Linux, region files are also mapped in memory so blocks can be decompressed straight from them.
+// Writes still go through a file handle, after which the mapping is recreated if the file grew.
+//
 class VoxelStreamRegionFiles : public VoxelStreamFile {
 	GDCLASS(VoxelStreamRegionFiles, VoxelStreamFile)
 public:
@@ -45,6 +57,8 @@ public:
 
 	void convert_files(Dictionary d);
 
+	bool is_thread_safe() const override;
+
 protected:
 	static void _bind_methods();
 
@@ -60,6 +74,7 @@ private:
 
 	EmergeResult _emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod);
 	void _immerge_block(Ref<VoxelBuffer> voxel_buffer, Vector3i origin_in_voxels, int lod);
+	void _immerge_block_in_region(CachedRegion *cache, Vector3i block_rpos, const std::vector<uint8_t> &data);
 
 	VoxelFileResult save_meta();
 	VoxelFileResult load_meta();
@@ -68,6 +83,10 @@ private:
 	void close_all_regions();
 	String get_region_file_path(const Vector3i &region_pos, unsigned int lod) const;
 	CachedRegion *open_region(const Vector3i region_pos, unsigned int lod, bool create_if_not_found);
+	bool open_region_file(CachedRegion *cache, bool create_if_not_found);
+	void release_region(CachedRegion *region);
+	bool map_region_file(CachedRegion *region);
+	void prefetch_blocks(const Vector<VoxelBlockRequest> &sorted_blocks);
 	void close_region(CachedRegion *cache);
 	unsigned int get_block_index_in_header(const Vector3i &rpos) const;
 	Vector3i get_block_position_from_index(int i) const;
@@ -76,7 +95,7 @@ private:
 	CachedRegion *get_region_from_cache(const Vector3i pos, int lod) const;
 	void remove_sectors_from_block(CachedRegion *p_region, Vector3i block_rpos, unsigned int p_sector_count);
 	int get_sectors_count(const RegionHeader &header) const;
-	void close_oldest_region();
+	bool close_oldest_region();
 	void save_header(CachedRegion *p_region);
 	void pad_to_sector_size(FileAccess *f);
 
@@ -142,10 +161,18 @@ private:
 	};
 
 	struct CachedRegion {
+		CachedRegion();
+		~CachedRegion();
+
 		Vector3i position;
 		int lod = 0;
 		bool file_exists = false;
+		String file_path;
 		FileAccess *file_access = nullptr;
+		// Used for loading when available. Created by readers under the file mutex,
+		// destroyed by writers under the write lock.
+		VoxelFileMapping file_mapping;
+		bool file_mapping_failed = false;
 		RegionHeader header;
 		bool header_modified = false;
 
@@ -155,14 +182,34 @@ private:
 		std::vector<Vector3i> sectors;
 
 		uint64_t last_opened = 0;
-		//uint64_t last_accessed;
+		uint64_t last_accessed = 0;
+
+		// Locked for reading to load blocks, and for writing to save blocks.
+		// Protects the header, the list of sectors and writes to the file.
+		RWLock *rw_lock = nullptr;
+		// Loads share the same file handle, so seeking and reading must not interleave between threads
+		Mutex *file_mutex = nullptr;
+		// How many threads are using the region. It can't be closed until they are done.
+		// Protected by the region cache mutex.
+		unsigned int users = 0;
+		// Set while a thread opens the file, which holds the write lock meanwhile.
+		// Protected by the region cache mutex.
+		bool opening = false;
+		// The file could not be opened. The region is no longer cached, and the last user deletes it.
+		bool opening_failed = false;
 	};
 
 	String _directory_path;
 	Meta _meta;
 	bool _meta_loaded = false;
 	bool _meta_saved = false;
+	// Lazy loading and saving of the meta file
+	Mutex *_meta_mutex = nullptr;
 	std::vector<CachedRegion *> _region_cache;
+	// Regions found to have no file. Files are assumed to only be created by this stream.
+	FixedArray<HashMap<Vector3i, bool, Vector3iHasher>, VoxelConstants::MAX_LOD> _absent_regions;
+	// Protects the list of cached regions, absent regions, and closing regions
+	Mutex *_region_cache_mutex = nullptr;
 	// TODO Add memory caches to increase capacity.
 	unsigned int _max_open_regions = MIN(8, FOPEN_MAX);
 };
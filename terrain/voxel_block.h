@@ -20,7 +20,8 @@ public:
 		MESH_UP_TO_DATE,
 		MESH_NEED_UPDATE, // The mesh is out of date but was not yet scheduled for update
 		MESH_UPDATE_NOT_SENT, // The mesh is out of date and was scheduled for update, but no request have been sent yet
-		MESH_UPDATE_SENT // The mesh is out of date, and an update request was sent, pending response
+		MESH_UPDATE_SENT, // The mesh is out of date, and an update request was sent, pending response
+		MESH_UPDATE_SENT_WITH_DATA // An update request was sent along with loading the block, pending response
 	};
 
 	Ref<VoxelBuffer> voxels;
@@ -1173,6 +1173,10 @@ void VoxelLodTerrain::flush_pending_lod_edits() {
 
 	int half_bs = get_block_size() >> 1;
 
+	// Keeping the SDF value closest to the surface preserves thin features better than picking any of the voxels
+	VoxelBuffer::DownscaleFilters downscale_filters(VoxelBuffer::DOWNSCALE_NEAREST);
+	downscale_filters[VoxelBuffer::CHANNEL_SDF] = VoxelBuffer::DOWNSCALE_MIN_ABS;
+
 	// Process downscales upwards in pairs of consecutive LODs.
 	// This ensures we don't process multiple times the same blocks.
 	// Only LOD0 is editable at the moment, so we'll downscale from there
@@ -1212,8 +1216,8 @@ void VoxelLodTerrain::flush_pending_lod_edits() {
 			// TODO Try to narrow to edited region instead of taking whole block
 			{
 				RWLockWrite lock(src_block->voxels->get_lock());
-				src_block->voxels->downscale_to(
-						**dst_block->voxels, Vector3i(), src_block->voxels->get_size(), rel * half_bs);
+				src_block->voxels->downscale_to(**dst_block->voxels, Vector3i(), src_block->voxels->get_size(),
+						rel * half_bs, downscale_filters);
 			}
 		}
 
@@ -1285,7 +1289,7 @@ void VoxelLodTerrain::save_all_modified_blocks(bool with_copy) {
 	flush_pending_lod_edits();
 
 	for (int i = 0; i < _lod_count; ++i) {
-		// That may cause a stutter, so should be used when the player won't notice
+		// Copies share voxel data with the blocks until they get edited, so this is cheap even for large maps
 		_lods[i].map->for_all_blocks(ScheduleSaveAction{ _blocks_to_save, _shader_material_pool, with_copy });
 	}
 
@@ -5,6 +5,7 @@
 #include "voxel_block.h"
 
 #include <core/hash_map.h>
+#include <core/os/rw_lock.h>
 #include <scene/main/node.h>
 
 // Infinite voxel storage by means of octants like Gridmap, within a constant LOD.
@@ -56,6 +57,27 @@ public:
 	void set_default_voxel(int value, unsigned int channel = 0);
 	int get_default_voxel(unsigned int channel = 0);
 
+	// Calls `action(Vector3i pos, uint64_t value) -> uint64_t` on every voxel of the box, and stores what it returns.
+	// Each block is locked once, instead of once per voxel. Missing blocks get created, like set_voxel does.
+	template <typename F>
+	void read_write_action(Rect3i voxel_box, unsigned int channel_index, F action) {
+		for_each_block_in_box(voxel_box, [&action, channel_index](VoxelBuffer &voxels, Rect3i local_box, Vector3i origin) {
+			voxels.read_write_action(local_box, channel_index, [&action, origin](Vector3i pos, uint64_t v) {
+				return action(pos + origin, v);
+			});
+		});
+	}
+
+	// Same as read_write_action, with `action(Vector3i pos, real_t value) -> real_t`
+	template <typename F>
+	void read_write_action_f(Rect3i voxel_box, unsigned int channel_index, F action) {
+		for_each_block_in_box(voxel_box, [&action, channel_index](VoxelBuffer &voxels, Rect3i local_box, Vector3i origin) {
+			voxels.read_write_action_f(local_box, channel_index, [&action, origin](Vector3i pos, real_t v) {
+				return action(pos + origin, v);
+			});
+		});
+	}
+
 	// Gets a copy of all voxels in the area starting at min_pos having the same size as dst_buffer.
 	void get_buffer_copy(Vector3i min_pos, VoxelBuffer &dst_buffer, unsigned int channels_mask = 1);
 
@@ -111,6 +133,29 @@ private:
 
 	void set_block_size_pow2(unsigned int p);
 
+	template <typename F>
+	void for_each_block_in_box(const Rect3i voxel_box, F f) {
+		if (voxel_box.size.volume() <= 0) {
+			return;
+		}
+		const Vector3i min_bpos = voxel_to_block(voxel_box.pos);
+		const Vector3i max_bpos = voxel_to_block(voxel_box.pos + voxel_box.size - Vector3i(1)) + Vector3i(1);
+		const Rect3i block_rect = Rect3i(Vector3i(), Vector3i(_block_size));
+
+		Vector3i bpos;
+		for (bpos.z = min_bpos.z; bpos.z < max_bpos.z; ++bpos.z) {
+			for (bpos.x = min_bpos.x; bpos.x < max_bpos.x; ++bpos.x) {
+				for (bpos.y = min_bpos.y; bpos.y < max_bpos.y; ++bpos.y) {
+					const Vector3i origin = block_to_voxel(bpos);
+					VoxelBlock *block = get_or_create_block_at_voxel_pos(origin);
+					const Rect3i local_box = Rect3i(voxel_box.pos - origin, voxel_box.size).clipped(block_rect);
+					RWLockWrite lock(block->voxels->get_lock());
+					f(**block->voxels, local_box, origin);
+				}
+			}
+		}
+	}
+
 	static void _bind_methods();
 
 	int _b_get_voxel(int x, int y, int z, unsigned int c) { return get_voxel(Vector3i(x, y, z), c); }
@@ -14,6 +14,8 @@
 #include <core/engine.h>
 #include <scene/3d/mesh_instance.h>
 
+#include <algorithm>
+
 const uint32_t MAIN_THREAD_MESHING_BUDGET_MS = 8;
 
 VoxelTerrain::VoxelTerrain() {
@@ -411,7 +413,7 @@ void VoxelTerrain::immerge_block(Vector3i bpos) {
 }
 
 void VoxelTerrain::save_all_modified_blocks(bool with_copy) {
-	// That may cause a stutter, so should be used when the player won't notice
+	// Copies share voxel data with the blocks until they get edited, so this is cheap even for large maps
 	_map->for_all_blocks(ScheduleSaveAction{ _blocks_to_save, with_copy });
 	// And flush immediately
 	send_block_data_requests();
@@ -472,7 +474,8 @@ void VoxelTerrain::start_updater() {
 void VoxelTerrain::stop_updater() {
 	struct ResetMeshStateAction {
 		void operator()(VoxelBlock *block) {
-			if (block->get_mesh_state() == VoxelBlock::MESH_UPDATE_SENT) {
+			if (block->get_mesh_state() == VoxelBlock::MESH_UPDATE_SENT ||
+					block->get_mesh_state() == VoxelBlock::MESH_UPDATE_SENT_WITH_DATA) {
 				block->set_mesh_state(VoxelBlock::MESH_UPDATE_NOT_SENT);
 			}
 		}
@@ -743,10 +746,51 @@ void VoxelTerrain::send_block_data_requests() {
 	VOXEL_PROFILE_SCOPE();
 
 	// Blocks to load
-	for (size_t i = 0; i < _blocks_pending_load.size(); ++i) {
-		const Vector3i block_pos = _blocks_pending_load[i];
-		// TODO Batch request
-		VoxelServer::get_singleton()->request_block_load(_volume_id, block_pos, 0);
+	if (_blocks_pending_load.size() > 0) {
+		// Blocks whose neighbors will all be available once this batch is loaded can have their mesh requested now.
+		// The server will compute them as soon as loading is done, saving a round-trip through the main thread.
+		std::vector<Vector3i> sorted_pending_load = _blocks_pending_load;
+		std::sort(sorted_pending_load.begin(), sorted_pending_load.end());
+
+		std::vector<VoxelServer::BlockMeshInput> mesh_requests;
+
+		for (size_t i = 0; i < _blocks_pending_load.size(); ++i) {
+			const Vector3i block_pos = _blocks_pending_load[i];
+			LoadingBlock *loading_block = _loading_blocks.getptr(block_pos);
+			if (loading_block == nullptr) {
+				continue;
+			}
+			loading_block->mesh_sent_with_data = false;
+
+			if (loading_block->viewers.get(VoxelViewerRefCount::TYPE_MESH) == 0 &&
+					loading_block->viewers.get(VoxelViewerRefCount::TYPE_COLLISION) == 0) {
+				continue;
+			}
+
+			VoxelServer::BlockMeshInput mesh_request;
+			mesh_request.position = block_pos;
+			mesh_request.lod = 0;
+
+			bool surrounded = true;
+			for (unsigned int j = 0; j < Cube::MOORE_AREA_3D_COUNT; ++j) {
+				const Vector3i npos = block_pos + Cube::g_ordered_moore_area_3d[j];
+				const VoxelBlock *nblock = _map->get_block(npos);
+				if (nblock != nullptr) {
+					mesh_request.blocks[j] = nblock->voxels;
+				} else if (!std::binary_search(sorted_pending_load.begin(), sorted_pending_load.end(), npos)) {
+					// Not available yet, the mesh will be requested when this neighbor gets loaded
+					surrounded = false;
+					break;
+				}
+			}
+
+			if (surrounded) {
+				mesh_requests.push_back(mesh_request);
+				loading_block->mesh_sent_with_data = true;
+			}
+		}
+
+		VoxelServer::get_singleton()->request_block_loads(_volume_id, _blocks_pending_load, 0, mesh_requests);
 	}
 
 	// Blocks to save
@@ -970,6 +1014,9 @@ void VoxelTerrain::_process() {
 									  .format(varray(ob.lod, ob.position.x, ob.position.y, ob.position.z)));
 				++_stats.dropped_block_loads;
 
+				// The mesh that might have been requested with it will be dropped too
+				_loading_blocks.getptr(block_pos)->mesh_sent_with_data = false;
+
 				_blocks_pending_load.push_back(ob.position);
 				continue;
 			}
@@ -998,6 +1045,11 @@ void VoxelTerrain::_process() {
 			if (was_not_loaded) {
 				// Set viewers count that are currently expecting the block
 				block->viewers = loading_block.viewers;
+
+				if (loading_block.mesh_sent_with_data) {
+					// Its neighbors were available or loaded along with it, so the mesh will follow
+					block->set_mesh_state(VoxelBlock::MESH_UPDATE_SENT_WITH_DATA);
+				}
 			}
 
 			emit_block_loaded(block);
@@ -1019,9 +1071,11 @@ void VoxelTerrain::_process() {
 							// TODO What if the map is really composed of empty blocks?
 							if (_map->is_block_surrounded(npos)) {
 								VoxelBlock *nblock = _map->get_block(npos);
-								if (nblock == nullptr || nblock->get_mesh_state() == VoxelBlock::MESH_UPDATE_NOT_SENT) {
+								if (nblock == nullptr || nblock->get_mesh_state() == VoxelBlock::MESH_UPDATE_NOT_SENT ||
+										nblock->get_mesh_state() == VoxelBlock::MESH_UPDATE_SENT_WITH_DATA) {
 									// Assuming it is scheduled to be updated already.
 									// In case of BLOCK_UPDATE_SENT, we'll have to resend it.
+									// In case of MESH_UPDATE_SENT_WITH_DATA, this neighbor was part of the request.
 									continue;
 								}
 
@@ -1151,9 +1205,28 @@ void VoxelTerrain::_process() {
 				// TODO Not sure what to do in this case, the code sending update queries has to be tweaked
 				PRINT_VERBOSE("Received a block mesh drop while we were still expecting it");
 				++_stats.dropped_block_meshs;
+
+				if (block->get_mesh_state() == VoxelBlock::MESH_UPDATE_SENT ||
+						block->get_mesh_state() == VoxelBlock::MESH_UPDATE_SENT_WITH_DATA) {
+					// The request was cancelled, or a load it depended on was. Fallback on regular scheduling,
+					// which happens now if the block is surrounded, or when its last neighbor gets loaded.
+					// If the block was modified since, it is already scheduled again.
+					block->set_mesh_state(VoxelBlock::MESH_NEED_UPDATE);
+					if (_map->is_block_surrounded(ob.position)) {
+						try_schedule_block_update(block);
+					}
+				}
 				continue;
 			}
 
+			// Whether the request was sent by the main thread or chained with loading, the mesh is now up to date,
+			// unless the block was modified since, in which case another update is scheduled already.
+			// From now on, changes to neighbors must trigger updates as usual.
+			if (block->get_mesh_state() == VoxelBlock::MESH_UPDATE_SENT ||
+					block->get_mesh_state() == VoxelBlock::MESH_UPDATE_SENT_WITH_DATA) {
+				block->set_mesh_state(VoxelBlock::MESH_UP_TO_DATE);
+			}
+
 			Ref<ArrayMesh> mesh;
 			mesh.instance();
 
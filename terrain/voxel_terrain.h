@@ -142,6 +142,8 @@ private:
 
 	struct LoadingBlock {
 		VoxelViewerRefCount viewers;
+		// If true, the mesh was requested along with the data and will be computed without our intervention
+		bool mesh_sent_with_data = false;
 	};
 
 	HashMap<Vector3i, LoadingBlock, Vector3iHasher> _loading_blocks;
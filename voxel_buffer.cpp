@@ -5,6 +5,7 @@
 #endif
 
 #include "edition/voxel_tool_buffer.h"
+#include "util/profiling_clock.h"
 #include "voxel_buffer.h"
 
 #include <core/func_ref.h>
@@ -12,25 +13,74 @@
 #include <core/io/marshalls.h>
 #include <core/math/math_funcs.h>
 #include <string.h>
+#include <algorithm>
+#include <atomic>
 
 namespace {
 
+// Channel data can be shared by several buffers, and gets copied when one of them writes to it.
+// Allocations start with a reference count, padded so data stays aligned for 64-bit values.
+struct ChannelDataHeader {
+	std::atomic<uint32_t> refcount;
+};
+
+const uint32_t CHANNEL_DATA_HEADER_SIZE = 16;
+static_assert(sizeof(ChannelDataHeader) <= CHANNEL_DATA_HEADER_SIZE, "Channel data header doesn't fit");
+
+inline ChannelDataHeader &get_channel_data_header(uint8_t *data) {
+	return *reinterpret_cast<ChannelDataHeader *>(data - CHANNEL_DATA_HEADER_SIZE);
+}
+
+inline uint8_t *init_channel_data(uint8_t *block) {
+	ChannelDataHeader *header = memnew_placement(block, ChannelDataHeader);
+	header->refcount.store(1, std::memory_order_relaxed);
+	return block + CHANNEL_DATA_HEADER_SIZE;
+}
+
+// Returns true if the caller held the last reference
+inline bool unref_channel_data(uint8_t *data) {
+	return get_channel_data_header(data).refcount.fetch_sub(1, std::memory_order_acq_rel) == 1;
+}
+
+inline uint8_t *ref_channel_data(uint8_t *data) {
+	get_channel_data_header(data).refcount.fetch_add(1, std::memory_order_relaxed);
+	return data;
+}
+
+inline bool is_channel_data_shared(uint8_t *data) {
+	return get_channel_data_header(data).refcount.load(std::memory_order_acquire) > 1;
+}
+
 inline uint8_t *allocate_channel_data(uint32_t size) {
 #ifdef VOXEL_BUFFER_USE_MEMORY_POOL
-	return VoxelMemoryPool::get_singleton()->allocate(size);
+	return init_channel_data(VoxelMemoryPool::get_singleton()->allocate(size + CHANNEL_DATA_HEADER_SIZE));
 #else
-	return (uint8_t *)memalloc(size * sizeof(uint8_t));
+	return init_channel_data((uint8_t *)memalloc((size + CHANNEL_DATA_HEADER_SIZE) * sizeof(uint8_t)));
 #endif
 }
 
 inline void free_channel_data(uint8_t *data, uint32_t size) {
+	if (!unref_channel_data(data)) {
+		return;
+	}
 #ifdef VOXEL_BUFFER_USE_MEMORY_POOL
-	VoxelMemoryPool::get_singleton()->recycle(data, size);
+	VoxelMemoryPool::get_singleton()->recycle(data - CHANNEL_DATA_HEADER_SIZE, size + CHANNEL_DATA_HEADER_SIZE);
 #else
-	memfree(data);
+	memfree(data - CHANNEL_DATA_HEADER_SIZE);
 #endif
 }
 
+// Compressed channels have sizes depending on their contents, which the pool can't reuse well
+inline uint8_t *allocate_compressed_channel_data(uint32_t size) {
+	return init_channel_data((uint8_t *)memalloc((size + CHANNEL_DATA_HEADER_SIZE) * sizeof(uint8_t)));
+}
+
+inline void free_compressed_channel_data(uint8_t *data) {
+	if (unref_channel_data(data)) {
+		memfree(data - CHANNEL_DATA_HEADER_SIZE);
+	}
+}
+
 uint32_t g_depth_bit_counts[] = {
 	8, 16, 32, 64
 };
@@ -65,19 +115,13 @@ static_assert(sizeof(uint64_t) == sizeof(double), "uint64_t and double cannot be
 inline uint64_t real_to_raw_voxel(real_t value, VoxelBuffer::Depth depth) {
 	switch (depth) {
 		case VoxelBuffer::DEPTH_8_BIT:
-			return clamp(static_cast<int>(128.f * value + 128.f), 0, 0xff);
+			return VoxelBuffer::real_to_raw_8(value);
 		case VoxelBuffer::DEPTH_16_BIT:
-			return clamp(static_cast<int>(0x7fff * value + 0x7fff), 0, 0xffff);
-		case VoxelBuffer::DEPTH_32_BIT: {
-			MarshallFloat m;
-			m.f = value;
-			return m.i;
-		}
-		case VoxelBuffer::DEPTH_64_BIT: {
-			MarshallDouble m;
-			m.d = value;
-			return m.l;
-		}
+			return VoxelBuffer::real_to_raw_16(value);
+		case VoxelBuffer::DEPTH_32_BIT:
+			return VoxelBuffer::real_to_raw_32(value);
+		case VoxelBuffer::DEPTH_64_BIT:
+			return VoxelBuffer::real_to_raw_64(value);
 		default:
 			CRASH_NOW();
 			return 0;
@@ -85,28 +129,702 @@ inline uint64_t real_to_raw_voxel(real_t value, VoxelBuffer::Depth depth) {
 }
 
 inline real_t raw_voxel_to_real(uint64_t value, VoxelBuffer::Depth depth) {
-	// Depths below 32 are normalized between -1 and 1
 	switch (depth) {
 		case VoxelBuffer::DEPTH_8_BIT:
-			return (static_cast<real_t>(value) - 0x7f) / 0x7f;
+			return VoxelBuffer::raw_8_to_real(value);
 		case VoxelBuffer::DEPTH_16_BIT:
-			return (static_cast<real_t>(value) - 0x7fff) / 0x7fff;
-		case VoxelBuffer::DEPTH_32_BIT: {
-			MarshallFloat m;
-			m.i = value;
-			return m.f;
+			return VoxelBuffer::raw_16_to_real(value);
+		case VoxelBuffer::DEPTH_32_BIT:
+			return VoxelBuffer::raw_32_to_real(value);
+		case VoxelBuffer::DEPTH_64_BIT:
+			return VoxelBuffer::raw_64_to_real(value);
+		default:
+			CRASH_NOW();
+			return 0;
+	}
+}
+
+// RLE channels store runs of identical values along each Y column, which suits stratified terrain.
+// See `VoxelBuffer::get_channel_compressed_data` for the layout.
+struct RleLayout {
+	uint32_t column_count;
+	uint32_t run_count;
+	uint32_t values_offset;
+	uint32_t ends_offset;
+	uint32_t size_in_bytes;
+};
+
+inline RleLayout get_rle_layout(uint32_t column_count, uint32_t run_count, uint32_t value_size) {
+	RleLayout layout;
+	layout.column_count = column_count;
+	layout.run_count = run_count;
+	layout.ends_offset = (column_count + 1) * sizeof(uint32_t);
+	// Aligned so values of any depth can be read directly
+	layout.values_offset = (layout.ends_offset + run_count * sizeof(uint16_t) + 7) & ~7u;
+	layout.size_in_bytes = layout.values_offset + run_count * value_size;
+	return layout;
+}
+
+inline RleLayout read_rle_layout(const uint8_t *rle, uint32_t column_count, uint32_t value_size) {
+	const uint32_t *column_starts = reinterpret_cast<const uint32_t *>(rle);
+	return get_rle_layout(column_count, column_starts[column_count], value_size);
+}
+
+// Columns are contiguous in dense data, so they are encoded in the same order
+template <typename T>
+uint32_t count_rle_runs(const T *src, uint32_t column_count, uint32_t column_height) {
+	uint32_t run_count = 0;
+	for (uint32_t ci = 0; ci < column_count; ++ci) {
+		const T *column = src + ci * column_height;
+		++run_count;
+		for (uint32_t y = 1; y < column_height; ++y) {
+			if (column[y] != column[y - 1]) {
+				++run_count;
+			}
 		}
-		case VoxelBuffer::DEPTH_64_BIT: {
-			MarshallDouble m;
-			m.l = value;
-			return m.d;
+	}
+	return run_count;
+}
+
+inline uint32_t count_rle_runs(const uint8_t *data, VoxelBuffer::Depth depth,
+		uint32_t column_count, uint32_t column_height) {
+	switch (depth) {
+		case VoxelBuffer::DEPTH_8_BIT:
+			return count_rle_runs(data, column_count, column_height);
+		case VoxelBuffer::DEPTH_16_BIT:
+			return count_rle_runs(reinterpret_cast<const uint16_t *>(data), column_count, column_height);
+		case VoxelBuffer::DEPTH_32_BIT:
+			return count_rle_runs(reinterpret_cast<const uint32_t *>(data), column_count, column_height);
+		case VoxelBuffer::DEPTH_64_BIT:
+			return count_rle_runs(reinterpret_cast<const uint64_t *>(data), column_count, column_height);
+		default:
+			CRASH_NOW();
+			return 0;
+	}
+}
+
+template <typename T>
+void encode_rle(const T *src, uint8_t *dst, const RleLayout &layout, uint32_t column_height) {
+	uint32_t *column_starts = reinterpret_cast<uint32_t *>(dst);
+	T *values = reinterpret_cast<T *>(dst + layout.values_offset);
+	uint16_t *run_ends = reinterpret_cast<uint16_t *>(dst + layout.ends_offset);
+
+	uint32_t ri = 0;
+	for (uint32_t ci = 0; ci < layout.column_count; ++ci) {
+		const T *column = src + ci * column_height;
+		column_starts[ci] = ri;
+		T v = column[0];
+		for (uint32_t y = 1; y < column_height; ++y) {
+			if (column[y] != v) {
+				values[ri] = v;
+				run_ends[ri] = y;
+				++ri;
+				v = column[y];
+			}
+		}
+		values[ri] = v;
+		run_ends[ri] = column_height;
+		++ri;
+	}
+	column_starts[layout.column_count] = ri;
+	CRASH_COND(ri != layout.run_count);
+}
+
+template <typename T>
+inline T get_rle_voxel(const uint8_t *rle, const RleLayout &layout, uint32_t column, uint32_t y) {
+	const uint32_t *column_starts = reinterpret_cast<const uint32_t *>(rle);
+	const T *values = reinterpret_cast<const T *>(rle + layout.values_offset);
+	const uint16_t *run_ends = reinterpret_cast<const uint16_t *>(rle + layout.ends_offset);
+	// First run ending after y
+	const uint16_t *it = std::upper_bound(run_ends + column_starts[column], run_ends + column_starts[column + 1], y);
+	return values[it - run_ends];
+}
+
+// Writes voxels of a column from `y_begin` to `y_end` (exclusive) into `dst`
+template <typename T>
+void decode_rle_column(const uint8_t *rle, const RleLayout &layout, uint32_t column,
+		uint32_t y_begin, uint32_t y_end, T *dst) {
+
+	const uint32_t *column_starts = reinterpret_cast<const uint32_t *>(rle);
+	const T *values = reinterpret_cast<const T *>(rle + layout.values_offset);
+	const uint16_t *run_ends = reinterpret_cast<const uint16_t *>(rle + layout.ends_offset);
+
+	uint32_t y = y_begin;
+	for (uint32_t ri = column_starts[column]; ri < column_starts[column + 1] && y < y_end; ++ri) {
+		const uint32_t run_end = MIN(run_ends[ri], y_end);
+		const T v = values[ri];
+		for (; y < run_end; ++y) {
+			*dst = v;
+			++dst;
+		}
+	}
+}
+
+template <typename T>
+void decode_rle_area(const uint8_t *rle, Vector3i src_size, Vector3i src_min, Vector3i area_size,
+		uint8_t *p_dst, Vector3i dst_size, Vector3i dst_min) {
+
+	const RleLayout layout = read_rle_layout(rle, src_size.x * src_size.z, sizeof(T));
+	T *dst = reinterpret_cast<T *>(p_dst);
+
+	for (int z = 0; z < area_size.z; ++z) {
+		for (int x = 0; x < area_size.x; ++x) {
+			const uint32_t column = (x + src_min.x) + src_size.x * (z + src_min.z);
+			// Same as VoxelBuffer::index()
+			const uint32_t dst_ri = dst_min.y + dst_size.y * ((x + dst_min.x) + dst_size.x * (z + dst_min.z));
+			decode_rle_column(rle, layout, column, src_min.y, src_min.y + area_size.y, dst + dst_ri);
+		}
+	}
+}
+
+template <typename T>
+bool is_rle_uniform(const uint8_t *rle, uint32_t column_count) {
+	const RleLayout layout = read_rle_layout(rle, column_count, sizeof(T));
+	const T *values = reinterpret_cast<const T *>(rle + layout.values_offset);
+	for (uint32_t i = 1; i < layout.run_count; ++i) {
+		if (values[i] != values[0]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Checks data coming from outside, so reading it can't go out of bounds
+bool validate_rle(const uint8_t *rle, uint32_t size_in_bytes, uint32_t column_count, uint32_t column_height,
+		uint32_t value_size) {
+
+	const uint32_t header_size = (column_count + 1) * sizeof(uint32_t);
+	ERR_FAIL_COND_V(size_in_bytes < header_size, false);
+	const RleLayout layout = read_rle_layout(rle, column_count, value_size);
+	ERR_FAIL_COND_V(layout.run_count < column_count ||
+							static_cast<uint64_t>(layout.run_count) > static_cast<uint64_t>(column_count) * column_height,
+			false);
+	ERR_FAIL_COND_V(layout.size_in_bytes != size_in_bytes, false);
+
+	const uint32_t *column_starts = reinterpret_cast<const uint32_t *>(rle);
+	const uint16_t *run_ends = reinterpret_cast<const uint16_t *>(rle + layout.ends_offset);
+
+	ERR_FAIL_COND_V(column_starts[0] != 0, false);
+	for (uint32_t ci = 0; ci < column_count; ++ci) {
+		const uint32_t begin = column_starts[ci];
+		const uint32_t end = column_starts[ci + 1];
+		ERR_FAIL_COND_V(end <= begin || end > layout.run_count, false);
+		uint32_t prev_end = 0;
+		for (uint32_t ri = begin; ri < end; ++ri) {
+			ERR_FAIL_COND_V(run_ends[ri] <= prev_end, false);
+			prev_end = run_ends[ri];
+		}
+		ERR_FAIL_COND_V(prev_end != column_height, false);
+	}
+
+	return true;
+}
+
+// Palette channels store each distinct value once, and voxels as bit-packed indices into the palette.
+// See `VoxelBuffer::get_channel_compressed_data` for the layout.
+struct PaletteLayout {
+	uint32_t bits;
+	uint32_t capacity;
+	uint32_t values_offset;
+	uint32_t indices_offset;
+	uint32_t size_in_bytes;
+};
+
+static const uint32_t MAX_PALETTE_BITS = 8;
+static const uint32_t MAX_PALETTE_SIZE = 1 << MAX_PALETTE_BITS;
+
+inline PaletteLayout get_palette_layout(uint32_t bits, uint32_t volume, uint32_t value_size) {
+	PaletteLayout layout;
+	layout.bits = bits;
+	layout.capacity = 1 << bits;
+	// Header is 8 bytes, so values are aligned for any depth
+	layout.values_offset = 2 * sizeof(uint32_t);
+	layout.indices_offset = layout.values_offset + layout.capacity * value_size;
+	layout.size_in_bytes = layout.indices_offset + (volume * bits + 7) / 8;
+	return layout;
+}
+
+inline uint32_t get_palette_bits_for_size(uint32_t palette_size) {
+	uint32_t bits = 1;
+	while ((1u << bits) < palette_size) {
+		bits <<= 1;
+	}
+	return bits;
+}
+
+// Largest palette whose layout takes at most `size_in_bytes`, or 0 if none does
+inline uint32_t get_max_palette_size_for_bytes(uint32_t size_in_bytes, uint32_t volume, uint32_t value_size) {
+	for (uint32_t bits = MAX_PALETTE_BITS; bits != 0; bits >>= 1) {
+		if (get_palette_layout(bits, volume, value_size).size_in_bytes <= size_in_bytes) {
+			return 1 << bits;
+		}
+	}
+	return 0;
+}
+
+inline uint32_t get_palette_bits(const uint8_t *palette) {
+	return reinterpret_cast<const uint32_t *>(palette)[0];
+}
+
+inline uint32_t get_palette_size(const uint8_t *palette) {
+	return reinterpret_cast<const uint32_t *>(palette)[1];
+}
+
+inline void set_palette_header(uint8_t *palette, uint32_t bits, uint32_t palette_size) {
+	reinterpret_cast<uint32_t *>(palette)[0] = bits;
+	reinterpret_cast<uint32_t *>(palette)[1] = palette_size;
+}
+
+// Bit counts divide 8, so indices never straddle two bytes
+inline uint32_t get_palette_index(const uint8_t *indices, uint32_t bits, uint32_t i) {
+	const uint32_t bit = i * bits;
+	return (indices[bit >> 3] >> (bit & 7)) & ((1 << bits) - 1);
+}
+
+inline void set_palette_index(uint8_t *indices, uint32_t bits, uint32_t i, uint32_t palette_index) {
+	const uint32_t bit = i * bits;
+	const uint32_t mask = ((1 << bits) - 1) << (bit & 7);
+	uint8_t &b = indices[bit >> 3];
+	b = (b & ~mask) | (palette_index << (bit & 7));
+}
+
+inline uint64_t get_palette_value(const uint8_t *values, uint32_t value_size, uint32_t i) {
+	switch (value_size) {
+		case 1:
+			return values[i];
+		case 2:
+			return reinterpret_cast<const uint16_t *>(values)[i];
+		case 4:
+			return reinterpret_cast<const uint32_t *>(values)[i];
+		case 8:
+			return reinterpret_cast<const uint64_t *>(values)[i];
+		default:
+			CRASH_NOW();
+			return 0;
+	}
+}
+
+inline void set_palette_value(uint8_t *values, uint32_t value_size, uint32_t i, uint64_t v) {
+	switch (value_size) {
+		case 1:
+			values[i] = v;
+			break;
+		case 2:
+			reinterpret_cast<uint16_t *>(values)[i] = v;
+			break;
+		case 4:
+			reinterpret_cast<uint32_t *>(values)[i] = v;
+			break;
+		case 8:
+			reinterpret_cast<uint64_t *>(values)[i] = v;
+			break;
+		default:
+			CRASH_NOW();
+	}
+}
+
+// Returns false if there are more than `max_palette_size` values
+template <typename T>
+bool find_palette(const T *src, uint32_t volume, FixedArray<T, MAX_PALETTE_SIZE> &palette, uint32_t &palette_size,
+		uint32_t max_palette_size) {
+	palette_size = 0;
+	uint32_t last = 0;
+	for (uint32_t i = 0; i < volume; ++i) {
+		const T v = src[i];
+		// Neighbor voxels are often the same
+		if (palette_size != 0 && palette[last] == v) {
+			continue;
+		}
+		uint32_t pi = 0;
+		for (; pi < palette_size; ++pi) {
+			if (palette[pi] == v) {
+				break;
+			}
+		}
+		if (pi == palette_size) {
+			if (palette_size == max_palette_size) {
+				return false;
+			}
+			palette[palette_size] = v;
+			++palette_size;
 		}
+		last = pi;
+	}
+	return true;
+}
+
+template <typename T>
+void encode_palette(const T *src, uint32_t volume, const FixedArray<T, MAX_PALETTE_SIZE> &palette,
+		uint32_t palette_size, const PaletteLayout &layout, uint8_t *dst) {
+
+	set_palette_header(dst, layout.bits, palette_size);
+	T *values = reinterpret_cast<T *>(dst + layout.values_offset);
+	for (uint32_t pi = 0; pi < palette_size; ++pi) {
+		values[pi] = palette[pi];
+	}
+
+	uint8_t *indices = dst + layout.indices_offset;
+	memset(indices, 0, layout.size_in_bytes - layout.indices_offset);
+	uint32_t last = 0;
+	for (uint32_t i = 0; i < volume; ++i) {
+		const T v = src[i];
+		if (palette[last] != v) {
+			last = 0;
+			while (palette[last] != v) {
+				++last;
+			}
+		}
+		set_palette_index(indices, layout.bits, i, last);
+	}
+}
+
+template <typename T>
+void decode_palette_area(const uint8_t *palette, Vector3i src_size, Vector3i src_min, Vector3i area_size,
+		uint8_t *p_dst, Vector3i dst_size, Vector3i dst_min) {
+
+	const uint32_t bits = get_palette_bits(palette);
+	const PaletteLayout layout = get_palette_layout(bits, src_size.x * src_size.y * src_size.z, sizeof(T));
+	const T *values = reinterpret_cast<const T *>(palette + layout.values_offset);
+	const uint8_t *indices = palette + layout.indices_offset;
+	T *dst = reinterpret_cast<T *>(p_dst);
+
+	for (int z = 0; z < area_size.z; ++z) {
+		for (int x = 0; x < area_size.x; ++x) {
+			// Same as VoxelBuffer::index()
+			const uint32_t src_ri = src_min.y + src_size.y * ((x + src_min.x) + src_size.x * (z + src_min.z));
+			T *dst_row = dst + dst_min.y + dst_size.y * ((x + dst_min.x) + dst_size.x * (z + dst_min.z));
+			for (int y = 0; y < area_size.y; ++y) {
+				dst_row[y] = values[get_palette_index(indices, bits, src_ri + y)];
+			}
+		}
+	}
+}
+
+// Checks data coming from outside, so reading it can't go out of bounds
+bool validate_palette(const uint8_t *palette, uint32_t size_in_bytes, uint32_t volume, uint32_t value_size) {
+	ERR_FAIL_COND_V(size_in_bytes < 2 * sizeof(uint32_t), false);
+	const uint32_t bits = get_palette_bits(palette);
+	ERR_FAIL_COND_V(bits != 1 && bits != 2 && bits != 4 && bits != 8, false);
+	const PaletteLayout layout = get_palette_layout(bits, volume, value_size);
+	ERR_FAIL_COND_V(layout.size_in_bytes != size_in_bytes, false);
+	const uint32_t palette_size = get_palette_size(palette);
+	ERR_FAIL_COND_V(palette_size == 0 || palette_size > layout.capacity, false);
+
+	const uint8_t *indices = palette + layout.indices_offset;
+	for (uint32_t i = 0; i < volume; ++i) {
+		ERR_FAIL_COND_V(get_palette_index(indices, bits, i) >= palette_size, false);
+	}
+
+	return true;
+}
+
+// Sparse channels split voxels into bricks, ordered [z][x][y] like voxels, and ordered the same way inside bricks.
+// A brick either holds one value, or has a slot of dense voxels which gets allocated when it is written to.
+// Bricks on the positive edges can exceed the buffer, voxels outside of it are ignored.
+// Layout, in this order:
+// - uint32 slot_capacity: how many slots there is room for
+// - uint32 slot_count: how many slots are used
+// - uint64 brick_values[brick_count]: value of bricks without a slot
+// - uint32 brick_slots[brick_count]: slot of each brick, or SPARSE_NO_SLOT
+// - Padding up to 8 bytes alignment
+// - Slots of SPARSE_BRICK_VOLUME voxels, with the depth of the channel
+struct SparseLayout {
+	Vector3i brick_counts;
+	uint32_t brick_count;
+	uint32_t values_offset;
+	uint32_t slots_offset;
+	uint32_t bricks_offset;
+	uint32_t slot_size_in_bytes;
+	uint32_t size_in_bytes;
+};
+
+static const uint32_t SPARSE_BRICK_SIZE_PO2 = 3;
+static const uint32_t SPARSE_BRICK_SIZE = 1 << SPARSE_BRICK_SIZE_PO2;
+static const uint32_t SPARSE_BRICK_MASK = SPARSE_BRICK_SIZE - 1;
+static const uint32_t SPARSE_BRICK_VOLUME = SPARSE_BRICK_SIZE * SPARSE_BRICK_SIZE * SPARSE_BRICK_SIZE;
+static const uint32_t SPARSE_NO_SLOT = 0xffffffff;
+
+inline SparseLayout get_sparse_layout(Vector3i size, uint32_t slot_capacity, uint32_t value_size) {
+	SparseLayout layout;
+	layout.brick_counts = Vector3i(
+			(size.x + SPARSE_BRICK_MASK) >> SPARSE_BRICK_SIZE_PO2,
+			(size.y + SPARSE_BRICK_MASK) >> SPARSE_BRICK_SIZE_PO2,
+			(size.z + SPARSE_BRICK_MASK) >> SPARSE_BRICK_SIZE_PO2);
+	layout.brick_count = layout.brick_counts.volume();
+	layout.values_offset = 2 * sizeof(uint32_t);
+	layout.slots_offset = layout.values_offset + layout.brick_count * sizeof(uint64_t);
+	layout.bricks_offset = (layout.slots_offset + layout.brick_count * sizeof(uint32_t) + 7) & ~7;
+	layout.slot_size_in_bytes = SPARSE_BRICK_VOLUME * value_size;
+	layout.size_in_bytes = layout.bricks_offset + slot_capacity * layout.slot_size_in_bytes;
+	return layout;
+}
+
+inline uint32_t get_sparse_slot_capacity(const uint8_t *sparse) {
+	return reinterpret_cast<const uint32_t *>(sparse)[0];
+}
+
+inline uint32_t get_sparse_slot_count(const uint8_t *sparse) {
+	return reinterpret_cast<const uint32_t *>(sparse)[1];
+}
+
+inline void set_sparse_header(uint8_t *sparse, uint32_t slot_capacity, uint32_t slot_count) {
+	reinterpret_cast<uint32_t *>(sparse)[0] = slot_capacity;
+	reinterpret_cast<uint32_t *>(sparse)[1] = slot_count;
+}
+
+inline uint32_t get_sparse_brick_index(const SparseLayout &layout, unsigned int x, unsigned int y, unsigned int z) {
+	return (y >> SPARSE_BRICK_SIZE_PO2) +
+		   layout.brick_counts.y * ((x >> SPARSE_BRICK_SIZE_PO2) + layout.brick_counts.x * (z >> SPARSE_BRICK_SIZE_PO2));
+}
+
+inline uint32_t get_sparse_local_index(unsigned int x, unsigned int y, unsigned int z) {
+	return (y & SPARSE_BRICK_MASK) + SPARSE_BRICK_SIZE * ((x & SPARSE_BRICK_MASK) + SPARSE_BRICK_SIZE * (z & SPARSE_BRICK_MASK));
+}
+
+// Area of the buffer covered by a brick
+inline Rect3i get_sparse_brick_box(const SparseLayout &layout, uint32_t brick_index, Vector3i size) {
+	const uint32_t by = brick_index % layout.brick_counts.y;
+	const uint32_t bxz = brick_index / layout.brick_counts.y;
+	const Vector3i min = Vector3i(bxz % layout.brick_counts.x, by, bxz / layout.brick_counts.x) * SPARSE_BRICK_SIZE;
+	const Vector3i max = Vector3i(
+			MIN(min.x + (int)SPARSE_BRICK_SIZE, size.x),
+			MIN(min.y + (int)SPARSE_BRICK_SIZE, size.y),
+			MIN(min.z + (int)SPARSE_BRICK_SIZE, size.z));
+	return Rect3i::from_min_max(min, max);
+}
+
+template <typename T>
+void decode_sparse_area(const uint8_t *sparse, Vector3i src_size, Vector3i src_min, Vector3i area_size,
+		uint8_t *p_dst, Vector3i dst_size, Vector3i dst_min) {
+
+	const SparseLayout layout = get_sparse_layout(src_size, get_sparse_slot_capacity(sparse), sizeof(T));
+	const uint64_t *values = reinterpret_cast<const uint64_t *>(sparse + layout.values_offset);
+	const uint32_t *slots = reinterpret_cast<const uint32_t *>(sparse + layout.slots_offset);
+	const T *bricks = reinterpret_cast<const T *>(sparse + layout.bricks_offset);
+	T *dst = reinterpret_cast<T *>(p_dst);
+
+	for (int z = 0; z < area_size.z; ++z) {
+		const int sz = z + src_min.z;
+		for (int x = 0; x < area_size.x; ++x) {
+			const int sx = x + src_min.x;
+			// Same as VoxelBuffer::index()
+			T *dst_row = dst + dst_min.y + dst_size.y * ((x + dst_min.x) + dst_size.x * (z + dst_min.z));
+
+			// Rows cross bricks along Y
+			int y = 0;
+			while (y < area_size.y) {
+				const int sy = y + src_min.y;
+				const int count = MIN(static_cast<int>(SPARSE_BRICK_SIZE - (sy & SPARSE_BRICK_MASK)), area_size.y - y);
+				const uint32_t bi = get_sparse_brick_index(layout, sx, sy, sz);
+				const uint32_t slot = slots[bi];
+				if (slot == SPARSE_NO_SLOT) {
+					std::fill_n(dst_row + y, count, static_cast<T>(values[bi]));
+				} else {
+					memcpy(dst_row + y, bricks + slot * SPARSE_BRICK_VOLUME + get_sparse_local_index(sx, sy, sz),
+							count * sizeof(T));
+				}
+				y += count;
+			}
+		}
+	}
+}
+
+// Copies the part of a dense channel covered by a brick into a slot.
+// Returns false if all voxels of the brick are the same, in which case `out_value` is set instead.
+template <typename T>
+bool encode_sparse_brick(const T *src, Vector3i size, const Rect3i &box, T *slot, T &out_value) {
+	const Vector3i max = box.pos + box.size;
+	const T v0 = src[box.pos.y + size.y * (box.pos.x + size.x * box.pos.z)];
+	bool uniform = true;
+	for (int z = box.pos.z; z < max.z && uniform; ++z) {
+		for (int x = box.pos.x; x < max.x && uniform; ++x) {
+			const T *row = src + size.y * (x + size.x * z);
+			for (int y = box.pos.y; y < max.y; ++y) {
+				if (row[y] != v0) {
+					uniform = false;
+					break;
+				}
+			}
+		}
+	}
+	if (uniform) {
+		out_value = v0;
+		return false;
+	}
+	// Voxels outside of the buffer still get a defined value
+	std::fill_n(slot, SPARSE_BRICK_VOLUME, v0);
+	for (int z = box.pos.z; z < max.z; ++z) {
+		for (int x = box.pos.x; x < max.x; ++x) {
+			memcpy(slot + get_sparse_local_index(x, box.pos.y, z), src + box.pos.y + size.y * (x + size.x * z),
+					box.size.y * sizeof(T));
+		}
+	}
+	return true;
+}
+
+// Encodes a dense channel, using as many slots as there are bricks with different values.
+// `dst` must be big enough for one slot per brick, the actual size is returned.
+template <typename T>
+uint32_t encode_sparse(const T *src, Vector3i size, uint8_t *dst) {
+	const SparseLayout layout = get_sparse_layout(size, 0, sizeof(T));
+	uint64_t *values = reinterpret_cast<uint64_t *>(dst + layout.values_offset);
+	uint32_t *slots = reinterpret_cast<uint32_t *>(dst + layout.slots_offset);
+	T *bricks = reinterpret_cast<T *>(dst + layout.bricks_offset);
+
+	uint32_t slot_count = 0;
+	for (uint32_t bi = 0; bi < layout.brick_count; ++bi) {
+		const Rect3i box = get_sparse_brick_box(layout, bi, size);
+		T v;
+		if (encode_sparse_brick(src, size, box, bricks + slot_count * SPARSE_BRICK_VOLUME, v)) {
+			values[bi] = 0;
+			slots[bi] = slot_count;
+			++slot_count;
+		} else {
+			values[bi] = v;
+			slots[bi] = SPARSE_NO_SLOT;
+		}
+	}
+	set_sparse_header(dst, slot_count, slot_count);
+	return layout.bricks_offset + slot_count * layout.slot_size_in_bytes;
+}
+
+template <typename T>
+bool is_sparse_uniform(const uint8_t *sparse, Vector3i size) {
+	const SparseLayout layout = get_sparse_layout(size, get_sparse_slot_capacity(sparse), sizeof(T));
+	const uint64_t *values = reinterpret_cast<const uint64_t *>(sparse + layout.values_offset);
+	const uint32_t *slots = reinterpret_cast<const uint32_t *>(sparse + layout.slots_offset);
+	const T *bricks = reinterpret_cast<const T *>(sparse + layout.bricks_offset);
+
+	const T v0 = slots[0] == SPARSE_NO_SLOT ? static_cast<T>(values[0]) : bricks[slots[0] * SPARSE_BRICK_VOLUME];
+	for (uint32_t bi = 0; bi < layout.brick_count; ++bi) {
+		const uint32_t slot = slots[bi];
+		if (slot == SPARSE_NO_SLOT) {
+			if (values[bi] != v0) {
+				return false;
+			}
+			continue;
+		}
+		const Rect3i box = get_sparse_brick_box(layout, bi, size);
+		const Vector3i max = box.pos + box.size;
+		const T *brick = bricks + slot * SPARSE_BRICK_VOLUME;
+		for (int z = box.pos.z; z < max.z; ++z) {
+			for (int x = box.pos.x; x < max.x; ++x) {
+				for (int y = box.pos.y; y < max.y; ++y) {
+					if (brick[get_sparse_local_index(x, y, z)] != v0) {
+						return false;
+					}
+				}
+			}
+		}
+	}
+	return true;
+}
+
+// Reads one voxel from the data of a channel, whichever way it is stored.
+// Shared by buffers and snapshots of their channels.
+uint64_t get_channel_data_voxel(const uint8_t *data, VoxelBuffer::Compression compression, VoxelBuffer::Depth depth,
+		Vector3i size, int x, int y, int z) {
+
+	if (compression == VoxelBuffer::COMPRESSION_RLE) {
+		const uint32_t column_count = size.x * size.z;
+		const uint32_t column = x + size.x * z;
+
+		switch (depth) {
+			case VoxelBuffer::DEPTH_8_BIT:
+				return get_rle_voxel<uint8_t>(data, read_rle_layout(data, column_count, sizeof(uint8_t)), column, y);
+			case VoxelBuffer::DEPTH_16_BIT:
+				return get_rle_voxel<uint16_t>(data, read_rle_layout(data, column_count, sizeof(uint16_t)), column, y);
+			case VoxelBuffer::DEPTH_32_BIT:
+				return get_rle_voxel<uint32_t>(data, read_rle_layout(data, column_count, sizeof(uint32_t)), column, y);
+			case VoxelBuffer::DEPTH_64_BIT:
+				return get_rle_voxel<uint64_t>(data, read_rle_layout(data, column_count, sizeof(uint64_t)), column, y);
+			default:
+				CRASH_NOW();
+				return 0;
+		}
+	}
+
+	// Same layout as VoxelBuffer
+	const uint32_t i = y + size.y * (x + size.x * z);
+
+	if (compression == VoxelBuffer::COMPRESSION_PALETTE) {
+		const uint32_t bits = get_palette_bits(data);
+		const uint32_t value_size = get_depth_bit_count(depth) / 8;
+		const PaletteLayout layout = get_palette_layout(bits, size.x * size.y * size.z, value_size);
+		const uint32_t pi = get_palette_index(data + layout.indices_offset, bits, i);
+		return get_palette_value(data + layout.values_offset, value_size, pi);
+	}
+
+	if (compression == VoxelBuffer::COMPRESSION_SPARSE) {
+		const uint32_t value_size = get_depth_bit_count(depth) / 8;
+		const SparseLayout layout = get_sparse_layout(size, get_sparse_slot_capacity(data), value_size);
+		const uint32_t bi = get_sparse_brick_index(layout, x, y, z);
+		const uint32_t slot = reinterpret_cast<const uint32_t *>(data + layout.slots_offset)[bi];
+		if (slot == SPARSE_NO_SLOT) {
+			return reinterpret_cast<const uint64_t *>(data + layout.values_offset)[bi];
+		}
+		return get_palette_value(data + layout.bricks_offset + slot * layout.slot_size_in_bytes,
+				value_size, get_sparse_local_index(x, y, z));
+	}
+
+	switch (depth) {
+		case VoxelBuffer::DEPTH_8_BIT:
+			return data[i];
+		case VoxelBuffer::DEPTH_16_BIT:
+			return reinterpret_cast<const uint16_t *>(data)[i];
+		case VoxelBuffer::DEPTH_32_BIT:
+			return reinterpret_cast<const uint32_t *>(data)[i];
+		case VoxelBuffer::DEPTH_64_BIT:
+			return reinterpret_cast<const uint64_t *>(data)[i];
 		default:
 			CRASH_NOW();
 			return 0;
 	}
 }
 
+// Expands an area of compressed channel data into dense voxels
+template <typename T>
+void decode_area(const uint8_t *data, VoxelBuffer::Compression compression, Vector3i src_size, Vector3i src_min,
+		Vector3i area_size, uint8_t *dst, Vector3i dst_size, Vector3i dst_min) {
+
+	switch (compression) {
+		case VoxelBuffer::COMPRESSION_RLE:
+			decode_rle_area<T>(data, src_size, src_min, area_size, dst, dst_size, dst_min);
+			break;
+		case VoxelBuffer::COMPRESSION_PALETTE:
+			decode_palette_area<T>(data, src_size, src_min, area_size, dst, dst_size, dst_min);
+			break;
+		case VoxelBuffer::COMPRESSION_SPARSE:
+			decode_sparse_area<T>(data, src_size, src_min, area_size, dst, dst_size, dst_min);
+			break;
+		default:
+			CRASH_NOW();
+			break;
+	}
+}
+
+void decode_channel_data_area(const uint8_t *data, VoxelBuffer::Compression compression, VoxelBuffer::Depth depth,
+		Vector3i src_size, Vector3i src_min, Vector3i area_size, uint8_t *dst, Vector3i dst_size, Vector3i dst_min) {
+
+	switch (depth) {
+		case VoxelBuffer::DEPTH_8_BIT:
+			decode_area<uint8_t>(data, compression, src_size, src_min, area_size, dst, dst_size, dst_min);
+			break;
+		case VoxelBuffer::DEPTH_16_BIT:
+			decode_area<uint16_t>(data, compression, src_size, src_min, area_size, dst, dst_size, dst_min);
+			break;
+		case VoxelBuffer::DEPTH_32_BIT:
+			decode_area<uint32_t>(data, compression, src_size, src_min, area_size, dst, dst_size, dst_min);
+			break;
+		case VoxelBuffer::DEPTH_64_BIT:
+			decode_area<uint64_t>(data, compression, src_size, src_min, area_size, dst, dst_size, dst_min);
+			break;
+		default:
+			CRASH_NOW();
+			break;
+	}
+}
+
 } // namespace
 
 const char *VoxelBuffer::CHANNEL_ID_HINT_STRING = "Type,Sdf,Data2,Data3,Data4,Data5,Data6,Data7";
@@ -134,7 +852,9 @@ void VoxelBuffer::create(unsigned int sx, unsigned int sy, unsigned int sz) {
 			if (channel.data) {
 				// Channel already contained data
 				delete_channel(i);
-				create_channel(i, new_size, channel.defval);
+				if (!channel.sparse) {
+					create_channel(i, new_size, channel.defval);
+				}
 			}
 		}
 		_size = new_size;
@@ -182,32 +902,11 @@ uint64_t VoxelBuffer::get_voxel(int x, int y, int z, unsigned int channel_index)
 	const Channel &channel = _channels[channel_index];
 
 	if (is_position_valid(x, y, z) && channel.data) {
-		uint32_t i = index(x, y, z);
-
-		switch (channel.depth) {
-			case DEPTH_8_BIT:
-				return channel.data[i];
-
-			case DEPTH_16_BIT:
-				return ((uint16_t *)channel.data)[i];
-
-			case DEPTH_32_BIT:
-				return ((uint32_t *)channel.data)[i];
-
-			case DEPTH_64_BIT:
-				return ((uint64_t *)channel.data)[i];
-
-			default:
-				CRASH_NOW();
-				return 0;
-		}
-
-		return channel.data[index(x, y, z)];
-
-	} else {
-		return channel.defval;
-	}
-}
+		return get_channel_data_voxel(channel.data, channel.compression, channel.depth, _size, x, y, z);
+	} else {
+		return channel.defval;
+	}
+}
 
 void VoxelBuffer::set_voxel(uint64_t value, int x, int y, int z, unsigned int channel_index) {
 	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
@@ -216,41 +915,63 @@ void VoxelBuffer::set_voxel(uint64_t value, int x, int y, int z, unsigned int ch
 	Channel &channel = _channels[channel_index];
 
 	value = clamp_value_for_depth(value, channel.depth);
-	bool do_set = true;
+
+	if (channel.compression == COMPRESSION_RLE) {
+		if (get_voxel(x, y, z, channel_index) == value) {
+			return;
+		}
+		// Edits tend to come in batches, so the channel stays dense until compressed again
+		decompress_channel(channel_index);
+
+	} else if (channel.compression == COMPRESSION_PALETTE) {
+		if (set_voxel_palette(channel_index, index(x, y, z), value)) {
+			return;
+		}
+		// Too many different values for a palette
+		decompress_channel(channel_index);
+	}
 
 	if (channel.data == nullptr) {
-		if (channel.defval != value) {
+		if (channel.defval == value) {
+			return;
+		}
+		if (channel.sparse) {
+			create_channel_sparse(channel_index);
+		} else {
 			// Allocate channel with same initial values as defval
 			create_channel(channel_index, _size, channel.defval);
-		} else {
-			do_set = false;
 		}
 	}
 
-	if (do_set) {
-		uint32_t i = index(x, y, z);
+	if (channel.compression == COMPRESSION_SPARSE) {
+		set_voxel_sparse(channel_index, x, y, z, value);
+		return;
+	}
 
-		switch (channel.depth) {
-			case DEPTH_8_BIT:
-				channel.data[i] = value;
-				break;
+	unshare_channel(channel_index);
+	channel.known_non_uniform = false;
+	uint32_t i = index(x, y, z);
 
-			case DEPTH_16_BIT:
-				((uint16_t *)channel.data)[i] = value;
-				break;
+	switch (channel.depth) {
+		case DEPTH_8_BIT:
+			channel.data[i] = value;
+			break;
 
-			case DEPTH_32_BIT:
-				((uint32_t *)channel.data)[i] = value;
-				break;
+		case DEPTH_16_BIT:
+			((uint16_t *)channel.data)[i] = value;
+			break;
 
-			case DEPTH_64_BIT:
-				((uint64_t *)channel.data)[i] = value;
-				break;
+		case DEPTH_32_BIT:
+			((uint32_t *)channel.data)[i] = value;
+			break;
 
-			default:
-				CRASH_NOW();
-				break;
-		}
+		case DEPTH_64_BIT:
+			((uint64_t *)channel.data)[i] = value;
+			break;
+
+		default:
+			CRASH_NOW();
+			break;
 	}
 }
 
@@ -283,6 +1004,15 @@ void VoxelBuffer::fill(uint64_t defval, unsigned int channel_index) {
 		}
 	}
 
+	if (channel.compression != COMPRESSION_NONE) {
+		// The whole channel gets the same value
+		delete_channel(channel_index);
+		channel.defval = defval;
+		return;
+	}
+
+	unshare_channel(channel_index);
+	channel.known_non_uniform = false;
 	unsigned int volume = get_volume();
 
 	switch (channel.depth) {
@@ -330,13 +1060,28 @@ void VoxelBuffer::fill_area(uint64_t defval, Vector3i min, Vector3i max, unsigne
 	Channel &channel = _channels[channel_index];
 	defval = clamp_value_for_depth(defval, channel.depth);
 
+	if (is_channel_written_sparse(channel_index)) {
+		if (channel.data == nullptr) {
+			if (channel.defval == defval) {
+				return;
+			}
+			create_channel_sparse(channel_index);
+		}
+		fill_area_sparse(channel_index, min, max, defval);
+		return;
+	}
+
 	if (channel.data == nullptr) {
 		if (channel.defval == defval) {
 			return;
 		} else {
 			create_channel(channel_index, _size, channel.defval);
 		}
+	} else if (channel.compression != COMPRESSION_NONE) {
+		decompress_channel(channel_index);
 	}
+	unshare_channel(channel_index);
+	channel.known_non_uniform = false;
 
 	Vector3i pos;
 	unsigned int volume = get_volume();
@@ -382,16 +1127,162 @@ void VoxelBuffer::fill_f(real_t value, unsigned int channel) {
 	fill(real_to_raw_voxel(value, _channels[channel].depth), channel);
 }
 
+namespace {
+
+// Conversions are done row by row in simple loops, so the compiler can vectorize them
+
+template <typename T, typename Convert_F>
+void set_voxels_f_t(T *data, Vector3i data_size, Rect3i box, const real_t *src, real_t scale, Convert_F convert) {
+	Vector3i pos;
+	const Vector3i end = box.pos + box.size;
+	for (pos.z = box.pos.z; pos.z < end.z; ++pos.z) {
+		for (pos.x = box.pos.x; pos.x < end.x; ++pos.x) {
+			T *row = data + box.pos.y + data_size.y * (pos.x + data_size.x * pos.z);
+			for (int y = 0; y < box.size.y; ++y) {
+				row[y] = convert(src[y] * scale);
+			}
+			src += box.size.y;
+		}
+	}
+}
+
+template <typename T, typename Convert_F>
+void get_voxels_f_t(const T *data, Vector3i data_size, Rect3i box, real_t *dst, real_t scale, Convert_F convert) {
+	const real_t inv_scale = 1.f / scale;
+	Vector3i pos;
+	const Vector3i end = box.pos + box.size;
+	for (pos.z = box.pos.z; pos.z < end.z; ++pos.z) {
+		for (pos.x = box.pos.x; pos.x < end.x; ++pos.x) {
+			const T *row = data + box.pos.y + data_size.y * (pos.x + data_size.x * pos.z);
+			for (int y = 0; y < box.size.y; ++y) {
+				dst[y] = convert(row[y]) * inv_scale;
+			}
+			dst += box.size.y;
+		}
+	}
+}
+
+} // namespace
+
+void VoxelBuffer::set_voxels_f(Rect3i box, unsigned int channel_index, ArraySlice<const real_t> values, real_t scale) {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	ERR_FAIL_COND(!is_box_valid(box));
+	ERR_FAIL_COND(values.size() != static_cast<size_t>(box.size.volume()));
+	ERR_FAIL_COND(scale == 0.f);
+
+	if (is_channel_written_sparse(channel_index)) {
+		// Keeps untouched bricks uniform
+		const real_t *src = values.data();
+		Vector3i pos;
+		const Vector3i end = box.pos + box.size;
+		for (pos.z = box.pos.z; pos.z < end.z; ++pos.z) {
+			for (pos.x = box.pos.x; pos.x < end.x; ++pos.x) {
+				for (pos.y = box.pos.y; pos.y < end.y; ++pos.y) {
+					set_voxel_f(*src++ * scale, pos.x, pos.y, pos.z, channel_index);
+				}
+			}
+		}
+		return;
+	}
+
+	if (!prepare_read_write_action(box, channel_index)) {
+		return;
+	}
+
+	Channel &channel = _channels[channel_index];
+	const real_t *src = values.data();
+
+	switch (channel.depth) {
+		case DEPTH_8_BIT:
+			set_voxels_f_t(channel.data, _size, box, src, scale, [](real_t v) { return real_to_raw_8(v); });
+			break;
+		case DEPTH_16_BIT:
+			set_voxels_f_t((uint16_t *)channel.data, _size, box, src, scale, [](real_t v) { return real_to_raw_16(v); });
+			break;
+		case DEPTH_32_BIT:
+			set_voxels_f_t((uint32_t *)channel.data, _size, box, src, scale, [](real_t v) { return real_to_raw_32(v); });
+			break;
+		case DEPTH_64_BIT:
+			set_voxels_f_t((uint64_t *)channel.data, _size, box, src, scale, [](real_t v) { return real_to_raw_64(v); });
+			break;
+		default:
+			CRASH_NOW();
+	}
+}
+
+void VoxelBuffer::get_voxels_f(Rect3i box, unsigned int channel_index, ArraySlice<real_t> out_values, real_t scale) const {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	ERR_FAIL_COND(!is_box_valid(box));
+	ERR_FAIL_COND(out_values.size() != static_cast<size_t>(box.size.volume()));
+	ERR_FAIL_COND(scale == 0.f);
+
+	const Channel &channel = _channels[channel_index];
+	real_t *dst = out_values.data();
+
+	if (channel.data == nullptr) {
+		const real_t v = raw_voxel_to_real(channel.defval, channel.depth) / scale;
+		for (size_t i = 0; i < out_values.size(); ++i) {
+			dst[i] = v;
+		}
+		return;
+	}
+
+	if (channel.compression != COMPRESSION_NONE) {
+		// Not worth specializing
+		Vector3i pos;
+		const Vector3i end = box.pos + box.size;
+		for (pos.z = box.pos.z; pos.z < end.z; ++pos.z) {
+			for (pos.x = box.pos.x; pos.x < end.x; ++pos.x) {
+				for (pos.y = box.pos.y; pos.y < end.y; ++pos.y) {
+					*dst++ = get_voxel_f(pos.x, pos.y, pos.z, channel_index) / scale;
+				}
+			}
+		}
+		return;
+	}
+
+	switch (channel.depth) {
+		case DEPTH_8_BIT:
+			get_voxels_f_t(channel.data, _size, box, dst, scale, [](uint8_t v) { return raw_8_to_real(v); });
+			break;
+		case DEPTH_16_BIT:
+			get_voxels_f_t((const uint16_t *)channel.data, _size, box, dst, scale, [](uint16_t v) { return raw_16_to_real(v); });
+			break;
+		case DEPTH_32_BIT:
+			get_voxels_f_t((const uint32_t *)channel.data, _size, box, dst, scale, [](uint32_t v) { return raw_32_to_real(v); });
+			break;
+		case DEPTH_64_BIT:
+			get_voxels_f_t((const uint64_t *)channel.data, _size, box, dst, scale, [](uint64_t v) { return raw_64_to_real(v); });
+			break;
+		default:
+			CRASH_NOW();
+	}
+}
+
 template <typename T>
 inline bool is_uniform(const uint8_t *p_data, uint32_t size) {
 	const T *data = (const T *)p_data;
-	T v0 = data[0];
-	for (unsigned int i = 1; i < size; ++i) {
+	const T v0 = data[0];
+
+	// If the first chunk is uniform and every voxel equals the one a chunk further, all voxels are the same.
+	// That second part is a single memcmp, which is vectorized by the C library.
+	const uint32_t chunk_size = 64 / sizeof(T);
+
+	if (size <= 2 * chunk_size) {
+		for (uint32_t i = 1; i < size; ++i) {
+			if (data[i] != v0) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	for (uint32_t i = 1; i < chunk_size; ++i) {
 		if (data[i] != v0) {
 			return false;
 		}
 	}
-	return true;
+	return memcmp(p_data, p_data + chunk_size * sizeof(T), (size - chunk_size) * sizeof(T)) == 0;
 }
 
 bool VoxelBuffer::is_uniform(unsigned int channel_index) const {
@@ -402,6 +1293,57 @@ bool VoxelBuffer::is_uniform(unsigned int channel_index) const {
 		// Channel has been optimized
 		return true;
 	}
+	if (channel.known_non_uniform) {
+		// Not modified since the last scan
+		return false;
+	}
+
+	if (channel.compression == COMPRESSION_RLE) {
+		const uint32_t column_count = _size.x * _size.z;
+		switch (channel.depth) {
+			case DEPTH_8_BIT:
+				return is_rle_uniform<uint8_t>(channel.data, column_count);
+			case DEPTH_16_BIT:
+				return is_rle_uniform<uint16_t>(channel.data, column_count);
+			case DEPTH_32_BIT:
+				return is_rle_uniform<uint32_t>(channel.data, column_count);
+			case DEPTH_64_BIT:
+				return is_rle_uniform<uint64_t>(channel.data, column_count);
+			default:
+				CRASH_NOW();
+				break;
+		}
+	}
+
+	if (channel.compression == COMPRESSION_PALETTE) {
+		// Palette values are unique, so comparing indices is enough
+		const uint32_t bits = get_palette_bits(channel.data);
+		const PaletteLayout layout = get_palette_layout(bits, get_volume(), ::get_depth_bit_count(channel.depth) / 8);
+		const uint8_t *indices = channel.data + layout.indices_offset;
+		const uint32_t pi0 = get_palette_index(indices, bits, 0);
+		for (uint32_t i = 1; i < get_volume(); ++i) {
+			if (get_palette_index(indices, bits, i) != pi0) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	if (channel.compression == COMPRESSION_SPARSE) {
+		switch (channel.depth) {
+			case DEPTH_8_BIT:
+				return is_sparse_uniform<uint8_t>(channel.data, _size);
+			case DEPTH_16_BIT:
+				return is_sparse_uniform<uint16_t>(channel.data, _size);
+			case DEPTH_32_BIT:
+				return is_sparse_uniform<uint32_t>(channel.data, _size);
+			case DEPTH_64_BIT:
+				return is_sparse_uniform<uint64_t>(channel.data, _size);
+			default:
+				CRASH_NOW();
+				break;
+		}
+	}
 
 	unsigned int volume = get_volume();
 
@@ -425,79 +1367,629 @@ bool VoxelBuffer::is_uniform(unsigned int channel_index) const {
 
 void VoxelBuffer::compress_uniform_channels() {
 	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
-		if (_channels[i].data && is_uniform(i)) {
-			clear_channel(i, _channels[i].data[0]);
+		Channel &channel = _channels[i];
+		if (channel.data == nullptr || channel.known_non_uniform) {
+			continue;
+		}
+		if (is_uniform(i)) {
+			clear_channel(i, get_voxel(0, 0, 0, i));
+		} else {
+			channel.known_non_uniform = true;
 		}
 	}
 }
 
-void VoxelBuffer::decompress_channel(unsigned int channel_index) {
-	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
-	Channel &channel = _channels[channel_index];
-	if (channel.data == nullptr) {
-		create_channel(channel_index, _size, channel.defval);
+void VoxelBuffer::compress_channels() {
+	if (get_volume() == 0) {
+		return;
 	}
-}
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		Channel &channel = _channels[i];
+		if (channel.compression != COMPRESSION_NONE) {
+			continue;
+		}
+		if (is_uniform(i)) {
+			clear_channel(i, get_voxel(0, 0, 0, i));
+			continue;
+		}
+		channel.known_non_uniform = true;
 
-VoxelBuffer::Compression VoxelBuffer::get_channel_compression(unsigned int channel_index) const {
-	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, VoxelBuffer::COMPRESSION_NONE);
-	const Channel &channel = _channels[channel_index];
-	if (channel.data == nullptr) {
-		return COMPRESSION_UNIFORM;
-	}
-	return COMPRESSION_NONE;
-}
+		if (channel.sparse) {
+			compress_channel_sparse(i);
+			continue;
+		}
 
-void VoxelBuffer::copy_from(const VoxelBuffer &other) {
-	// Copy all channels, assuming sizes and formats match
-	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
-		copy_from(other, i);
+		// Reads are slower than with dense data, so it's only worth it if it saves a good amount
+		const uint32_t max_size_in_bytes = channel.size_in_bytes - channel.size_in_bytes / 4;
+		const uint32_t rle_size_in_bytes = get_rle_size_in_bytes(i);
+		// The palette search stops early when it can't beat RLE, which is cheaper to measure
+		const uint32_t palette_size_in_bytes = get_palette_size_in_bytes(i, MIN(rle_size_in_bytes, max_size_in_bytes));
+
+		if (palette_size_in_bytes <= rle_size_in_bytes && palette_size_in_bytes <= max_size_in_bytes) {
+			compress_channel_palette(i);
+		} else if (rle_size_in_bytes <= max_size_in_bytes) {
+			compress_channel_rle(i);
+		}
 	}
 }
 
-void VoxelBuffer::copy_from(const VoxelBuffer &other, unsigned int channel_index) {
-	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
-	ERR_FAIL_COND(other._size != _size);
+uint32_t VoxelBuffer::get_rle_size_in_bytes(unsigned int channel_index) const {
+	const Channel &channel = _channels[channel_index];
+	CRASH_COND(channel.compression != COMPRESSION_NONE);
 
-	Channel &channel = _channels[channel_index];
-	const Channel &other_channel = other._channels[channel_index];
+	const uint32_t column_count = _size.x * _size.z;
+	const uint32_t column_height = _size.y;
+	const uint32_t value_size = ::get_depth_bit_count(channel.depth) / 8;
 
-	ERR_FAIL_COND(other_channel.depth != channel.depth);
+	const uint32_t run_count = count_rle_runs(channel.data, channel.depth, column_count, column_height);
+	return get_rle_layout(column_count, run_count, value_size).size_in_bytes;
+}
 
-	if (other_channel.data != nullptr) {
-		if (channel.data == nullptr) {
-			create_channel_noinit(channel_index, _size);
-		}
-		CRASH_COND(channel.size_in_bytes != other_channel.size_in_bytes);
-		memcpy(channel.data, other_channel.data, channel.size_in_bytes);
+void VoxelBuffer::compress_channel_rle(unsigned int channel_index) {
+	Channel &channel = _channels[channel_index];
+	CRASH_COND(channel.compression != COMPRESSION_NONE);
 
-	} else if (channel.data != nullptr) {
-		delete_channel(channel_index);
-	}
+	const uint32_t column_count = _size.x * _size.z;
+	const uint32_t column_height = _size.y;
+	const uint32_t value_size = ::get_depth_bit_count(channel.depth) / 8;
 
-	channel.defval = other_channel.defval;
-	channel.depth = other_channel.depth;
-}
+	const uint32_t run_count = count_rle_runs(channel.data, channel.depth, column_count, column_height);
+	const RleLayout layout = get_rle_layout(column_count, run_count, value_size);
 
-void VoxelBuffer::copy_from(const VoxelBuffer &other, Vector3i src_min, Vector3i src_max, Vector3i dst_min, unsigned int channel_index) {
-	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	uint8_t *rle = allocate_compressed_channel_data(layout.size_in_bytes);
 
-	Channel &channel = _channels[channel_index];
-	const Channel &other_channel = other._channels[channel_index];
+	switch (channel.depth) {
+		case DEPTH_8_BIT:
+			encode_rle(channel.data, rle, layout, column_height);
+			break;
+		case DEPTH_16_BIT:
+			encode_rle((const uint16_t *)channel.data, rle, layout, column_height);
+			break;
+		case DEPTH_32_BIT:
+			encode_rle((const uint32_t *)channel.data, rle, layout, column_height);
+			break;
+		case DEPTH_64_BIT:
+			encode_rle((const uint64_t *)channel.data, rle, layout, column_height);
+			break;
+		default:
+			CRASH_NOW();
+	}
 
-	ERR_FAIL_COND(other_channel.depth != channel.depth);
+	const bool known_non_uniform = channel.known_non_uniform;
+	delete_channel(channel_index);
+	channel.data = rle;
+	channel.size_in_bytes = layout.size_in_bytes;
+	channel.compression = COMPRESSION_RLE;
+	channel.known_non_uniform = known_non_uniform;
+}
 
-	if (channel.data == nullptr && other_channel.data == nullptr && channel.defval == other_channel.defval) {
-		// No action needed
-		return;
+template <typename T>
+static uint32_t get_palette_size_in_bytes_t(const uint8_t *data, uint32_t volume, uint32_t max_size_in_bytes) {
+	const uint32_t max_palette_size = get_max_palette_size_for_bytes(max_size_in_bytes, volume, sizeof(T));
+	if (max_palette_size == 0) {
+		return 0xffffffff;
 	}
+	FixedArray<T, MAX_PALETTE_SIZE> palette;
+	uint32_t palette_size;
+	if (!find_palette(reinterpret_cast<const T *>(data), volume, palette, palette_size, max_palette_size)) {
+		return 0xffffffff;
+	}
+	return get_palette_layout(get_palette_bits_for_size(palette_size), volume, sizeof(T)).size_in_bytes;
+}
 
-	Vector3i::sort_min_max(src_min, src_max);
-
-	src_min.clamp_to(Vector3i(0, 0, 0), other._size);
-	src_max.clamp_to(Vector3i(0, 0, 0), other._size + Vector3i(1, 1, 1));
+uint32_t VoxelBuffer::get_palette_size_in_bytes(unsigned int channel_index, uint32_t max_size_in_bytes) const {
+	const Channel &channel = _channels[channel_index];
+	CRASH_COND(channel.compression != COMPRESSION_NONE);
+	const uint32_t volume = get_volume();
 
-	dst_min.clamp_to(Vector3i(0, 0, 0), _size);
+	switch (channel.depth) {
+		case DEPTH_8_BIT:
+			return get_palette_size_in_bytes_t<uint8_t>(channel.data, volume, max_size_in_bytes);
+		case DEPTH_16_BIT:
+			return get_palette_size_in_bytes_t<uint16_t>(channel.data, volume, max_size_in_bytes);
+		case DEPTH_32_BIT:
+			return get_palette_size_in_bytes_t<uint32_t>(channel.data, volume, max_size_in_bytes);
+		case DEPTH_64_BIT:
+			return get_palette_size_in_bytes_t<uint64_t>(channel.data, volume, max_size_in_bytes);
+		default:
+			CRASH_NOW();
+			return 0;
+	}
+}
+
+template <typename T>
+static uint8_t *encode_palette_t(const uint8_t *data, uint32_t volume, uint32_t &out_size_in_bytes) {
+	FixedArray<T, MAX_PALETTE_SIZE> palette;
+	uint32_t palette_size;
+	CRASH_COND(!find_palette(reinterpret_cast<const T *>(data), volume, palette, palette_size, MAX_PALETTE_SIZE));
+	const PaletteLayout layout = get_palette_layout(get_palette_bits_for_size(palette_size), volume, sizeof(T));
+	uint8_t *dst = allocate_compressed_channel_data(layout.size_in_bytes);
+	encode_palette(reinterpret_cast<const T *>(data), volume, palette, palette_size, layout, dst);
+	out_size_in_bytes = layout.size_in_bytes;
+	return dst;
+}
+
+void VoxelBuffer::compress_channel_palette(unsigned int channel_index) {
+	Channel &channel = _channels[channel_index];
+	CRASH_COND(channel.compression != COMPRESSION_NONE);
+	const uint32_t volume = get_volume();
+
+	uint8_t *palette_data;
+	uint32_t size_in_bytes;
+	switch (channel.depth) {
+		case DEPTH_8_BIT:
+			palette_data = encode_palette_t<uint8_t>(channel.data, volume, size_in_bytes);
+			break;
+		case DEPTH_16_BIT:
+			palette_data = encode_palette_t<uint16_t>(channel.data, volume, size_in_bytes);
+			break;
+		case DEPTH_32_BIT:
+			palette_data = encode_palette_t<uint32_t>(channel.data, volume, size_in_bytes);
+			break;
+		case DEPTH_64_BIT:
+			palette_data = encode_palette_t<uint64_t>(channel.data, volume, size_in_bytes);
+			break;
+		default:
+			CRASH_NOW();
+			return;
+	}
+
+	const bool known_non_uniform = channel.known_non_uniform;
+	delete_channel(channel_index);
+	channel.data = palette_data;
+	channel.size_in_bytes = size_in_bytes;
+	channel.compression = COMPRESSION_PALETTE;
+	channel.known_non_uniform = known_non_uniform;
+}
+
+bool VoxelBuffer::set_voxel_palette(unsigned int channel_index, uint32_t i, uint64_t value) {
+	Channel &channel = _channels[channel_index];
+	CRASH_COND(channel.compression != COMPRESSION_PALETTE);
+	unshare_channel(channel_index);
+
+	const uint32_t volume = get_volume();
+	const uint32_t value_size = ::get_depth_bit_count(channel.depth) / 8;
+	uint32_t bits = get_palette_bits(channel.data);
+	uint32_t palette_size = get_palette_size(channel.data);
+	PaletteLayout layout = get_palette_layout(bits, volume, value_size);
+
+	uint32_t pi = 0;
+	for (; pi < palette_size; ++pi) {
+		if (get_palette_value(channel.data + layout.values_offset, value_size, pi) == value) {
+			break;
+		}
+	}
+
+	if (pi == palette_size) {
+		if (palette_size == layout.capacity) {
+			if (bits == MAX_PALETTE_BITS) {
+				return false;
+			}
+
+			// Grow indices to the next size
+			const PaletteLayout new_layout = get_palette_layout(bits * 2, volume, value_size);
+			uint8_t *new_data = allocate_compressed_channel_data(new_layout.size_in_bytes);
+			memcpy(new_data + new_layout.values_offset, channel.data + layout.values_offset,
+					palette_size * value_size);
+
+			const uint8_t *indices = channel.data + layout.indices_offset;
+			uint8_t *new_indices = new_data + new_layout.indices_offset;
+			memset(new_indices, 0, new_layout.size_in_bytes - new_layout.indices_offset);
+			for (uint32_t j = 0; j < volume; ++j) {
+				set_palette_index(new_indices, new_layout.bits, j, get_palette_index(indices, bits, j));
+			}
+
+			free_compressed_channel_data(channel.data);
+			channel.data = new_data;
+			channel.size_in_bytes = new_layout.size_in_bytes;
+			layout = new_layout;
+			bits = new_layout.bits;
+		}
+
+		set_palette_value(channel.data + layout.values_offset, value_size, pi, value);
+		++palette_size;
+		set_palette_header(channel.data, bits, palette_size);
+	}
+
+	set_palette_index(channel.data + layout.indices_offset, bits, i, pi);
+	channel.known_non_uniform = false;
+	return true;
+}
+
+void VoxelBuffer::set_channel_sparse(unsigned int channel_index, bool sparse) {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	Channel &channel = _channels[channel_index];
+	channel.sparse = sparse;
+	if (channel.data == nullptr) {
+		// Bricks get allocated on the first write
+		return;
+	}
+	if (sparse && channel.compression != COMPRESSION_SPARSE) {
+		compress_channel_sparse(channel_index);
+	} else if (!sparse && channel.compression == COMPRESSION_SPARSE) {
+		decompress_channel(channel_index);
+	}
+}
+
+bool VoxelBuffer::is_channel_sparse(unsigned int channel_index) const {
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, false);
+	return _channels[channel_index].sparse;
+}
+
+// Creates sparse data where all bricks have the default value of the channel
+void VoxelBuffer::create_channel_sparse(unsigned int channel_index) {
+	Channel &channel = _channels[channel_index];
+	CRASH_COND(channel.data != nullptr);
+	const SparseLayout layout = get_sparse_layout(_size, 0, ::get_depth_bit_count(channel.depth) / 8);
+	create_channel_compressed_noinit(channel_index, layout.size_in_bytes, COMPRESSION_SPARSE);
+
+	set_sparse_header(channel.data, 0, 0);
+	std::fill_n(reinterpret_cast<uint64_t *>(channel.data + layout.values_offset), layout.brick_count, channel.defval);
+	std::fill_n(reinterpret_cast<uint32_t *>(channel.data + layout.slots_offset), layout.brick_count, SPARSE_NO_SLOT);
+}
+
+void VoxelBuffer::compress_channel_sparse(unsigned int channel_index) {
+	Channel &channel = _channels[channel_index];
+	if (channel.compression == COMPRESSION_RLE || channel.compression == COMPRESSION_PALETTE) {
+		decompress_channel(channel_index);
+	}
+	CRASH_COND(channel.compression != COMPRESSION_NONE);
+	if (get_volume() == 0) {
+		return;
+	}
+
+	// Encoded assuming all bricks need a slot, then shrunk to what is used
+	const uint32_t value_size = ::get_depth_bit_count(channel.depth) / 8;
+	const SparseLayout max_layout = get_sparse_layout(_size, get_sparse_layout(_size, 0, value_size).brick_count, value_size);
+	std::vector<uint8_t> tmp(max_layout.size_in_bytes);
+	uint32_t size_in_bytes;
+	switch (channel.depth) {
+		case DEPTH_8_BIT:
+			size_in_bytes = encode_sparse(channel.data, _size, tmp.data());
+			break;
+		case DEPTH_16_BIT:
+			size_in_bytes = encode_sparse(reinterpret_cast<const uint16_t *>(channel.data), _size, tmp.data());
+			break;
+		case DEPTH_32_BIT:
+			size_in_bytes = encode_sparse(reinterpret_cast<const uint32_t *>(channel.data), _size, tmp.data());
+			break;
+		case DEPTH_64_BIT:
+			size_in_bytes = encode_sparse(reinterpret_cast<const uint64_t *>(channel.data), _size, tmp.data());
+			break;
+		default:
+			CRASH_NOW();
+	}
+
+	const bool known_non_uniform = channel.known_non_uniform;
+	delete_channel(channel_index);
+	create_channel_compressed_noinit(channel_index, size_in_bytes, COMPRESSION_SPARSE);
+	memcpy(channel.data, tmp.data(), size_in_bytes);
+	channel.known_non_uniform = known_non_uniform;
+}
+
+// Gives a brick its own slot, filled with the value it had. Returns the slot.
+uint32_t VoxelBuffer::allocate_sparse_slot(unsigned int channel_index, uint32_t brick_index) {
+	Channel &channel = _channels[channel_index];
+	const uint32_t value_size = ::get_depth_bit_count(channel.depth) / 8;
+	uint32_t capacity = get_sparse_slot_capacity(channel.data);
+	const uint32_t slot_count = get_sparse_slot_count(channel.data);
+	SparseLayout layout = get_sparse_layout(_size, capacity, value_size);
+
+	if (slot_count == capacity) {
+		// Grow geometrically, edits tend to allocate many bricks in a row
+		const uint32_t new_capacity = MIN(MAX(capacity * 2, 8u), layout.brick_count);
+		const SparseLayout new_layout = get_sparse_layout(_size, new_capacity, value_size);
+		uint8_t *new_data = allocate_compressed_channel_data(new_layout.size_in_bytes);
+		memcpy(new_data, channel.data, layout.bricks_offset + slot_count * layout.slot_size_in_bytes);
+		free_compressed_channel_data(channel.data);
+		channel.data = new_data;
+		channel.size_in_bytes = new_layout.size_in_bytes;
+		capacity = new_capacity;
+		layout = new_layout;
+	}
+
+	const uint32_t slot = slot_count;
+	set_sparse_header(channel.data, capacity, slot_count + 1);
+	reinterpret_cast<uint32_t *>(channel.data + layout.slots_offset)[brick_index] = slot;
+
+	const uint64_t v = reinterpret_cast<const uint64_t *>(channel.data + layout.values_offset)[brick_index];
+	uint8_t *brick = channel.data + layout.bricks_offset + slot * layout.slot_size_in_bytes;
+	switch (channel.depth) {
+		case DEPTH_8_BIT:
+			memset(brick, v, SPARSE_BRICK_VOLUME);
+			break;
+		case DEPTH_16_BIT:
+			std::fill_n(reinterpret_cast<uint16_t *>(brick), SPARSE_BRICK_VOLUME, v);
+			break;
+		case DEPTH_32_BIT:
+			std::fill_n(reinterpret_cast<uint32_t *>(brick), SPARSE_BRICK_VOLUME, v);
+			break;
+		case DEPTH_64_BIT:
+			std::fill_n(reinterpret_cast<uint64_t *>(brick), SPARSE_BRICK_VOLUME, v);
+			break;
+		default:
+			CRASH_NOW();
+	}
+	return slot;
+}
+
+// Makes a brick uniform again. Its value must be set by the caller.
+void VoxelBuffer::free_sparse_slot(unsigned int channel_index, uint32_t brick_index) {
+	Channel &channel = _channels[channel_index];
+	const uint32_t value_size = ::get_depth_bit_count(channel.depth) / 8;
+	const uint32_t capacity = get_sparse_slot_capacity(channel.data);
+	const uint32_t slot_count = get_sparse_slot_count(channel.data);
+	const SparseLayout layout = get_sparse_layout(_size, capacity, value_size);
+	uint32_t *slots = reinterpret_cast<uint32_t *>(channel.data + layout.slots_offset);
+
+	const uint32_t slot = slots[brick_index];
+	slots[brick_index] = SPARSE_NO_SLOT;
+	const uint32_t last_slot = slot_count - 1;
+
+	if (slot != last_slot) {
+		// Keep slots packed by moving the last one into the hole
+		for (uint32_t bi = 0; bi < layout.brick_count; ++bi) {
+			if (slots[bi] == last_slot) {
+				slots[bi] = slot;
+				break;
+			}
+		}
+		uint8_t *bricks = channel.data + layout.bricks_offset;
+		memcpy(bricks + slot * layout.slot_size_in_bytes, bricks + last_slot * layout.slot_size_in_bytes,
+				layout.slot_size_in_bytes);
+	}
+	set_sparse_header(channel.data, capacity, last_slot);
+}
+
+void VoxelBuffer::set_voxel_sparse(unsigned int channel_index, int x, int y, int z, uint64_t value) {
+	Channel &channel = _channels[channel_index];
+	CRASH_COND(channel.compression != COMPRESSION_SPARSE);
+
+	const uint32_t value_size = ::get_depth_bit_count(channel.depth) / 8;
+	SparseLayout layout = get_sparse_layout(_size, get_sparse_slot_capacity(channel.data), value_size);
+	const uint32_t bi = get_sparse_brick_index(layout, x, y, z);
+	uint32_t slot = reinterpret_cast<const uint32_t *>(channel.data + layout.slots_offset)[bi];
+
+	if (slot == SPARSE_NO_SLOT) {
+		if (reinterpret_cast<const uint64_t *>(channel.data + layout.values_offset)[bi] == value) {
+			return;
+		}
+		unshare_channel(channel_index);
+		slot = allocate_sparse_slot(channel_index, bi);
+		layout = get_sparse_layout(_size, get_sparse_slot_capacity(channel.data), value_size);
+	} else {
+		unshare_channel(channel_index);
+	}
+
+	set_palette_value(channel.data + layout.bricks_offset + slot * layout.slot_size_in_bytes, value_size,
+			get_sparse_local_index(x, y, z), value);
+	channel.known_non_uniform = false;
+}
+
+// Bricks entirely covered by the area become uniform, others get the area filled in their slot
+void VoxelBuffer::fill_area_sparse(unsigned int channel_index, Vector3i min, Vector3i max, uint64_t value) {
+	Channel &channel = _channels[channel_index];
+	CRASH_COND(channel.compression != COMPRESSION_SPARSE);
+	unshare_channel(channel_index);
+	channel.known_non_uniform = false;
+
+	const uint32_t value_size = ::get_depth_bit_count(channel.depth) / 8;
+	const Rect3i area = Rect3i::from_min_max(min, max).clipped(Rect3i(Vector3i(), _size));
+	if (area.size.volume() <= 0) {
+		return;
+	}
+	min = area.pos;
+	max = area.pos + area.size;
+	const Vector3i bmin = min >> SPARSE_BRICK_SIZE_PO2;
+	const Vector3i bmax = ((max - Vector3i(1)) >> SPARSE_BRICK_SIZE_PO2) + Vector3i(1);
+
+	Vector3i bpos;
+	for (bpos.z = bmin.z; bpos.z < bmax.z; ++bpos.z) {
+		for (bpos.x = bmin.x; bpos.x < bmax.x; ++bpos.x) {
+			for (bpos.y = bmin.y; bpos.y < bmax.y; ++bpos.y) {
+				// Layout changes as slots get allocated
+				SparseLayout layout = get_sparse_layout(_size, get_sparse_slot_capacity(channel.data), value_size);
+				const Vector3i origin = bpos * SPARSE_BRICK_SIZE;
+				const uint32_t bi = get_sparse_brick_index(layout, origin.x, origin.y, origin.z);
+				const Rect3i brick_box = get_sparse_brick_box(layout, bi, _size);
+				uint32_t slot = reinterpret_cast<const uint32_t *>(channel.data + layout.slots_offset)[bi];
+
+				if (area.contains(brick_box)) {
+					if (slot != SPARSE_NO_SLOT) {
+						free_sparse_slot(channel_index, bi);
+					}
+					reinterpret_cast<uint64_t *>(channel.data + layout.values_offset)[bi] = value;
+					continue;
+				}
+
+				if (slot == SPARSE_NO_SLOT) {
+					if (reinterpret_cast<const uint64_t *>(channel.data + layout.values_offset)[bi] == value) {
+						continue;
+					}
+					slot = allocate_sparse_slot(channel_index, bi);
+					layout = get_sparse_layout(_size, get_sparse_slot_capacity(channel.data), value_size);
+				}
+
+				Rect3i box = brick_box;
+				box.clip(area);
+				const Vector3i box_max = box.pos + box.size;
+				uint8_t *brick = channel.data + layout.bricks_offset + slot * layout.slot_size_in_bytes;
+				for (int z = box.pos.z; z < box_max.z; ++z) {
+					for (int x = box.pos.x; x < box_max.x; ++x) {
+						for (int y = box.pos.y; y < box_max.y; ++y) {
+							set_palette_value(brick, value_size, get_sparse_local_index(x, y, z), value);
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+void VoxelBuffer::decompress_channel(unsigned int channel_index) {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	Channel &channel = _channels[channel_index];
+	// Decompression doesn't change voxel values
+	const bool known_non_uniform = channel.known_non_uniform;
+
+	if (channel.data == nullptr) {
+		create_channel(channel_index, _size, channel.defval);
+
+	} else if (channel.compression == COMPRESSION_RLE) {
+		uint8_t *rle = channel.data;
+		channel.data = nullptr;
+		channel.size_in_bytes = 0;
+
+		create_channel_noinit(channel_index, _size);
+
+		switch (channel.depth) {
+			case DEPTH_8_BIT:
+				decode_rle_area<uint8_t>(rle, _size, Vector3i(), _size, channel.data, _size, Vector3i());
+				break;
+			case DEPTH_16_BIT:
+				decode_rle_area<uint16_t>(rle, _size, Vector3i(), _size, channel.data, _size, Vector3i());
+				break;
+			case DEPTH_32_BIT:
+				decode_rle_area<uint32_t>(rle, _size, Vector3i(), _size, channel.data, _size, Vector3i());
+				break;
+			case DEPTH_64_BIT:
+				decode_rle_area<uint64_t>(rle, _size, Vector3i(), _size, channel.data, _size, Vector3i());
+				break;
+			default:
+				CRASH_NOW();
+		}
+
+		free_compressed_channel_data(rle);
+
+	} else if (channel.compression == COMPRESSION_PALETTE) {
+		uint8_t *palette = channel.data;
+		channel.data = nullptr;
+		channel.size_in_bytes = 0;
+
+		create_channel_noinit(channel_index, _size);
+
+		switch (channel.depth) {
+			case DEPTH_8_BIT:
+				decode_palette_area<uint8_t>(palette, _size, Vector3i(), _size, channel.data, _size, Vector3i());
+				break;
+			case DEPTH_16_BIT:
+				decode_palette_area<uint16_t>(palette, _size, Vector3i(), _size, channel.data, _size, Vector3i());
+				break;
+			case DEPTH_32_BIT:
+				decode_palette_area<uint32_t>(palette, _size, Vector3i(), _size, channel.data, _size, Vector3i());
+				break;
+			case DEPTH_64_BIT:
+				decode_palette_area<uint64_t>(palette, _size, Vector3i(), _size, channel.data, _size, Vector3i());
+				break;
+			default:
+				CRASH_NOW();
+		}
+
+		free_compressed_channel_data(palette);
+
+	} else if (channel.compression == COMPRESSION_SPARSE) {
+		uint8_t *sparse = channel.data;
+		channel.data = nullptr;
+		channel.size_in_bytes = 0;
+
+		create_channel_noinit(channel_index, _size);
+
+		switch (channel.depth) {
+			case DEPTH_8_BIT:
+				decode_sparse_area<uint8_t>(sparse, _size, Vector3i(), _size, channel.data, _size, Vector3i());
+				break;
+			case DEPTH_16_BIT:
+				decode_sparse_area<uint16_t>(sparse, _size, Vector3i(), _size, channel.data, _size, Vector3i());
+				break;
+			case DEPTH_32_BIT:
+				decode_sparse_area<uint32_t>(sparse, _size, Vector3i(), _size, channel.data, _size, Vector3i());
+				break;
+			case DEPTH_64_BIT:
+				decode_sparse_area<uint64_t>(sparse, _size, Vector3i(), _size, channel.data, _size, Vector3i());
+				break;
+			default:
+				CRASH_NOW();
+		}
+
+		free_compressed_channel_data(sparse);
+	}
+
+	channel.known_non_uniform = known_non_uniform;
+}
+
+bool VoxelBuffer::prepare_read_write_action(Rect3i &box, unsigned int channel_index) {
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, false);
+
+	box.clip(Rect3i(Vector3i(), _size));
+	if (box.size.volume() <= 0) {
+		return false;
+	}
+
+	Channel &channel = _channels[channel_index];
+	if (channel.data == nullptr || channel.compression != COMPRESSION_NONE) {
+		decompress_channel(channel_index);
+	}
+	// The action is likely to write
+	unshare_channel(channel_index);
+	channel.known_non_uniform = false;
+	return true;
+}
+
+VoxelBuffer::Compression VoxelBuffer::get_channel_compression(unsigned int channel_index) const {
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, VoxelBuffer::COMPRESSION_NONE);
+	return _channels[channel_index].compression;
+}
+
+void VoxelBuffer::copy_from(const VoxelBuffer &other) {
+	// Copy all channels, assuming sizes and formats match
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		copy_from(other, i);
+	}
+}
+
+void VoxelBuffer::copy_from(const VoxelBuffer &other, unsigned int channel_index) {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	ERR_FAIL_COND(other._size != _size);
+
+	Channel &channel = _channels[channel_index];
+	const Channel &other_channel = other._channels[channel_index];
+
+	ERR_FAIL_COND(other_channel.depth != channel.depth);
+
+	if (channel.data != nullptr && channel.data != other_channel.data) {
+		delete_channel(channel_index);
+	}
+	if (other_channel.data != nullptr && channel.data == nullptr) {
+		// Data is shared as-is, until one of the buffers writes to it
+		channel.data = ref_channel_data(other_channel.data);
+		channel.size_in_bytes = other_channel.size_in_bytes;
+		channel.compression = other_channel.compression;
+	}
+
+	channel.defval = other_channel.defval;
+	channel.depth = other_channel.depth;
+	channel.known_non_uniform = other_channel.known_non_uniform;
+}
+
+void VoxelBuffer::copy_from(const VoxelBuffer &other, Vector3i src_min, Vector3i src_max, Vector3i dst_min, unsigned int channel_index) {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+
+	Channel &channel = _channels[channel_index];
+	const Channel &other_channel = other._channels[channel_index];
+
+	ERR_FAIL_COND(other_channel.depth != channel.depth);
+
+	if (channel.data == nullptr && other_channel.data == nullptr && channel.defval == other_channel.defval) {
+		// No action needed
+		return;
+	}
+
+	Vector3i::sort_min_max(src_min, src_max);
+
+	src_min.clamp_to(Vector3i(0, 0, 0), other._size);
+	src_max.clamp_to(Vector3i(0, 0, 0), other._size + Vector3i(1, 1, 1));
+
+	dst_min.clamp_to(Vector3i(0, 0, 0), _size);
 	Vector3i area_size = src_max - src_min;
 	//Vector3i dst_max = dst_min + area_size;
 
@@ -505,8 +1997,37 @@ void VoxelBuffer::copy_from(const VoxelBuffer &other, Vector3i src_min, Vector3i
 		// Equivalent of full copy between two blocks of same size
 		copy_from(other, channel_index);
 
+	} else if (is_channel_written_sparse(channel_index)) {
+		// Goes through the sparse write paths, so untouched bricks stay uniform
+		if (other_channel.data == nullptr) {
+			fill_area(other_channel.defval, dst_min, dst_min + area_size, channel_index);
+		} else {
+			Vector3i pos;
+			for (pos.z = 0; pos.z < area_size.z; ++pos.z) {
+				for (pos.x = 0; pos.x < area_size.x; ++pos.x) {
+					for (pos.y = 0; pos.y < area_size.y; ++pos.y) {
+						set_voxel(other.get_voxel(src_min + pos, channel_index), dst_min + pos, channel_index);
+					}
+				}
+			}
+		}
+
 	} else {
-		if (other_channel.data) {
+		if (channel.data != nullptr && channel.compression != COMPRESSION_NONE) {
+			decompress_channel(channel_index);
+		}
+		unshare_channel(channel_index);
+		channel.known_non_uniform = false;
+
+		if (other_channel.data != nullptr && other_channel.compression != COMPRESSION_NONE) {
+			if (channel.data == nullptr) {
+				create_channel(channel_index, _size, channel.defval);
+			}
+			// Compressed data is expanded directly into destination rows
+			decode_channel_data_area(other_channel.data, other_channel.compression, channel.depth,
+					other._size, src_min, area_size, channel.data, _size, dst_min);
+
+		} else if (other_channel.data) {
 
 			if (channel.data == nullptr) {
 				create_channel(channel_index, _size, channel.defval);
@@ -542,27 +2063,182 @@ void VoxelBuffer::copy_from(const VoxelBuffer &other, Vector3i src_min, Vector3i
 			if (channel.data == nullptr) {
 				create_channel(channel_index, _size, channel.defval);
 			}
-			fill_area(other_channel.defval, dst_min, dst_min + area_size, channel_index);
-		}
+			fill_area(other_channel.defval, dst_min, dst_min + area_size, channel_index);
+		}
+	}
+}
+
+Ref<VoxelBuffer> VoxelBuffer::duplicate(bool include_metadata) const {
+	VoxelBuffer *d = memnew(VoxelBuffer);
+	d->create(_size);
+	for (unsigned int i = 0; i < _channels.size(); ++i) {
+		d->set_channel_depth(i, _channels[i].depth);
+		d->set_channel_sparse(i, _channels[i].sparse);
+	}
+	d->copy_from(*this);
+	if (include_metadata) {
+		d->copy_voxel_metadata(*this);
+	}
+	return Ref<VoxelBuffer>(d);
+}
+
+bool VoxelBuffer::get_channel_raw(unsigned int channel_index, ArraySlice<uint8_t> &slice) const {
+	const Channel &channel = _channels[channel_index];
+	if (channel.compression == COMPRESSION_NONE) {
+		slice = ArraySlice<uint8_t>(channel.data, 0, channel.size_in_bytes);
+		return true;
+	}
+	slice = ArraySlice<uint8_t>();
+	return false;
+}
+
+void VoxelBuffer::get_channel_snapshot(unsigned int channel_index, ChannelSnapshot &out_snapshot) const {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	const Channel &channel = _channels[channel_index];
+	out_snapshot.clear();
+	if (channel.data != nullptr) {
+		out_snapshot._data = ref_channel_data(channel.data);
+	}
+	out_snapshot._size_in_bytes = channel.size_in_bytes;
+	out_snapshot._defval = channel.defval;
+	out_snapshot._size = _size;
+	out_snapshot._depth = channel.depth;
+	out_snapshot._compression = channel.compression;
+}
+
+void VoxelBuffer::ChannelSnapshot::clear() {
+	if (_data == nullptr) {
+		return;
+	}
+	if (_compression != COMPRESSION_NONE) {
+		free_compressed_channel_data(_data);
+	} else {
+		free_channel_data(_data, _size_in_bytes);
+	}
+	_data = nullptr;
+	_size_in_bytes = 0;
+	_compression = COMPRESSION_UNIFORM;
+}
+
+uint64_t VoxelBuffer::ChannelSnapshot::get_voxel(int x, int y, int z) const {
+	if (_data == nullptr) {
+		return _defval;
+	}
+	return get_channel_data_voxel(_data, _compression, _depth, _size, x, y, z);
+}
+
+void VoxelBuffer::copy_channel_raw_to(unsigned int channel_index, ArraySlice<uint8_t> dst) const {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	const Channel &channel = _channels[channel_index];
+	ERR_FAIL_COND(dst.size() != get_size_in_bytes_for_volume(_size, channel.depth));
+
+	switch (channel.compression) {
+		case COMPRESSION_NONE:
+			memcpy(dst.data(), channel.data, dst.size());
+			break;
+
+		case COMPRESSION_UNIFORM: {
+			const unsigned int volume = get_volume();
+			switch (channel.depth) {
+				case DEPTH_8_BIT:
+					memset(dst.data(), channel.defval, dst.size());
+					break;
+				case DEPTH_16_BIT:
+					std::fill_n(dst.reinterpret_cast_to<uint16_t>().data(), volume, channel.defval);
+					break;
+				case DEPTH_32_BIT:
+					std::fill_n(dst.reinterpret_cast_to<uint32_t>().data(), volume, channel.defval);
+					break;
+				case DEPTH_64_BIT:
+					std::fill_n(dst.reinterpret_cast_to<uint64_t>().data(), volume, channel.defval);
+					break;
+				default:
+					CRASH_NOW();
+			}
+		} break;
+
+		case COMPRESSION_RLE:
+			switch (channel.depth) {
+				case DEPTH_8_BIT:
+					decode_rle_area<uint8_t>(channel.data, _size, Vector3i(), _size, dst.data(), _size, Vector3i());
+					break;
+				case DEPTH_16_BIT:
+					decode_rle_area<uint16_t>(channel.data, _size, Vector3i(), _size, dst.data(), _size, Vector3i());
+					break;
+				case DEPTH_32_BIT:
+					decode_rle_area<uint32_t>(channel.data, _size, Vector3i(), _size, dst.data(), _size, Vector3i());
+					break;
+				case DEPTH_64_BIT:
+					decode_rle_area<uint64_t>(channel.data, _size, Vector3i(), _size, dst.data(), _size, Vector3i());
+					break;
+				default:
+					CRASH_NOW();
+			}
+			break;
+
+		case COMPRESSION_PALETTE:
+			switch (channel.depth) {
+				case DEPTH_8_BIT:
+					decode_palette_area<uint8_t>(channel.data, _size, Vector3i(), _size, dst.data(), _size, Vector3i());
+					break;
+				case DEPTH_16_BIT:
+					decode_palette_area<uint16_t>(channel.data, _size, Vector3i(), _size, dst.data(), _size, Vector3i());
+					break;
+				case DEPTH_32_BIT:
+					decode_palette_area<uint32_t>(channel.data, _size, Vector3i(), _size, dst.data(), _size, Vector3i());
+					break;
+				case DEPTH_64_BIT:
+					decode_palette_area<uint64_t>(channel.data, _size, Vector3i(), _size, dst.data(), _size, Vector3i());
+					break;
+				default:
+					CRASH_NOW();
+			}
+			break;
+
+		case COMPRESSION_SPARSE:
+			switch (channel.depth) {
+				case DEPTH_8_BIT:
+					decode_sparse_area<uint8_t>(channel.data, _size, Vector3i(), _size, dst.data(), _size, Vector3i());
+					break;
+				case DEPTH_16_BIT:
+					decode_sparse_area<uint16_t>(channel.data, _size, Vector3i(), _size, dst.data(), _size, Vector3i());
+					break;
+				case DEPTH_32_BIT:
+					decode_sparse_area<uint32_t>(channel.data, _size, Vector3i(), _size, dst.data(), _size, Vector3i());
+					break;
+				case DEPTH_64_BIT:
+					decode_sparse_area<uint64_t>(channel.data, _size, Vector3i(), _size, dst.data(), _size, Vector3i());
+					break;
+				default:
+					CRASH_NOW();
+			}
+			break;
+
+		default:
+			CRASH_NOW();
 	}
 }
 
-Ref<VoxelBuffer> VoxelBuffer::duplicate(bool include_metadata) const {
-	VoxelBuffer *d = memnew(VoxelBuffer);
-	d->create(_size);
-	for (unsigned int i = 0; i < _channels.size(); ++i) {
-		d->set_channel_depth(i, _channels[i].depth);
+void VoxelBuffer::set_channel_raw(unsigned int channel_index, ArraySlice<const uint8_t> src) {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	Channel &channel = _channels[channel_index];
+	ERR_FAIL_COND(src.size() != get_size_in_bytes_for_volume(_size, channel.depth));
+
+	// Previous contents are entirely replaced, so they don't need to be decompressed or unshared
+	if (channel.data != nullptr && (channel.compression != COMPRESSION_NONE || is_channel_data_shared(channel.data))) {
+		delete_channel(channel_index);
 	}
-	d->copy_from(*this);
-	if (include_metadata) {
-		d->copy_voxel_metadata(*this);
+	if (channel.data == nullptr) {
+		create_channel_noinit(channel_index, _size);
 	}
-	return Ref<VoxelBuffer>(d);
+	memcpy(channel.data, src.data(), src.size());
+	channel.known_non_uniform = false;
 }
 
-bool VoxelBuffer::get_channel_raw(unsigned int channel_index, ArraySlice<uint8_t> &slice) const {
+bool VoxelBuffer::get_channel_compressed_data(unsigned int channel_index, ArraySlice<uint8_t> &slice) const {
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, false);
 	const Channel &channel = _channels[channel_index];
-	if (channel.data != nullptr) {
+	if (channel.compression == COMPRESSION_RLE || channel.compression == COMPRESSION_PALETTE) {
 		slice = ArraySlice<uint8_t>(channel.data, 0, channel.size_in_bytes);
 		return true;
 	}
@@ -570,6 +2246,54 @@ bool VoxelBuffer::get_channel_raw(unsigned int channel_index, ArraySlice<uint8_t
 	return false;
 }
 
+bool VoxelBuffer::set_channel_compressed_data(unsigned int channel_index, Compression compression,
+		const uint8_t *data, uint32_t size_in_bytes) {
+
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, false);
+	ERR_FAIL_COND_V(data == nullptr, false);
+	Channel &channel = _channels[channel_index];
+
+	const uint32_t value_size = ::get_depth_bit_count(channel.depth) / 8;
+	switch (compression) {
+		case COMPRESSION_RLE:
+			if (!validate_rle(data, size_in_bytes, _size.x * _size.z, _size.y, value_size)) {
+				return false;
+			}
+			break;
+		case COMPRESSION_PALETTE:
+			if (!validate_palette(data, size_in_bytes, get_volume(), value_size)) {
+				return false;
+			}
+			break;
+		default:
+			ERR_PRINT("Compression mode has no compressed data");
+			return false;
+	}
+
+	if (channel.data != nullptr) {
+		delete_channel(channel_index);
+	}
+	create_channel_compressed_noinit(channel_index, size_in_bytes, compression);
+	memcpy(channel.data, data, size_in_bytes);
+	return true;
+}
+
+bool VoxelBuffer::get_channel_palette(unsigned int channel_index, std::vector<uint64_t> &out_values) const {
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, false);
+	const Channel &channel = _channels[channel_index];
+	if (channel.compression != COMPRESSION_PALETTE) {
+		return false;
+	}
+	const uint32_t value_size = ::get_depth_bit_count(channel.depth) / 8;
+	const PaletteLayout layout = get_palette_layout(get_palette_bits(channel.data), get_volume(), value_size);
+	const uint32_t palette_size = get_palette_size(channel.data);
+	out_values.resize(palette_size);
+	for (uint32_t i = 0; i < palette_size; ++i) {
+		out_values[i] = get_palette_value(channel.data + layout.values_offset, value_size, i);
+	}
+	return true;
+}
+
 void VoxelBuffer::create_channel(int i, Vector3i size, uint64_t defval) {
 	create_channel_noinit(i, size);
 	fill(defval, i);
@@ -583,68 +2307,493 @@ uint32_t VoxelBuffer::get_size_in_bytes_for_volume(Vector3i size, Depth depth) {
 	return size_in_bytes;
 }
 
+size_t VoxelBuffer::get_memory_usage() const {
+	size_t size_in_bytes = 0;
+	for (unsigned int i = 0; i < _channels.size(); ++i) {
+		const Channel &channel = _channels[i];
+		if (channel.data != nullptr) {
+			size_in_bytes += channel.size_in_bytes;
+		}
+	}
+	return size_in_bytes;
+}
+
 void VoxelBuffer::create_channel_noinit(int i, Vector3i size) {
 	Channel &channel = _channels[i];
 	uint32_t size_in_bytes = get_size_in_bytes_for_volume(size, channel.depth);
 	CRASH_COND(channel.data != nullptr);
 	channel.data = allocate_channel_data(size_in_bytes);
 	channel.size_in_bytes = size_in_bytes;
+	channel.compression = COMPRESSION_NONE;
+	channel.known_non_uniform = false;
+}
+
+void VoxelBuffer::create_channel_compressed_noinit(int i, uint32_t size_in_bytes, Compression compression) {
+	Channel &channel = _channels[i];
+	CRASH_COND(channel.data != nullptr);
+	CRASH_COND(compression != COMPRESSION_RLE && compression != COMPRESSION_PALETTE &&
+			compression != COMPRESSION_SPARSE);
+	channel.data = allocate_compressed_channel_data(size_in_bytes);
+	channel.size_in_bytes = size_in_bytes;
+	channel.compression = compression;
+	channel.known_non_uniform = false;
+}
+
+void VoxelBuffer::unshare_channel(unsigned int channel_index) {
+	Channel &channel = _channels[channel_index];
+	if (channel.data == nullptr || !is_channel_data_shared(channel.data)) {
+		return;
+	}
+	uint8_t *data;
+	if (channel.compression != COMPRESSION_NONE) {
+		data = allocate_compressed_channel_data(channel.size_in_bytes);
+		memcpy(data, channel.data, channel.size_in_bytes);
+		free_compressed_channel_data(channel.data);
+	} else {
+		data = allocate_channel_data(channel.size_in_bytes);
+		memcpy(data, channel.data, channel.size_in_bytes);
+		free_channel_data(channel.data, channel.size_in_bytes);
+	}
+	channel.data = data;
 }
 
 void VoxelBuffer::delete_channel(int i) {
 	Channel &channel = _channels[i];
 	ERR_FAIL_COND(channel.data == nullptr);
-	free_channel_data(channel.data, channel.size_in_bytes);
+	if (channel.compression != COMPRESSION_NONE) {
+		free_compressed_channel_data(channel.data);
+	} else {
+		free_channel_data(channel.data, channel.size_in_bytes);
+	}
 	channel.data = nullptr;
 	channel.size_in_bytes = 0;
+	channel.compression = COMPRESSION_UNIFORM;
+	channel.known_non_uniform = false;
+}
+
+namespace {
+
+// Downscaling kernels work on rows along Y, which is the contiguous axis.
+// `rows` are the 4 source rows of the 2x2 columns covering one destination row, ordered as
+// (x, z), (x + 1, z), (x, z + 1), (x + 1, z + 1). They are kept simple so compilers can vectorize them.
+
+template <typename T>
+void downscale_rows_nearest(const T *const *rows, T *dst, uint32_t count) {
+	const T *src = rows[0];
+	for (uint32_t i = 0; i < count; ++i) {
+		dst[i] = src[i << 1];
+	}
+}
+
+template <typename T, typename Sum_T>
+void downscale_rows_average(const T *const *rows, T *dst, uint32_t count) {
+	const T *r0 = rows[0];
+	const T *r1 = rows[1];
+	const T *r2 = rows[2];
+	const T *r3 = rows[3];
+	for (uint32_t i = 0; i < count; ++i) {
+		const uint32_t j = i << 1;
+		const Sum_T sum = static_cast<Sum_T>(r0[j]) + r0[j + 1] + r1[j] + r1[j + 1] + r2[j] + r2[j + 1] + r3[j] + r3[j + 1];
+		// Rounded to nearest
+		dst[i] = (sum + 4) >> 3;
+	}
+}
+
+// Values of 32 and 64-bit channels are reals stored as raw bits
+template <typename T, typename Real_T>
+inline Real_T raw_bits_to_real(T v) {
+	static_assert(sizeof(T) == sizeof(Real_T), "Raw type and real type must have the same size");
+	Real_T r;
+	memcpy(&r, &v, sizeof(T));
+	return r;
+}
+
+template <typename T, typename Real_T>
+inline T real_to_raw_bits(Real_T r) {
+	static_assert(sizeof(T) == sizeof(Real_T), "Raw type and real type must have the same size");
+	T v;
+	memcpy(&v, &r, sizeof(T));
+	return v;
+}
+
+template <typename T, typename Real_T>
+void downscale_rows_average_real(const T *const *rows, T *dst, uint32_t count) {
+	const T *r0 = rows[0];
+	const T *r1 = rows[1];
+	const T *r2 = rows[2];
+	const T *r3 = rows[3];
+	for (uint32_t i = 0; i < count; ++i) {
+		const uint32_t j = i << 1;
+		const Real_T sum =
+				raw_bits_to_real<T, Real_T>(r0[j]) + raw_bits_to_real<T, Real_T>(r0[j + 1]) +
+				raw_bits_to_real<T, Real_T>(r1[j]) + raw_bits_to_real<T, Real_T>(r1[j + 1]) +
+				raw_bits_to_real<T, Real_T>(r2[j]) + raw_bits_to_real<T, Real_T>(r2[j + 1]) +
+				raw_bits_to_real<T, Real_T>(r3[j]) + raw_bits_to_real<T, Real_T>(r3[j + 1]);
+		dst[i] = real_to_raw_bits<T, Real_T>(sum * static_cast<Real_T>(0.125));
+	}
+}
+
+// Min-abs picks the value closest to zero with selects rather than branches, values are usually noisy.
+// `zero` is the raw value representing 0 once normalized.
+template <typename T>
+inline void select_min_abs(T v, int zero, T &best, int &best_distance) {
+	const int distance = Math::abs(static_cast<int>(v) - zero);
+	const bool closer = distance < best_distance;
+	best = closer ? v : best;
+	best_distance = closer ? distance : best_distance;
+}
+
+template <typename T, typename Real_T>
+inline void select_min_abs_real(T v, T &best, Real_T &best_distance) {
+	const Real_T distance = Math::abs(raw_bits_to_real<T, Real_T>(v));
+	const bool closer = distance < best_distance;
+	best = closer ? v : best;
+	best_distance = closer ? distance : best_distance;
+}
+
+template <typename T>
+void downscale_rows_min_abs(const T *const *rows, T *dst, uint32_t count, int zero) {
+	const T *r0 = rows[0];
+	const T *r1 = rows[1];
+	const T *r2 = rows[2];
+	const T *r3 = rows[3];
+	for (uint32_t i = 0; i < count; ++i) {
+		const uint32_t j = i << 1;
+		T best = r0[j];
+		int best_distance = Math::abs(static_cast<int>(best) - zero);
+		select_min_abs(r0[j + 1], zero, best, best_distance);
+		select_min_abs(r1[j], zero, best, best_distance);
+		select_min_abs(r1[j + 1], zero, best, best_distance);
+		select_min_abs(r2[j], zero, best, best_distance);
+		select_min_abs(r2[j + 1], zero, best, best_distance);
+		select_min_abs(r3[j], zero, best, best_distance);
+		select_min_abs(r3[j + 1], zero, best, best_distance);
+		dst[i] = best;
+	}
+}
+
+template <typename T, typename Real_T>
+void downscale_rows_min_abs_real(const T *const *rows, T *dst, uint32_t count) {
+	const T *r0 = rows[0];
+	const T *r1 = rows[1];
+	const T *r2 = rows[2];
+	const T *r3 = rows[3];
+	for (uint32_t i = 0; i < count; ++i) {
+		const uint32_t j = i << 1;
+		T best = r0[j];
+		Real_T best_distance = Math::abs(raw_bits_to_real<T, Real_T>(best));
+		select_min_abs_real(r0[j + 1], best, best_distance);
+		select_min_abs_real(r1[j], best, best_distance);
+		select_min_abs_real(r1[j + 1], best, best_distance);
+		select_min_abs_real(r2[j], best, best_distance);
+		select_min_abs_real(r2[j + 1], best, best_distance);
+		select_min_abs_real(r3[j], best, best_distance);
+		select_min_abs_real(r3[j + 1], best, best_distance);
+		dst[i] = best;
+	}
+}
+
+// Runs a row kernel over a whole area. Source and destination have the [z][x][y] layout.
+// Source coordinates of the last destination voxel + 1 must be inside the source.
+template <typename T, typename Kernel_T>
+void downscale_area(const T *src, Vector3i src_size, Vector3i src_min,
+		T *dst, Vector3i dst_size, Vector3i dst_min, Vector3i dst_area_size, Kernel_T kernel) {
+
+	const uint32_t src_x_stride = src_size.y;
+	const uint32_t src_z_stride = src_size.y * src_size.x;
+
+	for (int z = 0; z < dst_area_size.z; ++z) {
+		for (int x = 0; x < dst_area_size.x; ++x) {
+			const uint32_t src_i = src_min.y +
+								   src_size.y * ((src_min.x + (x << 1)) + src_size.x * (src_min.z + (z << 1)));
+			const uint32_t dst_i = dst_min.y + dst_size.y * ((dst_min.x + x) + dst_size.x * (dst_min.z + z));
+
+			const T *rows[4] = {
+				src + src_i,
+				src + src_i + src_x_stride,
+				src + src_i + src_z_stride,
+				src + src_i + src_x_stride + src_z_stride
+			};
+
+			kernel(rows, dst + dst_i, dst_area_size.y);
+		}
+	}
+}
+
+// Integer depths are normalized around these values, see raw_voxel_to_real()
+const int DOWNSCALE_ZERO_8_BIT = 0x7f;
+const int DOWNSCALE_ZERO_16_BIT = 0x7fff;
+
+template <typename T>
+inline void downscale_area_nearest(const T *src, Vector3i src_size, Vector3i src_min,
+		T *dst, Vector3i dst_size, Vector3i dst_min, Vector3i dst_area_size) {
+	downscale_area(src, src_size, src_min, dst, dst_size, dst_min, dst_area_size, downscale_rows_nearest<T>);
+}
+
+void downscale_channel(VoxelBuffer::Depth depth, VoxelBuffer::DownscaleFilter filter,
+		const uint8_t *src, Vector3i src_size, Vector3i src_min,
+		uint8_t *dst, Vector3i dst_size, Vector3i dst_min, Vector3i dst_area_size) {
+
+	switch (depth) {
+		case VoxelBuffer::DEPTH_8_BIT: {
+			switch (filter) {
+				case VoxelBuffer::DOWNSCALE_NEAREST:
+					downscale_area_nearest(src, src_size, src_min, dst, dst_size, dst_min, dst_area_size);
+					break;
+				case VoxelBuffer::DOWNSCALE_AVERAGE:
+					downscale_area(src, src_size, src_min, dst, dst_size, dst_min, dst_area_size,
+							downscale_rows_average<uint8_t, uint16_t>);
+					break;
+				case VoxelBuffer::DOWNSCALE_MIN_ABS:
+					downscale_area(src, src_size, src_min, dst, dst_size, dst_min, dst_area_size,
+							[](const uint8_t *const *rows, uint8_t *row, uint32_t count) {
+								downscale_rows_min_abs(rows, row, count, DOWNSCALE_ZERO_8_BIT);
+							});
+					break;
+				default:
+					CRASH_NOW();
+					break;
+			}
+		} break;
+
+		case VoxelBuffer::DEPTH_16_BIT: {
+			const uint16_t *src16 = reinterpret_cast<const uint16_t *>(src);
+			uint16_t *dst16 = reinterpret_cast<uint16_t *>(dst);
+			switch (filter) {
+				case VoxelBuffer::DOWNSCALE_NEAREST:
+					downscale_area_nearest(src16, src_size, src_min, dst16, dst_size, dst_min, dst_area_size);
+					break;
+				case VoxelBuffer::DOWNSCALE_AVERAGE:
+					downscale_area(src16, src_size, src_min, dst16, dst_size, dst_min, dst_area_size,
+							downscale_rows_average<uint16_t, uint32_t>);
+					break;
+				case VoxelBuffer::DOWNSCALE_MIN_ABS:
+					downscale_area(src16, src_size, src_min, dst16, dst_size, dst_min, dst_area_size,
+							[](const uint16_t *const *rows, uint16_t *row, uint32_t count) {
+								downscale_rows_min_abs(rows, row, count, DOWNSCALE_ZERO_16_BIT);
+							});
+					break;
+				default:
+					CRASH_NOW();
+					break;
+			}
+		} break;
+
+		case VoxelBuffer::DEPTH_32_BIT: {
+			const uint32_t *src32 = reinterpret_cast<const uint32_t *>(src);
+			uint32_t *dst32 = reinterpret_cast<uint32_t *>(dst);
+			switch (filter) {
+				case VoxelBuffer::DOWNSCALE_NEAREST:
+					downscale_area_nearest(src32, src_size, src_min, dst32, dst_size, dst_min, dst_area_size);
+					break;
+				case VoxelBuffer::DOWNSCALE_AVERAGE:
+					downscale_area(src32, src_size, src_min, dst32, dst_size, dst_min, dst_area_size,
+							downscale_rows_average_real<uint32_t, float>);
+					break;
+				case VoxelBuffer::DOWNSCALE_MIN_ABS:
+					downscale_area(src32, src_size, src_min, dst32, dst_size, dst_min, dst_area_size,
+							downscale_rows_min_abs_real<uint32_t, float>);
+					break;
+				default:
+					CRASH_NOW();
+					break;
+			}
+		} break;
+
+		case VoxelBuffer::DEPTH_64_BIT: {
+			const uint64_t *src64 = reinterpret_cast<const uint64_t *>(src);
+			uint64_t *dst64 = reinterpret_cast<uint64_t *>(dst);
+			switch (filter) {
+				case VoxelBuffer::DOWNSCALE_NEAREST:
+					downscale_area_nearest(src64, src_size, src_min, dst64, dst_size, dst_min, dst_area_size);
+					break;
+				case VoxelBuffer::DOWNSCALE_AVERAGE:
+					downscale_area(src64, src_size, src_min, dst64, dst_size, dst_min, dst_area_size,
+							downscale_rows_average_real<uint64_t, double>);
+					break;
+				case VoxelBuffer::DOWNSCALE_MIN_ABS:
+					downscale_area(src64, src_size, src_min, dst64, dst_size, dst_min, dst_area_size,
+							downscale_rows_min_abs_real<uint64_t, double>);
+					break;
+				default:
+					CRASH_NOW();
+					break;
+			}
+		} break;
+
+		default:
+			CRASH_NOW();
+			break;
+	}
 }
 
+} // namespace
+
 void VoxelBuffer::downscale_to(VoxelBuffer &dst, Vector3i src_min, Vector3i src_max, Vector3i dst_min) const {
-	// TODO Align input to multiple of two
+	downscale_to(dst, src_min, src_max, dst_min, DownscaleFilters(DOWNSCALE_NEAREST));
+}
 
+void VoxelBuffer::downscale_to(VoxelBuffer &dst, Vector3i src_min, Vector3i src_max, Vector3i dst_min,
+		const DownscaleFilters &filters) const {
+	// Kernels read cells of 2x2x2 voxels, so odd extents are rounded down to whole cells inside the source
 	src_min.clamp_to(Vector3i(), _size);
-	src_max.clamp_to(Vector3i(), _size + Vector3i(1));
+	src_max = Vector3i::min(src_max, _size);
+	const Vector3i cell_count = (src_max - src_min) >> 1;
 
-	Vector3i dst_max = dst_min + ((src_max - src_min) >> 1);
+	Vector3i dst_max = dst_min + cell_count;
 
 	dst_min.clamp_to(Vector3i(), dst._size);
-	dst_max.clamp_to(Vector3i(), dst._size + Vector3i(1));
+	dst_max = Vector3i::min(dst_max, dst._size);
+
+	const Vector3i dst_area_size = dst_max - dst_min;
+	if (dst_area_size.x <= 0 || dst_area_size.y <= 0 || dst_area_size.z <= 0) {
+		return;
+	}
+
+#ifdef DEBUG_ENABLED
+	// The last voxel of the last cell must be inside the source
+	CRASH_COND(!is_position_valid(src_min + (dst_area_size << 1) - Vector3i(1)));
+#endif
 
 	for (int channel_index = 0; channel_index < MAX_CHANNELS; ++channel_index) {
 		const Channel &src_channel = _channels[channel_index];
 		const Channel &dst_channel = dst._channels[channel_index];
+		const DownscaleFilter filter = filters[channel_index];
+		ERR_FAIL_INDEX(filter, DOWNSCALE_FILTER_COUNT);
 
 		if (src_channel.data == nullptr && dst_channel.data == nullptr && src_channel.defval == dst_channel.defval) {
 			// No action needed
 			continue;
 		}
 
-		// Nearest-neighbor downscaling
+		if (src_channel.data == nullptr) {
+			// Whatever the filter, a uniform area downscales to the same value
+			dst.fill_area(src_channel.defval, dst_min, dst_max, channel_index);
+			continue;
+		}
 
-		Vector3i pos;
-		for (pos.z = dst_min.z; pos.z < dst_max.z; ++pos.z) {
-			for (pos.x = dst_min.x; pos.x < dst_max.x; ++pos.x) {
-				for (pos.y = dst_min.y; pos.y < dst_max.y; ++pos.y) {
-					const Vector3i src_pos = src_min + ((pos - dst_min) << 1);
-
-					// TODO Remove check once it works
-					CRASH_COND(!is_position_valid(src_pos.x, src_pos.y, src_pos.z));
-
-					uint64_t v;
-					if (src_channel.data) {
-						// TODO Optimized version?
-						v = get_voxel(src_pos, channel_index);
-					} else {
-						v = src_channel.defval;
-					}
+		if (src_channel.depth != dst_channel.depth || dst.is_channel_written_sparse(channel_index)) {
+			// Rare cases, not worth having specialized kernels
+			downscale_channel_generic(dst, channel_index, filter, src_min, dst_min, dst_max);
+			continue;
+		}
+
+		if (dst_channel.data == nullptr || dst_channel.compression != COMPRESSION_NONE) {
+			dst.decompress_channel(channel_index);
+		}
+		dst.unshare_channel(channel_index);
+		dst._channels[channel_index].known_non_uniform = false;
+
+		if (src_channel.compression != COMPRESSION_NONE) {
+			// Kernels need dense rows, so the source area is expanded first
+			const Vector3i src_area_size = dst_area_size << 1;
+			std::vector<uint8_t> src_area(get_size_in_bytes_for_volume(src_area_size, src_channel.depth));
+			decode_channel_data_area(src_channel.data, src_channel.compression, src_channel.depth,
+					_size, src_min, src_area_size, src_area.data(), src_area_size, Vector3i());
+
+			downscale_channel(src_channel.depth, filter, src_area.data(), src_area_size, Vector3i(),
+					dst_channel.data, dst._size, dst_min, dst_area_size);
+
+		} else {
+			downscale_channel(src_channel.depth, filter, src_channel.data, _size, src_min,
+					dst_channel.data, dst._size, dst_min, dst_area_size);
+		}
+	}
+}
+
+// Downscaling going through get_voxel and set_voxel, works with any channel format.
+// Cells are filtered with the same kernels as dense channels when depths match, otherwise through reals.
+void VoxelBuffer::downscale_channel_generic(VoxelBuffer &dst, unsigned int channel_index, DownscaleFilter filter,
+		Vector3i src_min, Vector3i dst_min, Vector3i dst_max) const {
 
-					dst.set_voxel(v, pos, channel_index);
+	const Depth depth = _channels[channel_index].depth;
+	const bool same_depth = depth == dst._channels[channel_index].depth;
+	const uint32_t value_size = ::get_depth_bit_count(depth) / 8;
+	const Vector3i cell_size(2);
+
+	// Enough room for a cell of 64-bit voxels, in the same layout as a buffer of 2x2x2
+	uint64_t cell[8];
+	uint64_t downscaled;
+
+	Vector3i pos;
+	for (pos.z = dst_min.z; pos.z < dst_max.z; ++pos.z) {
+		for (pos.x = dst_min.x; pos.x < dst_max.x; ++pos.x) {
+			for (pos.y = dst_min.y; pos.y < dst_max.y; ++pos.y) {
+				const Vector3i src_pos = src_min + ((pos - dst_min) << 1);
+
+				if (filter == DOWNSCALE_NEAREST) {
+					dst.set_voxel(get_voxel(src_pos, channel_index), pos, channel_index);
+
+				} else if (same_depth) {
+					for (unsigned int i = 0; i < 8; ++i) {
+						const Vector3i offset((i >> 1) & 1, i & 1, i >> 2);
+						set_palette_value(reinterpret_cast<uint8_t *>(cell), value_size, i,
+								get_voxel(src_pos + offset, channel_index));
+					}
+					downscale_channel(depth, filter, reinterpret_cast<const uint8_t *>(cell), cell_size, Vector3i(),
+							reinterpret_cast<uint8_t *>(&downscaled), Vector3i(1), Vector3i(), Vector3i(1));
+					dst.set_voxel(get_palette_value(reinterpret_cast<const uint8_t *>(&downscaled), value_size, 0),
+							pos, channel_index);
+
+				} else {
+					real_t sum = 0;
+					real_t closest = get_voxel_f(src_pos.x, src_pos.y, src_pos.z, channel_index);
+					for (unsigned int i = 0; i < 8; ++i) {
+						const Vector3i p = src_pos + Vector3i((i >> 1) & 1, i & 1, i >> 2);
+						const real_t v = get_voxel_f(p.x, p.y, p.z, channel_index);
+						sum += v;
+						if (Math::abs(v) < Math::abs(closest)) {
+							closest = v;
+						}
+					}
+					dst.set_voxel_f(filter == DOWNSCALE_AVERAGE ? sum * 0.125f : closest,
+							pos.x, pos.y, pos.z, channel_index);
 				}
 			}
 		}
 	}
 }
 
+Dictionary VoxelBuffer::debug_measure_downscale(int iterations) const {
+	ERR_FAIL_COND_V(iterations <= 0, Dictionary());
+
+	Ref<VoxelBuffer> dst;
+	dst.instance();
+	dst->create(_size >> 1);
+	for (unsigned int channel_index = 0; channel_index < MAX_CHANNELS; ++channel_index) {
+		dst->set_channel_depth(channel_index, get_channel_depth(channel_index));
+	}
+
+	ProfilingClock profiling_clock;
+
+	for (int i = 0; i < iterations; ++i) {
+		for (unsigned int channel_index = 0; channel_index < MAX_CHANNELS; ++channel_index) {
+			if (_channels[channel_index].data != nullptr) {
+				downscale_channel_generic(**dst, channel_index, DOWNSCALE_NEAREST, Vector3i(), Vector3i(), dst->get_size());
+			}
+		}
+	}
+	const uint64_t generic_usec = profiling_clock.restart();
+
+	FixedArray<uint64_t, DOWNSCALE_FILTER_COUNT> filter_usec;
+	for (unsigned int filter = 0; filter < DOWNSCALE_FILTER_COUNT; ++filter) {
+		const DownscaleFilters filters(static_cast<DownscaleFilter>(filter));
+		profiling_clock.restart();
+		for (int i = 0; i < iterations; ++i) {
+			downscale_to(**dst, Vector3i(), _size, Vector3i(), filters);
+		}
+		filter_usec[filter] = profiling_clock.restart();
+	}
+
+	Dictionary d;
+	d["iterations"] = iterations;
+	d["generic_usec"] = generic_usec;
+	d["nearest_usec"] = filter_usec[DOWNSCALE_NEAREST];
+	d["average_usec"] = filter_usec[DOWNSCALE_AVERAGE];
+	d["min_abs_usec"] = filter_usec[DOWNSCALE_MIN_ABS];
+	return d;
+}
+
 Ref<VoxelTool> VoxelBuffer::get_voxel_tool() {
 	// I can't make this function `const`, because `Ref<T>` has no constructor taking a `const T*`.
 	// The compiler would then choose Ref<T>(const Variant&), which fumbles `this` into a null pointer
@@ -672,13 +2821,40 @@ bool VoxelBuffer::equals(const VoxelBuffer *p_other) const {
 			return false;
 		}
 
+		if (channel.data != nullptr && channel.data == other_channel.data) {
+			// Shared
+			continue;
+		}
+
+		if (channel.data != nullptr &&
+				(channel.compression == COMPRESSION_PALETTE || other_channel.compression == COMPRESSION_PALETTE ||
+						channel.compression == COMPRESSION_SPARSE || other_channel.compression == COMPRESSION_SPARSE)) {
+			// Palettes and sparse slots depend on the order values were added in, so they are compared voxel by voxel
+			Vector3i pos;
+			for (pos.z = 0; pos.z < _size.z; ++pos.z) {
+				for (pos.x = 0; pos.x < _size.x; ++pos.x) {
+					for (pos.y = 0; pos.y < _size.y; ++pos.y) {
+						if (get_voxel(pos, channel_index) != p_other->get_voxel(pos, channel_index)) {
+							return false;
+						}
+					}
+				}
+			}
+			continue;
+		}
+
+		// RLE encoding only depends on contents, so it can be compared byte by byte too
+		if (channel.compression != other_channel.compression ||
+				channel.size_in_bytes != other_channel.size_in_bytes) {
+			return false;
+		}
+
 		if (channel.data == nullptr) {
 			if (channel.defval != other_channel.defval) {
 				return false;
 			}
 
 		} else {
-			CRASH_COND(channel.size_in_bytes != other_channel.size_in_bytes);
 			for (unsigned int i = 0; i < channel.size_in_bytes; ++i) {
 				if (channel.data[i] != other_channel.data[i]) {
 					return false;
@@ -719,11 +2895,23 @@ void VoxelBuffer::set_block_metadata(Variant meta) {
 	_block_metadata = meta;
 }
 
+namespace {
+
+template <typename It_T>
+inline It_T find_voxel_metadata(It_T begin, It_T end, uint32_t index) {
+	return std::lower_bound(begin, end, index, [](const VoxelBuffer::VoxelMetadata &m, uint32_t i) {
+		return m.index < i;
+	});
+}
+
+} // namespace
+
 Variant VoxelBuffer::get_voxel_metadata(Vector3i pos) const {
 	ERR_FAIL_COND_V(!is_position_valid(pos), Variant());
-	const Map<Vector3i, Variant>::Element *elem = _voxel_metadata.find(pos);
-	if (elem != nullptr) {
-		return elem->value();
+	const uint32_t i = index(pos.x, pos.y, pos.z);
+	auto it = find_voxel_metadata(_voxel_metadata.begin(), _voxel_metadata.end(), i);
+	if (it != _voxel_metadata.end() && it->index == i) {
+		return it->value;
 	} else {
 		return Variant();
 	}
@@ -731,20 +2919,51 @@ Variant VoxelBuffer::get_voxel_metadata(Vector3i pos) const {
 
 void VoxelBuffer::set_voxel_metadata(Vector3i pos, Variant meta) {
 	ERR_FAIL_COND(!is_position_valid(pos));
+	const uint32_t i = index(pos.x, pos.y, pos.z);
+	auto it = find_voxel_metadata(_voxel_metadata.begin(), _voxel_metadata.end(), i);
+	const bool found = it != _voxel_metadata.end() && it->index == i;
 	if (meta.get_type() == Variant::NIL) {
-		_voxel_metadata.erase(pos);
+		if (found) {
+			_voxel_metadata.erase(it);
+		}
+	} else if (found) {
+		it->value = meta;
 	} else {
-		_voxel_metadata[pos] = meta;
+		_voxel_metadata.insert(it, VoxelMetadata{ i, meta });
 	}
 }
 
 void VoxelBuffer::for_each_voxel_metadata(Ref<FuncRef> callback) const {
 	ERR_FAIL_COND(callback.is_null());
-	const Map<Vector3i, Variant>::Element *elem = _voxel_metadata.front();
+	for_each_voxel_metadata_in_area(callback, Rect3i(Vector3i(), _size));
+}
+
+void VoxelBuffer::for_each_voxel_metadata_in_area(Ref<FuncRef> callback, Rect3i box) const {
+	ERR_FAIL_COND(callback.is_null());
+	box.clip(Rect3i(Vector3i(), _size));
+	if (box.size.volume() <= 0) {
+		return;
+	}
 
-	while (elem != nullptr) {
-		const Variant key = elem->key().to_vec3();
-		const Variant *args[2] = { &key, &elem->value() };
+	// Voxels of the box can only be between its first and last corner in index order
+	const uint32_t begin_index = index(box.pos.x, box.pos.y, box.pos.z);
+	const Vector3i last = box.pos + box.size - Vector3i(1);
+	const uint32_t end_index = index(last.x, last.y, last.z) + 1;
+
+	size_t i = find_voxel_metadata(_voxel_metadata.begin(), _voxel_metadata.end(), begin_index) -
+			   _voxel_metadata.begin();
+
+	// Indexes are used instead of iterators, because the callback could modify metadata
+	for (; i < _voxel_metadata.size() && _voxel_metadata[i].index < end_index; ++i) {
+		const Vector3i pos = get_position_from_index(_voxel_metadata[i].index);
+		if (!box.contains(pos)) {
+			continue;
+		}
+
+		// Copied because the callback could modify metadata
+		const Variant key = pos.to_vec3();
+		const Variant value = _voxel_metadata[i].value;
+		const Variant *args[2] = { &key, &value };
 		Variant::CallError err;
 		callback->call_func(args, 2, err);
 
@@ -753,30 +2972,6 @@ void VoxelBuffer::for_each_voxel_metadata(Ref<FuncRef> callback) const {
 		// TODO Can't provide detailed error because FuncRef doesn't give us access to the object
 		// ERR_FAIL_COND_MSG(err.error != Variant::CallError::CALL_OK, false,
 		// 		Variant::get_call_error_text(callback->get_object(), method_name, nullptr, 0, err));
-
-		elem = elem->next();
-	}
-}
-
-void VoxelBuffer::for_each_voxel_metadata_in_area(Ref<FuncRef> callback, Rect3i box) const {
-	ERR_FAIL_COND(callback.is_null());
-	const Map<Vector3i, Variant>::Element *elem = _voxel_metadata.front();
-
-	while (elem != nullptr) {
-		if (box.contains(elem->key())) {
-			const Variant key = elem->key().to_vec3();
-			const Variant *args[2] = { &key, &elem->value() };
-			Variant::CallError err;
-			callback->call_func(args, 2, err);
-
-			ERR_FAIL_COND_MSG(err.error != Variant::CallError::CALL_OK,
-					String("FuncRef call failed at {0}").format(varray(key)));
-			// TODO Can't provide detailed error because FuncRef doesn't give us access to the object
-			// ERR_FAIL_COND_MSG(err.error != Variant::CallError::CALL_OK, false,
-			// 		Variant::get_call_error_text(callback->get_object(), method_name, nullptr, 0, err));
-
-			elem = elem->next();
-		}
 	}
 }
 
@@ -785,45 +2980,64 @@ void VoxelBuffer::clear_voxel_metadata() {
 }
 
 void VoxelBuffer::clear_voxel_metadata_in_area(Rect3i box) {
-	Map<Vector3i, Variant>::Element *elem = _voxel_metadata.front();
-	while (elem != nullptr) {
-		if (box.contains(elem->key())) {
-			Map<Vector3i, Variant>::Element *next_elem = elem->next();
-			_voxel_metadata.erase(elem);
-			elem = next_elem;
-		}
+	box.clip(Rect3i(Vector3i(), _size));
+	if (box.size.volume() <= 0) {
+		return;
 	}
+
+	const uint32_t begin_index = index(box.pos.x, box.pos.y, box.pos.z);
+	const Vector3i last = box.pos + box.size - Vector3i(1);
+	const uint32_t end_index = index(last.x, last.y, last.z) + 1;
+
+	auto begin = find_voxel_metadata(_voxel_metadata.begin(), _voxel_metadata.end(), begin_index);
+	auto end = find_voxel_metadata(begin, _voxel_metadata.end(), end_index);
+
+	auto new_end = std::remove_if(begin, end, [this, box](const VoxelMetadata &m) {
+		return box.contains(get_position_from_index(m.index));
+	});
+	_voxel_metadata.erase(new_end, end);
 }
 
 void VoxelBuffer::copy_voxel_metadata_in_area(Ref<VoxelBuffer> src_buffer, Rect3i src_box, Vector3i dst_origin) {
 	ERR_FAIL_COND(src_buffer.is_null());
-	ERR_FAIL_COND(src_buffer->is_box_valid(src_box));
+	ERR_FAIL_COND(!src_buffer->is_box_valid(src_box));
 
+	// Only the part of the source box which lands inside this buffer
 	const Rect3i clipped_src_box = src_box.clipped(Rect3i(src_box.pos - dst_origin, _size));
-	const Vector3i clipped_dst_offset = dst_origin + clipped_src_box.pos - src_box.pos;
-
-	const Map<Vector3i, Variant>::Element *elem = src_buffer->_voxel_metadata.front();
-
-	while (elem != nullptr) {
-		const Vector3i src_pos = elem->key();
-		if (src_box.contains(src_pos)) {
-			const Vector3i dst_pos = src_pos + clipped_dst_offset;
+	if (clipped_src_box.size.volume() <= 0) {
+		return;
+	}
+	const Vector3i dst_offset = dst_origin - src_box.pos;
+
+	const std::vector<VoxelMetadata> &src_metadata = src_buffer->_voxel_metadata;
+	const uint32_t begin_index = src_buffer->index(clipped_src_box.pos.x, clipped_src_box.pos.y, clipped_src_box.pos.z);
+	const Vector3i last = clipped_src_box.pos + clipped_src_box.size - Vector3i(1);
+	const uint32_t end_index = src_buffer->index(last.x, last.y, last.z) + 1;
+
+	auto it = find_voxel_metadata(src_metadata.begin(), src_metadata.end(), begin_index);
+	for (; it != src_metadata.end() && it->index < end_index; ++it) {
+		const Vector3i src_pos = src_buffer->get_position_from_index(it->index);
+		if (clipped_src_box.contains(src_pos)) {
+			const Vector3i dst_pos = src_pos + dst_offset;
 			CRASH_COND(!is_position_valid(dst_pos));
-			_voxel_metadata[dst_pos] = elem->value().duplicate();
+			set_voxel_metadata(dst_pos, it->value.duplicate());
 		}
-		elem = elem->next();
 	}
 }
 
 void VoxelBuffer::copy_voxel_metadata(const VoxelBuffer &src_buffer) {
 	ERR_FAIL_COND(src_buffer.get_size() != _size);
 
-	const Map<Vector3i, Variant>::Element *elem = src_buffer._voxel_metadata.front();
-
-	while (elem != nullptr) {
-		const Vector3i pos = elem->key();
-		_voxel_metadata[pos] = elem->value().duplicate();
-		elem = elem->next();
+	if (_voxel_metadata.empty()) {
+		// Same size, so same order
+		_voxel_metadata.reserve(src_buffer._voxel_metadata.size());
+		for (auto it = src_buffer._voxel_metadata.begin(); it != src_buffer._voxel_metadata.end(); ++it) {
+			_voxel_metadata.push_back(VoxelMetadata{ it->index, it->value.duplicate() });
+		}
+	} else {
+		for (auto it = src_buffer._voxel_metadata.begin(); it != src_buffer._voxel_metadata.end(); ++it) {
+			set_voxel_metadata(get_position_from_index(it->index), it->value.duplicate());
+		}
 	}
 
 	_block_metadata = src_buffer._block_metadata.duplicate();
@@ -876,11 +3090,21 @@ void VoxelBuffer::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("copy_channel_from", "other", "channel"), &VoxelBuffer::_b_copy_channel_from);
 	ClassDB::bind_method(D_METHOD("copy_channel_from_area", "other", "src_min", "src_max", "dst_min", "channel"), &VoxelBuffer::_b_copy_channel_from_area);
 	ClassDB::bind_method(D_METHOD("downscale_to", "dst", "src_min", "src_max", "dst_min"), &VoxelBuffer::_b_downscale_to);
+	ClassDB::bind_method(D_METHOD("get_channel_as_byte_array", "channel"), &VoxelBuffer::_b_get_channel_as_byte_array);
+	ClassDB::bind_method(D_METHOD("set_channel_from_byte_array", "channel", "data"),
+			&VoxelBuffer::_b_set_channel_from_byte_array);
+	ClassDB::bind_method(D_METHOD("get_voxels_f", "min", "max", "channel", "scale"), &VoxelBuffer::_b_get_voxels_f,
+			DEFVAL(0), DEFVAL(1.0));
+	ClassDB::bind_method(D_METHOD("set_voxels_f", "values", "min", "max", "channel", "scale"),
+			&VoxelBuffer::_b_set_voxels_f, DEFVAL(0), DEFVAL(1.0));
 
 	ClassDB::bind_method(D_METHOD("is_uniform", "channel"), &VoxelBuffer::is_uniform);
 	// TODO Rename `compress_uniform_channels`
 	ClassDB::bind_method(D_METHOD("optimize"), &VoxelBuffer::compress_uniform_channels);
+	ClassDB::bind_method(D_METHOD("compress_channels"), &VoxelBuffer::compress_channels);
 	ClassDB::bind_method(D_METHOD("get_channel_compression", "channel"), &VoxelBuffer::get_channel_compression);
+	ClassDB::bind_method(D_METHOD("set_channel_sparse", "channel", "sparse"), &VoxelBuffer::set_channel_sparse);
+	ClassDB::bind_method(D_METHOD("is_channel_sparse", "channel"), &VoxelBuffer::is_channel_sparse);
 
 	ClassDB::bind_method(D_METHOD("get_block_metadata"), &VoxelBuffer::get_block_metadata);
 	ClassDB::bind_method(D_METHOD("set_block_metadata", "meta"), &VoxelBuffer::set_block_metadata);
@@ -910,6 +3134,9 @@ void VoxelBuffer::_bind_methods() {
 
 	BIND_ENUM_CONSTANT(COMPRESSION_NONE);
 	BIND_ENUM_CONSTANT(COMPRESSION_UNIFORM);
+	BIND_ENUM_CONSTANT(COMPRESSION_RLE);
+	BIND_ENUM_CONSTANT(COMPRESSION_PALETTE);
+	BIND_ENUM_CONSTANT(COMPRESSION_SPARSE);
 	BIND_ENUM_CONSTANT(COMPRESSION_COUNT);
 }
 
@@ -928,6 +3155,52 @@ void VoxelBuffer::_b_downscale_to(Ref<VoxelBuffer> dst, Vector3 src_min, Vector3
 	downscale_to(**dst, Vector3i(src_min), Vector3i(src_max), Vector3i(dst_min));
 }
 
+// Scripts can't share the memory of channels, so this always returns a copy.
+// Uncompressed channels are copied as they are, others get expanded.
+PoolByteArray VoxelBuffer::_b_get_channel_as_byte_array(unsigned int channel_index) const {
+	PoolByteArray dst;
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, dst);
+
+	ArraySlice<uint8_t> raw;
+	if (get_channel_raw(channel_index, raw)) {
+		dst.resize(raw.size());
+		PoolByteArray::Write w = dst.write();
+		memcpy(w.ptr(), raw.data(), raw.size());
+		return dst;
+	}
+
+	dst.resize(get_size_in_bytes_for_volume(_size, _channels[channel_index].depth));
+	{
+		PoolByteArray::Write w = dst.write();
+		copy_channel_raw_to(channel_index, ArraySlice<uint8_t>(w.ptr(), 0, dst.size()));
+	}
+	return dst;
+}
+
+void VoxelBuffer::_b_set_channel_from_byte_array(unsigned int channel_index, PoolByteArray data) {
+	PoolByteArray::Read r = data.read();
+	set_channel_raw(channel_index, ArraySlice<const uint8_t>(r.ptr(), 0, data.size()));
+}
+
+PoolRealArray VoxelBuffer::_b_get_voxels_f(Vector3 min, Vector3 max, unsigned int channel_index, real_t scale) const {
+	PoolRealArray dst;
+	const Rect3i box = Rect3i::from_min_max(Vector3i(min), Vector3i(max));
+	ERR_FAIL_COND_V(!is_box_valid(box), dst);
+	dst.resize(box.size.volume());
+	{
+		PoolRealArray::Write w = dst.write();
+		get_voxels_f(box, channel_index, ArraySlice<real_t>(w.ptr(), 0, dst.size()), scale);
+	}
+	return dst;
+}
+
+void VoxelBuffer::_b_set_voxels_f(PoolRealArray values, Vector3 min, Vector3 max, unsigned int channel_index,
+		real_t scale) {
+	PoolRealArray::Read r = values.read();
+	set_voxels_f(Rect3i::from_min_max(Vector3i(min), Vector3i(max)), channel_index,
+			ArraySlice<const real_t>(r.ptr(), 0, values.size()), scale);
+}
+
 void VoxelBuffer::_b_for_each_voxel_metadata_in_area(Ref<FuncRef> callback, Vector3 min_pos, Vector3 max_pos) {
 	for_each_voxel_metadata_in_area(callback, Rect3i::from_min_max(Vector3i(min_pos), Vector3i(max_pos)));
 }
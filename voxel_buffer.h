@@ -5,15 +5,48 @@
 #include "util/array_slice.h"
 #include "util/fixed_array.h"
 
-#include <core/map.h>
+#include <core/io/marshalls.h>
 #include <core/reference.h>
 #include <core/vector.h>
+#include <vector>
 
 class VoxelTool;
 class Image;
 class FuncRef;
 class RWLock;
 
+// Typed access to the voxels of one channel of a cubic buffer, with size and depth known at compile time.
+// Index calculations fold into constants, and no depth or compression check happens per voxel.
+// Obtained with `VoxelBuffer::get_channel_view()`, it is only valid as long as the buffer is not modified otherwise.
+// Use a `const T` type for read-only access.
+template <typename T, unsigned int SIZE>
+class VoxelBufferCubeView {
+public:
+	static const unsigned int VOLUME = SIZE * SIZE * SIZE;
+
+	// Same layout as VoxelBuffer
+	static inline unsigned int index(unsigned int x, unsigned int y, unsigned int z) {
+		return y + SIZE * (x + SIZE * z);
+	}
+
+	inline bool is_valid() const { return _data != nullptr; }
+
+	inline T get(unsigned int x, unsigned int y, unsigned int z) const {
+		return _data[index(x, y, z)];
+	}
+
+	inline void set(T value, unsigned int x, unsigned int y, unsigned int z) {
+		_data[index(x, y, z)] = value;
+	}
+
+	// Flat access, in the same order as `index()`
+	inline T *data() const { return _data; }
+
+private:
+	friend class VoxelBuffer;
+	T *_data = nullptr;
+};
+
 // Dense voxels data storage.
 // Organized in channels of configurable bit depth.
 // Values can be interpreted either as unsigned integers or normalized floats.
@@ -40,7 +73,14 @@ public:
 	enum Compression {
 		COMPRESSION_NONE = 0,
 		COMPRESSION_UNIFORM,
-		//COMPRESSION_RLE,
+		// Runs of identical values along Y columns. Transparent for reads, writes decompress the channel.
+		COMPRESSION_RLE,
+		// Distinct values are stored once, voxels are indices packed in 1, 2, 4 or 8 bits.
+		// Transparent for reads and writes, the palette grows as new values get written.
+		COMPRESSION_PALETTE,
+		// Voxels are split in bricks of 8x8x8, which only get allocated when they contain different values.
+		// Used by channels made sparse with `set_channel_sparse`. Transparent for reads and writes.
+		COMPRESSION_SPARSE,
 		COMPRESSION_COUNT
 	};
 
@@ -54,6 +94,17 @@ public:
 
 	static const Depth DEFAULT_CHANNEL_DEPTH = DEPTH_8_BIT;
 
+	// How each 2x2x2 cell of voxels is reduced to one voxel by downscale_to.
+	// Average and min-abs interpret values as reals, the same way get_voxel_f does.
+	enum DownscaleFilter {
+		// Takes one voxel of the cell. Suits values that can't be blended, like types.
+		DOWNSCALE_NEAREST = 0,
+		DOWNSCALE_AVERAGE,
+		// Takes the value closest to zero, which preserves surfaces of signed distance fields
+		DOWNSCALE_MIN_ABS,
+		DOWNSCALE_FILTER_COUNT
+	};
+
 	// Limit was made explicit for serialization reasons, and also because there must be a reasonable one
 	static const uint32_t MAX_SIZE = 65535;
 
@@ -77,22 +128,44 @@ public:
 	void set_voxel_f(real_t value, int x, int y, int z, unsigned int channel_index = 0);
 
 	_FORCE_INLINE_ uint64_t get_voxel(const Vector3i pos, unsigned int channel_index = 0) const { return get_voxel(pos.x, pos.y, pos.z, channel_index); }
-	_FORCE_INLINE_ void set_voxel(int value, const Vector3i pos, unsigned int channel_index = 0) { set_voxel(value, pos.x, pos.y, pos.z, channel_index); }
+	_FORCE_INLINE_ void set_voxel(uint64_t value, const Vector3i pos, unsigned int channel_index = 0) { set_voxel(value, pos.x, pos.y, pos.z, channel_index); }
 
 	void fill(uint64_t defval, unsigned int channel_index = 0);
 	void fill_area(uint64_t defval, Vector3i min, Vector3i max, unsigned int channel_index = 0);
 	void fill_f(real_t value, unsigned int channel = 0);
 
+	// Bulk conversion between real values and the voxels of a box, which is faster than going voxel by voxel.
+	// Values are ordered like channel data, with Y being the fastest axis, so a column of voxels is contiguous.
+	// Values are multiplied by `scale` when stored and divided by it when read. In 8 and 16-bit channels, which are
+	// quantized in the [-1, 1] range, it allows to trade range for precision.
+	void set_voxels_f(Rect3i box, unsigned int channel_index, ArraySlice<const real_t> values, real_t scale = 1.f);
+	void get_voxels_f(Rect3i box, unsigned int channel_index, ArraySlice<real_t> out_values, real_t scale = 1.f) const;
+
+	// Channels found non-uniform by a previous compression are not scanned again until they get modified
 	bool is_uniform(unsigned int channel_index) const;
 
 	void compress_uniform_channels();
+	// Compresses channels as uniform if they are, otherwise with the smallest of RLE and palette modes,
+	// if it uses at least a quarter less memory than dense data
+	void compress_channels();
 	void decompress_channel(unsigned int channel_index);
 	Compression get_channel_compression(unsigned int channel_index) const;
 
+	// Sparse channels allocate memory for bricks of voxels as they get written to, instead of the whole channel.
+	// Bricks containing a single value take no more space than that value. This suits large buffers with a lot of
+	// empty space, like prefabs. Access is the same, but writes in bulk are slower than with dense channels.
+	void set_channel_sparse(unsigned int channel_index, bool sparse);
+	bool is_channel_sparse(unsigned int channel_index) const;
+
 	static uint32_t get_size_in_bytes_for_volume(Vector3i size, Depth depth);
 
+	// Bytes allocated for voxel data, without metadata.
+	// Data shared with other buffers is counted as if it was not.
+	size_t get_memory_usage() const;
+
 	// Note: these functions don't include metadata on purpose.
 	// If you also want to copy metadata, use the specialized functions.
+	// Whole channels are not copied right away. Both buffers share the data until one of them writes to it.
 	void copy_from(const VoxelBuffer &other);
 	void copy_from(const VoxelBuffer &other, unsigned int channel_index);
 	void copy_from(const VoxelBuffer &other, Vector3i src_min, Vector3i src_max, Vector3i dst_min, unsigned int channel_index);
@@ -115,6 +188,11 @@ public:
 		return y + _size.y * (x + _size.x * z);
 	}
 
+	_FORCE_INLINE_ Vector3i get_position_from_index(unsigned int i) const {
+		const unsigned int xz = i / _size.y;
+		return Vector3i(xz % _size.x, i % _size.y, xz / _size.x);
+	}
+
 	//	_FORCE_INLINE_ unsigned int row_index(unsigned int x, unsigned int y, unsigned int z) const {
 	//		return _size.y * (x + _size.x * z);
 	//	}
@@ -124,9 +202,43 @@ public:
 	}
 
 	// TODO Have a template version based on channel depth
+	// Only succeeds if the channel is not compressed.
+	// Writing through the slice is only allowed on freshly created channels, which are neither shared with another
+	// buffer nor checked for uniformity yet. Otherwise, use `set_voxel` or `read_write_action`.
 	bool get_channel_raw(unsigned int channel_index, ArraySlice<uint8_t> &slice) const;
 
+	// Copies all voxels of a channel in the same form as `get_channel_raw`, expanding it if it is compressed.
+	// `dst` must have the size of dense data, given by `get_size_in_bytes_for_volume`.
+	void copy_channel_raw_to(unsigned int channel_index, ArraySlice<uint8_t> dst) const;
+	// Replaces all voxels of a channel with raw data in the same form
+	void set_channel_raw(unsigned int channel_index, ArraySlice<const uint8_t> src);
+
+	// Access to RLE or palette channels in their compressed form, so they can be stored without being expanded.
+	// Formats are native-endian.
+	// RLE, in this order:
+	// - uint32 column_starts[size.x * size.z + 1]: index of the first run of each column, X being the fastest axis
+	// - uint16 run_ends[run_count]: Y coordinate where each run stops, exclusive
+	// - Padding up to 8 bytes alignment
+	// - Values of each run, with the depth of the channel
+	// Palette, in this order:
+	// - uint32 bits: size of indices, 1, 2, 4 or 8
+	// - uint32 palette_size: how many values are used in the palette
+	// - Values of the palette, with the depth of the channel. There is room for 2^bits of them.
+	// - Indices packed in bytes, lowest bits first, in the same order as voxels
+	bool get_channel_compressed_data(unsigned int channel_index, ArraySlice<uint8_t> &slice) const;
+	// Returns false if the data is not valid for the current size and depth of the channel
+	bool set_channel_compressed_data(unsigned int channel_index, Compression compression,
+			const uint8_t *data, uint32_t size_in_bytes);
+
+	// Gets values of the palette if the channel uses one. It can contain values no longer present in the channel.
+	bool get_channel_palette(unsigned int channel_index, std::vector<uint64_t> &out_values) const;
+
+	typedef FixedArray<DownscaleFilter, MAX_CHANNELS> DownscaleFilters;
+
+	// Halves the resolution of an area into another buffer. All channels use nearest filtering.
 	void downscale_to(VoxelBuffer &dst, Vector3i src_min, Vector3i src_max, Vector3i dst_min) const;
+	void downscale_to(VoxelBuffer &dst, Vector3i src_min, Vector3i src_max, Vector3i dst_min,
+			const DownscaleFilters &filters) const;
 	Ref<VoxelTool> get_voxel_tool();
 
 	bool equals(const VoxelBuffer *p_other) const;
@@ -137,6 +249,12 @@ public:
 
 	// Metadata
 
+	struct VoxelMetadata {
+		// Index of the voxel, in the same order as channel data
+		uint32_t index;
+		Variant value;
+	};
+
 	Variant get_block_metadata() const { return _block_metadata; }
 	void set_block_metadata(Variant meta);
 	Variant get_voxel_metadata(Vector3i pos) const;
@@ -148,43 +266,289 @@ public:
 	void copy_voxel_metadata_in_area(Ref<VoxelBuffer> src_buffer, Rect3i src_box, Vector3i dst_origin);
 	void copy_voxel_metadata(const VoxelBuffer &src_buffer);
 
-	const Map<Vector3i, Variant> &get_voxel_metadata() const { return _voxel_metadata; }
+	// Sorted by voxel index
+	const std::vector<VoxelMetadata> &get_voxel_metadata() const { return _voxel_metadata; }
 
 	// Internal synchronization.
 	// This lock is optional, and used internally at the moment, only in multithreaded areas.
 	inline const RWLock *get_lock() const { return _rw_lock; }
 	inline RWLock *get_lock() { return _rw_lock; }
 
-	// TODO Make this work, would be awesome for perf
-	//
-	//	template <typename F>
-	//	void read_write_action(Rect3i box, Vector3i offset, unsigned int channel_index, F f) {
-	//		ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
-	//		box.clip(Rect3i(Vector3i(), _size));
-	//		Vector3i min_pos = box.pos;
-	//		Vector3i max_pos = box.pos + box.size;
-	//		Vector3i pos;
-	//		for (pos.z = min_pos.z; pos.z < max_pos.z; ++pos.z) {
-	//			for (pos.x = min_pos.x; pos.x < max_pos.x; ++pos.x) {
-	//				for (pos.y = min_pos.y; pos.y < max_pos.y; ++pos.y) {
-	//					int v0 = get_voxel(pos, channel_index);
-	//					int v1 = f(pos + offset, v0);
-	//					if (v0 != v1) {
-	//						set_voxel(v1, pos, channel_index);
-	//					}
-	//				}
-	//			}
-	//		}
-	//	}
+	// Calls `action(Vector3i pos, uint64_t value) -> uint64_t` on every voxel of the box, and stores what it returns.
+	// The box is clipped to the buffer. Channel depth is resolved once per call instead of once per voxel,
+	// so this is much faster than get_voxel/set_voxel in a loop. The channel gets decompressed first.
+	template <typename F>
+	void read_write_action(Rect3i box, unsigned int channel_index, F action) {
+		if (is_channel_written_sparse(channel_index)) {
+			read_write_action_generic(box, channel_index, action);
+			return;
+		}
+		if (!prepare_read_write_action(box, channel_index)) {
+			return;
+		}
+		Channel &channel = _channels[channel_index];
+		switch (channel.depth) {
+			case DEPTH_8_BIT:
+				read_write_action_t(channel.data, box, [&action](Vector3i pos, uint8_t v) {
+					const uint64_t r = action(pos, v);
+					return static_cast<uint8_t>(r < 0xff ? r : 0xff);
+				});
+				break;
+			case DEPTH_16_BIT:
+				read_write_action_t(reinterpret_cast<uint16_t *>(channel.data), box, [&action](Vector3i pos, uint16_t v) {
+					const uint64_t r = action(pos, v);
+					return static_cast<uint16_t>(r < 0xffff ? r : 0xffff);
+				});
+				break;
+			case DEPTH_32_BIT:
+				read_write_action_t(reinterpret_cast<uint32_t *>(channel.data), box, [&action](Vector3i pos, uint32_t v) {
+					const uint64_t r = action(pos, v);
+					return static_cast<uint32_t>(r < 0xffffffff ? r : 0xffffffff);
+				});
+				break;
+			case DEPTH_64_BIT:
+				read_write_action_t(reinterpret_cast<uint64_t *>(channel.data), box, action);
+				break;
+			default:
+				CRASH_NOW();
+				break;
+		}
+	}
+
+	// Same as read_write_action, with values converted like get_voxel_f and set_voxel_f do.
+	// `action` is called as `action(Vector3i pos, real_t value) -> real_t`.
+	template <typename F>
+	void read_write_action_f(Rect3i box, unsigned int channel_index, F action) {
+		if (is_channel_written_sparse(channel_index)) {
+			read_write_action_f_generic(box, channel_index, action);
+			return;
+		}
+		if (!prepare_read_write_action(box, channel_index)) {
+			return;
+		}
+		Channel &channel = _channels[channel_index];
+		switch (channel.depth) {
+			case DEPTH_8_BIT:
+				read_write_action_t(channel.data, box, [&action](Vector3i pos, uint8_t v) {
+					return real_to_raw_8(action(pos, raw_8_to_real(v)));
+				});
+				break;
+			case DEPTH_16_BIT:
+				read_write_action_t(reinterpret_cast<uint16_t *>(channel.data), box, [&action](Vector3i pos, uint16_t v) {
+					return real_to_raw_16(action(pos, raw_16_to_real(v)));
+				});
+				break;
+			case DEPTH_32_BIT:
+				read_write_action_t(reinterpret_cast<uint32_t *>(channel.data), box, [&action](Vector3i pos, uint32_t v) {
+					return real_to_raw_32(action(pos, raw_32_to_real(v)));
+				});
+				break;
+			case DEPTH_64_BIT:
+				read_write_action_t(reinterpret_cast<uint64_t *>(channel.data), box, [&action](Vector3i pos, uint64_t v) {
+					return real_to_raw_64(action(pos, raw_64_to_real(v)));
+				});
+				break;
+			default:
+				CRASH_NOW();
+				break;
+		}
+	}
+
+	// Gets a view of the channel for reading, specialized for cubic buffers of `SIZE` and channels of `T`'s width.
+	// Returns false if the buffer doesn't match or if the channel is not dense, in which case generic access must be used.
+	template <typename T, unsigned int SIZE>
+	bool get_channel_view(unsigned int channel_index, VoxelBufferCubeView<const T, SIZE> &out_view) const {
+		ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, false);
+		const Channel &channel = _channels[channel_index];
+		if (!is_channel_view_compatible(channel_index, SIZE, sizeof(T)) || channel.compression != COMPRESSION_NONE) {
+			return false;
+		}
+		out_view._data = reinterpret_cast<const T *>(channel.data);
+		return true;
+	}
+
+	// Same as get_channel_view, for writing. The channel gets decompressed, and stops being shared with other buffers.
+	template <typename T, unsigned int SIZE>
+	bool get_channel_view_for_write(unsigned int channel_index, VoxelBufferCubeView<T, SIZE> &out_view) {
+		ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, false);
+		if (!is_channel_view_compatible(channel_index, SIZE, sizeof(T)) || is_channel_written_sparse(channel_index)) {
+			return false;
+		}
+		Rect3i box(Vector3i(), _size);
+		if (!prepare_read_write_action(box, channel_index)) {
+			return false;
+		}
+		out_view._data = reinterpret_cast<T *>(_channels[channel_index].data);
+		return true;
+	}
+
+	// Read-only reference to the data of one channel, taken without copying voxels.
+	// It stays valid after the buffer is unlocked or modified, because writes give the buffer its own copy.
+	class ChannelSnapshot {
+	public:
+		ChannelSnapshot() {}
+		~ChannelSnapshot() { clear(); }
+
+		void clear();
+
+		inline Compression get_compression() const { return _compression; }
+		inline Depth get_depth() const { return _depth; }
+		inline const Vector3i &get_size() const { return _size; }
+
+		// Voxels in the same layout as the buffer, only if the channel is not compressed
+		inline const uint8_t *get_dense_data() const {
+			return _compression == COMPRESSION_NONE ? _data : nullptr;
+		}
+
+		// Works with any compression. The position is not checked.
+		uint64_t get_voxel(int x, int y, int z) const;
+
+	private:
+		friend class VoxelBuffer;
+
+		// Holds a reference, so it can't be copied
+		ChannelSnapshot(const ChannelSnapshot &);
+		ChannelSnapshot &operator=(const ChannelSnapshot &);
+
+		uint8_t *_data = nullptr;
+		uint32_t _size_in_bytes = 0;
+		uint64_t _defval = 0;
+		Vector3i _size;
+		Depth _depth = DEFAULT_CHANNEL_DEPTH;
+		Compression _compression = COMPRESSION_UNIFORM;
+	};
+
+	// The buffer only needs to be locked while the snapshot is taken
+	void get_channel_snapshot(unsigned int channel_index, ChannelSnapshot &out_snapshot) const;
+
+	// Conversions between raw values and reals, for each depth.
+	// Depths below 32 are normalized between -1 and 1.
+
+	static inline real_t raw_8_to_real(uint8_t v) {
+		return (static_cast<real_t>(v) - 0x7f) / 0x7f;
+	}
+
+	static inline real_t raw_16_to_real(uint16_t v) {
+		return (static_cast<real_t>(v) - 0x7fff) / 0x7fff;
+	}
+
+	static inline real_t raw_32_to_real(uint32_t v) {
+		MarshallFloat m;
+		m.i = v;
+		return m.f;
+	}
+
+	static inline real_t raw_64_to_real(uint64_t v) {
+		MarshallDouble m;
+		m.l = v;
+		return m.d;
+	}
+
+	static inline uint8_t real_to_raw_8(real_t v) {
+		return CLAMP(static_cast<int>(128.f * v + 128.f), 0, 0xff);
+	}
+
+	static inline uint16_t real_to_raw_16(real_t v) {
+		return CLAMP(static_cast<int>(0x7fff * v + 0x7fff), 0, 0xffff);
+	}
+
+	static inline uint32_t real_to_raw_32(real_t v) {
+		MarshallFloat m;
+		m.f = v;
+		return m.i;
+	}
+
+	static inline uint64_t real_to_raw_64(real_t v) {
+		MarshallDouble m;
+		m.d = v;
+		return m.l;
+	}
 
 	// Debugging
 
 	Ref<Image> debug_print_sdf_to_image_top_down();
 
+	// Measures downscaling the contents of this buffer with each filter, and with the generic per-voxel path.
+	// Not exposed to scripts.
+	Dictionary debug_measure_downscale(int iterations = 1000) const;
+
 private:
 	void create_channel_noinit(int i, Vector3i size);
+	void create_channel_compressed_noinit(int i, uint32_t size_in_bytes, Compression compression);
 	void create_channel(int i, Vector3i size, uint64_t defval);
 	void delete_channel(int i);
+	// Gives the channel its own copy of the data if it is shared with other buffers. Must be done before writing.
+	void unshare_channel(unsigned int channel_index);
+	uint32_t get_rle_size_in_bytes(unsigned int channel_index) const;
+	// Returns 0xffffffff if the palette would take more than `max_size_in_bytes`
+	uint32_t get_palette_size_in_bytes(unsigned int channel_index, uint32_t max_size_in_bytes) const;
+	void compress_channel_rle(unsigned int channel_index);
+	void compress_channel_palette(unsigned int channel_index);
+	bool set_voxel_palette(unsigned int channel_index, uint32_t i, uint64_t value);
+	void create_channel_sparse(unsigned int channel_index);
+	void compress_channel_sparse(unsigned int channel_index);
+	void set_voxel_sparse(unsigned int channel_index, int x, int y, int z, uint64_t value);
+	void fill_area_sparse(unsigned int channel_index, Vector3i min, Vector3i max, uint64_t value);
+	uint32_t allocate_sparse_slot(unsigned int channel_index, uint32_t brick_index);
+	void free_sparse_slot(unsigned int channel_index, uint32_t brick_index);
+	// True if writing to the channel keeps it sparse, so it must not be decompressed
+	bool is_channel_written_sparse(unsigned int channel_index) const {
+		const Channel &channel = _channels[channel_index];
+		return channel.compression == COMPRESSION_SPARSE || (channel.data == nullptr && channel.sparse);
+	}
+	bool prepare_read_write_action(Rect3i &box, unsigned int channel_index);
+	bool is_channel_view_compatible(unsigned int channel_index, unsigned int size, unsigned int value_size) const {
+		return _size == Vector3i(size) && get_depth_bit_count(_channels[channel_index].depth) == value_size * 8;
+	}
+	void downscale_channel_generic(VoxelBuffer &dst, unsigned int channel_index, DownscaleFilter filter,
+			Vector3i src_min, Vector3i dst_min, Vector3i dst_max) const;
+
+	// Goes through get_voxel and set_voxel, for channels which can't be accessed directly
+	template <typename F>
+	void read_write_action_generic(Rect3i box, unsigned int channel_index, F action) {
+		ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+		box.clip(Rect3i(Vector3i(), _size));
+		const Vector3i max = box.pos + box.size;
+		Vector3i pos;
+		for (pos.z = box.pos.z; pos.z < max.z; ++pos.z) {
+			for (pos.x = box.pos.x; pos.x < max.x; ++pos.x) {
+				for (pos.y = box.pos.y; pos.y < max.y; ++pos.y) {
+					set_voxel(action(pos, get_voxel(pos, channel_index)), pos.x, pos.y, pos.z, channel_index);
+				}
+			}
+		}
+	}
+
+	template <typename F>
+	void read_write_action_f_generic(Rect3i box, unsigned int channel_index, F action) {
+		ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+		box.clip(Rect3i(Vector3i(), _size));
+		const Vector3i max = box.pos + box.size;
+		Vector3i pos;
+		for (pos.z = box.pos.z; pos.z < max.z; ++pos.z) {
+			for (pos.x = box.pos.x; pos.x < max.x; ++pos.x) {
+				for (pos.y = box.pos.y; pos.y < max.y; ++pos.y) {
+					set_voxel_f(action(pos, get_voxel_f(pos.x, pos.y, pos.z, channel_index)),
+							pos.x, pos.y, pos.z, channel_index);
+				}
+			}
+		}
+	}
+
+	template <typename T, typename F>
+	void read_write_action_t(T *data, const Rect3i box, F action) {
+		const Vector3i max = box.pos + box.size;
+		Vector3i pos;
+		for (pos.z = box.pos.z; pos.z < max.z; ++pos.z) {
+			for (pos.x = box.pos.x; pos.x < max.x; ++pos.x) {
+				// Y is the contiguous axis
+				T *p = data + index(pos.x, box.pos.y, pos.z);
+				for (pos.y = box.pos.y; pos.y < max.y; ++pos.y, ++p) {
+					*p = action(pos, *p);
+				}
+			}
+		}
+	}
 
 	static void _bind_methods();
 
@@ -203,6 +567,10 @@ private:
 	void _b_set_voxel_f(real_t value, int x, int y, int z, unsigned int channel) { set_voxel_f(value, x, y, z, channel); }
 	void _b_set_voxel_v(uint64_t value, Vector3 pos, unsigned int channel_index = 0) { set_voxel(value, pos.x, pos.y, pos.z, channel_index); }
 	void _b_downscale_to(Ref<VoxelBuffer> dst, Vector3 src_min, Vector3 src_max, Vector3 dst_min) const;
+	PoolByteArray _b_get_channel_as_byte_array(unsigned int channel_index) const;
+	void _b_set_channel_from_byte_array(unsigned int channel_index, PoolByteArray data);
+	PoolRealArray _b_get_voxels_f(Vector3 min, Vector3 max, unsigned int channel_index, real_t scale) const;
+	void _b_set_voxels_f(PoolRealArray values, Vector3 min, Vector3 max, unsigned int channel_index, real_t scale);
 	Variant _b_get_voxel_metadata(Vector3 pos) const { return get_voxel_metadata(Vector3i(pos)); }
 	void _b_set_voxel_metadata(Vector3 pos, Variant meta) { set_voxel_metadata(Vector3i(pos), meta); }
 	void _b_for_each_voxel_metadata_in_area(Ref<FuncRef> callback, Vector3 min_pos, Vector3 max_pos);
@@ -221,6 +589,16 @@ private:
 		Depth depth = DEFAULT_CHANNEL_DEPTH;
 
 		uint32_t size_in_bytes = 0;
+
+		// Uniform when data is null, otherwise tells how data is stored
+		Compression compression = COMPRESSION_UNIFORM;
+
+		// Set when a scan found voxels with different values, and cleared by any write.
+		// Allows to skip scanning again channels which were not modified since.
+		bool known_non_uniform = false;
+
+		// Writes to the uniform channel create sparse data instead of dense data
+		bool sparse = false;
 	};
 
 	// Each channel can store arbitary data.
@@ -231,7 +609,8 @@ private:
 	Vector3i _size;
 
 	Variant _block_metadata;
-	Map<Vector3i, Variant> _voxel_metadata;
+	// Flat and sorted by voxel index, so lookups are binary searches and areas are range searches
+	std::vector<VoxelMetadata> _voxel_metadata;
 
 	RWLock *_rw_lock;
 };
@@ -15,6 +15,8 @@ void VoxelMemoryPool::create_singleton() {
 void VoxelMemoryPool::destroy_singleton() {
 	CRASH_COND(g_memory_pool == nullptr);
 	VoxelMemoryPool *pool = g_memory_pool;
+	// Other threads are expected to have exited already, which flushed their caches
+	pool->flush_thread_cache();
 	g_memory_pool = nullptr;
 	memdelete(pool);
 }
@@ -38,26 +40,188 @@ VoxelMemoryPool::~VoxelMemoryPool() {
 
 uint8_t *VoxelMemoryPool::allocate(uint32_t size) {
 	VOXEL_PROFILE_SCOPE();
-	MutexLock lock(_mutex);
+	ThreadCache &cache = get_thread_cache();
+	ThreadStats::add<int64_t>(cache.stats.used_blocks, 1);
+
+	Magazine *magazine = cache.get_magazine(size);
+
+	if (magazine != nullptr) {
+		if (magazine->count == 0) {
+			ThreadStats::add<uint64_t>(cache.stats.cache_misses, 1);
+			refill(*magazine);
+			if (magazine->count == 0) {
+				magazine->pool->total_blocks.fetch_add(1, std::memory_order_relaxed);
+				return (uint8_t *)memalloc(size * sizeof(uint8_t));
+			}
+		} else {
+			ThreadStats::add<uint64_t>(cache.stats.cache_hits, 1);
+		}
+		--magazine->count;
+		return magazine->blocks[magazine->count];
+	}
+
+	// The thread already caches too many sizes
+	ThreadStats::add<uint64_t>(cache.stats.cache_misses, 1);
+	uint8_t *block = nullptr;
+	lock();
 	Pool *pool = get_or_create_pool(size);
-	uint8_t *block;
 	if (pool->blocks.size() > 0) {
 		block = pool->blocks.back();
 		pool->blocks.pop_back();
-	} else {
+		_free_bytes -= size;
+	}
+	_mutex->unlock();
+
+	if (block == nullptr) {
+		pool->total_blocks.fetch_add(1, std::memory_order_relaxed);
 		block = (uint8_t *)memalloc(size * sizeof(uint8_t));
 	}
-	++_used_blocks;
 	return block;
 }
 
 void VoxelMemoryPool::recycle(uint8_t *block, uint32_t size) {
-	MutexLock lock(_mutex);
-	Pool *pool = _pools[size]; // If not found, entry will be created! It would be an error
+	// Blocks can be recycled by another thread than the one which allocated them,
+	// so the count of a thread can go negative. Only the sum matters.
+	ThreadCache &cache = get_thread_cache();
+	ThreadStats::add<int64_t>(cache.stats.used_blocks, -1);
+
+	Magazine *magazine = cache.get_magazine(size);
+
+	if (magazine != nullptr) {
+		if (magazine->count == MAGAZINE_CAPACITY) {
+			ThreadStats::add<uint64_t>(cache.stats.cache_misses, 1);
+			flush(*magazine, MAGAZINE_BATCH_SIZE);
+		} else {
+			ThreadStats::add<uint64_t>(cache.stats.cache_hits, 1);
+		}
+		magazine->blocks[magazine->count] = block;
+		++magazine->count;
+		return;
+	}
+
+	ThreadStats::add<uint64_t>(cache.stats.cache_misses, 1);
+	lock();
+	Pool **ppool = _pools.getptr(size);
+	// Check recycling before having allocated
+	CRASH_COND(ppool == nullptr);
+	push_free_block(**ppool, block, size);
+	enforce_budget();
+	_mutex->unlock();
+}
+
+void VoxelMemoryPool::flush_thread_cache() {
+	ThreadCache &cache = get_thread_cache();
+	for (unsigned int i = 0; i < cache.magazines.size(); ++i) {
+		Magazine &magazine = cache.magazines[i];
+		if (magazine.count > 0) {
+			flush(magazine, magazine.count);
+		}
+		magazine.size = 0;
+		magazine.pool = nullptr;
+	}
+}
+
+void VoxelMemoryPool::set_free_memory_budget(uint64_t bytes) {
+	_free_memory_budget = bytes;
+	lock();
+	enforce_budget();
+	_mutex->unlock();
+}
+
+uint64_t VoxelMemoryPool::get_free_memory_budget() const {
+	return _free_memory_budget;
+}
+
+void VoxelMemoryPool::trim(uint64_t max_free_bytes) {
+	lock();
+	trim_locked(max_free_bytes);
+	_mutex->unlock();
+}
+
+// Moves blocks from the shared pool into an empty magazine
+void VoxelMemoryPool::refill(Magazine &magazine) {
+	lock();
+	Pool *pool = get_or_create_pool(magazine.size);
+	magazine.pool = pool;
+	while (magazine.count < MAGAZINE_BATCH_SIZE && pool->blocks.size() > 0) {
+		magazine.blocks[magazine.count] = pool->blocks.back();
+		pool->blocks.pop_back();
+		++magazine.count;
+		_free_bytes -= magazine.size;
+	}
+	_mutex->unlock();
+}
+
+// Moves the last `count` blocks of a magazine to the shared pool
+void VoxelMemoryPool::flush(Magazine &magazine, uint32_t count) {
+	CRASH_COND(count > magazine.count);
+	lock();
+	Pool **ppool = _pools.getptr(magazine.size);
 	// Check recycling before having allocated
-	CRASH_COND(pool == nullptr);
-	pool->blocks.push_back(block);
-	--_used_blocks;
+	CRASH_COND(ppool == nullptr);
+	Pool *pool = *ppool;
+	for (uint32_t i = magazine.count - count; i < magazine.count; ++i) {
+		push_free_block(*pool, magazine.blocks[i], magazine.size);
+	}
+	magazine.count -= count;
+	enforce_budget();
+	_mutex->unlock();
+}
+
+// Must be called with the mutex locked
+void VoxelMemoryPool::push_free_block(Pool &pool, uint8_t *block, uint32_t size) {
+	pool.blocks.push_back(block);
+	_free_bytes += size;
+}
+
+// Must be called with the mutex locked
+void VoxelMemoryPool::enforce_budget() {
+	const uint64_t budget = _free_memory_budget;
+	if (budget > 0 && _free_bytes > budget) {
+		trim_locked(budget);
+	}
+}
+
+// Must be called with the mutex locked
+void VoxelMemoryPool::trim_locked(uint64_t max_free_bytes) {
+	while (_free_bytes > max_free_bytes) {
+		// Pick the size class holding the most free memory
+		Pool *largest_pool = nullptr;
+		uint32_t largest_pool_block_size = 0;
+		uint64_t largest_free_bytes = 0;
+		const uint32_t *key = nullptr;
+		while ((key = _pools.next(key))) {
+			Pool *pool = _pools.get(*key);
+			const uint64_t free_bytes = static_cast<uint64_t>(*key) * pool->blocks.size();
+			if (free_bytes > largest_free_bytes) {
+				largest_pool = pool;
+				largest_pool_block_size = *key;
+				largest_free_bytes = free_bytes;
+			}
+		}
+		if (largest_pool == nullptr || largest_pool_block_size == 0) {
+			break;
+		}
+
+		// Release its least recently recycled blocks, enough to get under the limit if possible
+		const uint64_t excess_bytes = _free_bytes - max_free_bytes;
+		const size_t count = MIN(largest_pool->blocks.size(),
+				(excess_bytes + largest_pool_block_size - 1) / largest_pool_block_size);
+		for (size_t i = 0; i < count; ++i) {
+			memfree(largest_pool->blocks[i]);
+		}
+		largest_pool->blocks.erase(largest_pool->blocks.begin(), largest_pool->blocks.begin() + count);
+		largest_pool->total_blocks.fetch_sub(count, std::memory_order_relaxed);
+		_free_bytes -= count * largest_pool_block_size;
+	}
+}
+
+// Locks the shared pool, counting how often another thread already holds it
+void VoxelMemoryPool::lock() {
+	if (_mutex->try_lock() != OK) {
+		_lock_contentions.fetch_add(1, std::memory_order_relaxed);
+		_mutex->lock();
+	}
 }
 
 void VoxelMemoryPool::clear() {
@@ -71,11 +235,14 @@ void VoxelMemoryPool::clear() {
 			CRASH_COND(ptr == nullptr);
 			memfree(ptr);
 		}
+		memdelete(pool);
 	}
 	_pools.clear();
+	_free_bytes = 0;
 }
 
 void VoxelMemoryPool::debug_print() {
+	const DebugStats stats = debug_get_stats();
 	MutexLock lock(_mutex);
 	print_line("-------- VoxelMemoryPool ----------");
 	const uint32_t *key = nullptr;
@@ -85,11 +252,55 @@ void VoxelMemoryPool::debug_print() {
 		print_line(String("Pool {0} for size {1}: {2} blocks").format(varray(i, *key, static_cast<int>(pool->blocks.size()))));
 		++i;
 	}
+	print_line(String("Thread cache hits: {0}, misses: {1}, lock contentions: {2}")
+					   .format(varray(stats.cache_hits, stats.cache_misses, stats.lock_contentions)));
 }
 
 unsigned int VoxelMemoryPool::debug_get_used_blocks() const {
+	return debug_get_stats().used_blocks;
+}
+
+VoxelMemoryPool::DebugStats VoxelMemoryPool::debug_get_stats() const {
+	DebugStats stats;
+	stats.lock_contentions = _lock_contentions.load(std::memory_order_relaxed);
+
+	MutexLock lock(_mutex);
+
+	int64_t used_blocks = _exited_threads_used_blocks;
+	stats.cache_hits = _exited_threads_cache_hits;
+	stats.cache_misses = _exited_threads_cache_misses;
+	for (size_t i = 0; i < _thread_caches.size(); ++i) {
+		const ThreadStats &thread_stats = _thread_caches[i]->stats;
+		used_blocks += thread_stats.used_blocks.load(std::memory_order_relaxed);
+		stats.cache_hits += thread_stats.cache_hits.load(std::memory_order_relaxed);
+		stats.cache_misses += thread_stats.cache_misses.load(std::memory_order_relaxed);
+	}
+	stats.used_blocks = used_blocks;
+
+	stats.free_bytes = _free_bytes;
+	uint64_t total_bytes = 0;
+	const uint32_t *key = nullptr;
+	while ((key = _pools.next(key))) {
+		const Pool *pool = _pools.get(*key);
+		total_bytes += static_cast<uint64_t>(*key) * pool->total_blocks;
+	}
+	stats.used_bytes = total_bytes - _free_bytes;
+
+	return stats;
+}
+
+void VoxelMemoryPool::debug_get_size_class_stats(std::vector<SizeClassStats> &out_stats) const {
 	MutexLock lock(_mutex);
-	return _used_blocks;
+	out_stats.clear();
+	const uint32_t *key = nullptr;
+	while ((key = _pools.next(key))) {
+		const Pool *pool = _pools.get(*key);
+		SizeClassStats stats;
+		stats.block_size = *key;
+		stats.free_blocks = pool->blocks.size();
+		stats.used_blocks = pool->total_blocks - stats.free_blocks;
+		out_stats.push_back(stats);
+	}
 }
 
 VoxelMemoryPool::Pool *VoxelMemoryPool::get_or_create_pool(uint32_t size) {
@@ -105,3 +316,75 @@ VoxelMemoryPool::Pool *VoxelMemoryPool::get_or_create_pool(uint32_t size) {
 	}
 	return pool;
 }
+
+VoxelMemoryPool::ThreadCache &VoxelMemoryPool::get_thread_cache() {
+	static thread_local ThreadCache cache;
+	if (cache.owner != this) {
+		// First use by this thread
+		register_thread_cache(cache);
+	}
+	return cache;
+}
+
+void VoxelMemoryPool::register_thread_cache(ThreadCache &cache) {
+	// The thread may have used a previous pool
+	cache.stats.used_blocks = 0;
+	cache.stats.cache_hits = 0;
+	cache.stats.cache_misses = 0;
+	MutexLock lock(_mutex);
+	_thread_caches.push_back(&cache);
+	cache.owner = this;
+}
+
+// Keeps the statistics of the thread once it exits
+void VoxelMemoryPool::unregister_thread_cache(ThreadCache &cache) {
+	MutexLock lock(_mutex);
+	for (size_t i = 0; i < _thread_caches.size(); ++i) {
+		if (_thread_caches[i] == &cache) {
+			_thread_caches[i] = _thread_caches.back();
+			_thread_caches.pop_back();
+			break;
+		}
+	}
+	_exited_threads_used_blocks += cache.stats.used_blocks.load(std::memory_order_relaxed);
+	_exited_threads_cache_hits += cache.stats.cache_hits.load(std::memory_order_relaxed);
+	_exited_threads_cache_misses += cache.stats.cache_misses.load(std::memory_order_relaxed);
+	cache.owner = nullptr;
+}
+
+// Returns the magazine used for the given size, or null if the thread already caches too many other sizes
+VoxelMemoryPool::Magazine *VoxelMemoryPool::ThreadCache::get_magazine(uint32_t size) {
+	for (unsigned int i = 0; i < magazines.size(); ++i) {
+		Magazine &magazine = magazines[i];
+		if (magazine.size == size) {
+			return &magazine;
+		}
+		if (magazine.size == 0) {
+			magazine.size = size;
+			return &magazine;
+		}
+	}
+	return nullptr;
+}
+
+// Runs when the thread exits
+VoxelMemoryPool::ThreadCache::~ThreadCache() {
+	for (unsigned int i = 0; i < magazines.size(); ++i) {
+		Magazine &magazine = magazines[i];
+		if (magazine.count == 0) {
+			continue;
+		}
+		if (g_memory_pool != nullptr) {
+			g_memory_pool->flush(magazine, magazine.count);
+		} else {
+			// The pool is gone already
+			for (uint32_t j = 0; j < magazine.count; ++j) {
+				memfree(magazine.blocks[j]);
+			}
+			magazine.count = 0;
+		}
+	}
+	if (g_memory_pool != nullptr && owner == g_memory_pool) {
+		g_memory_pool->unregister_thread_cache(*this);
+	}
+}
@@ -3,18 +3,31 @@
 
 #include "core/hash_map.h"
 #include "core/os/mutex.h"
+#include "util/fixed_array.h"
 
+#include <atomic>
 #include <vector>
 
 // Pool based on a scenario where allocated blocks are often the same size.
 // A pool of blocks is assigned for each size.
+// Each thread also keeps a few free blocks of the sizes it uses most, so most allocations don't need to lock.
 class VoxelMemoryPool {
 private:
 	struct Pool {
+		// Free blocks, from least to most recently recycled
 		std::vector<uint8_t *> blocks;
+		// How many blocks of this size exist, used or free
+		std::atomic<uint32_t> total_blocks{ 0 };
 	};
 
 public:
+	// How many free blocks a thread can keep for one size
+	static const uint32_t MAGAZINE_CAPACITY = 32;
+	// How many blocks are moved at once between a thread and the shared pool
+	static const uint32_t MAGAZINE_BATCH_SIZE = MAGAZINE_CAPACITY / 2;
+	// How many different sizes a thread can keep blocks for. Other sizes always go to the shared pool.
+	static const uint32_t MAGAZINES_PER_THREAD = 4;
+
 	static void create_singleton();
 	static void destroy_singleton();
 	static VoxelMemoryPool *get_singleton();
@@ -25,16 +38,104 @@ public:
 	uint8_t *allocate(uint32_t size);
 	void recycle(uint8_t *block, uint32_t size);
 
+	// Gives back blocks kept by the calling thread to the shared pool
+	void flush_thread_cache();
+
+	// Free blocks are kept for reuse up to this amount of bytes. Beyond it, the least recently recycled ones are
+	// released to the system. 0 means no limit, which is the default.
+	// Blocks kept by thread caches are not counted.
+	void set_free_memory_budget(uint64_t bytes);
+	uint64_t get_free_memory_budget() const;
+
+	// Releases free blocks to the system, least recently recycled first, until at most `max_free_bytes` remain.
+	// Size classes holding the most free memory are trimmed first.
+	void trim(uint64_t max_free_bytes = 0);
+
+	struct DebugStats {
+		unsigned int used_blocks;
+		// Allocations and recycles done without locking
+		uint64_t cache_hits;
+		// Allocations and recycles which had to go to the shared pool
+		uint64_t cache_misses;
+		// How many times the shared pool was already locked by another thread
+		uint64_t lock_contentions;
+		// Free memory kept by the shared pool
+		uint64_t free_bytes;
+		// Memory of all blocks which are not in the shared pool, including those kept by thread caches
+		uint64_t used_bytes;
+	};
+
+	struct SizeClassStats {
+		uint32_t block_size;
+		uint32_t free_blocks;
+		uint32_t used_blocks;
+	};
+
 	void debug_print();
 	unsigned int debug_get_used_blocks() const;
+	DebugStats debug_get_stats() const;
+	void debug_get_size_class_stats(std::vector<SizeClassStats> &out_stats) const;
 
 private:
+	struct Magazine {
+		uint32_t size = 0;
+		uint32_t count = 0;
+		// Assigned on first refill
+		Pool *pool = nullptr;
+		FixedArray<uint8_t *, MAGAZINE_CAPACITY> blocks;
+	};
+
+	// Counters of one thread, so the fast paths don't write to memory shared with other threads.
+	// Only the owning thread writes them, other threads read them for statistics.
+	struct ThreadStats {
+		std::atomic<int64_t> used_blocks{ 0 };
+		std::atomic<uint64_t> cache_hits{ 0 };
+		std::atomic<uint64_t> cache_misses{ 0 };
+
+		// Cheaper than fetch_add, since there is only one writer
+		template <typename T>
+		static inline void add(std::atomic<T> &counter, T n) {
+			counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+		}
+	};
+
+	struct ThreadCache {
+		FixedArray<Magazine, MAGAZINES_PER_THREAD> magazines;
+		ThreadStats stats;
+		// Pool the cache is registered to
+		VoxelMemoryPool *owner = nullptr;
+
+		~ThreadCache();
+		Magazine *get_magazine(uint32_t size);
+	};
+
+	ThreadCache &get_thread_cache();
+	void register_thread_cache(ThreadCache &cache);
+	void unregister_thread_cache(ThreadCache &cache);
+
 	Pool *get_or_create_pool(uint32_t size);
+	void lock();
+	void refill(Magazine &magazine);
+	void flush(Magazine &magazine, uint32_t count);
+	void push_free_block(Pool &pool, uint8_t *block, uint32_t size);
+	void enforce_budget();
+	void trim_locked(uint64_t max_free_bytes);
 	void clear();
 
 	HashMap<uint32_t, Pool *> _pools;
-	unsigned int _used_blocks = 0;
 	Mutex *_mutex = nullptr;
+	// Protected by the mutex
+	uint64_t _free_bytes = 0;
+	std::atomic<uint64_t> _free_memory_budget{ 0 };
+
+	// Protected by the mutex. Statistics are the sum of those of all threads, including exited ones.
+	std::vector<ThreadCache *> _thread_caches;
+	int64_t _exited_threads_used_blocks = 0;
+	uint64_t _exited_threads_cache_hits = 0;
+	uint64_t _exited_threads_cache_misses = 0;
+
+	// Only counted when already locking
+	std::atomic<uint64_t> _lock_contentions{ 0 };
 };
 
 #endif // VOXEL_MEMORY_POOL_H